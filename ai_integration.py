@@ -6,8 +6,13 @@ Fast C-Python communication using JSON-RPC over pipes
 
 import os
 import json
+import mmap
+import socket
+import struct
 import argparse
+import queue
 import subprocess
+import threading
 import time
 from dotenv import load_dotenv
 
@@ -21,12 +26,26 @@ except ImportError:
     print("❌ OpenAI library not found. Please install: pip install openai")
     exit(1)
 
-def run_file_info_simple_rpc(directory=".", suppress_errors=False):
+# Optional in-process listing via the libfilesavant extension (see README)
+try:
+    import _filesavant
+except ImportError:
+    _filesavant = None
+
+# Optional: lets FileSavantClient take large responses LZ4-compressed
+try:
+    import lz4.frame as lz4_frame
+except ImportError:
+    lz4_frame = None
+
+SERVER_PATH = './file_info_mcp_server'
+
+def run_file_info_simple_rpc(directory=".", suppress_errors=False, server_path=SERVER_PATH):
     """Use simple JSON-RPC to get file information quickly"""
     try:
         # Start the server process
         process = subprocess.Popen(
-            ['./file_info_mcp_server'],
+            [server_path],
             stdin=subprocess.PIPE,
             stdout=subprocess.PIPE,
             stderr=subprocess.PIPE,
@@ -65,6 +84,437 @@ def run_file_info_simple_rpc(directory=".", suppress_errors=False):
             print(f"❌ Error communicating with file server: {e}")
         return []
 
+def receive_shm_ring(sock):
+    """Receive the server's result ring: (fd, size) passed with SCM_RIGHTS"""
+    fd_size = struct.calcsize("i")
+    payload, ancdata, _, _ = sock.recvmsg(8, socket.CMSG_LEN(fd_size))
+    for level, kind, data in ancdata:
+        if level == socket.SOL_SOCKET and kind == socket.SCM_RIGHTS:
+            return struct.unpack("i", data[:fd_size])[0], struct.unpack("Q", payload)[0]
+    raise RuntimeError("server did not pass a shared-memory fd")
+
+def run_file_info_shm_rpc(directory=".", suppress_errors=False, server_path=SERVER_PATH):
+    """Like run_file_info_simple_rpc, but large results arrive via shared memory"""
+    parent_sock, child_sock = socket.socketpair(socket.AF_UNIX, socket.SOCK_STREAM)
+    try:
+        process = subprocess.Popen(
+            [server_path, f'--shm-socket={child_sock.fileno()}'],
+            stdin=subprocess.PIPE,
+            stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE,
+            pass_fds=(child_sock.fileno(),),
+            text=True
+        )
+        child_sock.close()
+
+        fd, size = receive_shm_ring(parent_sock)
+        try:
+            ring = mmap.mmap(fd, size, prot=mmap.PROT_READ)
+        finally:
+            os.close(fd)
+
+        with ring:
+            request = {"jsonrpc": "2.0", "id": 1, "method": "tools/call",
+                       "params": {"name": "list_files", "arguments": {"directory": directory}}}
+            process.stdin.write(json.dumps(request, separators=(",", ":")) + "\n")
+            process.stdin.close()
+
+            # stdout only carries control lines; big payloads live in the ring
+            for line in process.stdout:
+                try:
+                    message = json.loads(line)
+                except json.JSONDecodeError:
+                    continue
+                if message.get("id") != 1:
+                    continue
+                if "shm" in message:
+                    region = message["shm"]
+                    start = region["offset"]
+                    message = json.loads(ring[start:start + region["length"]])
+                process.wait()
+                return message.get("result", [])
+
+        process.wait()
+        return []
+
+    except Exception as e:
+        if not suppress_errors:
+            print(f"❌ Error communicating with file server: {e}")
+        return []
+    finally:
+        parent_sock.close()
+        child_sock.close()
+
+def run_file_info_inprocess(directory=".", suppress_errors=False):
+    """List a directory in-process through the _filesavant extension (no server, no JSON)"""
+    if _filesavant is None:
+        if not suppress_errors:
+            print("❌ _filesavant extension not built; see README (In-Process Listing)")
+        return []
+    try:
+        fields = _filesavant.FIELDS
+        return [dict(zip(fields, row)) for row in _filesavant.list_dir(directory)]
+    except OSError as e:
+        if not suppress_errors:
+            print(f"❌ Error listing directory: {e}")
+        return []
+
+def _expand_names(entries, users, groups):
+    """Put owner/group back into dictionary-encoded entries from the id tables"""
+    for entry in entries:
+        entry["owner"] = users.get(str(entry["uid"]), str(entry["uid"]))
+        entry["group"] = groups.get(str(entry["gid"]), str(entry["gid"]))
+    return entries
+
+class FileSavantError(Exception):
+    """Error response or lost connection from the file server"""
+
+class ServerLostError(FileSavantError):
+    """The server exited or the connection broke before a response arrived"""
+
+class FileSavantClient:
+    """Keeps one file server alive and multiplexes JSON-RPC requests over it.
+
+    The server is spawned (or, with socket_path, a --listen daemon is dialled)
+    on first use, the initialize handshake runs once, and a reader thread
+    routes each response to its caller by id. If the server dies, in-flight
+    calls fail and the next call starts a fresh server.
+    """
+
+    def __init__(self, server_path=SERVER_PATH, socket_path=None, timeout=30.0):
+        self.server_path = server_path
+        self.socket_path = socket_path
+        self.timeout = timeout
+        self._lock = threading.Lock()
+        self._write_lock = threading.Lock()    # taken without _lock, which the reader needs to drain
+        self._pending = {}
+        self._next_id = 1
+        self._generation = 0
+        self._connected = False
+        self._process = None
+        self._sock = None
+        self._writer = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    def _connect(self):
+        """Start a server and write the initialize handshake (lock held)"""
+        if self.socket_path:
+            self._sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            self._sock.connect(self.socket_path)
+            self._writer = self._sock.makefile('wb')
+            reader = self._sock.makefile('rb')
+        else:
+            self._process = subprocess.Popen(
+                [self.server_path, "--zero-copy"],    # read() below, so spliced pages are safe to reuse
+                stdin=subprocess.PIPE,
+                stdout=subprocess.PIPE,
+                stderr=subprocess.DEVNULL
+            )
+            self._writer = self._process.stdin
+            reader = self._process.stdout
+
+        self._generation += 1
+        self._connected = True
+        threading.Thread(target=self._read_loop, args=(reader, self._generation), daemon=True).start()
+        # Large responses then arrive as an LZ4 frame after a "compressed" line
+        capabilities = {"experimental": {"compression": ["lz4"]}} if lz4_frame else {}
+        waiter, request = self._register("initialize", {"protocolVersion": "2024-11-05", "capabilities": capabilities})
+        try:
+            # Nobody else has the new writer yet and the empty pipe takes one line, so this cannot block
+            self._write(self._writer, request)
+        except (OSError, ValueError):
+            raise self._lost(self._writer, [waiter])
+        return waiter
+
+    def _read_loop(self, reader, generation):
+        try:
+            for line in iter(reader.readline, b""):
+                try:
+                    message = json.loads(line)
+                except json.JSONDecodeError:
+                    continue
+                if isinstance(message, dict) and "compressed" in message:
+                    payload = reader.read(message["compressed"]["length"])
+                    message = json.loads(lz4_frame.decompress(payload))
+                # A batch is answered with one array of responses
+                messages = message if isinstance(message, list) else [message]
+                with self._lock:
+                    routed = [(self._route(m), m) for m in messages if isinstance(m, dict)]
+                for waiter, response in routed:
+                    if waiter is None:
+                        continue
+                    if "method" not in response:
+                        waiter["response"] = response
+                        waiter["done"].set()
+                    if waiter.get("events") is not None:
+                        waiter["events"].put(response)
+        except (OSError, ValueError):
+            pass
+
+        # EOF: the server went away; fail whatever was still waiting on it
+        with self._lock:
+            if generation != self._generation:
+                return
+            self._connected = False
+            pending, self._pending = self._pending, {}
+        for waiter in pending.values():
+            waiter["done"].set()
+            if waiter.get("events") is not None:
+                waiter["events"].put(None)
+
+    def _route(self, message):
+        """The waiter a message is for; a final response also retires it (lock held)"""
+        params = message.get("params") or {}
+        if message.get("method") == "notifications/progress":
+            return self._pending.get(params.get("progressToken"))
+        if message.get("method") == "notifications/partial_result":
+            return self._pending.get(params.get("requestId"))
+        return self._pending.pop(message.get("id"), None)
+
+    def _register(self, method, params):
+        """Allocate an id and a waiter for a request (lock held)"""
+        request_id = self._next_id
+        self._next_id += 1
+        waiter = {"id": request_id, "done": threading.Event(), "response": None}
+        self._pending[request_id] = waiter
+        return waiter, {"jsonrpc": "2.0", "id": request_id, "method": method, "params": params}
+
+    def _write(self, writer, payload):
+        """Write one request line, a single request or a batch array"""
+        # The server matches on compact JSON, one request per line
+        writer.write((json.dumps(payload, separators=(",", ":")) + "\n").encode())
+        writer.flush()
+
+    def _lost(self, writer, waiters):
+        """Retire the waiters of a request that could not be written (lock held)"""
+        for waiter in waiters:
+            self._pending.pop(waiter["id"], None)
+        if writer is self._writer:
+            self._connected = False
+        return ServerLostError("could not write to the file server")
+
+    def _submit(self, writer, payload, waiters):
+        """Write a registered request (lock not held)
+
+        A write can block until the server reads, and the server only reads
+        once its responses drain, which needs the reader thread to get _lock.
+        """
+        try:
+            with self._write_lock:
+                self._write(writer, payload)
+        except (OSError, ValueError):
+            with self._lock:
+                raise self._lost(writer, waiters)
+
+    def _wait(self, waiter, method):
+        if not waiter["done"].wait(self.timeout):
+            with self._lock:
+                self._pending.pop(waiter["id"], None)
+            raise FileSavantError(f"{method} timed out after {self.timeout}s")
+        response = waiter["response"]
+        if response is None:
+            raise ServerLostError("file server exited before answering")
+        if "error" in response:
+            raise FileSavantError(response["error"].get("message", "unknown error"))
+        return response.get("result")
+
+    def _ensure_connected(self):
+        """Start a server if there is none; returns the handshake to wait on, or None (lock held)"""
+        if self._connected:
+            return None
+        self._shutdown()
+        return self._connect()
+
+    def _send(self, method, params):
+        with self._lock:
+            handshake = self._ensure_connected()
+            waiter, request = self._register(method, params)
+            writer = self._writer
+        self._submit(writer, request, [waiter])
+        if handshake is not None:
+            self._wait(handshake, "initialize")
+        return self._wait(waiter, method)
+
+    def _send_batch(self, calls):
+        with self._lock:
+            handshake = self._ensure_connected()
+            queued = [self._register("tools/call", {"name": name, "arguments": arguments})
+                      for name, arguments in calls]
+            writer = self._writer
+        self._submit(writer, [request for _, request in queued], [waiter for waiter, _ in queued])
+        if handshake is not None:
+            self._wait(handshake, "initialize")
+        results = []
+        for (waiter, _), (name, _) in zip(queued, calls):
+            try:
+                results.append(self._wait(waiter, name))
+            except ServerLostError:
+                raise
+            except FileSavantError as error:
+                results.append(error)
+        return results
+
+    def batch(self, calls):
+        """Run several tool calls in one round trip, e.g.
+        [("list_files", {"directory": d}) for d in dirs]. The server runs them
+        concurrently; results come back in order, with a FileSavantError in
+        place of each call that failed."""
+        calls = list(calls)
+        if not calls:
+            return []
+        try:
+            return self._send_batch(calls)
+        except ServerLostError:
+            return self._send_batch(calls)
+
+    def call(self, method, params=None):
+        """Send one request and wait for its result, restarting a crashed server once"""
+        try:
+            return self._send(method, params or {})
+        except ServerLostError:
+            return self._send(method, params or {})
+
+    def list_files(self, directory=".", **options):
+        """List a directory; options are the server's list_files arguments
+        (sort="size", order="desc", limit=10, offset, type, min_size, max_size,
+        modified_after, modified_before, content_type=True, pattern="*.log",
+        regex="^img_[0-9]+", ignore_case=True), applied server-side.
+        dictionary=True has the server name each uid/gid once rather than per
+        entry; owner and group are filled back in here, so the result is the same."""
+        result = self.call("tools/call", {"name": "list_files", "arguments": {"directory": directory, **options}})
+        if options.get("dictionary"):
+            return _expand_names(result["entries"], result["users"], result["groups"])
+        return result
+
+    def list_changes(self, directory=".", since=None, **options):
+        """What changed in a directory since the listing that returned token since:
+        {"token", "reset", "added", "modified", "removed"}, removed being names.
+        Without since (or when the server no longer knows it) reset is True and
+        every entry is added. Pass the returned token to the next call; options
+        are list_files' filters, which must stay the same between calls."""
+        arguments = {"directory": directory, **options}
+        if since is None:
+            arguments["track"] = True
+        else:
+            arguments["since"] = since
+        result = self.call("tools/call", {"name": "list_files", "arguments": arguments})
+        if options.get("dictionary"):
+            for key in ("added", "modified"):
+                _expand_names(result[key], result["users"], result["groups"])
+        return result
+
+    def iter_files(self, directory=".", chunk_size=1000, on_progress=None, **options):
+        """Yield list_files entries as the server sends them, chunk_size at a time,
+        instead of waiting for the whole listing. on_progress(scanned) is called
+        with the server's entries-scanned count while it reads; options are
+        list_files'. The timeout applies to the gap between messages."""
+        params = {"name": "list_files", "arguments": {"directory": directory, "chunk_size": chunk_size, **options}}
+        with self._lock:
+            handshake = self._ensure_connected()
+            waiter, request = self._register("tools/call", params)
+            waiter["events"] = queue.Queue()
+            params["_meta"] = {"progressToken": waiter["id"]}
+            writer = self._writer
+        self._submit(writer, request, [waiter])
+        if handshake is not None:
+            self._wait(handshake, "initialize")
+        users, groups = {}, {}    # dictionary=True: names arrive with the chunk first using them
+        while True:
+            try:
+                message = waiter["events"].get(timeout=self.timeout)
+            except queue.Empty:
+                with self._lock:
+                    self._pending.pop(waiter["id"], None)
+                raise FileSavantError(f"list_files sent nothing for {self.timeout}s")
+            if message is None:
+                raise ServerLostError("file server exited before answering")
+            method = message.get("method")
+            if method == "notifications/progress":
+                if on_progress:
+                    on_progress(message["params"]["progress"])
+            elif method == "notifications/partial_result":
+                chunk = message["params"]
+                users.update(chunk.get("users", {}))
+                groups.update(chunk.get("groups", {}))
+                yield from _expand_names(chunk["result"], users, groups) if options.get("dictionary") else chunk["result"]
+            else:
+                break
+        result = self._wait(waiter, "list_files")
+        if options.get("dictionary"):
+            result = _expand_names(result["entries"], result["users"], result["groups"])
+        yield from result
+
+    def hash_files(self, directory=".", files=None):
+        """BLAKE3 digests of files in directory (every regular file unless files names some);
+        each result has "blake3", or "error" if the file could not be read."""
+        arguments = {"directory": directory}
+        if files is not None:
+            arguments["files"] = list(files)
+        return self.call("tools/call", {"name": "hash_files", "arguments": arguments})
+
+    def find_duplicates(self, directory=".", **options):
+        """Groups of identical files under directory, most wasted bytes first;
+        options are min_size (default 1), include_hidden (default True) and
+        limit (number of groups)."""
+        return self.call("tools/call", {"name": "find_duplicates", "arguments": {"directory": directory, **options}})
+
+    def diff_snapshots(self, old, new, limit=None):
+        """Changes between two `file_info --snapshot` files: per-kind counts plus
+        up to limit (server default 1000) added/removed/modified/renamed records."""
+        arguments = {"old": old, "new": new}
+        if limit is not None:
+            arguments["limit"] = limit
+        return self.call("tools/call", {"name": "diff_snapshots", "arguments": arguments})
+
+    def render_for_llm(self, directory=".", token_budget=None, **options):
+        """Compact text table of directory for a prompt, cut to about token_budget
+        tokens (server default 4000); takes list_files' sort and filter options.
+        Returns {"text", "entries", "shown", "tokens", "token_budget"}."""
+        arguments = {"directory": directory, **options}
+        if token_budget is not None:
+            arguments["token_budget"] = token_budget
+        return self.call("tools/call", {"name": "render_for_llm", "arguments": arguments})
+
+    def sample_files(self, directory=".", sample_size=None, seed=None):
+        """Exact counts (types, extensions, size buckets, odd permissions), outliers
+        (largest, newest, oldest) and a stratified random sample of directory,
+        for directories too large to send whole. Pass seed for a repeatable sample."""
+        arguments = {"directory": directory}
+        if sample_size is not None:
+            arguments["sample_size"] = sample_size
+        if seed is not None:
+            arguments["seed"] = seed
+        return self.call("tools/call", {"name": "sample_files", "arguments": arguments})
+
+    def get_metrics(self):
+        """Server-side latency percentiles (ns) per method and phase, e.g. ["list_files"]["stat"]["p99_ns"]"""
+        return self.call("tools/call", {"name": "get_metrics", "arguments": {}})["methods"]
+
+    def _shutdown(self):
+        self._connected = False
+        for stream in (self._writer, self._sock):
+            try:
+                if stream:
+                    stream.close()
+            except OSError:
+                pass
+        if self._process:
+            try:
+                self._process.wait(timeout=5)
+            except subprocess.TimeoutExpired:
+                self._process.kill()
+                self._process.wait()
+        self._process = self._sock = self._writer = None
+
+    def close(self):
+        with self._lock:
+            self._shutdown()
+
 # Import all the other functions from the original file
 def find_file(files, filename, match_type="contains", case_sensitive=False):
     """Find files matching the criteria"""
@@ -164,22 +614,8 @@ For unclear queries, default to: {"match_type": "contains", "case_sensitive": fa
             "intent": "error fallback"
         }
 
-def answer_file_question_with_ai(files, query, filename=None, suppress_warnings=False):
-    """Use OpenAI to intelligently answer questions about file attributes"""
-    if not files:
-        return "❌ No files found to analyze."
-    
-    # If filename specified, extract parameters and filter files
-    if filename:
-        params = extract_query_parameters(query, suppress_warnings)
-        match_type = params["match_type"]
-        case_sensitive = params["case_sensitive"]
-        
-        if not (target_files := find_file(files, filename, match_type, case_sensitive)):
-            return f"❌ File '{filename}' not found."
-        files = target_files
-    
-    # Prepare file data for AI analysis
+def summarize_files(files):
+    """Per-file dicts with readable sizes, owners, permissions and dates"""
     file_data_summary = []
     for file_info in files:
         file_summary = {
@@ -194,7 +630,33 @@ def answer_file_question_with_ai(files, query, filename=None, suppress_warnings=
             "changed": format_timestamp(file_info["changed"])
         }
         file_data_summary.append(file_summary)
+    return file_data_summary
+
+def answer_file_question_with_ai(files, query, filename=None, suppress_warnings=False, listing=None):
+    """Use OpenAI to intelligently answer questions about file attributes
+
+    listing is an optional render_for_llm table of the same directory. It is
+    sent instead of per-file JSON unless filename narrows the files down.
+    """
+    if not files:
+        return "❌ No files found to analyze."
     
+    # If filename specified, extract parameters and filter files
+    if filename:
+        params = extract_query_parameters(query, suppress_warnings)
+        match_type = params["match_type"]
+        case_sensitive = params["case_sensitive"]
+        
+        if not (target_files := find_file(files, filename, match_type, case_sensitive)):
+            return f"❌ File '{filename}' not found."
+        files = target_files
+    
+    # Prepare file data for AI analysis
+    if listing is not None and not filename:
+        file_data = listing
+    else:
+        file_data = json.dumps(summarize_files(files), indent=2)
+
     system_prompt = """You are a file system expert assistant. Analyze file metadata and answer natural language queries about files.
     
     Provide clear, accurate answers based on the file data. Use emojis for better readability.
@@ -204,7 +666,7 @@ def answer_file_question_with_ai(files, query, filename=None, suppress_warnings=
     user_prompt = f"""Query: {query}
 
 File Data:
-{json.dumps(file_data_summary, indent=2)}
+{file_data}
 
 Please analyze this file information and answer the query clearly and accurately."""
     
@@ -249,13 +711,30 @@ def main():
     parser.add_argument("--filename", help="Specific file to analyze")
     parser.add_argument("--query", default="show me detailed information about all files", help="Natural language query about the file(s)")
     parser.add_argument("--validate", action="store_true", help="Validate results with ls -l")
+    parser.add_argument("--transport", choices=["pipe", "shm", "inprocess"], default="pipe",
+                        help="How listings reach Python: server over a text pipe, shared memory, or the in-process extension")
+    parser.add_argument("--server-socket", help="Query a running 'file_info_mcp_server --listen' daemon at this path")
 
     args = parser.parse_args()
 
     print(f"🔍 Analyzing files in '{args.dir}' using fast MCP communication...")
     
     # Use simplified RPC to get file information quickly
-    files = run_file_info_simple_rpc(args.dir)
+    listing = None
+    if args.server_socket:
+        try:
+            with FileSavantClient(socket_path=args.server_socket) as client:
+                files = client.list_files(args.dir, dictionary=True)
+                listing = client.render_for_llm(args.dir)["text"]
+        except (FileSavantError, OSError) as e:
+            print(f"❌ Error communicating with file server: {e}")
+            files = []
+    elif args.transport == "shm":
+        files = run_file_info_shm_rpc(args.dir)
+    elif args.transport == "inprocess":
+        files = run_file_info_inprocess(args.dir)
+    else:
+        files = run_file_info_simple_rpc(args.dir)
     if not files:
         print("❌ No files found or error getting file information")
         return
@@ -269,7 +748,7 @@ def main():
     if has_openai:
         print(f"\n🤖 AI Analysis for '{args.filename if args.filename else 'all files'}':")
         openai.api_key = api_key
-        answer = answer_file_question_with_ai(files, args.query, args.filename)
+        answer = answer_file_question_with_ai(files, args.query, args.filename, listing=listing)
     else:
         print(f"\n📝 Basic Analysis for '{args.filename if args.filename else 'all files'}' (No OpenAI API key):")
         # Filter files if filename specified
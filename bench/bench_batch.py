@@ -0,0 +1,59 @@
+#!/usr/bin/env python3
+"""
+Listing many directories: one request per round trip vs one JSON-RPC batch
+
+Usage: python3 bench/bench_batch.py ROOT [--server ./file_info_mcp_server]
+           [--socket PATH] [--dirs 100] [--rounds 50]
+
+Lists the first --dirs subdirectories of ROOT (e.g. the "wide" profile of
+bench/gen_tree.py) through one persistent server, first as back-to-back
+list_files calls and then as a single batch, and prints per-round latency.
+With --socket it talks to a running --listen daemon instead, so server
+flags such as --batch-threads can be varied.
+"""
+
+import argparse
+import os
+import statistics
+import sys
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), ".."))
+
+from ai_integration import FileSavantClient
+
+def measure(label, query, rounds):
+    samples = []
+    for _ in range(rounds):
+        start = time.perf_counter()
+        query()
+        samples.append((time.perf_counter() - start) * 1000)
+    ordered = sorted(samples)
+    p99 = ordered[min(len(ordered) - 1, round(0.99 * len(ordered)) - 1)]
+    print(f"{label:<10} p50 {statistics.median(samples):9.3f} ms   p99 {p99:9.3f} ms   "
+          f"mean {statistics.mean(samples):9.3f} ms")
+    return statistics.median(samples)
+
+def main():
+    parser = argparse.ArgumentParser(description="Batched vs serial list_files round trips")
+    parser.add_argument("root", help="Directory whose subdirectories are listed")
+    parser.add_argument("--server", default="./file_info_mcp_server", help="Server binary")
+    parser.add_argument("--socket", help="Use a --listen daemon at this socket path")
+    parser.add_argument("--dirs", type=int, default=100, help="Directories per round")
+    parser.add_argument("--rounds", type=int, default=50, help="Timed rounds per mode")
+    args = parser.parse_args()
+
+    directories = sorted(entry.path for entry in os.scandir(args.root) if entry.is_dir())[:args.dirs]
+    if not directories:
+        sys.exit(f"no subdirectories in {args.root}")
+
+    calls = [("list_files", {"directory": directory}) for directory in directories]
+    print(f"{len(directories)} directories under '{args.root}', {args.rounds} rounds each")
+    with FileSavantClient(args.server, socket_path=args.socket) as client:
+        client.batch(calls)    # spawn, initialize and warm the caches outside the timed loops
+        serial = measure("serial", lambda: [client.list_files(d) for d in directories], args.rounds)
+        batched = measure("batched", lambda: client.batch(calls), args.rounds)
+    print(f"batched is {serial / batched:.1f}x faster per round")
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,53 @@
+#!/usr/bin/env python3
+"""
+Latency of back-to-back list_files queries: spawn-per-query vs persistent server
+
+Usage: python3 bench/bench_client_latency.py [--server ./file_info_mcp_server] [--dir .] [--queries 1000]
+"""
+
+import argparse
+import os
+import statistics
+import sys
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), ".."))
+
+from ai_integration import FileSavantClient, run_file_info_simple_rpc
+
+def percentile(samples, pct):
+    ordered = sorted(samples)
+    index = min(len(ordered) - 1, max(0, round(pct / 100 * len(ordered)) - 1))
+    return ordered[index]
+
+def measure(label, query, count):
+    samples = []
+    for _ in range(count):
+        start = time.perf_counter()
+        query()
+        samples.append((time.perf_counter() - start) * 1000)
+    print(f"{label:<22} p50 {percentile(samples, 50):8.3f} ms   p99 {percentile(samples, 99):8.3f} ms   "
+          f"mean {statistics.mean(samples):8.3f} ms   total {sum(samples) / 1000:7.2f} s")
+
+def main():
+    parser = argparse.ArgumentParser(description="Client latency benchmark")
+    parser.add_argument("--server", default="./file_info_mcp_server", help="Server binary")
+    parser.add_argument("--socket", help="Also measure a --listen daemon at this socket path")
+    parser.add_argument("--dir", default=".", help="Directory to list")
+    parser.add_argument("--queries", type=int, default=1000, help="Queries per mode")
+    args = parser.parse_args()
+
+    print(f"{args.queries} back-to-back list_files queries on '{args.dir}'")
+    measure("spawn per query", lambda: run_file_info_simple_rpc(args.dir, server_path=args.server), args.queries)
+
+    with FileSavantClient(args.server) as client:
+        client.list_files(args.dir)    # spawn + initialize outside the timed loop
+        measure("persistent server", lambda: client.list_files(args.dir), args.queries)
+
+    if args.socket:
+        with FileSavantClient(socket_path=args.socket) as client:
+            client.list_files(args.dir)
+            measure("socket daemon", lambda: client.list_files(args.dir), args.queries)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,205 @@
+#!/usr/bin/env python3
+"""
+Listing throughput of file_info and the MCP server's list_files
+
+Usage: python3 bench/bench_listing.py ROOT [--file-info ./file_info]
+           [--server ./file_info_mcp_server] [--repeat 3] [--cold] [--strace]
+
+ROOT is a tree made by bench/gen_tree.py. For every profile in its manifest
+this lists each target directory and reports entries/sec, output bytes/sec,
+syscalls/entry (with --strace) and the peak RSS of the listing process.
+
+file_info is timed from exec to exit. list_files is timed from request to
+response on an already-started server, so process startup is excluded.
+--cold repeats everything after dropping the page, dentry and inode caches
+(needs root); without it only warm-cache numbers are reported.
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+SAMPLED_DEPTHS = 10
+
+def target_dirs(profile, info):
+    """Yield (label, dir_fd) for every directory a profile lists; caller closes fds"""
+    root = os.open(info["path"], os.O_RDONLY | os.O_DIRECTORY)
+    if profile == "wide":
+        for name in sorted(os.listdir(root)):
+            yield name, os.open(name, os.O_RDONLY | os.O_DIRECTORY, dir_fd=root)
+        yield "root", root
+    elif profile == "deep":
+        # Levels below PATH_MAX are only reachable relative to a dir fd
+        step = max(1, info["depth"] // SAMPLED_DEPTHS)
+        fd = root
+        for level in range(info["depth"]):
+            if level % step == 0:
+                yield f"level {level}", os.dup(fd)
+            child = os.open("d", os.O_RDONLY | os.O_DIRECTORY, dir_fd=fd)
+            os.close(fd)
+            fd = child
+        os.close(fd)
+    else:
+        yield "root", root
+
+def count_syscalls(command, dir_fd, stdin_data=None):
+    """Total syscalls of command under strace -c, or None if strace is unavailable"""
+    with tempfile.NamedTemporaryFile(mode="r", suffix=".strace") as log:
+        try:
+            subprocess.run(["strace", "-f", "-c", "-o", log.name, "--"] + command,
+                           input=stdin_data, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL,
+                           preexec_fn=lambda: os.fchdir(dir_fd), pass_fds=(dir_fd,), check=False)
+        except FileNotFoundError:
+            return None
+        for line in log:
+            parts = line.split()
+            if parts and parts[-1] == "total":
+                return int(parts[3])
+    return None
+
+def peak_rss_kb(pid):
+    """VmHWM of a live process, or 0 once it has exited"""
+    try:
+        with open(f"/proc/{pid}/status") as f:
+            for line in f:
+                if line.startswith("VmHWM:"):
+                    return int(line.split()[1])
+    except OSError:
+        pass
+    return 0
+
+def run_file_info(binary, dir_fd):
+    """Run file_info in dir_fd; returns (seconds, output bytes, entries, peak RSS KB)
+
+    A forked child inherits the driver's high-water mark, so wait4's
+    ru_maxrss is useless here. VmHWM is sampled after every read instead;
+    file_info that exits before the first sample reports 0 (shown as n/a).
+    """
+    start = time.perf_counter()
+    process = subprocess.Popen([binary, "."], stdout=subprocess.PIPE, stderr=subprocess.DEVNULL,
+                               preexec_fn=lambda: os.fchdir(dir_fd), pass_fds=(dir_fd,))
+    chunks = []
+    rss = 0
+    while True:
+        chunk = process.stdout.read1(1 << 16)
+        if not chunk:
+            break
+        chunks.append(chunk)
+        rss = max(rss, peak_rss_kb(process.pid))
+    process.wait()
+    elapsed = time.perf_counter() - start
+    output = b"".join(chunks)
+    return elapsed, len(output), len(json.loads(output)), rss
+
+LIST_REQUEST = b'{"jsonrpc":"2.0","id":1,"method":"tools/call","params":{"name":"list_files","arguments":{"directory":"."}}}\n'
+
+def run_list_files(binary, dir_fd):
+    """One list_files request on a fresh server in dir_fd; same tuple as run_file_info"""
+    process = subprocess.Popen([binary], stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                               stderr=subprocess.DEVNULL,
+                               preexec_fn=lambda: os.fchdir(dir_fd), pass_fds=(dir_fd,))
+    process.stdout.readline()    # notifications/initialized
+    start = time.perf_counter()
+    process.stdin.write(LIST_REQUEST)
+    process.stdin.flush()
+    line = process.stdout.readline()
+    elapsed = time.perf_counter() - start
+    rss = peak_rss_kb(process.pid)
+    process.stdin.close()
+    process.stdout.read()
+    process.wait()
+    return elapsed, len(line), len(json.loads(line).get("result", [])), rss
+
+def drop_caches():
+    subprocess.run(["sync"], check=False)
+    with open("/proc/sys/vm/drop_caches", "w") as f:
+        f.write("3\n")
+
+def bench_tool(name, runner, binary, command, profile, info, args, cold):
+    totals = {"seconds": 0.0, "bytes": 0, "entries": 0, "rss_kb": 0, "syscalls": 0}
+    strace_ok = args.strace
+    for _ in range(args.repeat):
+        for label, fd in target_dirs(profile, info):
+            try:
+                if cold:
+                    drop_caches()
+                seconds, nbytes, entries, rss = runner(binary, fd)
+                totals["seconds"] += seconds
+                totals["bytes"] += nbytes
+                totals["entries"] += entries
+                totals["rss_kb"] = max(totals["rss_kb"], rss)
+                if strace_ok:
+                    stdin_data = LIST_REQUEST if command == [binary] else None
+                    calls = count_syscalls(command, fd, stdin_data)
+                    if calls is None:
+                        strace_ok = False
+                    else:
+                        totals["syscalls"] += calls
+            finally:
+                os.close(fd)
+
+    seconds = totals["seconds"] or 1e-9
+    return {
+        "tool": name,
+        "profile": profile,
+        "cache": "cold" if cold else "warm",
+        "entries": totals["entries"],
+        "entries_per_sec": totals["entries"] / seconds,
+        "bytes_per_sec": totals["bytes"] / seconds,
+        "syscalls_per_entry": totals["syscalls"] / max(1, totals["entries"]) if strace_ok else None,
+        "peak_rss_kb": totals["rss_kb"] or None,
+    }
+
+def print_row(row):
+    syscalls = f"{row['syscalls_per_entry']:8.2f}" if row["syscalls_per_entry"] is not None else "     n/a"
+    rss = f"{row['peak_rss_kb'] / 1024:9.1f}" if row["peak_rss_kb"] else "      n/a"
+    print(f"{row['profile']:<10} {row['tool']:<11} {row['cache']:<5} {row['entries']:>10} "
+          f"{row['entries_per_sec']:>12,.0f} {row['bytes_per_sec'] / 1e6:>10.1f} {syscalls} "
+          f"{rss}")
+
+def main():
+    parser = argparse.ArgumentParser(description="Listing benchmark driver")
+    parser.add_argument("root", help="Tree generated by bench/gen_tree.py")
+    parser.add_argument("--file-info", default="./file_info", help="file_info binary")
+    parser.add_argument("--server", default="./file_info_mcp_server", help="file_info_mcp_server binary")
+    parser.add_argument("--repeat", type=int, default=3, help="Runs per directory")
+    parser.add_argument("--cold", action="store_true", help="Also run after drop_caches (root only)")
+    parser.add_argument("--strace", action="store_true", help="Count syscalls with strace -c (extra run)")
+    parser.add_argument("--json", help="Write the results to this file as well")
+    args = parser.parse_args()
+
+    with open(os.path.join(args.root, ".bench_manifest.json")) as f:
+        manifest = json.load(f)
+
+    file_info = os.path.abspath(args.file_info)
+    server = os.path.abspath(args.server)
+    modes = [False]
+    if args.cold:
+        if os.geteuid() == 0:
+            modes.append(True)
+        else:
+            print("--cold needs root to write /proc/sys/vm/drop_caches; reporting warm cache only",
+                  file=sys.stderr)
+
+    print(f"{'profile':<10} {'tool':<11} {'cache':<5} {'entries':>10} {'entries/s':>12} "
+          f"{'MB/s':>10} {'sys/entry':>8} {'RSS MB':>9}")
+    rows = []
+    for profile, info in manifest.items():
+        for cold in modes:
+            for row in (bench_tool("file_info", run_file_info, file_info, [file_info, "."],
+                                   profile, info, args, cold),
+                        bench_tool("list_files", run_list_files, server, [server],
+                                   profile, info, args, cold)):
+                print_row(row)
+                rows.append(row)
+
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(rows, f, indent=2)
+
+if __name__ == "__main__":
+    main()
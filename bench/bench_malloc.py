@@ -0,0 +1,53 @@
+#!/usr/bin/env python3
+"""
+Allocator calls per request in steady state
+
+Usage: python3 bench/bench_malloc.py [--dir .] [--requests 1000]
+           [--server ./file_info_mcp_server] [--shim ./malloc_count.so]
+
+Builds bench/malloc_count.c as an LD_PRELOAD shim if --shim does not exist,
+then runs the server twice: once with a warm-up batch of list_files calls and
+once with the warm-up plus --requests more. The difference divided by
+--requests is what each request costs after caches and buffers have grown.
+"""
+
+import argparse
+import os
+import subprocess
+import sys
+
+def count_calls(server, shim, directory, requests):
+    request = ('{"jsonrpc":"2.0","id":1,"method":"tools/call","params":{"name":"list_files",'
+               '"arguments":{"directory":"%s"}}}\n' % directory)
+    result = subprocess.run([server], input=(request * requests).encode(),
+                            stdout=subprocess.DEVNULL, stderr=subprocess.PIPE,
+                            env={**os.environ, "LD_PRELOAD": shim}, check=True)
+    for line in result.stderr.decode().splitlines():
+        if line.startswith("malloc_count "):
+            return {key: int(value) for key, value in (field.split("=") for field in line.split()[1:])}
+    sys.exit("shim did not report; is the server linked against glibc?")
+
+def main():
+    parser = argparse.ArgumentParser(description="Allocator calls per list_files request")
+    parser.add_argument("--dir", default=".", help="Directory to list")
+    parser.add_argument("--requests", type=int, default=1000, help="Measured requests")
+    parser.add_argument("--warmup", type=int, default=100, help="Requests before measuring")
+    parser.add_argument("--server", default="./file_info_mcp_server", help="Server binary")
+    parser.add_argument("--shim", default="./malloc_count.so", help="LD_PRELOAD counting shim")
+    args = parser.parse_args()
+
+    shim = os.path.abspath(args.shim)
+    if not os.path.exists(shim):
+        source = os.path.join(os.path.dirname(os.path.abspath(__file__)), "malloc_count.c")
+        subprocess.run(["gcc", "-O2", "-shared", "-fPIC", "-o", shim, source], check=True)
+
+    directory = os.path.abspath(args.dir)
+    base = count_calls(args.server, shim, directory, args.warmup)
+    total = count_calls(args.server, shim, directory, args.warmup + args.requests)
+
+    print(f"{args.requests} list_files requests on {directory} after {args.warmup} warm-up:")
+    for key in ("malloc", "calloc", "realloc", "free"):
+        print(f"  {key:<8} {(total[key] - base[key]) / args.requests:8.2f} per request")
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+"""
+Cost of getting a large response out of the server: copied vs vmsplice()d
+
+Usage: python3 bench/bench_output.py DIR [--server ./file_info_mcp_server]
+           [--rounds 20] [--socket PATH]
+
+Lists DIR (bench/gen_tree.py's "flat" profile makes a 300k-entry, ~100 MB
+response) through a server started with --cache-mb, so after the first call
+every request is a cache hit and what is left is copying the body into the
+response and the response into the pipe. The server is run once as is and
+once with --zero-copy, reading stdout with readinto() into one reused
+buffer, and the time from request to the last byte is printed per mode.
+With --socket it measures a running --listen daemon instead.
+"""
+
+import argparse
+import os
+import socket
+import statistics
+import subprocess
+import time
+
+def request_line(directory, request_id):
+    return ('{"jsonrpc":"2.0","id":%d,"method":"tools/call","params":{"name":"list_files",'
+            '"arguments":{"directory":"%s"}}}\n' % (request_id, directory)).encode()
+
+def read_lines(read_into, buffer, lines):
+    """Reads until lines newlines have arrived; returns the bytes read.
+    Nothing else is in flight, so the last of them ends the response."""
+    view = memoryview(buffer)
+    total = 0
+    while lines > 0:
+        n = read_into(view)
+        if n <= 0:
+            raise SystemExit("server closed the connection")
+        total += n
+        lines -= buffer.count(b"\n", 0, n)
+    return total
+
+def measure(label, send, read_into, directory, rounds, greeting):
+    buffer = bytearray(1 << 20)
+    send(request_line(directory, 1))
+    read_lines(read_into, buffer, greeting + 1)    # fills the cache
+    samples = []
+    for i in range(rounds):
+        start = time.perf_counter()
+        send(request_line(directory, i + 2))
+        size = read_lines(read_into, buffer, 1)
+        samples.append((time.perf_counter() - start) * 1000)
+    print(f"{label:<12} {size / 1e6:8.1f} MB   p50 {statistics.median(samples):8.2f} ms   "
+          f"min {min(samples):8.2f} ms   {size / 1e6 / (statistics.median(samples) / 1000):7.0f} MB/s")
+    return statistics.median(samples)
+
+def measure_pipe(server, flags, directory, rounds):
+    process = subprocess.Popen([server, "--cache-mb=1024", *flags], stdin=subprocess.PIPE,
+                               stdout=subprocess.PIPE, stderr=subprocess.DEVNULL, bufsize=0)
+    try:
+        def send(line):
+            process.stdin.write(line)
+        # A stdio server opens with a notifications/initialized line
+        return measure(" ".join(flags) or "copy", send, process.stdout.readinto, directory, rounds, 1)
+    finally:
+        process.stdin.close()
+        process.wait()
+
+def main():
+    parser = argparse.ArgumentParser(description="Large-response output cost, copied vs vmsplice")
+    parser.add_argument("dir", help="Directory to list (large, e.g. gen_tree.py flat)")
+    parser.add_argument("--server", default="./file_info_mcp_server", help="Server binary")
+    parser.add_argument("--rounds", type=int, default=20, help="Timed requests per mode")
+    parser.add_argument("--socket", help="Measure a running --listen daemon at this path instead")
+    args = parser.parse_args()
+    directory = os.path.abspath(args.dir)
+
+    if args.socket:
+        with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as sock:
+            sock.connect(args.socket)
+            measure("socket", sock.sendall, sock.recv_into, directory, args.rounds, 0)
+        return
+    copied = measure_pipe(args.server, [], directory, args.rounds)
+    spliced = measure_pipe(args.server, ["--zero-copy"], directory, args.rounds)
+    print(f"--zero-copy takes {spliced / copied:.2f}x the time of the copying path")
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+"""
+Reproducible synthetic directory trees for the listing benchmarks
+
+Usage: python3 bench/gen_tree.py ROOT [--profile all] [--seed 42] [--scale 1.0]
+
+Profiles (each in its own subdirectory of ROOT):
+  flat       one directory with 1,000,000 files
+  deep       a 10,000-level chain of directories (paths exceed PATH_MAX)
+  wide       1,000 subdirectories with 100 files each
+  longnames  10,000 files with 200-255 byte names
+  owners     100,000 files spread across 1,000 uid/gid pairs (needs root)
+
+--scale multiplies every count, e.g. --scale 0.01 for a quick run. File
+sizes are random but seeded and the files are sparse, so generation is
+cheap on disk. A .bench_manifest.json in ROOT records what was built.
+"""
+
+import argparse
+import json
+import os
+import random
+import string
+import sys
+
+PROFILES = {
+    "flat": {"files": 1_000_000},
+    "deep": {"depth": 10_000},
+    "wide": {"dirs": 1_000, "files_per_dir": 100},
+    "longnames": {"files": 10_000},
+    "owners": {"files": 100_000, "owners": 1_000, "first_id": 20_000},
+}
+
+def make_file(dir_fd, name, rng):
+    # Log-uniform sizes from 0 B to ~1 GB; sparse, so nothing is written
+    size = int(2 ** rng.uniform(0, 30)) if rng.random() > 0.05 else 0
+    fd = os.open(name, os.O_WRONLY | os.O_CREAT | os.O_TRUNC, 0o644, dir_fd=dir_fd)
+    try:
+        os.ftruncate(fd, size)
+    finally:
+        os.close(fd)
+
+def open_dir(path, dir_fd=None):
+    os.makedirs(path, exist_ok=True) if dir_fd is None else os.mkdir(path, dir_fd=dir_fd)
+    return os.open(path, os.O_RDONLY | os.O_DIRECTORY, dir_fd=dir_fd)
+
+def gen_flat(root, params, rng):
+    fd = open_dir(root)
+    for i in range(params["files"]):
+        make_file(fd, f"file_{i:07d}.dat", rng)
+    os.close(fd)
+
+def gen_deep(root, params, rng):
+    # Walk down with dir fds: the full path is far longer than PATH_MAX
+    fd = open_dir(root)
+    for level in range(params["depth"]):
+        make_file(fd, "leaf.txt", rng)
+        child = open_dir("d", dir_fd=fd)
+        os.close(fd)
+        fd = child
+    os.close(fd)
+
+def gen_wide(root, params, rng):
+    root_fd = open_dir(root)
+    for d in range(params["dirs"]):
+        fd = open_dir(f"dir_{d:05d}", dir_fd=root_fd)
+        for i in range(params["files_per_dir"]):
+            make_file(fd, f"file_{i:05d}.dat", rng)
+        os.close(fd)
+    os.close(root_fd)
+
+def gen_longnames(root, params, rng):
+    fd = open_dir(root)
+    alphabet = string.ascii_letters + string.digits + "_-."
+    for i in range(params["files"]):
+        length = rng.randint(200, 255) - 8
+        make_file(fd, f"{i:07d}_" + "".join(rng.choice(alphabet) for _ in range(length)), rng)
+    os.close(fd)
+
+def gen_owners(root, params, rng):
+    if os.geteuid() != 0:
+        print("  owners: skipped (chown needs root)")
+        return False
+    fd = open_dir(root)
+    for i in range(params["files"]):
+        name = f"file_{i:07d}.dat"
+        make_file(fd, name, rng)
+        owner = params["first_id"] + rng.randrange(params["owners"])
+        os.chown(name, owner, owner, dir_fd=fd)
+    os.close(fd)
+    return True
+
+GENERATORS = {
+    "flat": gen_flat,
+    "deep": gen_deep,
+    "wide": gen_wide,
+    "longnames": gen_longnames,
+    "owners": gen_owners,
+}
+
+def main():
+    parser = argparse.ArgumentParser(description="Generate benchmark directory trees")
+    parser.add_argument("root", help="Directory to create the trees in")
+    parser.add_argument("--profile", choices=["all"] + list(PROFILES), default="all")
+    parser.add_argument("--seed", type=int, default=42, help="RNG seed (same seed, same tree)")
+    parser.add_argument("--scale", type=float, default=1.0, help="Multiply every count")
+    args = parser.parse_args()
+
+    names = list(PROFILES) if args.profile == "all" else [args.profile]
+    manifest_path = os.path.join(args.root, ".bench_manifest.json")
+    manifest = {}
+    if os.path.exists(manifest_path):
+        with open(manifest_path) as f:
+            manifest = json.load(f)
+
+    for name in names:
+        params = {key: value if key == "first_id" else max(1, int(value * args.scale))
+                  for key, value in PROFILES[name].items()}
+        path = os.path.join(args.root, name)
+        if os.path.exists(path):
+            print(f"  {name}: {path} exists, remove it to regenerate", file=sys.stderr)
+            continue
+        print(f"  {name}: {params}")
+        rng = random.Random(f"{args.seed}:{name}")
+        if GENERATORS[name](path, params, rng) is False:
+            continue
+        manifest[name] = {"path": path, "seed": args.seed, **params}
+
+    os.makedirs(args.root, exist_ok=True)
+    with open(manifest_path, "w") as f:
+        json.dump(manifest, f, indent=2)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,41 @@
+// LD_PRELOAD shim that counts allocator calls and prints the totals at exit
+//
+//   gcc -O2 -shared -fPIC -o malloc_count.so bench/malloc_count.c
+//   LD_PRELOAD=./malloc_count.so ./file_info_mcp_server < requests.jsonl
+//
+// glibc only: forwards to the __libc_* entry points, so no dlsym bootstrap.
+#include <stdio.h>
+#include <stddef.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long malloc_calls, calloc_calls, realloc_calls, free_calls;
+
+void *malloc(size_t size) {
+    __atomic_fetch_add(&malloc_calls, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    __atomic_fetch_add(&calloc_calls, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    __atomic_fetch_add(&realloc_calls, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    if (ptr) __atomic_fetch_add(&free_calls, 1, __ATOMIC_RELAXED);
+    __libc_free(ptr);
+}
+
+__attribute__((destructor))
+static void report(void) {
+    fprintf(stderr, "malloc_count malloc=%lu calloc=%lu realloc=%lu free=%lu\n",
+            malloc_calls, calloc_calls, realloc_calls, free_calls);
+}
@@ -1,113 +1,710 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <sys/stat.h>
-#include <dirent.h>
-#include <pwd.h>
-#include <grp.h>
-#include <time.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 
+#include "libfilesavant.h"
+
+// ---------------------------------------------------------------------------
+// Arrow IPC stream output (--format=arrow)
+//
+// The stream is a Schema message, then DictionaryBatch/RecordBatch messages,
+// then the end-of-stream marker, as laid out in the Arrow columnar format
+// spec. Message metadata is FlatBuffers-encoded by the small builder below.
+// Body buffers are padded to ARROW_ALIGNMENT so readers can map them in place.
+// Values are written in host byte order and the schema declares little-endian,
+// which holds on every platform we build for.
+// ---------------------------------------------------------------------------
+
+#define ARROW_ALIGNMENT 64
+#define ARROW_DEFAULT_BATCH_ROWS 65536
+#define FB_MAX_FIELDS 8
+
+// Message.fbs / Schema.fbs enum values
+#define ARROW_METADATA_V5 4
+#define ARROW_HEADER_SCHEMA 1
+#define ARROW_HEADER_DICTIONARY_BATCH 2
+#define ARROW_HEADER_RECORD_BATCH 3
+#define ARROW_TYPE_INT 2
+#define ARROW_TYPE_UTF8 5
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+} byte_buf;
+
+void bb_reserve(byte_buf *b, size_t extra) {
+    if (b->len + extra <= b->cap) return;
+    size_t cap = b->cap ? b->cap : 256;
+    while (cap < b->len + extra) cap *= 2;
+    uint8_t *data = realloc(b->data, cap);
+    if (!data) {
+        perror("realloc");
+        exit(1);
+    }
+    b->data = data;
+    b->cap = cap;
+}
+
+// Appends n bytes (zeros when src is NULL) and returns their offset
+size_t bb_append(byte_buf *b, const void *src, size_t n) {
+    bb_reserve(b, n);
+    size_t at = b->len;
+    if (src) memcpy(b->data + at, src, n);
+    else memset(b->data + at, 0, n);
+    b->len += n;
+    return at;
+}
+
+// Zero-pads until (len + skew) is a multiple of alignment
+void bb_pad_skewed(byte_buf *b, size_t alignment, size_t skew) {
+    size_t rem = (b->len + skew) % alignment;
+    if (rem) bb_append(b, NULL, alignment - rem);
+}
+
+void bb_pad(byte_buf *b, size_t alignment) {
+    bb_pad_skewed(b, alignment, 0);
+}
+
 /**
- * @brief Determines file type from mode
- * @param mode File mode from stat structure
- * @return String representation of file type
+ * @brief Pending FlatBuffers table: scalar values and offset slots by field id
+ *
+ * Tables are emitted front-to-back: vtable, then table, then children, with
+ * offset fields patched once their target has been written. Since children
+ * always land after their parent, every uoffset points forward as required.
  */
-const char* get_file_type(mode_t mode) {
-    if (S_ISDIR(mode)) return "directory";
-    if (S_ISREG(mode)) return "file";
-    if (S_ISLNK(mode)) return "symlink";
-    if (S_ISCHR(mode)) return "char_device";
-    if (S_ISBLK(mode)) return "block_device";
-    if (S_ISFIFO(mode)) return "fifo";
-    if (S_ISSOCK(mode)) return "socket";
-    return "unknown";
-}
-
-void print_file_info_json(const char *directory, const char *filename, struct stat *st) {
-    // Get owner and group names
-    struct passwd *pwd = getpwuid(st->st_uid);
-    struct group *grp = getgrgid(st->st_gid);
-    
-    const char *file_type = get_file_type(st->st_mode);
-    
-    // Build full path
-    char fullpath[2048];
-    if (strcmp(directory, ".") == 0) {
-        snprintf(fullpath, sizeof(fullpath), "%s", filename);
-    } else {
-        snprintf(fullpath, sizeof(fullpath), "%s/%s", directory, filename);
+typedef struct {
+    int nfields;
+    uint8_t size[FB_MAX_FIELDS];      // 0 = field absent
+    uint8_t value[FB_MAX_FIELDS][8];
+    size_t slot[FB_MAX_FIELDS];       // buffer position of each field once emitted
+} fb_table;
+
+void fb_scalar(fb_table *t, int id, const void *value, int size) {
+    memcpy(t->value[id], value, size);
+    t->size[id] = size;
+    if (id >= t->nfields) t->nfields = id + 1;
+}
+
+void fb_i64(fb_table *t, int id, int64_t v) { fb_scalar(t, id, &v, 8); }
+void fb_i32(fb_table *t, int id, int32_t v) { fb_scalar(t, id, &v, 4); }
+void fb_i16(fb_table *t, int id, int16_t v) { fb_scalar(t, id, &v, 2); }
+void fb_u8(fb_table *t, int id, uint8_t v) { fb_scalar(t, id, &v, 1); }
+void fb_offset(fb_table *t, int id) { fb_i32(t, id, 0); }
+
+void fb_patch(byte_buf *b, size_t slot, size_t target) {
+    uint32_t rel = (uint32_t)(target - slot);
+    memcpy(b->data + slot, &rel, 4);
+}
+
+size_t fb_emit_table(byte_buf *b, fb_table *t) {
+    uint16_t vtable[2 + FB_MAX_FIELDS] = {0};
+    uint16_t offset = 4;
+
+    // Largest fields first so every scalar is naturally aligned
+    for (int size = 8; size >= 1; size /= 2) {
+        for (int id = 0; id < t->nfields; id++) {
+            if (t->size[id] == size) {
+                vtable[2 + id] = offset;
+                offset += size;
+            }
+        }
     }
-    
-    // Print JSON object
-    printf("{\n");
-    printf("  \"name\": \"%s\",\n", filename);
-    printf("  \"path\": \"%s\",\n", fullpath);
-    printf("  \"size\": %lld,\n", (long long)st->st_size);
-    printf("  \"owner\": \"%s\",\n", pwd ? pwd->pw_name : "unknown");
-    printf("  \"group\": \"%s\",\n", grp ? grp->gr_name : "unknown");
-    printf("  \"uid\": %d,\n", st->st_uid);
-    printf("  \"gid\": %d,\n", st->st_gid);
-    printf("  \"permissions\": \"%03o\",\n", st->st_mode & 0777);
-    printf("  \"permissions_readable\": \"");
-    
-    // Print human-readable permissions
-    printf("%c", S_ISDIR(st->st_mode) ? 'd' : '-');
-    printf("%c", (st->st_mode & S_IRUSR) ? 'r' : '-');
-    printf("%c", (st->st_mode & S_IWUSR) ? 'w' : '-');
-    printf("%c", (st->st_mode & S_IXUSR) ? 'x' : '-');
-    printf("%c", (st->st_mode & S_IRGRP) ? 'r' : '-');
-    printf("%c", (st->st_mode & S_IWGRP) ? 'w' : '-');
-    printf("%c", (st->st_mode & S_IXGRP) ? 'x' : '-');
-    printf("%c", (st->st_mode & S_IROTH) ? 'r' : '-');
-    printf("%c", (st->st_mode & S_IWOTH) ? 'w' : '-');
-    printf("%c", (st->st_mode & S_IXOTH) ? 'x' : '-');
-    printf("\",\n");
-    
-    printf("  \"type\": \"%s\",\n", file_type);
-    printf("  \"modified\": %ld,\n", st->st_mtime);
-    printf("  \"accessed\": %ld,\n", st->st_atime);
-    printf("  \"changed\": %ld,\n", st->st_ctime);
-    printf("  \"inode\": %llu,\n", (unsigned long long)st->st_ino);
-    printf("  \"device\": \"%ld\",\n", (long)st->st_dev);
-    printf("  \"hard_links\": %hu,\n", st->st_nlink);
-    printf("  \"block_size\": %d,\n", st->st_blksize);
-    printf("  \"blocks\": %lld\n", (long long)st->st_blocks);
-    printf("}");
+    vtable[0] = (uint16_t)(4 + 2 * t->nfields);
+    vtable[1] = offset;
+
+    bb_pad(b, 2);
+    size_t vt = bb_append(b, vtable, vtable[0]);
+    bb_pad_skewed(b, 8, 4);   // the first field after the soffset is 8-aligned
+    size_t table = bb_append(b, NULL, offset);
+
+    int32_t soffset = (int32_t)(table - vt);
+    memcpy(b->data + table, &soffset, 4);
+    for (int id = 0; id < t->nfields; id++) {
+        if (!t->size[id]) continue;
+        t->slot[id] = table + vtable[2 + id];
+        memcpy(b->data + t->slot[id], t->value[id], t->size[id]);
+    }
+    return table;
+}
+
+// Emits a vector; elems may be NULL for offset vectors patched afterwards
+size_t fb_emit_vector(byte_buf *b, const void *elems, uint32_t count, size_t elem_size, size_t alignment) {
+    bb_pad_skewed(b, alignment < 4 ? 4 : alignment, 4);
+    size_t at = bb_append(b, &count, 4);
+    bb_append(b, elems, count * elem_size);
+    return at;
+}
+
+size_t fb_emit_string(byte_buf *b, const char *s) {
+    uint32_t len = (uint32_t)strlen(s);
+    bb_pad(b, 4);
+    size_t at = bb_append(b, &len, 4);
+    bb_append(b, s, len);
+    bb_append(b, NULL, 1);
+    return at;
+}
+
+enum { ARROW_UTF8, ARROW_INT64, ARROW_DICT };
+
+enum {
+    INT_SIZE, INT_UID, INT_GID, INT_PERMISSIONS, INT_MODIFIED, INT_ACCESSED,
+    INT_CHANGED, INT_INODE, INT_DEVICE, INT_HARD_LINKS, INT_BLOCKS, NUM_INT_COLUMNS
+};
+
+enum { DICT_TYPE, DICT_OWNER, DICT_GROUP, NUM_DICTS };
+
+typedef struct {
+    const char *name;
+    int kind;
+    int index;    // into the int64 or dictionary column arrays
+} arrow_column;
+
+const arrow_column arrow_columns[] = {
+    {"name", ARROW_UTF8, 0},
+    {"type", ARROW_DICT, DICT_TYPE},
+    {"size", ARROW_INT64, INT_SIZE},
+    {"owner", ARROW_DICT, DICT_OWNER},
+    {"group", ARROW_DICT, DICT_GROUP},
+    {"uid", ARROW_INT64, INT_UID},
+    {"gid", ARROW_INT64, INT_GID},
+    {"permissions", ARROW_INT64, INT_PERMISSIONS},
+    {"modified", ARROW_INT64, INT_MODIFIED},
+    {"accessed", ARROW_INT64, INT_ACCESSED},
+    {"changed", ARROW_INT64, INT_CHANGED},
+    {"inode", ARROW_INT64, INT_INODE},
+    {"device", ARROW_INT64, INT_DEVICE},
+    {"hard_links", ARROW_INT64, INT_HARD_LINKS},
+    {"blocks", ARROW_INT64, INT_BLOCKS},
+};
+
+#define NUM_ARROW_COLUMNS ((int)(sizeof(arrow_columns) / sizeof(arrow_columns[0])))
+
+/**
+ * @brief String dictionary keyed by a numeric id (uid, gid or S_IFMT bits)
+ *
+ * Each distinct key is resolved to its name once; entries past `emitted`
+ * still have to be sent to the reader as a delta DictionaryBatch.
+ */
+typedef struct {
+    long long *keys;
+    char **values;
+    int count;
+    int cap;
+    int emitted;
+    int *slots;       // open addressing, entry index + 1 (0 = empty)
+    int nslots;
+} arrow_dict;
+
+const char* resolve_type(long long fmt) {
+    return fs_file_type((mode_t)fmt);
+}
+
+const char* resolve_owner(long long uid) {
+    return fs_user_name((uid_t)uid);
+}
+
+const char* resolve_group(long long gid) {
+    return fs_group_name((gid_t)gid);
+}
+
+int arrow_dict_slot(arrow_dict *d, long long key) {
+    unsigned long long h = (unsigned long long)key * 0x9E3779B97F4A7C15ULL;
+    int mask = d->nslots - 1;
+    int i = (int)(h >> 32) & mask;
+    while (d->slots[i] && d->keys[d->slots[i] - 1] != key) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+int arrow_dict_lookup(arrow_dict *d, long long key, const char *(*resolve)(long long)) {
+    if (2 * (d->count + 1) > d->nslots) {
+        free(d->slots);
+        d->nslots = d->nslots ? 2 * d->nslots : 16;
+        d->slots = calloc(d->nslots, sizeof(int));
+        for (int i = 0; i < d->count; i++) {
+            d->slots[arrow_dict_slot(d, d->keys[i])] = i + 1;
+        }
+    }
+
+    int slot = arrow_dict_slot(d, key);
+    if (d->slots[slot]) return d->slots[slot] - 1;
+
+    if (d->count == d->cap) {
+        d->cap = d->cap ? 2 * d->cap : 16;
+        d->keys = realloc(d->keys, d->cap * sizeof(long long));
+        d->values = realloc(d->values, d->cap * sizeof(char *));
+    }
+    d->keys[d->count] = key;
+    d->values[d->count] = strdup(resolve(key));
+    d->slots[slot] = d->count + 1;
+    return d->count++;
+}
+
+typedef struct {
+    FILE *out;
+    int batch_rows;
+    int rows;
+    int64_t *ints[NUM_INT_COLUMNS];
+    int32_t *dict_indices[NUM_DICTS];
+    int32_t *name_offsets;      // batch_rows + 1 entries
+    byte_buf names;
+    arrow_dict dicts[NUM_DICTS];
+    byte_buf meta;              // scratch buffers reused for every message
+    byte_buf body;
+} arrow_writer;
+
+// Starts a Message as the root table and returns the slot for its header
+size_t arrow_begin_message(byte_buf *meta, uint8_t header_type, int64_t body_length) {
+    meta->len = 0;
+    size_t root = bb_append(meta, NULL, 4);
+
+    fb_table msg = {0};
+    fb_i16(&msg, 0, ARROW_METADATA_V5);
+    fb_u8(&msg, 1, header_type);
+    fb_offset(&msg, 2);
+    fb_i64(&msg, 3, body_length);
+    fb_patch(meta, root, fb_emit_table(meta, &msg));
+    return msg.slot[2];
+}
+
+void arrow_write_message(arrow_writer *w) {
+    bb_pad(&w->meta, 8);
+    uint32_t prefix[2] = {0xFFFFFFFFu, (uint32_t)w->meta.len};
+    fwrite(prefix, sizeof(uint32_t), 2, w->out);
+    fwrite(w->meta.data, 1, w->meta.len, w->out);
+    if (w->body.len) fwrite(w->body.data, 1, w->body.len, w->out);
+}
+
+// Appends a body buffer and records its (offset, length) Buffer struct
+void arrow_body_buffer(arrow_writer *w, int64_t *buffers, int *nbuf, const void *data, size_t len) {
+    buffers[2 * *nbuf] = (int64_t)w->body.len;
+    buffers[2 * *nbuf + 1] = (int64_t)len;
+    (*nbuf)++;
+    if (len) bb_append(&w->body, data, len);
+    bb_pad(&w->body, ARROW_ALIGNMENT);
+}
+
+// Emits a RecordBatch table whose field nodes all have `rows` values and no nulls
+size_t arrow_emit_record_batch(byte_buf *meta, int64_t rows, int nnodes, const int64_t *buffers, int nbuf) {
+    fb_table rb = {0};
+    fb_i64(&rb, 0, rows);
+    fb_offset(&rb, 1);
+    fb_offset(&rb, 2);
+    size_t table = fb_emit_table(meta, &rb);
+
+    int64_t nodes[2 * NUM_ARROW_COLUMNS];
+    for (int i = 0; i < nnodes; i++) {
+        nodes[2 * i] = rows;
+        nodes[2 * i + 1] = 0;
+    }
+    fb_patch(meta, rb.slot[1], fb_emit_vector(meta, nodes, nnodes, 16, 8));
+    fb_patch(meta, rb.slot[2], fb_emit_vector(meta, buffers, nbuf, 16, 8));
+    return table;
+}
+
+size_t arrow_emit_int_type(byte_buf *meta, int bit_width) {
+    fb_table type = {0};
+    fb_i32(&type, 0, bit_width);
+    fb_u8(&type, 1, 1);   // is_signed
+    return fb_emit_table(meta, &type);
+}
+
+void arrow_write_schema(arrow_writer *w) {
+    byte_buf *meta = &w->meta;
+    size_t header = arrow_begin_message(meta, ARROW_HEADER_SCHEMA, 0);
+
+    fb_table schema = {0};
+    fb_i16(&schema, 0, 0);    // Endianness::Little
+    fb_offset(&schema, 1);
+    fb_patch(meta, header, fb_emit_table(meta, &schema));
+
+    size_t fields = fb_emit_vector(meta, NULL, NUM_ARROW_COLUMNS, 4, 4);
+    fb_patch(meta, schema.slot[1], fields);
+
+    for (int i = 0; i < NUM_ARROW_COLUMNS; i++) {
+        const arrow_column *col = &arrow_columns[i];
+        int is_int = col->kind == ARROW_INT64;
+
+        fb_table field = {0};
+        fb_offset(&field, 0);
+        fb_u8(&field, 1, 0);    // nullable
+        fb_u8(&field, 2, is_int ? ARROW_TYPE_INT : ARROW_TYPE_UTF8);
+        fb_offset(&field, 3);
+        if (col->kind == ARROW_DICT) fb_offset(&field, 4);
+        fb_offset(&field, 5);
+        fb_patch(meta, fields + 4 + 4 * i, fb_emit_table(meta, &field));
+
+        fb_patch(meta, field.slot[0], fb_emit_string(meta, col->name));
+        if (is_int) {
+            fb_patch(meta, field.slot[3], arrow_emit_int_type(meta, 64));
+        } else {
+            fb_table utf8 = {0};
+            fb_patch(meta, field.slot[3], fb_emit_table(meta, &utf8));
+        }
+        if (col->kind == ARROW_DICT) {
+            fb_table encoding = {0};
+            fb_i64(&encoding, 0, col->index);
+            fb_offset(&encoding, 1);
+            fb_patch(meta, field.slot[4], fb_emit_table(meta, &encoding));
+            fb_patch(meta, encoding.slot[1], arrow_emit_int_type(meta, 32));
+        }
+        fb_patch(meta, field.slot[5], fb_emit_vector(meta, NULL, 0, 4, 4));
+    }
+
+    w->body.len = 0;
+    arrow_write_message(w);
+}
+
+// Sends dictionary entries the reader has not seen yet as a delta batch
+void arrow_write_dictionary(arrow_writer *w, int id) {
+    arrow_dict *d = &w->dicts[id];
+    int count = d->count - d->emitted;
+    if (count == 0) return;
+
+    int32_t *offsets = malloc((count + 1) * sizeof(int32_t));
+    byte_buf data = {0};
+    offsets[0] = 0;
+    for (int i = 0; i < count; i++) {
+        const char *value = d->values[d->emitted + i];
+        bb_append(&data, value, strlen(value));
+        offsets[i + 1] = (int32_t)data.len;
+    }
+
+    int64_t buffers[6];
+    int nbuf = 0;
+    w->body.len = 0;
+    arrow_body_buffer(w, buffers, &nbuf, NULL, 0);
+    arrow_body_buffer(w, buffers, &nbuf, offsets, (count + 1) * sizeof(int32_t));
+    arrow_body_buffer(w, buffers, &nbuf, data.data, data.len);
+    free(offsets);
+    free(data.data);
+
+    byte_buf *meta = &w->meta;
+    size_t header = arrow_begin_message(meta, ARROW_HEADER_DICTIONARY_BATCH, (int64_t)w->body.len);
+    fb_table batch = {0};
+    fb_i64(&batch, 0, id);
+    fb_offset(&batch, 1);
+    fb_u8(&batch, 2, d->emitted > 0);   // isDelta
+    fb_patch(meta, header, fb_emit_table(meta, &batch));
+    fb_patch(meta, batch.slot[1], arrow_emit_record_batch(meta, count, 1, buffers, nbuf));
+
+    arrow_write_message(w);
+    d->emitted = d->count;
+}
+
+void arrow_flush_batch(arrow_writer *w) {
+    if (w->rows == 0) return;
+
+    for (int id = 0; id < NUM_DICTS; id++) {
+        arrow_write_dictionary(w, id);
+    }
+
+    int64_t buffers[2 * 3 * NUM_ARROW_COLUMNS];
+    int nbuf = 0;
+    w->body.len = 0;
+    for (int i = 0; i < NUM_ARROW_COLUMNS; i++) {
+        const arrow_column *col = &arrow_columns[i];
+        arrow_body_buffer(w, buffers, &nbuf, NULL, 0);   // validity: no nulls
+        if (col->kind == ARROW_UTF8) {
+            arrow_body_buffer(w, buffers, &nbuf, w->name_offsets, (w->rows + 1) * sizeof(int32_t));
+            arrow_body_buffer(w, buffers, &nbuf, w->names.data, w->names.len);
+        } else if (col->kind == ARROW_INT64) {
+            arrow_body_buffer(w, buffers, &nbuf, w->ints[col->index], w->rows * sizeof(int64_t));
+        } else {
+            arrow_body_buffer(w, buffers, &nbuf, w->dict_indices[col->index], w->rows * sizeof(int32_t));
+        }
+    }
+
+    byte_buf *meta = &w->meta;
+    size_t header = arrow_begin_message(meta, ARROW_HEADER_RECORD_BATCH, (int64_t)w->body.len);
+    fb_patch(meta, header, arrow_emit_record_batch(meta, w->rows, NUM_ARROW_COLUMNS, buffers, nbuf));
+    arrow_write_message(w);
+
+    w->rows = 0;
+    w->names.len = 0;
+}
+
+void arrow_writer_init(arrow_writer *w, FILE *out, int batch_rows) {
+    memset(w, 0, sizeof(*w));
+    w->out = out;
+    w->batch_rows = batch_rows;
+    for (int i = 0; i < NUM_INT_COLUMNS; i++) {
+        w->ints[i] = malloc(batch_rows * sizeof(int64_t));
+    }
+    for (int i = 0; i < NUM_DICTS; i++) {
+        w->dict_indices[i] = malloc(batch_rows * sizeof(int32_t));
+    }
+    w->name_offsets = calloc(batch_rows + 1, sizeof(int32_t));
+    arrow_write_schema(w);
+}
+
+void arrow_append_row(arrow_writer *w, const char *filename, const struct stat *st) {
+    int row = w->rows;
+
+    bb_append(&w->names, filename, strlen(filename));
+    w->name_offsets[row + 1] = (int32_t)w->names.len;
+
+    w->ints[INT_SIZE][row] = st->st_size;
+    w->ints[INT_UID][row] = st->st_uid;
+    w->ints[INT_GID][row] = st->st_gid;
+    w->ints[INT_PERMISSIONS][row] = st->st_mode & 0777;
+    w->ints[INT_MODIFIED][row] = st->st_mtime;
+    w->ints[INT_ACCESSED][row] = st->st_atime;
+    w->ints[INT_CHANGED][row] = st->st_ctime;
+    w->ints[INT_INODE][row] = (int64_t)st->st_ino;
+    w->ints[INT_DEVICE][row] = (int64_t)st->st_dev;
+    w->ints[INT_HARD_LINKS][row] = st->st_nlink;
+    w->ints[INT_BLOCKS][row] = st->st_blocks;
+
+    w->dict_indices[DICT_TYPE][row] = arrow_dict_lookup(&w->dicts[DICT_TYPE], st->st_mode & S_IFMT, resolve_type);
+    w->dict_indices[DICT_OWNER][row] = arrow_dict_lookup(&w->dicts[DICT_OWNER], st->st_uid, resolve_owner);
+    w->dict_indices[DICT_GROUP][row] = arrow_dict_lookup(&w->dicts[DICT_GROUP], st->st_gid, resolve_group);
+
+    if (++w->rows == w->batch_rows) {
+        arrow_flush_batch(w);
+    }
+}
+
+void arrow_writer_finish(arrow_writer *w) {
+    arrow_flush_batch(w);
+
+    uint32_t eos[2] = {0xFFFFFFFFu, 0};
+    fwrite(eos, sizeof(uint32_t), 2, w->out);
+    fflush(w->out);
+
+    for (int i = 0; i < NUM_INT_COLUMNS; i++) free(w->ints[i]);
+    for (int i = 0; i < NUM_DICTS; i++) {
+        arrow_dict *d = &w->dicts[i];
+        for (int j = 0; j < d->count; j++) free(d->values[j]);
+        free(d->values);
+        free(d->keys);
+        free(d->slots);
+        free(w->dict_indices[i]);
+    }
+    free(w->name_offsets);
+    free(w->names.data);
+    free(w->meta.data);
+    free(w->body.data);
+}
+
+void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--format=json|arrow] [--batch-rows=N] [--hash]\n"
+                    "          [--pattern=GLOB] [--regex=RE] [--ignore-case] [directory]\n"
+                    "       %s --snapshot [--output=FILE] [directory]\n", prog, prog);
+}
+
+// file_info --snapshot: records the tree under directory for diff_snapshots
+int snapshot_main(const char *prog, int argc, char *argv[]) {
+    const char *path = ".";
+    const char *output = NULL;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--snapshot") == 0) {
+            continue;
+        } else if (strncmp(argv[i], "--output=", 9) == 0) {
+            output = argv[i] + 9;
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            print_usage(prog);
+            return 2;
+        } else {
+            path = argv[i];
+        }
+    }
+    if (!output && isatty(STDOUT_FILENO)) {
+        print_usage(prog);
+        return 2;
+    }
+
+    FILE *out = output ? fopen(output, "wb") : stdout;
+    if (!out) {
+        perror(output);
+        return 1;
+    }
+    long long count = fs_snapshot_write(path, out);
+    if (count < 0) {
+        perror(path);
+        if (output) {
+            fclose(out);
+            unlink(output);    // do not leave a truncated snapshot behind
+        }
+        return 1;
+    }
+    if (output && fclose(out) != 0) {
+        perror(output);
+        return 1;
+    }
+    fprintf(stderr, "%lld entries\n", count);
+    return 0;
+}
+
+// --hash: entries are held back this many at a time so their files hash in parallel
+#define HASH_BATCH 256
+
+typedef struct {
+    fs_entry entries[HASH_BATCH];
+    fs_hash_job jobs[HASH_BATCH];
+    int job_of[HASH_BATCH];     // index into jobs, -1 for anything but a regular file
+    int count;
+    int njobs;
+} hash_batch;
+
+void hash_batch_add(hash_batch *b, const fs_entry *entry) {
+    fs_entry *copy = &b->entries[b->count];
+    copy->name = strdup(entry->name);
+    copy->path = strdup(entry->path);
+    copy->st = entry->st;
+    b->job_of[b->count] = -1;
+    if (S_ISREG(entry->st.st_mode)) {
+        b->jobs[b->njobs].path = copy->path;
+        b->jobs[b->njobs].st = &copy->st;
+        b->job_of[b->count] = b->njobs++;
+    }
+    b->count++;
+}
+
+// Hashes the batch and renders it, adding "blake3" to every regular file (null if unreadable)
+void hash_batch_flush(hash_batch *b, fs_pool *pool, fs_buf *out, int *first_file) {
+    fs_hash_files(pool, AT_FDCWD, b->jobs, b->njobs, 0);
+    for (int i = 0; i < b->count; i++) {
+        fs_entry *entry = &b->entries[i];
+        if (!*first_file) fs_buf_append(out, ",\n", 2);
+        *first_file = 0;
+        fs_entry_to_json(out, entry, 1);
+        if (b->job_of[i] >= 0) {
+            const fs_hash_job *job = &b->jobs[b->job_of[i]];
+            char hex[2 * FS_HASH_LEN + 1];
+            fs_hash_hex(job->digest, hex);
+            out->len -= 2;    // reopen the object before its "\n}"
+            fs_buf_printf(out, ",\n  \"blake3\": %s%s%s\n}",
+                          job->error ? "" : "\"", job->error ? "null" : hex, job->error ? "" : "\"");
+        }
+        free((char *)entry->name);
+        free((char *)entry->path);
+    }
+    b->count = b->njobs = 0;
 }
 
 int main(int argc, char *argv[]) {
-    const char *path = (argc > 1) ? argv[1] : ".";
-    DIR *dir = opendir(path);
+    const char *path = ".";
+    const char *format = "json";
+    int batch_rows = ARROW_DEFAULT_BATCH_ROWS;
+    int hash = 0;
+    const char *pattern = NULL;
+    const char *regex = NULL;
+    int glob_flags = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--snapshot") == 0) return snapshot_main(argv[0], argc - 1, argv + 1);
+    }
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--format=", 9) == 0) {
+            format = argv[i] + 9;
+        } else if (strncmp(argv[i], "--batch-rows=", 13) == 0) {
+            batch_rows = atoi(argv[i] + 13);
+        } else if (strcmp(argv[i], "--hash") == 0) {
+            hash = 1;
+        } else if (strncmp(argv[i], "--pattern=", 10) == 0) {
+            pattern = argv[i] + 10;
+        } else if (strncmp(argv[i], "--regex=", 8) == 0) {
+            regex = argv[i] + 8;
+        } else if (strcmp(argv[i], "--ignore-case") == 0) {
+            glob_flags |= FS_GLOB_NOCASE;
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            print_usage(argv[0]);
+            return 2;
+        } else {
+            path = argv[i];
+        }
+    }
+
+    int arrow = strcmp(format, "arrow") == 0;
+    if ((!arrow && strcmp(format, "json") != 0) || batch_rows <= 0 || (arrow && hash)) {
+        print_usage(argv[0]);
+        return 2;
+    }
+
+    fs_glob *glob = pattern ? fs_glob_compile(pattern, glob_flags) : NULL;
+    if (pattern && !glob) {
+        fprintf(stderr, "%s: %s pattern: %s\n", argv[0], errno == E2BIG ? "too complex" : "invalid", pattern);
+        return 2;
+    }
+    fs_regex *re = regex ? fs_regex_compile(regex, glob_flags) : NULL;
+    if (regex && !re) {
+        fprintf(stderr, "%s: %s regex: %s\n", argv[0], errno == E2BIG ? "too complex" : "invalid", regex);
+        return 2;
+    }
+
+    fs_dir *dir = fs_dir_open(path, 0);
     if (!dir) {
-        printf("{\n");
-        printf("  \"error\": \"Cannot open directory\",\n");
-        printf("  \"directory\": \"%s\"\n", path);
-        printf("}\n");
+        // Keep binary stdout clean; a reader would choke on JSON mid-stream
+        FILE *err = arrow ? stderr : stdout;
+        fprintf(err, "{\n");
+        fprintf(err, "  \"error\": \"Cannot open directory\",\n");
+        fprintf(err, "  \"directory\": \"%s\"\n", path);
+        fprintf(err, "}\n");
         return 1;
     }
+    fs_dir_set_glob(dir, glob);
+    fs_dir_set_regex(dir, re);
     
-    struct dirent *entry;
-    struct stat st;
+    const fs_entry *entry;
+    fs_buf out = {0};
     int first_file = 1;
+    arrow_writer writer;
+    hash_batch *batch = hash ? calloc(1, sizeof(hash_batch)) : NULL;
+    fs_pool *pool = hash ? fs_pool_create(0) : NULL;
     
-    printf("[\n");
+    if (arrow) {
+        arrow_writer_init(&writer, stdout, batch_rows);
+    } else {
+        printf("[\n");
+    }
     
-    while ((entry = readdir(dir))) {
-        if (entry->d_name[0] == '.') continue; // skip hidden files
-        
-        char fullpath[2048];
-        snprintf(fullpath, sizeof(fullpath), "%s/%s", path, entry->d_name);
-
-        if (stat(fullpath, &st) == 0) {
-            if (!first_file) {
-                printf(",\n");
-            }
-            print_file_info_json(path, entry->d_name, &st);
-            first_file = 0;
+    while ((entry = fs_dir_next(dir))) {
+        if (arrow) {
+            arrow_append_row(&writer, entry->name, &entry->st);
+            continue;
+        }
+        if (batch) {
+            hash_batch_add(batch, entry);
+            if (batch->count == HASH_BATCH) hash_batch_flush(batch, pool, &out, &first_file);
+            fwrite(out.data, 1, out.len, stdout);
+            out.len = 0;
+            continue;
+        }
+        if (!first_file) {
+            fs_buf_append(&out, ",\n", 2);
+        }
+        fs_entry_to_json(&out, entry, 1);
+        first_file = 0;
+
+        // Emit in large writes instead of holding the whole listing
+        if (out.len >= 64 * 1024) {
+            fwrite(out.data, 1, out.len, stdout);
+            out.len = 0;
         }
     }
     
-    printf("\n]\n");
-    closedir(dir);
+    if (batch) {
+        hash_batch_flush(batch, pool, &out, &first_file);
+        free(batch);
+        fs_pool_destroy(pool);
+    }
+    if (arrow) {
+        arrow_writer_finish(&writer);
+    } else {
+        fwrite(out.data, 1, out.len, stdout);
+        printf("\n]\n");
+    }
+    fs_buf_free(&out);
+    fs_dir_close(dir);
+    fs_glob_free(glob);
+    fs_regex_free(re);
     return 0;
 }
\ No newline at end of file
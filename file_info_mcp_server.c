@@ -1,119 +1,2870 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
-#include <dirent.h>
-#include <pwd.h>
-#include <grp.h>
-#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#endif
+
+#include "libfilesavant.h"
+#include "fs_lz4.h"
+#include "file_info_probes.h"
+
+// MCP Server for FileSavantAI - File Operations
+
+// Responses at least this large go through the shared-memory ring when enabled
+#define SHM_INLINE_LIMIT 4096
+#define SHM_DEFAULT_SIZE (64 * 1024 * 1024)
+#define SHM_MAX_REGIONS 256
+
+#define MAX_REQUEST_LINE 65536
+#define DIFF_DEFAULT_LIMIT 1000    // changes listed by diff_snapshots
+#define RENDER_DEFAULT_BUDGET 4000 // render_for_llm tokens
+
+// sample_files
+#define SAMPLE_DEFAULT 24
+#define SAMPLE_MAX 200
+#define SAMPLE_STRATA 64          // distinct (type, extension, size bucket); the rest share one
+#define SAMPLE_EXT_LEN 10
+#define SAMPLE_EXT_SLOTS 256      // extensions counted exactly; the rest go to other_extensions
+#define SAMPLE_TOP_EXTENSIONS 12
+#define SAMPLE_OUTLIERS 3
+// list_files progress notifications and result chunks
+#define PROGRESS_INTERVAL_MS 250
+#define STREAM_CHUNK_BYTES (256 * 1024)    // a chunk goes out at this size even short of chunk_size
+#define ZERO_COPY_MIN (1024 * 1024)    // smaller responses are copied into the pipe as before
+#define FLUSH_CHUNK (1024 * 1024)      // a listing on plain stdio goes out in pieces of this size
+#define COMPRESS_MIN (64 * 1024)       // smaller responses go out as plain lines
+#define COMPRESS_JOBS 8                // blocks queued to the compressor before rendering waits
+#define DELTA_DEFAULT_MB 64       // list_files states kept for "since" (--delta-mb)
+#define MAX_EVENTS 64
+// Per-connection backpressure: stop reading once this much output is queued
+#define CONN_HIGH_WATER (4 * 1024 * 1024)
+#define CONN_LOW_WATER (1024 * 1024)
+// A listing streaming to a client that takes nothing for this long drops it
+#define CONN_STALL_MS 2000
+
+// Log-linear histogram: 2^HIST_SUB_BITS buckets per power of two (~3% error)
+#define HIST_SUB_BITS 5
+#define HIST_MAX_BITS 40    // values clamp at 2^40 ns (~18 minutes)
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+void send_initialization();
+void send_tools_list(int id);
+void send_error(int id, const char* code, const char* message);
+void send_response(int id);
+typedef struct list_options list_options;
+
+void handle_list_files(int id, const char* directory, const list_options *opts);
+void handle_get_metrics(int id);
+void handle_hash_files(int id, const char* directory, const char* line);
+void handle_find_duplicates(int id, const char* directory, long long min_size, long long limit, int hidden);
+void handle_diff_snapshots(int id, const char* old_file, const char* new_file, long long limit);
+void handle_render_for_llm(int id, const char* directory, const list_options *opts, long long budget);
+void handle_sample_files(int id, const char* directory, long long sample_size, uint64_t seed);
+char* extract_string_value(const char* json, const char* key);
+char* extract_progress_token(const char* json);
+int extract_string_into(const char* json, const char* key, char *out, size_t cap);
+long long extract_number(const char* json, const char* key, long long fallback);
+int extract_id(const char* json);
+void handle_request(char *line);
+void handle_batch(char *line);
+
+/**
+ * @brief A --listen client: partial request line in, queued responses out
+ */
+typedef struct {
+    int fd;
+    char *in;
+    size_t in_len;
+    fs_buf out;
+    size_t out_sent;
+    int paused;     // reading suspended until queued output drains
+    int eof;        // the peer is done sending; close once its output is out
+    int dropped;    // stalled mid-stream; the rest of the request is discarded
+    int codec;      // CODEC_*, agreed in initialize
+} connection;
+
+// Every response is rendered here first, then handed to the transport.
+// Request-scoped state is per thread so batch items can run side by side.
+__thread fs_buf response;
+
+// Connection the current request came from; NULL means stdio
+connection *current_conn;
+
+// Parsed arguments and the directory iterator; reset once the response is out
+__thread fs_arena request_arena;
+
+/**
+ * @brief list_files arguments besides "directory"
+ *
+ * Any of them makes the server collect the listing into listing_table
+ * before answering; without them entries are streamed into the response.
+ */
+struct list_options {
+    int sort;               // FS_SORT_*
+    int descending;
+    long long offset;
+    long long limit;        // -1: no limit
+    fs_filter filter;
+    int buffered;
+    int content_type;       // add "content_type" to regular files
+    int dictionary;         // owner and group names once per id, not per record
+    int ignore_case;
+    char pattern[256];      // glob on names, "" for none; inline so options stay a flat cache key
+    char regex[256];        // regex on names, "" for none
+    int track;              // answer as a delta and keep a state token
+    char since[24];         // token of the state to diff against, "" for none
+};
+
+// Buffered listings; keeps its capacity between requests
+__thread fs_table listing_table;
+
+// Runs the elements of JSON-RPC batches; --batch-threads=N sizes it (0: one per CPU).
+// Separate from io_pool because batched requests submit their file reads to that one.
+fs_pool *batch_pool;
+int batch_threads;
+pthread_once_t batch_pool_once = PTHREAD_ONCE_INIT;
+
+void start_batch_pool() {
+    batch_pool = fs_pool_create(batch_threads);
+}
+
+// File-reading workers (hashing, content sniffing); --io-threads=N sizes it (0: one per CPU)
+fs_pool *io_pool;
+int io_threads;
+pthread_once_t io_pool_once = PTHREAD_ONCE_INIT;
+
+void start_io_pool() {
+    io_pool = fs_pool_create(io_threads);
+}
+
+// Started on first use, so servers that never read file contents have no extra threads
+fs_pool* get_io_pool() {
+    pthread_once(&io_pool_once, start_io_pool);
+    return io_pool;
+}
+
+#define SNIFF_BATCH 128
+#define SNIFF_DEFAULT_BUDGET_MS 250
+
+/**
+ * @brief list_files entries held back so content_type reads run in parallel
+ *
+ * Each batch is sniffed on the I/O pool, then rendered in directory order.
+ * Once the request's budget (--sniff-budget-ms) is spent no more files are
+ * opened and the rest report "content_type":null, so a slow disk bounds the
+ * added latency instead of multiplying it by the entry count.
+ */
+typedef struct {
+    fs_entry entries[SNIFF_BATCH];
+    size_t path_at[SNIFF_BATCH];
+    size_t name_at[SNIFF_BATCH];
+    const char *types[SNIFF_BATCH];    // NULL: no field (not a regular file), "": null
+    size_t count;
+    fs_buf names;                      // paths and names of the batch; reused
+    uint64_t deadline;
+    int skipped;                       // a type was given up on; the listing is not cached
+} sniff_batch;
+
+__thread sniff_batch sniff;
+uint64_t sniff_budget_ns = SNIFF_DEFAULT_BUDGET_MS * 1000000ull;
+
+/**
+ * @brief LRU cache of list_files result bodies (--cache-mb=N)
+ *
+ * Keyed by the directory's (st_dev, st_ino), the path string (entries embed
+ * it) and the list options; valid while the directory's mtime and ctime
+ * are unchanged to the nanosecond, so a hit costs one stat() and a memcpy.
+ * Directory times only move when entries are added, removed or renamed:
+ * edits to a file inside it are not seen until then, which is why the
+ * cache is opt-in.
+ */
+typedef struct cache_entry {
+    struct cache_entry *next_in_bucket;
+    struct cache_entry *newer;
+    struct cache_entry *older;
+    uint64_t hash;
+    dev_t dev;
+    ino_t ino;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    list_options opts;
+    char *directory;
+    char *body;             // JSON array contents, without the brackets
+    size_t body_len;
+    size_t cost;            // bytes charged against the budget
+} cache_entry;
+
+struct {
+    pthread_mutex_t lock;   // held across lookup and copy-out; batch items share the cache
+    size_t budget;          // 0: cache disabled
+    size_t used;
+    size_t count;
+    cache_entry **buckets;
+    size_t nbuckets;
+    cache_entry *newest;
+    cache_entry *oldest;
+    uint64_t hits;          // counters are read by the metrics dump thread
+    uint64_t misses;
+    uint64_t invalidations;
+    uint64_t evictions;
+} result_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Directories changed this recently are not cached: a later change could land in the same timestamp tick
+#define CACHE_SETTLE_NS 2000000000LL
+
+int64_t timespec_ns(struct timespec ts) {
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#ifdef __APPLE__
+#define STAT_MTIME_NS(st) timespec_ns((st)->st_mtimespec)
+#define STAT_CTIME_NS(st) timespec_ns((st)->st_ctimespec)
+#else
+#define STAT_MTIME_NS(st) timespec_ns((st)->st_mtim)
+#define STAT_CTIME_NS(st) timespec_ns((st)->st_ctim)
+#endif
+
+uint64_t cache_hash(const struct stat *st, const char *directory, const list_options *opts) {
+    uint64_t h = 1469598103934665603ULL;    // FNV-1a
+    const unsigned char *parts[] = { (const void *)&st->st_dev, (const void *)&st->st_ino, (const void *)opts };
+    size_t lengths[] = { sizeof(st->st_dev), sizeof(st->st_ino), sizeof(*opts) };
+    for (int p = 0; p < 3; p++) {
+        for (size_t i = 0; i < lengths[p]; i++) h = (h ^ parts[p][i]) * 1099511628211ULL;
+    }
+    for (const char *c = directory; *c; c++) h = (h ^ (unsigned char)*c) * 1099511628211ULL;
+    return h;
+}
+
+void cache_unlink_lru(cache_entry *e) {
+    if (e->newer) e->newer->older = e->older;
+    else result_cache.newest = e->older;
+    if (e->older) e->older->newer = e->newer;
+    else result_cache.oldest = e->newer;
+}
+
+void cache_push_newest(cache_entry *e) {
+    e->newer = NULL;
+    e->older = result_cache.newest;
+    if (result_cache.newest) result_cache.newest->newer = e;
+    result_cache.newest = e;
+    if (!result_cache.oldest) result_cache.oldest = e;
+}
+
+void cache_remove(cache_entry *e) {
+    cache_entry **link = &result_cache.buckets[e->hash & (result_cache.nbuckets - 1)];
+    while (*link != e) link = &(*link)->next_in_bucket;
+    *link = e->next_in_bucket;
+    cache_unlink_lru(e);
+    result_cache.used -= e->cost;
+    result_cache.count--;
+    free(e->directory);
+    free(e->body);
+    free(e);
+}
+
+/**
+ * @brief Cached body for this directory state and options, or NULL
+ */
+cache_entry* cache_lookup(const struct stat *st, const char *directory, const list_options *opts) {
+    uint64_t hash = cache_hash(st, directory, opts);
+    cache_entry *e = result_cache.buckets ? result_cache.buckets[hash & (result_cache.nbuckets - 1)] : NULL;
+    for (; e; e = e->next_in_bucket) {
+        if (e->hash == hash && e->dev == st->st_dev && e->ino == st->st_ino &&
+            strcmp(e->directory, directory) == 0 && memcmp(&e->opts, opts, sizeof(*opts)) == 0) break;
+    }
+    if (e && (e->mtime_ns != STAT_MTIME_NS(st) || e->ctime_ns != STAT_CTIME_NS(st))) {
+        cache_remove(e);
+        __atomic_fetch_add(&result_cache.invalidations, 1, __ATOMIC_RELAXED);
+        e = NULL;
+    }
+    if (!e) {
+        __atomic_fetch_add(&result_cache.misses, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    cache_unlink_lru(e);
+    cache_push_newest(e);
+    __atomic_fetch_add(&result_cache.hits, 1, __ATOMIC_RELAXED);
+    return e;
+}
+
+void cache_grow_buckets() {
+    size_t nbuckets = result_cache.nbuckets ? result_cache.nbuckets * 2 : 1024;
+    cache_entry **buckets = calloc(nbuckets, sizeof(cache_entry *));
+    if (!buckets) return;
+    for (cache_entry *e = result_cache.oldest; e; e = e->newer) {
+        e->next_in_bucket = buckets[e->hash & (nbuckets - 1)];
+        buckets[e->hash & (nbuckets - 1)] = e;
+    }
+    free(result_cache.buckets);
+    result_cache.buckets = buckets;
+    result_cache.nbuckets = nbuckets;
+}
+
+/**
+ * @brief Stores a body listed while the directory looked like st
+ */
+void cache_insert(const struct stat *st, const char *directory, const list_options *opts,
+                  const char *body, size_t body_len) {
+    size_t cost = sizeof(cache_entry) + strlen(directory) + 1 + body_len;
+    if (cost > result_cache.budget) return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t changed = STAT_MTIME_NS(st) > STAT_CTIME_NS(st) ? STAT_MTIME_NS(st) : STAT_CTIME_NS(st);
+    if (timespec_ns(now) - changed < CACHE_SETTLE_NS) return;
+
+    while (result_cache.used + cost > result_cache.budget) {
+        cache_remove(result_cache.oldest);
+        __atomic_fetch_add(&result_cache.evictions, 1, __ATOMIC_RELAXED);
+    }
+    if (result_cache.count >= result_cache.nbuckets) cache_grow_buckets();
+    if (!result_cache.buckets) return;
+
+    cache_entry *e = calloc(1, sizeof(cache_entry));
+    char *copy = malloc(body_len ? body_len : 1);
+    char *name = strdup(directory);
+    if (!e || !copy || !name) {
+        free(e);
+        free(copy);
+        free(name);
+        return;
+    }
+    memcpy(copy, body, body_len);
+    e->hash = cache_hash(st, directory, opts);
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->mtime_ns = STAT_MTIME_NS(st);
+    e->ctime_ns = STAT_CTIME_NS(st);
+    e->opts = *opts;
+    e->directory = name;
+    e->body = copy;
+    e->body_len = body_len;
+    e->cost = cost;
+
+    e->next_in_bucket = result_cache.buckets[e->hash & (result_cache.nbuckets - 1)];
+    result_cache.buckets[e->hash & (result_cache.nbuckets - 1)] = e;
+    cache_push_newest(e);
+    result_cache.used += cost;
+    result_cache.count++;
+}
+
+/**
+ * @brief list_files states that "since" requests are diffed against
+ *
+ * With "track": true or "since": token, list_files keeps one row per entry
+ * that passed the name filters (its name, a fingerprint of inode, size,
+ * mtime, ctime and mode, and whether the stat filters kept it) under a new
+ * token, and answers only what changed relative to the "since" state. States
+ * are immutable once published, shared by every request naming them, and
+ * evicted oldest first beyond --delta-mb.
+ */
+typedef struct delta_state {
+    struct delta_state *newer;
+    struct delta_state *older;
+    uint64_t token;
+    dev_t dev;
+    ino_t ino;
+    int64_t mtime_ns;       // directory times when the scan started
+    int64_t ctime_ns;
+    int settled;            // ...and they were old enough to be trusted unchanged
+    list_options opts;      // the options that select rows (delta_options())
+    size_t count;
+    size_t cap;
+    uint64_t *fingerprint;  // 0: changed too recently to compare, always reported
+    uint64_t *name;         // offset of each name in names
+    uint8_t *flags;         // DELTA_*
+    fs_buf names;
+    uint32_t *index;        // open addressing on the name hash: row + 1, 0 empty
+    size_t index_mask;
+    size_t cost;
+    int refs;               // requests diffing against it
+    int evicted;            // freed by the last release
+} delta_state;
+
+#define DELTA_KEPT 0x1        // passed the stat filters: part of the listing
+#define DELTA_ADDED 0x2       // set while answering the request that built the state
+#define DELTA_MODIFIED 0x4
+
+struct {
+    pthread_mutex_t lock;
+    size_t budget;
+    size_t used;
+    delta_state *newest;
+    delta_state *oldest;
+    uint64_t next_token;    // random high half, so tokens of an earlier process are unknown
+} delta_store = { .lock = PTHREAD_MUTEX_INITIALIZER, .budget = (size_t)DELTA_DEFAULT_MB << 20 };
+
+uint64_t delta_name_hash(const char *name) {
+    uint64_t h = 1469598103934665603ULL;    // FNV-1a
+    for (const char *c = name; *c; c++) h = (h ^ (unsigned char)*c) * 1099511628211ULL;
+    return h;
+}
+
+/**
+ * @brief What a later listing compares an entry against
+ *
+ * Entries changed after settle_before fingerprint as 0: another change in
+ * the same timestamp tick would leave every field equal, so they are
+ * reported as modified again until they settle.
+ */
+uint64_t delta_fingerprint(const struct stat *st, int64_t settle_before) {
+    int64_t mtime = STAT_MTIME_NS(st), ctime = STAT_CTIME_NS(st);
+    if (mtime >= settle_before || ctime >= settle_before) return 0;
+    uint64_t fields[] = { (uint64_t)st->st_ino, (uint64_t)st->st_size, (uint64_t)mtime,
+                          (uint64_t)ctime, (uint64_t)st->st_mode };
+    uint64_t h = 0;
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        h = (h ^ fields[i]) * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 29;
+    }
+    return h | 1;
+}
+
+// The list options that decide which rows a state holds and keeps
+list_options delta_options(const list_options *opts) {
+    list_options key;
+    memset(&key, 0, sizeof(key));
+    key.filter = opts->filter;
+    key.ignore_case = opts->ignore_case;
+    memcpy(key.pattern, opts->pattern, sizeof(key.pattern));
+    memcpy(key.regex, opts->regex, sizeof(key.regex));
+    return key;
+}
+
+int delta_keeps(const fs_filter *f, const struct stat *st) {
+    return st->st_size >= f->min_size && st->st_size <= f->max_size &&
+           st->st_mtime >= f->modified_after && st->st_mtime <= f->modified_before &&
+           (!f->type || (st->st_mode & S_IFMT) == f->type);
+}
+
+size_t delta_add_row(delta_state *s, const char *name, uint64_t fingerprint, int kept) {
+    if (s->count == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 256;
+        s->fingerprint = realloc(s->fingerprint, s->cap * sizeof(*s->fingerprint));
+        s->name = realloc(s->name, s->cap * sizeof(*s->name));
+        s->flags = realloc(s->flags, s->cap * sizeof(*s->flags));
+        if (!s->fingerprint || !s->name || !s->flags) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    size_t row = s->count++;
+    s->fingerprint[row] = fingerprint;
+    s->name[row] = s->names.len;
+    s->flags[row] = kept ? DELTA_KEPT : 0;
+    fs_buf_append(&s->names, name, strlen(name) + 1);
+    return row;
+}
+
+static inline const char* delta_name(const delta_state *s, size_t row) {
+    return s->names.data + s->name[row];
+}
+
+// Indexes a finished state by name for the next request's lookups
+void delta_build_index(delta_state *s) {
+    size_t slots = 16;
+    while (slots < 2 * s->count) slots *= 2;
+    s->index = calloc(slots, sizeof(uint32_t));
+    if (!s->index) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    s->index_mask = slots - 1;
+    for (size_t row = 0; row < s->count; row++) {
+        size_t i = delta_name_hash(delta_name(s, row)) & s->index_mask;
+        while (s->index[i]) i = (i + 1) & s->index_mask;
+        s->index[i] = (uint32_t)row + 1;
+    }
+    s->cost = sizeof(*s) + s->count * (2 * sizeof(uint64_t) + 1) + slots * sizeof(uint32_t) +
+              s->names.len;
+}
+
+// Row of name in s, or -1
+long delta_find(const delta_state *s, const char *name) {
+    for (size_t i = delta_name_hash(name) & s->index_mask; s->index[i]; i = (i + 1) & s->index_mask) {
+        size_t row = s->index[i] - 1;
+        if (strcmp(delta_name(s, row), name) == 0) return (long)row;
+    }
+    return -1;
+}
+
+void delta_free(delta_state *s) {
+    free(s->fingerprint);
+    free(s->name);
+    free(s->flags);
+    free(s->index);
+    fs_buf_free(&s->names);
+    free(s);
+}
+
+void delta_unlink(delta_state *s) {
+    if (s->newer) s->newer->older = s->older;
+    else delta_store.newest = s->older;
+    if (s->older) s->older->newer = s->newer;
+    else delta_store.oldest = s->newer;
+}
+
+void delta_push_newest(delta_state *s) {
+    s->newer = NULL;
+    s->older = delta_store.newest;
+    if (delta_store.newest) delta_store.newest->newer = s;
+    delta_store.newest = s;
+    if (!delta_store.oldest) delta_store.oldest = s;
+}
+
+/**
+ * @brief The state a token names, held until delta_release(), or NULL
+ */
+delta_state* delta_acquire(const char *token) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(token, &end, 16);
+    if (errno || *end || end - token != 16) return NULL;
+    pthread_mutex_lock(&delta_store.lock);
+    delta_state *s = delta_store.newest;
+    while (s && s->token != value) s = s->older;
+    if (s) {
+        s->refs++;
+        delta_unlink(s);
+        delta_push_newest(s);
+    }
+    pthread_mutex_unlock(&delta_store.lock);
+    return s;
+}
+
+void delta_release(delta_state *s) {
+    pthread_mutex_lock(&delta_store.lock);
+    int last = --s->refs == 0 && s->evicted;
+    pthread_mutex_unlock(&delta_store.lock);
+    if (last) delta_free(s);
+}
+
+/**
+ * @brief Gives a finished state its token and keeps it, evicting the oldest
+ * states beyond the budget; a state larger than the budget is not kept
+ *
+ * The caller holds s like delta_acquire() would have given it.
+ */
+uint64_t delta_publish(delta_state *s) {
+    delta_build_index(s);
+    pthread_mutex_lock(&delta_store.lock);
+    if (!delta_store.next_token) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        uint64_t seed = (uint64_t)timespec_ns(now) ^ ((uint64_t)getpid() << 32);
+        delta_store.next_token = (seed * 0x9E3779B97F4A7C15ULL) & 0xFFFFFFFF00000000ULL;
+    }
+    uint64_t token = s->token = ++delta_store.next_token;
+    s->refs = 1;
+    if (s->cost <= delta_store.budget) {
+        delta_push_newest(s);
+        delta_store.used += s->cost;
+    } else {
+        s->evicted = 1;
+    }
+    while (delta_store.used > delta_store.budget) {
+        delta_state *old = delta_store.oldest;
+        delta_unlink(old);
+        delta_store.used -= old->cost;
+        old->evicted = 1;
+        if (old->refs == 0) delta_free(old);
+    }
+    pthread_mutex_unlock(&delta_store.lock);
+    return token;
+}
+
+/**
+ * @brief Shared-memory result ring (--shm-socket=FD)
+ *
+ * Large responses are copied into a memfd-backed ring whose fd was passed to
+ * the client over a Unix socket with SCM_RIGHTS; stdout only carries a small
+ * {"id":N,"shm":{"offset":..,"length":..}} control line. The client hands each
+ * region back with an "shm/release" notification once it has parsed it.
+ */
+typedef struct {
+    size_t offset;
+    size_t length;
+    int released;
+} shm_region;
+
+struct {
+    char *base;
+    size_t size;
+    shm_region regions[SHM_MAX_REGIONS];   // outstanding regions, oldest first
+    int head;
+    int count;
+    pthread_mutex_t release_lock;           // batched releases run concurrently; publishes come after
+} shm_ring = { .release_lock = PTHREAD_MUTEX_INITIALIZER };
+
+int shm_init(int sock, size_t size) {
+#ifdef __linux__
+    int fd = memfd_create("filesavant-results", MFD_CLOEXEC);
+#else
+    char name[64];
+    snprintf(name, sizeof(name), "/filesavant-%d", (int)getpid());
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) shm_unlink(name);
+#endif
+    if (fd < 0 || ftruncate(fd, size) != 0) return -1;
+
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    // Payload carries the ring size; the fd rides along as ancillary data
+    unsigned long long payload = size;
+    struct iovec iov = { &payload, sizeof(payload) };
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    ssize_t sent = sendmsg(sock, &msg, 0);
+    close(fd);
+    if (sent != (ssize_t)sizeof(payload)) {
+        munmap(base, size);
+        return -1;
+    }
+
+    shm_ring.base = base;
+    shm_ring.size = size;
+    return 0;
+}
+
+// Finds room for len contiguous bytes; returns -1 when the ring is too full
+long long shm_reserve(size_t len) {
+    if (shm_ring.count == SHM_MAX_REGIONS) return -1;
+    if (shm_ring.count == 0) return len <= shm_ring.size ? 0 : -1;
+
+    shm_region *oldest = &shm_ring.regions[shm_ring.head];
+    shm_region *newest = &shm_ring.regions[(shm_ring.head + shm_ring.count - 1) % SHM_MAX_REGIONS];
+    size_t tail = oldest->offset;
+    size_t head = newest->offset + newest->length;
+
+    if (head > tail) {
+        if (shm_ring.size - head >= len) return head;
+        if (tail >= len) return 0;    // wrap around
+        return -1;
+    }
+    return tail - head >= len ? (long long)head : -1;
+}
+
+int shm_publish(int id, const char *data, size_t len) {
+    long long offset = shm_reserve(len);
+    if (offset < 0) return -1;
+
+    memcpy(shm_ring.base + offset, data, len);
+    shm_region *region = &shm_ring.regions[(shm_ring.head + shm_ring.count) % SHM_MAX_REGIONS];
+    region->offset = offset;
+    region->length = len;
+    region->released = 0;
+    shm_ring.count++;
+
+    printf("{\"jsonrpc\":\"2.0\",\"id\":%d,\"shm\":{\"offset\":%lld,\"length\":%zu}}\n", id, offset, len);
+    return 0;
+}
+
+void shm_release(long long offset) {
+    pthread_mutex_lock(&shm_ring.release_lock);
+    for (int i = 0; i < shm_ring.count; i++) {
+        shm_region *region = &shm_ring.regions[(shm_ring.head + i) % SHM_MAX_REGIONS];
+        if ((long long)region->offset == offset) region->released = 1;
+    }
+    // Regions can be released out of order; reclaim from the oldest end
+    while (shm_ring.count > 0 && shm_ring.regions[shm_ring.head].released) {
+        shm_ring.head = (shm_ring.head + 1) % SHM_MAX_REGIONS;
+        shm_ring.count--;
+    }
+    pthread_mutex_unlock(&shm_ring.release_lock);
+}
+
+/**
+ * @brief Per-method, per-phase request latency histograms
+ *
+ * Requests are timed phase by phase (parse, opendir, enumerate, stat,
+ * select, name resolution, serialize, compress, write) and each phase total is recorded once per
+ * request. Buckets are updated with relaxed atomics so the --metrics-interval
+ * dump thread can read them while the event loop keeps recording.
+ */
+enum { PHASE_PARSE, PHASE_OPENDIR, PHASE_ENUMERATE, PHASE_STAT, PHASE_SELECT, PHASE_HASH, PHASE_SNIFF,
+       PHASE_NAMES, PHASE_SERIALIZE, PHASE_COMPRESS, PHASE_WRITE, PHASE_TOTAL, PHASE_COUNT };
+enum { METHOD_INITIALIZE, METHOD_TOOLS_LIST, METHOD_LIST_FILES, METHOD_GET_METRICS,
+       METHOD_HASH_FILES, METHOD_FIND_DUPLICATES, METHOD_DIFF_SNAPSHOTS, METHOD_RENDER_FOR_LLM,
+       METHOD_SAMPLE_FILES, METHOD_SHM_RELEASE, METHOD_BATCH, METHOD_OTHER, METHOD_COUNT };
+
+const char *phase_names[PHASE_COUNT] = {
+    "parse", "opendir", "enumerate", "stat", "select", "hash", "sniff", "names", "serialize", "compress", "write", "total",
+};
+const char *method_names[METHOD_COUNT] = {
+    "initialize", "tools/list", "list_files", "get_metrics", "hash_files", "find_duplicates",
+    "diff_snapshots", "render_for_llm", "sample_files", "shm/release", "batch", "other",
+};
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+} histogram;
+
+histogram metrics[METHOD_COUNT][PHASE_COUNT];
+uint64_t metrics_start_ns;
+
+int hist_index(uint64_t v) {
+    if (v >= (1ull << HIST_MAX_BITS)) v = (1ull << HIST_MAX_BITS) - 1;
+    if (v < (1u << HIST_SUB_BITS)) return (int)v;
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (int)((v >> shift) & ((1u << HIST_SUB_BITS) - 1));
+}
+
+// Largest value that lands in bucket i
+uint64_t hist_bucket_high(int i) {
+    if (i < (1 << HIST_SUB_BITS)) return (uint64_t)i;
+    int shift = (i >> HIST_SUB_BITS) - 1;
+    uint64_t sub = (uint64_t)(i & ((1 << HIST_SUB_BITS) - 1)) | (1u << HIST_SUB_BITS);
+    return ((sub + 1) << shift) - 1;
+}
+
+void hist_record(histogram *h, uint64_t v) {
+    __atomic_fetch_add(&h->counts[hist_index(v)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, v, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (v > max && !__atomic_compare_exchange_n(&h->max, &max, v, 1,
+                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Value at quantile q (0..1), reported as the bucket's highest equivalent value
+uint64_t hist_quantile(const histogram *h, double q) {
+    uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    uint64_t target = (uint64_t)(q * count + 0.5);
+    if (target == 0) target = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+        if (seen >= target) {
+            uint64_t high = hist_bucket_high(i);
+            return high < max ? high : max;
+        }
+    }
+    return max;
+}
+
+/**
+ * @brief Phase clock for the request being handled, one per thread running requests
+ */
+typedef struct {
+    int active;
+    int method;
+    uint64_t start;
+    uint64_t mark;          // end of the last attributed phase
+    unsigned used;          // bit per phase that ran
+    uint64_t ns[PHASE_COUNT];
+} phase_clock;
+
+__thread phase_clock request_timer;
+
+void timer_start() {
+    memset(&request_timer, 0, sizeof(request_timer));
+    request_timer.active = 1;
+    request_timer.method = METHOD_OTHER;
+    request_timer.start = request_timer.mark = fs_now_ns();
+}
+
+void timer_add(int phase, uint64_t ns) {
+    request_timer.ns[phase] += ns;
+    request_timer.used |= 1u << phase;
+}
+
+// Attributes everything since the previous mark to phase
+void phase_mark(int phase) {
+    if (!request_timer.active) return;
+    uint64_t now = fs_now_ns();
+    timer_add(phase, now - request_timer.mark);
+    request_timer.mark = now;
+}
+
+void timer_finish() {
+    if (!request_timer.active) return;
+    timer_add(PHASE_TOTAL, fs_now_ns() - request_timer.start);
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        if (request_timer.used & (1u << p)) hist_record(&metrics[request_timer.method][p], request_timer.ns[p]);
+    }
+    request_timer.active = 0;
+}
+
+// Prometheus histogram buckets (seconds) folded from the log-linear buckets
+const double prometheus_bounds[] = {
+    1e-6, 5e-6, 1e-5, 5e-5, 1e-4, 5e-4, 1e-3, 5e-3, 1e-2, 5e-2, 0.1, 0.5, 1, 5, 10,
+};
+
+void metrics_prometheus(fs_buf *out) {
+    fs_buf_printf(out, "# HELP filesavant_request_phase_seconds Time per request phase\n"
+                       "# TYPE filesavant_request_phase_seconds histogram\n");
+    for (int m = 0; m < METHOD_COUNT; m++) {
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            const histogram *h = &metrics[m][p];
+            if (__atomic_load_n(&h->count, __ATOMIC_RELAXED) == 0) continue;
+
+            uint64_t seen = 0;
+            int i = 0;
+            for (size_t b = 0; b < sizeof(prometheus_bounds) / sizeof(prometheus_bounds[0]); b++) {
+                uint64_t bound_ns = (uint64_t)(prometheus_bounds[b] * 1e9);
+                for (; i < HIST_BUCKETS && hist_bucket_high(i) <= bound_ns; i++) {
+                    seen += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+                }
+                fs_buf_printf(out, "filesavant_request_phase_seconds_bucket{method=\"%s\",phase=\"%s\",le=\"%g\"} %llu\n",
+                              method_names[m], phase_names[p], prometheus_bounds[b], (unsigned long long)seen);
+            }
+            for (; i < HIST_BUCKETS; i++) seen += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+            fs_buf_printf(out, "filesavant_request_phase_seconds_bucket{method=\"%s\",phase=\"%s\",le=\"+Inf\"} %llu\n"
+                               "filesavant_request_phase_seconds_sum{method=\"%s\",phase=\"%s\"} %.9f\n"
+                               "filesavant_request_phase_seconds_count{method=\"%s\",phase=\"%s\"} %llu\n",
+                          method_names[m], phase_names[p], (unsigned long long)seen,
+                          method_names[m], phase_names[p], __atomic_load_n(&h->sum, __ATOMIC_RELAXED) / 1e9,
+                          method_names[m], phase_names[p], (unsigned long long)seen);
+        }
+    }
+    if (result_cache.budget) {
+        fs_buf_printf(out, "# TYPE filesavant_cache_requests_total counter\n"
+                           "filesavant_cache_requests_total{result=\"hit\"} %llu\n"
+                           "filesavant_cache_requests_total{result=\"miss\"} %llu\n"
+                           "# TYPE filesavant_cache_invalidations_total counter\n"
+                           "filesavant_cache_invalidations_total %llu\n"
+                           "# TYPE filesavant_cache_evictions_total counter\n"
+                           "filesavant_cache_evictions_total %llu\n",
+                      (unsigned long long)__atomic_load_n(&result_cache.hits, __ATOMIC_RELAXED),
+                      (unsigned long long)__atomic_load_n(&result_cache.misses, __ATOMIC_RELAXED),
+                      (unsigned long long)__atomic_load_n(&result_cache.invalidations, __ATOMIC_RELAXED),
+                      (unsigned long long)__atomic_load_n(&result_cache.evictions, __ATOMIC_RELAXED));
+    }
+}
+
+// --metrics-interval: dumps every histogram to stderr in Prometheus text format
+void* metrics_dump_thread(void *arg) {
+    unsigned interval = *(unsigned *)arg;
+    fs_buf out = {0};
+    for (;;) {
+        sleep(interval);
+        out.len = 0;
+        metrics_prometheus(&out);
+        fwrite(out.data, 1, out.len, stderr);
+        fflush(stderr);
+    }
+    return NULL;
+}
+
+void conn_flush(connection *c);
+void conn_drain(connection *c);
+
+// Set while this thread runs an element of a batch: responses stay in the buffer
+__thread int in_batch;
+
+// --zero-copy: large responses to a stdout pipe are vmsplice()d (see write_stdout())
+int zero_copy;
+
+enum { CODEC_NONE, CODEC_LZ4 };
+
+// Codec the stdio client agreed to; --listen clients keep theirs in connection
+int stdio_codec;
+
+/**
+ * @brief Compressed responses, offered as "compression":["lz4"] in initialize
+ *
+ * Once agreed, a response of COMPRESS_MIN bytes or more goes out as a control
+ * line, {"jsonrpc":"2.0","id":N,"compressed":{"codec":"lz4","length":L,"size":S}},
+ * followed by L bytes of LZ4 frame that decode to the S-byte response line.
+ * Its 64 KB blocks are copied into jobs and compressed by one worker thread;
+ * a listing hands each block over as soon as it is rendered
+ * (compress_progress()), so compression overlaps the rest of the listing.
+ */
+struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;        // a job was queued
+    pthread_cond_t idle;        // a job was finished
+    pthread_once_t once;
+    struct {
+        uint8_t data[FS_LZ4_BLOCK_MAX];
+        size_t len;
+    } jobs[COMPRESS_JOBS];
+    size_t head;                // job the worker takes next
+    size_t queued;              // jobs not compressed yet
+    fs_buf frame;               // frame so far; only the worker touches it while jobs are queued
+    size_t cursor;              // response bytes handed over
+} compressor = { .lock = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER,
+                 .idle = PTHREAD_COND_INITIALIZER, .once = PTHREAD_ONCE_INIT };
+
+// Set by the request being answered when its blocks may be handed over early
+__thread int compress_early;
+
+void* compressor_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&compressor.lock);
+    for (;;) {
+        while (!compressor.queued) pthread_cond_wait(&compressor.work, &compressor.lock);
+        size_t i = compressor.head;
+        pthread_mutex_unlock(&compressor.lock);
+        fs_buf_reserve(&compressor.frame, FS_LZ4_BLOCK_BOUND(FS_LZ4_BLOCK_MAX));
+        compressor.frame.len += fs_lz4_frame_block(compressor.jobs[i].data, compressor.jobs[i].len,
+                                                   (uint8_t *)compressor.frame.data + compressor.frame.len);
+        pthread_mutex_lock(&compressor.lock);
+        compressor.head = (i + 1) % COMPRESS_JOBS;
+        compressor.queued--;
+        pthread_cond_signal(&compressor.idle);
+    }
+    return NULL;
+}
+
+void start_compressor() {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, compressor_thread, NULL) != 0) {
+        fprintf(stderr, "cannot start the compression thread\n");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+int current_codec() {
+    return current_conn ? current_conn->codec : stdio_codec;
+}
+
+// Queues len bytes of data as the frame's next block, waiting while every job is taken
+void compress_submit(const char *data, size_t len) {
+    pthread_once(&compressor.once, start_compressor);
+    pthread_mutex_lock(&compressor.lock);
+    if (!compressor.queued && !compressor.frame.len) {
+        uint8_t header[FS_LZ4_HEADER_LEN];
+        fs_buf_append(&compressor.frame, header, fs_lz4_frame_header(header));
+    }
+    while (compressor.queued == COMPRESS_JOBS) pthread_cond_wait(&compressor.idle, &compressor.lock);
+    size_t i = (compressor.head + compressor.queued) % COMPRESS_JOBS;
+    pthread_mutex_unlock(&compressor.lock);
+    memcpy(compressor.jobs[i].data, data, len);    // not the worker's until queued counts it
+    compressor.jobs[i].len = len;
+    pthread_mutex_lock(&compressor.lock);
+    compressor.queued++;
+    pthread_cond_signal(&compressor.work);
+    pthread_mutex_unlock(&compressor.lock);
+    compressor.cursor += len;
+}
+
+void compress_wait() {
+    pthread_mutex_lock(&compressor.lock);
+    while (compressor.queued) pthread_cond_wait(&compressor.idle, &compressor.lock);
+    pthread_mutex_unlock(&compressor.lock);
+}
+
+// Hands every finished 64 KB block of a large response to the compressor
+void compress_progress() {
+    if (!compress_early || response.len < COMPRESS_MIN || response.len - compressor.cursor <= FS_LZ4_BLOCK_MAX) return;
+    uint64_t start = fs_now_ns();
+    while (response.len - compressor.cursor > FS_LZ4_BLOCK_MAX) {
+        compress_submit(response.data + compressor.cursor, FS_LZ4_BLOCK_MAX);
+    }
+    timer_add(PHASE_COMPRESS, fs_now_ns() - start);
+}
+
+// Drops blocks handed over for a response that was cut back after all
+void compress_discard() {
+    compress_wait();
+    compressor.frame.len = compressor.cursor = 0;
+}
+
+// Replaces the response with its control line and LZ4 frame
+void compress_response(int id) {
+    if (compressor.cursor > response.len) compress_discard();
+    while (compressor.cursor < response.len) {
+        size_t len = response.len - compressor.cursor;
+        compress_submit(response.data + compressor.cursor, len < FS_LZ4_BLOCK_MAX ? len : FS_LZ4_BLOCK_MAX);
+    }
+    compress_wait();
+    uint8_t end[FS_LZ4_END_LEN];
+    fs_buf_append(&compressor.frame, end, fs_lz4_frame_end(end));
+    size_t size = response.len;
+    response.len = 0;
+    fs_buf_printf(&response, "{\"jsonrpc\":\"2.0\",\"id\":%d,\"compressed\":{\"codec\":\"lz4\",\"length\":%zu,\"size\":%zu}}\n",
+                  id, compressor.frame.len, size);
+    fs_buf_append(&response, compressor.frame.data, compressor.frame.len);
+    compressor.frame.len = compressor.cursor = 0;
+}
+
+/**
+ * @brief Writes a response to stdout
+ *
+ * With --zero-copy, a response of ZERO_COPY_MIN bytes or more going into a
+ * pipe is vmsplice()d: the pipe takes references to the response's pages
+ * instead of a copy of them. Only the last pipe-capacity bytes are written
+ * normally. They need every slot of the pipe, so by the time write()
+ * returns the reader has consumed all the spliced pages and the buffer can
+ * be reused by the next request. That holds for a reader that read()s the
+ * pipe, like the Python client; one that splice()s it onward would keep the
+ * pages referenced, which is why the mode is opt-in. SPLICE_F_GIFT is not
+ * passed because the pages are reused, not handed over.
+ */
+void write_stdout(const char *data, size_t len) {
+#ifdef __linux__
+    int capacity = zero_copy && len >= ZERO_COPY_MIN ? fcntl(STDOUT_FILENO, F_GETPIPE_SZ) : -1;
+    if (capacity > 0 && len > (size_t)capacity) {
+        fflush(stdout);    // keep anything printed before it in order
+        struct iovec pages = { (void *)data, len - capacity };
+        while (pages.iov_len > 0) {
+            ssize_t n = vmsplice(STDOUT_FILENO, &pages, 1, 0);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                break;    // the rest goes through write() below
+            }
+            pages.iov_base = (char *)pages.iov_base + n;
+            pages.iov_len -= n;
+        }
+        for (const char *at = pages.iov_base; at < data + len;) {
+            ssize_t n = write(STDOUT_FILENO, at, data + len - at);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            at += n;
+        }
+        return;
+    }
+#endif
+    fwrite(data, 1, len, stdout);
+}
+
+// Set by the request being answered when what it has rendered may be written before it ends
+__thread int flush_early;
+
+// Writes out a listing's rendered part once it reaches FLUSH_CHUNK, so it is never held whole
+void flush_progress() {
+    if (!flush_early || response.len < FLUSH_CHUNK) return;
+    uint64_t start = fs_now_ns();
+    write_stdout(response.data, response.len);    // spliced pages are consumed before it returns
+    response.len = 0;
+    timer_add(PHASE_WRITE, fs_now_ns() - start);
+}
+
+void send_response(int id) {
+    phase_mark(PHASE_SERIALIZE);
+    if (in_batch) return;    // handle_batch collects it from this thread's response
+    compress_early = 0;
+    flush_early = 0;
+    if (current_codec() && !shm_ring.base && response.len >= COMPRESS_MIN) {
+        compress_response(id);
+        phase_mark(PHASE_COMPRESS);
+    } else if (compressor.cursor) {
+        compress_discard();
+    }
+    PROBE_FLUSH(id, response.len,
+                current_conn ? 2 : (shm_ring.base && response.len >= SHM_INLINE_LIMIT));
+    if (current_conn && current_conn->dropped) {
+        response.len = 0;
+        phase_mark(PHASE_WRITE);
+        return;
+    }
+    if (current_conn) {
+        connection *c = current_conn;
+        size_t sent = 0;
+        // With nothing queued ahead of it the response goes straight to the socket;
+        // only what the socket does not take now is copied into the queue
+        while (c->out_sent == c->out.len && sent < response.len) {
+            ssize_t n = write(c->fd, response.data + sent, response.len - sent);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                break;    // EAGAIN queues the rest; errors surface on the next wait
+            }
+            sent += n;
+        }
+        fs_buf_append(&c->out, response.data + sent, response.len - sent);
+        response.len = 0;
+        conn_flush(c);
+        phase_mark(PHASE_WRITE);
+        return;
+    }
+    if (!shm_ring.base || response.len < SHM_INLINE_LIMIT ||
+        shm_publish(id, response.data, response.len) != 0) {
+        // Small responses, or a full ring, fall back to the pipe
+        write_stdout(response.data, response.len);
+    }
+    fflush(stdout);
+    response.len = 0;
+    phase_mark(PHASE_WRITE);
+}
+
+/**
+ * @brief uids or gids named by a dictionary-encoded listing
+ *
+ * With "dictionary": true, list_files records keep uid and gid but drop the
+ * owner and group strings, and the result becomes
+ * {"entries":[...],"users":{"uid":"name",...},"groups":{...}}, so each
+ * distinct id is resolved and sent once instead of once per entry.
+ */
+typedef struct {
+    uint32_t *ids;
+    size_t count;
+    size_t cap;
+    size_t sent;            // ids already named in a partial_result chunk
+    size_t last;            // previous hit: runs of one owner skip the scan
+} id_table;
+
+__thread struct {
+    int on;
+    id_table users;
+    id_table groups;
+} dictionary;
+
+void id_table_reset(id_table *t) {
+    t->count = t->sent = t->last = 0;
+}
+
+void id_table_add(id_table *t, uint32_t id) {
+    if (t->last < t->count && t->ids[t->last] == id) return;
+    for (size_t i = 0; i < t->count; i++) {
+        if (t->ids[i] == id) {
+            t->last = i;
+            return;
+        }
+    }
+    if (t->count == t->cap) {
+        t->cap = t->cap ? t->cap * 2 : 16;
+        t->ids = realloc(t->ids, t->cap * sizeof(uint32_t));
+    }
+    t->ids[t->count] = id;
+    t->last = t->count++;
+}
+
+// Appends ,"key":{"id":"name",...} for the ids from index from on
+void append_id_names(fs_buf *out, const char *key, const id_table *t, size_t from, int is_group) {
+    fs_buf_printf(out, ",\"%s\":{", key);
+    for (size_t i = from; i < t->count; i++) {
+        fs_buf_printf(out, "%s\"%u\":\"%s\"", i > from ? "," : "", t->ids[i],
+                      is_group ? fs_group_name((gid_t)t->ids[i]) : fs_user_name((uid_t)t->ids[i]));
+    }
+    fs_buf_putc(out, '}');
+}
+
+/**
+ * @brief Progress notifications and result chunks for the list_files being answered
+ *
+ * With params._meta.progressToken the client gets notifications/progress
+ * carrying the entries scanned so far, at most every PROGRESS_INTERVAL_MS.
+ * With a chunk_size argument, finished entries leave early as
+ * notifications/partial_result arrays of at most chunk_size entries (or
+ * STREAM_CHUNK_BYTES), and the response carries only the rest: the chunks
+ * and the result, concatenated, are the listing. Both are off for batch
+ * elements, which cannot write to the transport.
+ */
+__thread struct {
+    int id;
+    const char *token;      // raw JSON value; NULL: no progress notifications
+    uint64_t next_progress;
+    size_t chunk_size;      // 0: not chunked
+    size_t chunk_start;     // where the entries not yet sent begin in response
+    size_t chunk_entries;
+    size_t chunks;
+    fs_buf note;            // notification being written; reused
+} stream;
+
+// A --listen client conn_drain() gave up on: its request can stop early
+int peer_dropped() {
+    return current_conn && current_conn->dropped;
+}
+
+// Writes note to the client right away, ahead of the response still being built
+void send_notification(fs_buf *note) {
+    if (peer_dropped()) {
+        note->len = 0;
+        return;
+    }
+    if (current_conn) {
+        fs_buf_append(&current_conn->out, note->data, note->len);
+        conn_drain(current_conn);
+    } else {
+        fwrite(note->data, 1, note->len, stdout);
+        fflush(stdout);
+    }
+    note->len = 0;
+}
+
+void stream_begin(int id, const char *line) {
+    long long chunk_size = extract_number(line, "chunk_size", 0);
+    stream.id = id;
+    stream.token = in_batch ? NULL : extract_progress_token(line);
+    stream.next_progress = fs_now_ns() + PROGRESS_INTERVAL_MS * 1000000ull;
+    stream.chunk_size = in_batch || chunk_size < 0 ? 0 : (size_t)chunk_size;
+    stream.chunk_entries = 0;
+    stream.chunks = 0;
+}
+
+void stream_progress(size_t scanned) {
+    if (!stream.token) return;
+    uint64_t now = fs_now_ns();
+    if (now < stream.next_progress) return;
+    fs_buf_printf(&stream.note, "{\"jsonrpc\":\"2.0\",\"method\":\"notifications/progress\",\"params\":"
+                  "{\"progressToken\":%s,\"progress\":%zu,\"message\":\"%zu entries scanned\"}}\n",
+                  stream.token, scanned, scanned);
+    send_notification(&stream.note);
+    uint64_t sent = fs_now_ns();
+    timer_add(PHASE_WRITE, sent - now);
+    stream.next_progress = sent + PROGRESS_INTERVAL_MS * 1000000ull;
+}
+
+// Sends the entries rendered since the last chunk and drops them from the response
+void stream_chunk() {
+    uint64_t start = fs_now_ns();
+    fs_buf_printf(&stream.note, "{\"jsonrpc\":\"2.0\",\"method\":\"notifications/partial_result\",\"params\":"
+                  "{\"requestId\":%d,\"chunk\":%zu,\"result\":[", stream.id, stream.chunks++);
+    fs_buf_append(&stream.note, response.data + stream.chunk_start, response.len - stream.chunk_start);
+    fs_buf_putc(&stream.note, ']');
+    if (dictionary.on) {
+        // Names of the ids this chunk introduces; the final result repeats them all
+        if (dictionary.users.count > dictionary.users.sent)
+            append_id_names(&stream.note, "users", &dictionary.users, dictionary.users.sent, 0);
+        if (dictionary.groups.count > dictionary.groups.sent)
+            append_id_names(&stream.note, "groups", &dictionary.groups, dictionary.groups.sent, 1);
+        dictionary.users.sent = dictionary.users.count;
+        dictionary.groups.sent = dictionary.groups.count;
+    }
+    fs_buf_append(&stream.note, "}}\n", 3);
+    response.len = stream.chunk_start;
+    stream.chunk_entries = 0;
+    send_notification(&stream.note);
+    timer_add(PHASE_WRITE, fs_now_ns() - start);
+}
+
+// Lets the listing about to be rendered hand its blocks to the compressor as they fill;
+// not while chunks are cut out of the response
+void compress_begin() {
+    compress_early = current_codec() && !in_batch && !shm_ring.base && !stream.chunk_size;
+}
+
+// Lets the listing about to be rendered go to stdout as it fills when nothing needs it whole:
+// not the compressor, the shm ring, a batch, chunking, or the result cache (cached)
+void flush_begin(int cached) {
+    flush_early = !cached && !current_conn && !current_codec() && !in_batch && !shm_ring.base &&
+                  !stream.chunk_size;
+}
+
+void send_initialization() {
+    fs_buf_printf(&response, "{\"jsonrpc\":\"2.0\",\"method\":\"notifications/initialized\"}\n");
+    send_response(-1);
+}
+
+void send_tools_list(int id) {
+    fs_buf_printf(&response, "{\"jsonrpc\":\"2.0\",\"id\":%d,\"result\":["
+           "{\"name\":\"list_files\","
+           "\"description\":\"List all files in a directory\","
+           "\"inputSchema\":{\"type\":\"object\",\"properties\":{"
+           "\"directory\":{\"type\":\"string\",\"description\":\"Directory path\"},"
+           "\"sort\":{\"type\":\"string\",\"enum\":[\"name\",\"size\",\"modified\"]},"
+           "\"order\":{\"type\":\"string\",\"enum\":[\"asc\",\"desc\"]},"
+           "\"offset\":{\"type\":\"integer\"},\"limit\":{\"type\":\"integer\"},"
+           "\"type\":{\"type\":\"string\",\"description\":\"file, directory, symlink, ...\"},"
+           "\"min_size\":{\"type\":\"integer\"},\"max_size\":{\"type\":\"integer\"},"
+           "\"modified_after\":{\"type\":\"integer\"},\"modified_before\":{\"type\":\"integer\"},"
+           "\"content_type\":{\"type\":\"boolean\",\"description\":\"Sniff MIME types from the first 512 bytes\"},"
+           "\"pattern\":{\"type\":\"string\",\"description\":\"Glob on names: *, ?, [a-z], [!...], {a,b}\"},"
+           "\"regex\":{\"type\":\"string\",\"description\":\"Linear-time regex searched in names (no backreferences)\"},"
+           "\"ignore_case\":{\"type\":\"boolean\",\"description\":\"Match pattern and regex case-insensitively\"},"
+           "\"dictionary\":{\"type\":\"boolean\",\"description\":\"Records keep uid/gid only; result is {entries, users, groups} with each id named once\"},"
+           "\"track\":{\"type\":\"boolean\",\"description\":\"Answer {token, reset, added, modified, removed} and keep the listing's state under token\"},"
+           "\"since\":{\"type\":\"string\",\"description\":\"Token of an earlier tracked listing: return only what changed since it\"},"
+           "\"chunk_size\":{\"type\":\"integer\",\"description\":\"Send entries early as notifications/partial_result arrays of this many\"}},"
+           "\"required\":[\"directory\"]}},"
+           "{\"name\":\"get_metrics\","
+           "\"description\":\"Per-method, per-phase request latency percentiles in nanoseconds\","
+           "\"inputSchema\":{\"type\":\"object\",\"properties\":{}}},"
+           "{\"name\":\"hash_files\","
+           "\"description\":\"BLAKE3 digests of file contents, to tell whether files are identical\","
+           "\"inputSchema\":{\"type\":\"object\",\"properties\":{"
+           "\"directory\":{\"type\":\"string\",\"description\":\"Directory path\"},"
+           "\"files\":{\"type\":\"array\",\"items\":{\"type\":\"string\"},"
+           "\"description\":\"Names within directory; default every regular file in it\"}},"
+           "\"required\":[\"directory\"]}},"
+           "{\"name\":\"find_duplicates\","
+           "\"description\":\"Groups of identical files under a directory, largest waste first\","
+           "\"inputSchema\":{\"type\":\"object\",\"properties\":{"
+           "\"directory\":{\"type\":\"string\",\"description\":\"Directory path, searched recursively\"},"
+           "\"min_size\":{\"type\":\"integer\",\"description\":\"Ignore smaller files (default 1)\"},"
+           "\"include_hidden\":{\"type\":\"boolean\",\"description\":\"Search dot files and dot directories too (default true)\"},"
+           "\"limit\":{\"type\":\"integer\",\"description\":\"Return at most this many groups\"}},"
+           "\"required\":[\"directory\"]}},"
+           "{\"name\":\"diff_snapshots\","
+           "\"description\":\"Files added, removed, modified or renamed between two file_info snapshots\","
+           "\"inputSchema\":{\"type\":\"object\",\"properties\":{"
+           "\"old\":{\"type\":\"string\",\"description\":\"Earlier snapshot file\"},"
+           "\"new\":{\"type\":\"string\",\"description\":\"Later snapshot file\"},"
+           "\"limit\":{\"type\":\"integer\",\"description\":\"List at most this many changes (default 1000)\"}},"
+           "\"required\":[\"old\",\"new\"]}},"
+           "{\"name\":\"render_for_llm\","
+           "\"description\":\"Directory listing as a compact text table sized to a token budget, for prompts\","
+           "\"inputSchema\":{\"type\":\"object\",\"properties\":{"
+           "\"directory\":{\"type\":\"string\",\"description\":\"Directory path\"},"
+           "\"token_budget\":{\"type\":\"integer\",\"description\":\"Estimated tokens to fill (default 4000)\"},"
+           "\"sort\":{\"type\":\"string\",\"enum\":[\"name\",\"size\",\"modified\"]},"
+           "\"order\":{\"type\":\"string\",\"enum\":[\"asc\",\"desc\"]},"
+           "\"type\":{\"type\":\"string\"},\"min_size\":{\"type\":\"integer\"},\"max_size\":{\"type\":\"integer\"},"
+           "\"modified_after\":{\"type\":\"integer\"},\"modified_before\":{\"type\":\"integer\"}},"
+           "\"required\":[\"directory\"]}},"
+           "{\"name\":\"sample_files\","
+           "\"description\":\"Exact summary counts, outliers and a stratified random sample of a large directory\","
+           "\"inputSchema\":{\"type\":\"object\",\"properties\":{"
+           "\"directory\":{\"type\":\"string\",\"description\":\"Directory path\"},"
+           "\"sample_size\":{\"type\":\"integer\",\"description\":\"Sampled entries (default 24, at most 200)\"},"
+           "\"seed\":{\"type\":\"integer\",\"description\":\"Random seed, for a repeatable sample\"}},"
+           "\"required\":[\"directory\"]}}"
+           "]}\n", id);
+    send_response(id);
+}
+
+void send_error(int id, const char* code, const char* message) {
+    fs_buf_printf(&response, "{\"jsonrpc\":\"2.0\",\"id\":%d,\"error\":{\"code\":\"%s\",\"message\":\"%s\"}}\n", 
+           id, code, message);
+    send_response(id);
+}
+
+// Appends one entry to the response, timing name resolution and rendering
+void append_entry(const char *directory, const fs_entry *entry, int first, const char *content_type) {
+    (void)directory;    // only read by the probe
+    if (stream.chunk_size && (stream.chunk_entries == stream.chunk_size ||
+                              response.len - stream.chunk_start >= STREAM_CHUNK_BYTES)) {
+        stream_chunk();
+        first = 1;
+    }
+    stream.chunk_entries++;
+    uint64_t t0 = fs_now_ns();
+    const char *owner = NULL, *group = NULL;
+    if (dictionary.on) {
+        id_table_add(&dictionary.users, (uint32_t)entry->st.st_uid);
+        id_table_add(&dictionary.groups, (uint32_t)entry->st.st_gid);
+    } else {
+        owner = fs_user_name(entry->st.st_uid);
+        group = fs_group_name(entry->st.st_gid);
+    }
+    uint64_t t1 = fs_now_ns();
+    if (!first) fs_buf_putc(&response, ',');
+    fs_entry_to_json_as(&response, entry, 0, owner, group);
+    if (content_type) {
+        response.len--;    // reopen the object
+        fs_buf_printf(&response, ",\"content_type\":%s%s%s}", *content_type ? "\"" : "",
+                      *content_type ? content_type : "null", *content_type ? "\"" : "");
+    }
+    timer_add(PHASE_NAMES, t1 - t0);
+    timer_add(PHASE_SERIALIZE, fs_now_ns() - t1);
+    PROBE_ENTRY_DONE(directory, response.len);
+    compress_progress();
+    flush_progress();
+}
+
+void sniff_one(void *ctx, size_t i) {
+    sniff_batch *batch = ctx;    // the requesting thread's; pool workers have their own
+    const fs_entry *entry = &batch->entries[i];
+    if (!S_ISREG(entry->st.st_mode)) {
+        batch->types[i] = NULL;
+    } else if (entry->st.st_size == 0) {
+        batch->types[i] = "inode/x-empty";
+    } else if (fs_now_ns() > batch->deadline) {
+        batch->types[i] = "";
+        __atomic_store_n(&batch->skipped, 1, __ATOMIC_RELAXED);
+    } else {
+        const char *type = fs_sniff_file(AT_FDCWD, entry->path);
+        batch->types[i] = type ? type : "";
+    }
+}
+
+void sniff_flush(const char *directory, int *first) {
+    uint64_t start = fs_now_ns();
+    for (size_t i = 0; i < sniff.count; i++) {
+        sniff.entries[i].path = sniff.names.data + sniff.path_at[i];
+        sniff.entries[i].name = sniff.names.data + sniff.name_at[i];
+    }
+    if (sniff.count > 1) {
+        fs_pool_run(get_io_pool(), sniff.count, sniff_one, &sniff);
+    } else if (sniff.count == 1) {
+        sniff_one(&sniff, 0);
+    }
+    timer_add(PHASE_SNIFF, fs_now_ns() - start);
+
+    for (size_t i = 0; i < sniff.count; i++) {
+        append_entry(directory, &sniff.entries[i], *first, sniff.types[i]);
+        *first = 0;
+    }
+    sniff.count = 0;
+    sniff.names.len = 0;
+}
+
+// Appends entry, or queues it for sniffing when the listing wants content types
+void emit_entry(const char *directory, const fs_entry *entry, const list_options *opts, int *first) {
+    if (!opts->content_type) {
+        append_entry(directory, entry, *first, NULL);
+        *first = 0;
+        return;
+    }
+    size_t i = sniff.count++;
+    sniff.entries[i].st = entry->st;
+    sniff.path_at[i] = sniff.names.len;
+    fs_buf_append(&sniff.names, entry->path, strlen(entry->path) + 1);
+    sniff.name_at[i] = sniff.names.len;
+    fs_buf_append(&sniff.names, entry->name, strlen(entry->name) + 1);
+    if (sniff.count == SNIFF_BATCH) sniff_flush(directory, first);
+}
+
+// Filters, orders and pages the listing in listing_table, then re-stats the rows it returns
+void append_selected(const char *directory, fs_dir *dir, const list_options *opts) {
+    const fs_entry *entry;
+    fs_table_clear(&listing_table);
+    while ((entry = fs_dir_next(dir))) {
+        PROBE_ENTRY_STAT(directory, entry->name, (long long)entry->st.st_size);
+        fs_table_add(&listing_table, entry);
+        stream_progress(listing_table.count);
+    }
+
+    uint64_t start = fs_now_ns();
+    uint32_t *rows = fs_arena_alloc(&request_arena, (listing_table.count + 1) * sizeof(uint32_t));
+    size_t n = fs_table_filter(&listing_table, &opts->filter, rows);
+    size_t end = n;
+    if (opts->limit >= 0 && (unsigned long long)opts->limit < n &&
+        (unsigned long long)opts->offset < n - (unsigned long long)opts->limit) {
+        end = opts->offset + opts->limit;
+    }
+    end = fs_table_top(&listing_table, rows, n, opts->sort, opts->descending, end);
+    timer_add(PHASE_SELECT, fs_now_ns() - start);
+
+    int first = 1;
+    for (size_t i = opts->offset; i < end; i++) {
+        entry = fs_dir_lookup(dir, fs_table_name(&listing_table, rows[i]));
+        if (!entry) continue;    // removed since it was listed
+        emit_entry(directory, entry, opts, &first);
+    }
+    if (opts->content_type) sniff_flush(directory, &first);
+}
+
+// Compiles opts->pattern and opts->regex into request_arena as dir's pre-stat
+// filters; -1 if one is invalid or too complex
+int set_name_filters(fs_dir *dir, const list_options *opts) {
+    if (opts->pattern[0]) {
+        fs_glob *glob = fs_glob_compile_in(opts->pattern, opts->ignore_case ? FS_GLOB_NOCASE : 0, &request_arena);
+        if (!glob) return -1;
+        fs_dir_set_glob(dir, glob);
+    }
+    if (opts->regex[0]) {
+        fs_regex *re = fs_regex_compile_in(opts->regex, opts->ignore_case ? FS_REGEX_NOCASE : 0, &request_arena);
+        if (!re) return -1;
+        fs_dir_set_regex(dir, re);
+    }
+    return 0;
+}
+
+// Re-stats and renders the rows of s flagged with flag
+void append_flagged(const char *directory, fs_dir *dir, const delta_state *s, int flag, const list_options *opts) {
+    int first = 1;
+    for (size_t row = 0; row < s->count; row++) {
+        if (!(s->flags[row] & flag)) continue;
+        const fs_entry *entry = fs_dir_lookup(dir, delta_name(s, row));
+        if (entry) emit_entry(directory, entry, opts, &first);
+    }
+    if (opts->content_type) sniff_flush(directory, &first);
+}
+
+/**
+ * @brief list_files with "track" or "since": the changes since a kept state
+ *
+ * Answers {"token":T,"reset":bool,"added":[...],"modified":[...],"removed":[names]}.
+ * Without a usable "since" state (none given, unknown or evicted, another
+ * directory or other filters) "reset" is true and the whole listing is
+ * added. While the directory's own times still match a settled state no
+ * entry can have been added, removed or renamed, so only its known names
+ * are re-stat'ed and the directory is not read. An unchanged listing keeps
+ * its token instead of storing a new state.
+ */
+void handle_list_delta(int id, const char *directory, const list_options *opts) {
+    if (opts->sort || opts->descending || opts->offset > 0 || opts->limit >= 0) {
+        send_error(id, "invalid_params", "since and track cannot be combined with sort, order, offset or limit");
+        return;
+    }
+    stream.chunk_size = 0;    // three arrays, not one listing to split
+    struct stat dir_st;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t settle_before = timespec_ns(now) - CACHE_SETTLE_NS;
+
+    sniff.deadline = fs_now_ns() + sniff_budget_ns;
+    sniff.skipped = 0;
+    fs_dir *dir = fs_dir_open_in(directory, FS_LIST_TIMED, &request_arena);
+    PROBE_DIR_OPEN(directory, dir != NULL);
+    phase_mark(PHASE_OPENDIR);
+    if (!dir || stat(directory, &dir_st) != 0) {
+        if (dir) fs_dir_close(dir);
+        send_error(id, "directory_error", "Cannot open directory");
+        return;
+    }
+    if (set_name_filters(dir, opts) != 0) {
+        fs_dir_close(dir);
+        send_error(id, "invalid_params", "Invalid or too complex pattern or regex");
+        return;
+    }
+
+    list_options key = delta_options(opts);
+    delta_state *old = opts->since[0] ? delta_acquire(opts->since) : NULL;
+    if (old && (old->dev != dir_st.st_dev || old->ino != dir_st.st_ino ||
+                memcmp(&old->opts, &key, sizeof(key)) != 0)) {
+        delta_release(old);
+        old = NULL;
+    }
+    delta_state *cur = calloc(1, sizeof(delta_state));
+    if (!cur) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    cur->dev = dir_st.st_dev;
+    cur->ino = dir_st.st_ino;
+    cur->mtime_ns = STAT_MTIME_NS(&dir_st);
+    cur->ctime_ns = STAT_CTIME_NS(&dir_st);
+    cur->settled = cur->mtime_ns < settle_before && cur->ctime_ns < settle_before;
+    cur->opts = key;
+    phase_mark(PHASE_PARSE);
+
+    // seen[row of old]: 1 still there, 2 still there and kept
+    uint8_t *seen = NULL;
+    if (old) {
+        seen = fs_arena_alloc(&request_arena, old->count + 1);
+        memset(seen, 0, old->count + 1);
+    }
+    int same_names = old && old->settled && old->mtime_ns == cur->mtime_ns && old->ctime_ns == cur->ctime_ns;
+    size_t changes = 0, scanned = 0;
+    for (size_t next = 0;;) {
+        const fs_entry *entry;
+        long prev = -1;
+        if (same_names) {
+            if (next == old->count) break;
+            prev = (long)next++;
+            entry = fs_dir_lookup(dir, delta_name(old, prev));
+            if (!entry) continue;
+        } else {
+            entry = fs_dir_next(dir);
+            if (!entry) break;
+            if (old) prev = delta_find(old, entry->name);
+        }
+        PROBE_ENTRY_STAT(directory, entry->name, (long long)entry->st.st_size);
+        stream_progress(++scanned);
+        int kept = delta_keeps(&opts->filter, &entry->st);
+        uint64_t fingerprint = delta_fingerprint(&entry->st, settle_before);
+        size_t row = delta_add_row(cur, entry->name, fingerprint, kept);
+        if (prev >= 0) seen[prev] = kept ? 2 : 1;
+        if (!kept) continue;
+        if (prev < 0 || !(old->flags[prev] & DELTA_KEPT)) {
+            cur->flags[row] |= DELTA_ADDED;
+            changes++;
+        } else if (!fingerprint || fingerprint != old->fingerprint[prev]) {
+            cur->flags[row] |= DELTA_MODIFIED;
+            changes++;
+        }
+    }
+    for (size_t row = 0; old && row < old->count; row++) {
+        if ((old->flags[row] & DELTA_KEPT) && seen[row] != 2) changes++;
+    }
+    const fs_dir_times *times = fs_dir_timing(dir);
+    timer_add(PHASE_ENUMERATE, times->enumerate_ns);
+    timer_add(PHASE_STAT, times->stat_ns);
+    request_timer.mark = fs_now_ns();
+
+    uint64_t token;
+    if (old && !changes && (old->settled || !cur->settled)) {
+        token = old->token;    // old answers the next request just as well
+        delta_free(cur);
+        cur = NULL;
+    } else {
+        token = delta_publish(cur);
+    }
+
+    dictionary.on = opts->dictionary;
+    compress_begin();
+    flush_begin(0);
+    id_table_reset(&dictionary.users);
+    id_table_reset(&dictionary.groups);
+    fs_buf_printf(&response, "{\"jsonrpc\":\"2.0\",\"id\":%d,\"result\":{\"token\":\"%016llx\",\"reset\":%s,\"added\":[",
+                  id, (unsigned long long)token, old ? "false" : "true");
+    if (cur) {
+        append_flagged(directory, dir, cur, DELTA_ADDED, opts);
+        fs_buf_printf(&response, "],\"modified\":[");
+        append_flagged(directory, dir, cur, DELTA_MODIFIED, opts);
+    } else {
+        fs_buf_printf(&response, "],\"modified\":[");
+    }
+    fs_buf_printf(&response, "],\"removed\":[");
+    int first = 1;
+    for (size_t row = 0; old && row < old->count; row++) {
+        if (!(old->flags[row] & DELTA_KEPT) || seen[row] == 2) continue;
+        if (!first) fs_buf_putc(&response, ',');
+        fs_buf_json_string(&response, delta_name(old, row));
+        first = 0;
+    }
+    fs_buf_putc(&response, ']');
+    if (dictionary.on) {
+        append_id_names(&response, "users", &dictionary.users, 0, 0);
+        append_id_names(&response, "groups", &dictionary.groups, 0, 1);
+        phase_mark(PHASE_NAMES);
+        dictionary.on = 0;
+    }
+    fs_buf_printf(&response, "}}\n");
+    if (old) delta_release(old);
+    if (cur) delta_release(cur);
+    send_response(id);
+    fs_dir_close(dir);
+}
+
+void handle_list_files(int id, const char* directory, const list_options *opts) {
+    if (opts->track || opts->since[0]) {
+        handle_list_delta(id, directory, opts);
+        return;
+    }
+    struct stat dir_st;
+    int cacheable = result_cache.budget > 0 && !stream.chunk_size &&
+                    stat(directory, &dir_st) == 0 && S_ISDIR(dir_st.st_mode);
+    if (cacheable) {
+        pthread_mutex_lock(&result_cache.lock);
+        cache_entry *hit = cache_lookup(&dir_st, directory, opts);
+        if (hit) {
+            fs_buf_printf(&response, "{\"jsonrpc\":\"2.0\",\"id\":%d,\"result\":%s", id,
+                          opts->dictionary ? "{\"entries\":[" : "[");
+            fs_buf_append(&response, hit->body, hit->body_len);
+            pthread_mutex_unlock(&result_cache.lock);
+            fs_buf_printf(&response, opts->dictionary ? "}}\n" : "]}\n");
+            send_response(id);
+            return;
+        }
+        pthread_mutex_unlock(&result_cache.lock);
+    }
+
+    sniff.deadline = fs_now_ns() + sniff_budget_ns;
+    sniff.skipped = 0;
+    fs_dir *dir = fs_dir_open_in(directory, FS_LIST_TIMED, &request_arena);
+    PROBE_DIR_OPEN(directory, dir != NULL);
+    if (!dir) {
+        phase_mark(PHASE_OPENDIR);
+        send_error(id, "directory_error", "Cannot open directory");
+        return;
+    }
+    phase_mark(PHASE_OPENDIR);
+    if (set_name_filters(dir, opts) != 0) {
+        fs_dir_close(dir);
+        send_error(id, "invalid_params", "Invalid or too complex pattern or regex");
+        return;
+    }
+    phase_mark(PHASE_PARSE);
+    dictionary.on = opts->dictionary;
+    compress_begin();
+    flush_begin(cacheable);
+    id_table_reset(&dictionary.users);
+    id_table_reset(&dictionary.groups);
+    
+    fs_buf_printf(&response, "{\"jsonrpc\":\"2.0\",\"id\":%d,\"result\":%s", id,
+                  opts->dictionary ? "{\"entries\":[" : "[");
+    size_t body_start = response.len;
+    stream.chunk_start = body_start;
+    
+    if (opts->buffered) {
+        append_selected(directory, dir, opts);
+    } else {
+        const fs_entry *entry;
+        int first = 1;
+        size_t scanned = 0;
+        while (!peer_dropped() && (entry = fs_dir_next(dir))) {
+            PROBE_ENTRY_STAT(directory, entry->name, (long long)entry->st.st_size);
+            emit_entry(directory, entry, opts, &first);
+            stream_progress(++scanned);
+        }
+        if (opts->content_type) sniff_flush(directory, &first);
+    }
+    
+    const fs_dir_times *times = fs_dir_timing(dir);
+    timer_add(PHASE_ENUMERATE, times->enumerate_ns);
+    timer_add(PHASE_STAT, times->stat_ns);
+    request_timer.mark = fs_now_ns();    // the loop is attributed above
+    if (dictionary.on) {
+        // The name tables belong to the cached body, so hits need no resolution either
+        fs_buf_putc(&response, ']');
+        append_id_names(&response, "users", &dictionary.users, 0, 0);
+        append_id_names(&response, "groups", &dictionary.groups, 0, 1);
+        phase_mark(PHASE_NAMES);
+        dictionary.on = 0;
+    }
+    
+    if (cacheable && !sniff.skipped) {
+        // Validators come from before the listing: a change during it invalidates the entry
+        pthread_mutex_lock(&result_cache.lock);
+        cache_insert(&dir_st, directory, opts, response.data + body_start, response.len - body_start);
+        pthread_mutex_unlock(&result_cache.lock);
+    }
+    fs_buf_printf(&response, opts->dictionary ? "}}\n" : "]}\n");
+    send_response(id);
+    fs_dir_close(dir);
+}
+
+void handle_get_metrics(int id) {
+    double uptime = (fs_now_ns() - metrics_start_ns) / 1e9;
+    fs_buf_printf(&response, "{\"jsonrpc\":\"2.0\",\"id\":%d,\"result\":{\"uptime_s\":%.3f,\"methods\":{", id, uptime);
+    int first_method = 1;
+    for (int m = 0; m < METHOD_COUNT; m++) {
+        if (__atomic_load_n(&metrics[m][PHASE_TOTAL].count, __ATOMIC_RELAXED) == 0) continue;
+        fs_buf_printf(&response, "%s\"%s\":{", first_method ? "" : ",", method_names[m]);
+        first_method = 0;
+
+        int first_phase = 1;
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            const histogram *h = &metrics[m][p];
+            uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+            if (count == 0) continue;
+            fs_buf_printf(&response, "%s\"%s\":{\"count\":%llu,\"sum_ns\":%llu,\"p50_ns\":%llu,"
+                          "\"p90_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu}",
+                          first_phase ? "" : ",", phase_names[p], (unsigned long long)count,
+                          (unsigned long long)__atomic_load_n(&h->sum, __ATOMIC_RELAXED),
+                          (unsigned long long)hist_quantile(h, 0.50), (unsigned long long)hist_quantile(h, 0.90),
+                          (unsigned long long)hist_quantile(h, 0.99), (unsigned long long)hist_quantile(h, 0.999),
+                          (unsigned long long)__atomic_load_n(&h->max, __ATOMIC_RELAXED));
+            first_phase = 0;
+        }
+        fs_buf_putc(&response, '}');
+    }
+    fs_buf_printf(&response, "},\"cache\":{\"enabled\":%s,\"hits\":%llu,\"misses\":%llu,"
+                  "\"invalidations\":%llu,\"evictions\":%llu,\"entries\":%zu,\"bytes\":%zu,\"budget_bytes\":%zu}}}\n",
+                  result_cache.budget ? "true" : "false",
+                  (unsigned long long)__atomic_load_n(&result_cache.hits, __ATOMIC_RELAXED),
+                  (unsigned long long)__atomic_load_n(&result_cache.misses, __ATOMIC_RELAXED),
+                  (unsigned long long)__atomic_load_n(&result_cache.invalidations, __ATOMIC_RELAXED),
+                  (unsigned long long)__atomic_load_n(&result_cache.evictions, __ATOMIC_RELAXED),
+                  result_cache.count, result_cache.used, result_cache.budget);
+    send_response(id);
+}
+
+/**
+ * @brief Hashes the named files (or every regular file) in directory on the I/O pool
+ *
+ * Each result is {name, path, size, blake3} or {name, path, error}.
+ */
+void handle_hash_files(int id, const char* directory, const char* line) {
+    int dirfd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    PROBE_DIR_OPEN(directory, dirfd >= 0);
+    phase_mark(PHASE_OPENDIR);
+    if (dirfd < 0) {
+        send_error(id, "directory_error", "Cannot open directory");
+        return;
+    }
+
+    size_t count = 0, cap = 64;
+    fs_hash_job *jobs = fs_arena_alloc(&request_arena, cap * sizeof(fs_hash_job));
+    struct stat *stats = fs_arena_alloc(&request_arena, cap * sizeof(struct stat));
+    const char *files = strstr(line, "\"files\":[");
+    const char *p = files ? files + 9 : NULL;
+    fs_dir *dir = files ? NULL : fs_dir_open_in(directory, 0, &request_arena);
+    for (;;) {
+        if (count == cap) {
+            fs_hash_job *grown_jobs = fs_arena_alloc(&request_arena, 2 * cap * sizeof(fs_hash_job));
+            struct stat *grown_stats = fs_arena_alloc(&request_arena, 2 * cap * sizeof(struct stat));
+            memcpy(grown_jobs, jobs, cap * sizeof(fs_hash_job));
+            memcpy(grown_stats, stats, cap * sizeof(struct stat));
+            jobs = grown_jobs;
+            stats = grown_stats;
+            cap *= 2;
+        }
+        const char *name;
+        if (files) {
+            // Same unescaped-string assumption as extract_string_value
+            while (*p == ' ' || *p == ',') p++;
+            if (*p != '"') break;
+            const char *end = strchr(p + 1, '"');
+            if (!end) break;
+            name = fs_arena_strndup(&request_arena, p + 1, end - p - 1);
+            p = end + 1;
+            if (fstatat(dirfd, name, &stats[count], 0) != 0) memset(&stats[count], 0, sizeof(struct stat));
+        } else {
+            const fs_entry *entry = dir ? fs_dir_next(dir) : NULL;
+            if (!entry) break;
+            if (!S_ISREG(entry->st.st_mode)) continue;
+            name = fs_arena_strndup(&request_arena, entry->name, strlen(entry->name));
+            stats[count] = entry->st;
+        }
+        jobs[count].path = name;
+        jobs[count].st = &stats[count];
+        count++;
+    }
+    if (dir) fs_dir_close(dir);
+    phase_mark(PHASE_STAT);
+
+    fs_hash_files(count > 1 ? get_io_pool() : NULL, dirfd, jobs, count, 0);
+    close(dirfd);
+    phase_mark(PHASE_HASH);
+
+    int dot = strcmp(directory, ".") == 0;
+    size_t dir_len = strlen(directory);
+    int slash = dir_len > 0 && directory[dir_len - 1] == '/';
+    fs_buf_printf(&response, "{\"jsonrpc\":\"2.0\",\"id\":%d,\"result\":[", id);
+    for (size_t i = 0; i < count; i++) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s%s%s", dot ? "" : directory, dot || slash ? "" : "/", jobs[i].path);
+        fs_buf_printf(&response, "%s{\"name\":", i ? "," : "");
+        fs_buf_json_string(&response, jobs[i].path);
+        fs_buf_printf(&response, ",\"path\":");
+        fs_buf_json_string(&response, path);
+        if (jobs[i].error) {
+            fs_buf_printf(&response, ",\"error\":");
+            fs_buf_json_string(&response, jobs[i].error == EINVAL ? "Not a regular file" : strerror(jobs[i].error));
+        } else {
+            char hex[2 * FS_HASH_LEN + 1];
+            fs_hash_hex(jobs[i].digest, hex);
+            fs_buf_printf(&response, ",\"size\":%lld,\"blake3\":\"%s\"", (long long)stats[i].st_size, hex);
+        }
+        fs_buf_putc(&response, '}');
+    }
+    fs_buf_printf(&response, "]}\n");
+    send_response(id);
+}
+
+/**
+ * @brief find_duplicates working set
+ *
+ * Whole trees can be large, so unlike per-request arena memory this is
+ * malloc'd and freed by every call.
+ */
+typedef struct {
+    fs_buf paths;           // NUL-terminated file paths, then directory paths
+    size_t *file_at;
+    struct stat *st;
+    size_t nfiles;
+    size_t file_cap;
+    size_t *dir_at;
+    size_t ndirs;
+    size_t dir_cap;
+} dup_scan;
+
+void* dup_grow(void *array, size_t *cap, size_t width) {
+    *cap = *cap ? 2 * *cap : 1024;
+    void *grown = realloc(array, *cap * width);
+    if (!grown) {
+        perror("realloc");
+        exit(1);
+    }
+    return grown;
+}
+
+// Breadth-first, so only one directory is open at a time however deep the tree is
+void dup_walk(dup_scan *scan, const char *root, long long min_size, int hidden) {
+    scan->dir_at = dup_grow(scan->dir_at, &scan->dir_cap, sizeof(size_t));
+    scan->dir_at[scan->ndirs++] = scan->paths.len;
+    fs_buf_append(&scan->paths, root, strlen(root) + 1);
+
+    for (size_t d = 0; d < scan->ndirs; d++) {
+        fs_dir *dir = fs_dir_open(scan->paths.data + scan->dir_at[d], FS_LIST_NOFOLLOW | (hidden ? FS_LIST_HIDDEN : 0));
+        if (!dir) continue;
+        const fs_entry *entry;
+        while ((entry = fs_dir_next(dir))) {
+            if (S_ISDIR(entry->st.st_mode)) {
+                if (scan->ndirs == scan->dir_cap) {
+                    scan->dir_at = dup_grow(scan->dir_at, &scan->dir_cap, sizeof(size_t));
+                }
+                scan->dir_at[scan->ndirs++] = scan->paths.len;
+            } else if (S_ISREG(entry->st.st_mode) && entry->st.st_size >= min_size) {
+                if (scan->nfiles == scan->file_cap) {
+                    size_t cap = scan->file_cap;
+                    scan->file_at = dup_grow(scan->file_at, &scan->file_cap, sizeof(size_t));
+                    scan->st = dup_grow(scan->st, &cap, sizeof(struct stat));
+                }
+                scan->file_at[scan->nfiles] = scan->paths.len;
+                scan->st[scan->nfiles++] = entry->st;
+            } else {
+                continue;
+            }
+            fs_buf_append(&scan->paths, entry->path, strlen(entry->path) + 1);
+        }
+        fs_dir_close(dir);
+    }
+}
+
+// Largest size first, then by inode so hard links sit next to each other
+int dup_by_size(const void *a, const void *b) {
+    const struct stat *x = ((const fs_hash_job *)a)->st, *y = ((const fs_hash_job *)b)->st;
+    if (x->st_size != y->st_size) return x->st_size < y->st_size ? 1 : -1;
+    if (x->st_dev != y->st_dev) return x->st_dev < y->st_dev ? -1 : 1;
+    return x->st_ino < y->st_ino ? -1 : x->st_ino > y->st_ino;
+}
+
+// Size, then digest; failed jobs last within their size
+int dup_by_digest(const void *a, const void *b) {
+    const fs_hash_job *x = a, *y = b;
+    if (x->st->st_size != y->st->st_size) return x->st->st_size < y->st->st_size ? 1 : -1;
+    if (!x->error != !y->error) return x->error ? 1 : -1;
+    int c = memcmp(x->digest, y->digest, FS_HASH_LEN);
+    return c ? c : strcmp(x->path, y->path);
+}
+
+int dup_same(const fs_hash_job *x, const fs_hash_job *y) {
+    return !x->error && !y->error && x->st->st_size == y->st->st_size &&
+           memcmp(x->digest, y->digest, FS_HASH_LEN) == 0;
+}
+
+/**
+ * @brief Hashes jobs with flags, then keeps only runs of at least two equal (size, digest)
+ * @return Number of jobs kept, compacted to the front and sorted
+ */
+size_t dup_hash_stage(fs_hash_job *jobs, size_t n, int flags) {
+    fs_hash_files(n > 1 ? get_io_pool() : NULL, AT_FDCWD, jobs, n, flags);
+    qsort(jobs, n, sizeof(fs_hash_job), dup_by_digest);
+    size_t kept = 0;
+    for (size_t i = 0, j; i < n; i = j) {
+        for (j = i + 1; j < n && dup_same(&jobs[i], &jobs[j]); j++) { }
+        if (j - i < 2 || jobs[i].error) continue;
+        memmove(jobs + kept, jobs + i, (j - i) * sizeof(fs_hash_job));
+        kept += j - i;
+    }
+    return kept;
+}
+
+typedef struct {
+    size_t first;
+    size_t count;
+    unsigned long long wasted;
+} dup_group;
+
+int dup_by_waste(const void *a, const void *b) {
+    const dup_group *x = a, *y = b;
+    if (x->wasted != y->wasted) return x->wasted < y->wasted ? 1 : -1;
+    return x->first < y->first ? -1 : 1;
+}
+
+/**
+ * @brief Duplicate groups under directory, staged so I/O follows real collisions
+ *
+ * 1. Walk the tree; regular files only, symlinks are not followed.
+ * 2. Keep sizes shared by two or more distinct (dev, ino); extra hard links are skipped.
+ * 3. Hash the first and last 4 KB of those; keep equal (size, edge digest) runs.
+ * 4. Full BLAKE3 of survivors larger than 8 KB (smaller ones were hashed whole in 3).
+ */
+void handle_find_duplicates(int id, const char* directory, long long min_size, long long limit, int hidden) {
+    struct stat root;
+    if (stat(directory, &root) != 0 || !S_ISDIR(root.st_mode)) {
+        phase_mark(PHASE_OPENDIR);
+        send_error(id, "directory_error", "Cannot open directory");
+        return;
+    }
+    dup_scan scan = {0};
+    dup_walk(&scan, directory, min_size < 1 ? 1 : min_size, hidden);
+    phase_mark(PHASE_ENUMERATE);
+
+    fs_hash_job *jobs = calloc(scan.nfiles + 1, sizeof(fs_hash_job));
+    for (size_t i = 0; i < scan.nfiles; i++) {
+        jobs[i].path = scan.paths.data + scan.file_at[i];
+        jobs[i].st = &scan.st[i];
+    }
+    qsort(jobs, scan.nfiles, sizeof(fs_hash_job), dup_by_size);
+    size_t candidates = 0, hard_links = 0;
+    for (size_t i = 0, j; i < scan.nfiles; i = j) {
+        size_t start = candidates;
+        for (j = i; j < scan.nfiles && jobs[j].st->st_size == jobs[i].st->st_size; j++) {
+            if (j > i && jobs[j].st->st_dev == jobs[j - 1].st->st_dev &&
+                jobs[j].st->st_ino == jobs[j - 1].st->st_ino) {
+                hard_links++;
+                continue;
+            }
+            jobs[candidates++] = jobs[j];
+        }
+        if (candidates - start < 2) candidates = start;
+    }
+    phase_mark(PHASE_SELECT);
+
+    size_t partial = candidates;
+    size_t kept = dup_hash_stage(jobs, candidates, FS_HASH_EDGES);
+    // Files up to 2 * FS_HASH_EDGE already have their full digest and sort last
+    size_t large = 0;
+    while (large < kept && jobs[large].st->st_size > 2 * FS_HASH_EDGE) large++;
+    size_t full = large;
+    size_t confirmed = dup_hash_stage(jobs, large, 0);
+    memmove(jobs + confirmed, jobs + large, (kept - large) * sizeof(fs_hash_job));
+    size_t total = confirmed + kept - large;
+    phase_mark(PHASE_HASH);
+
+    dup_group *groups = malloc((total / 2 + 1) * sizeof(dup_group));
+    size_t ngroups = 0;
+    unsigned long long wasted = 0;
+    for (size_t i = 0, j; i < total; i = j) {
+        for (j = i + 1; j < total && dup_same(&jobs[i], &jobs[j]); j++) { }
+        groups[ngroups].first = i;
+        groups[ngroups].count = j - i;
+        groups[ngroups].wasted = (unsigned long long)jobs[i].st->st_size * (j - i - 1);
+        wasted += groups[ngroups++].wasted;
+    }
+    qsort(groups, ngroups, sizeof(dup_group), dup_by_waste);
+
+    fs_buf_printf(&response, "{\"jsonrpc\":\"2.0\",\"id\":%d,\"result\":{\"groups\":[", id);
+    size_t shown = limit >= 0 && (unsigned long long)limit < ngroups ? (size_t)limit : ngroups;
+    for (size_t g = 0; g < shown; g++) {
+        const fs_hash_job *first = &jobs[groups[g].first];
+        char hex[2 * FS_HASH_LEN + 1];
+        fs_hash_hex(first->digest, hex);
+        fs_buf_printf(&response, "%s{\"size\":%lld,\"blake3\":\"%s\",\"wasted_bytes\":%llu,\"files\":[",
+                      g ? "," : "", (long long)first->st->st_size, hex, groups[g].wasted);
+        for (size_t k = 0; k < groups[g].count; k++) {
+            if (k) fs_buf_putc(&response, ',');
+            fs_buf_json_string(&response, first[k].path);
+        }
+        fs_buf_printf(&response, "]}");
+    }
+    fs_buf_printf(&response, "],\"group_count\":%zu,\"wasted_bytes\":%llu,\"files_scanned\":%zu,"
+                  "\"hard_links_skipped\":%zu,\"partial_hashed\":%zu,\"full_hashed\":%zu}}\n",
+                  ngroups, wasted, scan.nfiles, hard_links, partial, full);
+    send_response(id);
+
+    free(groups);
+    free(jobs);
+    free(scan.paths.data);
+    free(scan.file_at);
+    free(scan.st);
+    free(scan.dir_at);
+}
+
+/**
+ * @brief All records of one snapshot that share an inode, plus one record of lookahead
+ *
+ * Usually a single file; hard links make larger groups. Paths are kept in
+ * the snapshot's (path) order.
+ */
+typedef struct {
+    fs_snapshot *snap;
+    const fs_snapshot_entry *next;    // first record of the following group, NULL at the end
+    fs_snapshot_entry *entries;
+    unsigned char *matched;
+    size_t count;
+    size_t cap;
+    fs_buf paths;
+} snap_group;
+
+// Reads the next inode's records; 0 when the snapshot is exhausted
+int snap_group_load(snap_group *g) {
+    g->count = 0;
+    g->paths.len = 0;
+    if (!g->next) return 0;
+    uint64_t ino = g->next->ino;
+    while (g->next && g->next->ino == ino) {
+        if (g->count == g->cap) {
+            g->cap = g->cap ? g->cap * 2 : 8;
+            g->entries = realloc(g->entries, g->cap * sizeof(fs_snapshot_entry));
+            g->matched = realloc(g->matched, g->cap);
+        }
+        g->entries[g->count] = *g->next;
+        g->entries[g->count].path = (const char *)(uintptr_t)g->paths.len;
+        g->matched[g->count++] = 0;
+        fs_buf_append(&g->paths, g->next->path, g->next->path_len + 1);
+        g->next = fs_snapshot_next(g->snap);
+    }
+    for (size_t i = 0; i < g->count; i++) {
+        g->entries[i].path = g->paths.data + (uintptr_t)g->entries[i].path;
+    }
+    return 1;
+}
+
+/**
+ * @brief Records the inode merge could not place, joined by path once it is done
+ *
+ * A file that was replaced rather than rewritten (an editor's save-to-temp
+ * and rename) keeps its path but not its inode, so it surfaces here as a
+ * removal and an addition of the same path. Memory grows with the number of
+ * such records, not with the size of the snapshots.
+ */
+typedef struct {
+    fs_snapshot_entry *entries;
+    size_t count;
+    size_t cap;
+    fs_buf paths;
+} snap_pending;
+
+typedef struct {
+    unsigned long long added, removed, modified, renamed, unchanged;
+    long long limit;
+    size_t shown;
+    snap_pending gone;
+    snap_pending born;
+} snap_diff;
+
+void snap_pending_add(snap_pending *p, const fs_snapshot_entry *e) {
+    if (p->count == p->cap) {
+        p->cap = p->cap ? p->cap * 2 : 64;
+        p->entries = realloc(p->entries, p->cap * sizeof(fs_snapshot_entry));
+    }
+    p->entries[p->count] = *e;
+    p->entries[p->count++].path = (const char *)(uintptr_t)p->paths.len;
+    fs_buf_append(&p->paths, e->path, e->path_len + 1);
+}
+
+int snap_by_path(const void *a, const void *b) {
+    return strcmp(((const fs_snapshot_entry *)a)->path, ((const fs_snapshot_entry *)b)->path);
+}
+
+void snap_pending_sort(snap_pending *p) {
+    for (size_t i = 0; i < p->count; i++) p->entries[i].path = p->paths.data + (uintptr_t)p->entries[i].path;
+    qsort(p->entries, p->count, sizeof(fs_snapshot_entry), snap_by_path);
+}
+
+void snap_pending_free(snap_pending *p) {
+    free(p->entries);
+    fs_buf_free(&p->paths);
+}
+
+// Same file: the type matches and, where both sides know it, so does the creation time
+int snap_same_file(const fs_snapshot_entry *a, const fs_snapshot_entry *b) {
+    return (a->mode & S_IFMT) == (b->mode & S_IFMT) &&
+           (!a->btime_ns || !b->btime_ns || a->btime_ns == b->btime_ns);
+}
+
+int snap_changed(const fs_snapshot_entry *a, const fs_snapshot_entry *b) {
+    return a->size != b->size || a->mtime_ns != b->mtime_ns || a->mode != b->mode;
+}
+
+// Appends one change record unless the limit has been reached
+void snap_report(snap_diff *d, const char *change, const fs_snapshot_entry *was, const fs_snapshot_entry *now) {
+    if (d->limit >= 0 && d->shown >= (unsigned long long)d->limit) return;
+    const fs_snapshot_entry *e = now ? now : was;
+    fs_buf_printf(&response, "%s{\"change\":\"%s\",\"path\":", d->shown++ ? "," : "", change);
+    fs_buf_json_string(&response, e->path);
+    if (was && now && strcmp(was->path, now->path) != 0) {
+        fs_buf_printf(&response, ",\"old_path\":");
+        fs_buf_json_string(&response, was->path);
+    }
+    fs_buf_printf(&response, ",\"type\":\"%s\",\"size\":%llu,\"modified\":%lld",
+                  fs_file_type(e->mode), (unsigned long long)e->size, (long long)(e->mtime_ns / 1000000000));
+    if (was && now) {
+        fs_buf_printf(&response, ",\"old_size\":%llu,\"old_modified\":%lld",
+                      (unsigned long long)was->size, (long long)(was->mtime_ns / 1000000000));
+    }
+    fs_buf_putc(&response, '}');
+}
+
+/**
+ * @brief Classifies the records of one inode, either side of which may be empty
+ *
+ * Paths present on both sides are modified or unchanged. The rest are
+ * paired in path order as renames; records that are not the same file
+ * (the inode was freed and reused) or have no partner are left for the
+ * path join in snap_diff_finish().
+ */
+void snap_diff_group(snap_diff *d, snap_group *was, snap_group *now) {
+    for (size_t i = 0, j = 0; i < was->count && j < now->count; ) {
+        const fs_snapshot_entry *a = &was->entries[i], *b = &now->entries[j];
+        int c = strcmp(a->path, b->path);
+        if (c < 0) { i++; continue; }
+        if (c > 0) { j++; continue; }
+        if (!snap_same_file(a, b)) {
+            snap_pending_add(&d->gone, a);
+            snap_pending_add(&d->born, b);
+        } else if (snap_changed(a, b)) {
+            d->modified++;
+            snap_report(d, "modified", a, b);
+        } else {
+            d->unchanged++;
+        }
+        was->matched[i++] = now->matched[j++] = 1;
+    }
+    size_t i = 0, j = 0;
+    for (;;) {
+        while (i < was->count && was->matched[i]) i++;
+        while (j < now->count && now->matched[j]) j++;
+        const fs_snapshot_entry *a = i < was->count ? &was->entries[i++] : NULL;
+        const fs_snapshot_entry *b = j < now->count ? &now->entries[j++] : NULL;
+        if (!a && !b) break;
+        if (a && b && snap_same_file(a, b)) {
+            d->renamed++;
+            snap_report(d, "renamed", a, b);
+            continue;
+        }
+        if (a) snap_pending_add(&d->gone, a);
+        if (b) snap_pending_add(&d->born, b);
+    }
+}
+
+// Path join of the leftovers: a path on both sides was replaced, the rest were removed or added
+void snap_diff_finish(snap_diff *d) {
+    snap_pending_sort(&d->gone);
+    snap_pending_sort(&d->born);
+    size_t i = 0, j = 0;
+    while (i < d->gone.count || j < d->born.count) {
+        const fs_snapshot_entry *a = i < d->gone.count ? &d->gone.entries[i] : NULL;
+        const fs_snapshot_entry *b = j < d->born.count ? &d->born.entries[j] : NULL;
+        int c = !a ? 1 : !b ? -1 : strcmp(a->path, b->path);
+        if (c == 0 && (a->mode & S_IFMT) == (b->mode & S_IFMT)) {
+            d->modified++;
+            snap_report(d, "modified", a, b);
+            i++;
+            j++;
+            continue;
+        }
+        if (c <= 0) {
+            d->removed++;
+            snap_report(d, "removed", a, NULL);
+            i++;
+        }
+        if (c >= 0) {
+            d->added++;
+            snap_report(d, "added", NULL, b);
+            j++;
+        }
+    }
+}
+
+void snap_group_free(snap_group *g) {
+    fs_snapshot_close(g->snap);
+    free(g->entries);
+    free(g->matched);
+    fs_buf_free(&g->paths);
+}
+
+void snap_info(const fs_snapshot *snap) {
+    fs_buf_printf(&response, "{\"root\":");
+    fs_buf_json_string(&response, fs_snapshot_root(snap));
+    fs_buf_printf(&response, ",\"taken\":%lld,\"entries\":%llu}",
+                  (long long)(fs_snapshot_taken(snap) / 1000000000),
+                  (unsigned long long)fs_snapshot_count(snap));
+}
+
+/**
+ * @brief Differences between two `file_info --snapshot` files
+ *
+ * Both files are sorted by inode, so this is one merge pass with buffered
+ * sequential reads: memory stays constant however many entries they hold.
+ */
+void handle_diff_snapshots(int id, const char* old_file, const char* new_file, long long limit) {
+    snap_group was = {0}, now = {0};
+    was.snap = fs_snapshot_open(old_file);
+    now.snap = fs_snapshot_open(new_file);
+    phase_mark(PHASE_OPENDIR);
+    if (!was.snap || !now.snap) {
+        fs_snapshot_close(was.snap);
+        fs_snapshot_close(now.snap);
+        send_error(id, "snapshot_error", "Cannot read snapshot");
+        return;
+    }
+
+    size_t start = response.len;
+    fs_buf_printf(&response, "{\"jsonrpc\":\"2.0\",\"id\":%d,\"result\":{\"old\":", id);
+    snap_info(was.snap);
+    fs_buf_printf(&response, ",\"new\":");
+    snap_info(now.snap);
+    fs_buf_printf(&response, ",\"changes\":[");
+
+    snap_diff d = {0};
+    d.limit = limit;
+    was.next = fs_snapshot_next(was.snap);
+    now.next = fs_snapshot_next(now.snap);
+    int more_was = snap_group_load(&was), more_now = snap_group_load(&now);
+    while (more_was || more_now) {
+        uint64_t a = more_was ? was.entries[0].ino : UINT64_MAX;
+        uint64_t b = more_now ? now.entries[0].ino : UINT64_MAX;
+        snap_group none = {0};
+        snap_diff_group(&d, a <= b ? &was : &none, b <= a ? &now : &none);
+        if (a <= b) more_was = snap_group_load(&was);
+        if (b <= a) more_now = snap_group_load(&now);
+    }
+    snap_diff_finish(&d);
+    phase_mark(PHASE_ENUMERATE);
+
+    if (fs_snapshot_error(was.snap) || fs_snapshot_error(now.snap)) {
+        response.len = start;
+        send_error(id, "snapshot_error", "Snapshot is truncated or corrupt");
+    } else {
+        unsigned long long total = d.added + d.removed + d.modified + d.renamed;
+        fs_buf_printf(&response, "],\"added\":%llu,\"removed\":%llu,\"modified\":%llu,\"renamed\":%llu,"
+                      "\"unchanged\":%llu,\"truncated\":%s}}\n",
+                      d.added, d.removed, d.modified, d.renamed, d.unchanged,
+                      total > d.shown ? "true" : "false");
+        send_response(id);
+    }
+    snap_group_free(&was);
+    snap_group_free(&now);
+    snap_pending_free(&d.gone);
+    snap_pending_free(&d.born);
+}
+
+/**
+ * @brief Rough BPE token count of s
+ *
+ * Letter runs cost one token per 4 letters, digit runs one per 3 digits
+ * (tokenizers split numbers that way), punctuation one per 2 characters
+ * and other bytes one per 2. A space before a word rides along with it.
+ * Checked by hand against cl100k; it errs on the high side for names.
+ */
+size_t llm_tokens(const char *s, size_t len) {
+    size_t tokens = 0;
+    for (size_t i = 0; i < len; ) {
+        unsigned char c = (unsigned char)s[i];
+        int cls = (c | 0x20) >= 'a' && (c | 0x20) <= 'z' ? 0 : c >= '0' && c <= '9' ? 1 : c >= 0x80 ? 2 : 3;
+        if (c == ' ' && i + 1 < len && (s[i + 1] | 0x20) >= 'a' && (s[i + 1] | 0x20) <= 'z') {
+            i++;
+            continue;
+        }
+        size_t run = 1;
+        while (i + run < len) {
+            unsigned char d = (unsigned char)s[i + run];
+            int next = (d | 0x20) >= 'a' && (d | 0x20) <= 'z' ? 0 : d >= '0' && d <= '9' ? 1 : d >= 0x80 ? 2 : 3;
+            if (next != cls || d == ' ' || d == '|' || d == '\n') break;
+            run++;
+        }
+        tokens += cls == 0 ? (run + 3) / 4 : cls == 1 ? (run + 2) / 3 : (run + 1) / 2;
+        i += run;
+    }
+    return tokens;
+}
+
+// ls -h style: 512, 4.0K, 13M
+void format_size_short(uint64_t size, char out[16]) {
+    static const char units[] = "KMGTPE";
+    if (size < 1024) {
+        snprintf(out, 16, "%llu", (unsigned long long)size);
+        return;
+    }
+    double v = size / 1024.0;
+    int u = 0;
+    while (v >= 1024 && u < 5) {
+        v /= 1024;
+        u++;
+    }
+    snprintf(out, 16, v < 10 ? "%.1f%c" : "%.0f%c", v, units[u]);
+}
+
+/**
+ * @brief uid or gid to dictionary code, e.g. u0, g1; new ids are appended to dict as " u0=root"
+ */
+typedef struct {
+    uint32_t *ids;
+    size_t count;
+    size_t cap;
+    fs_buf text;
+} render_dict;
+
+__thread render_dict render_owners, render_groups;    // keep their capacity between requests
+__thread fs_buf render_rows;
 
-// MCP Server for FileSavantAI - File Operations
-void send_initialization();
-void send_tools_list(int id);
-void send_error(int id, const char* code, const char* message);
-void handle_list_files(int id, const char* directory);
-char* extract_string_value(const char* json, const char* key);
-int extract_id(const char* json);
+size_t render_code(render_dict *d, uint32_t id, char prefix, int is_group) {
+    for (size_t i = 0; i < d->count; i++) {
+        if (d->ids[i] == id) return i;
+    }
+    if (d->count == d->cap) {
+        d->cap = d->cap ? d->cap * 2 : 16;
+        d->ids = realloc(d->ids, d->cap * sizeof(uint32_t));
+    }
+    fs_buf_printf(&d->text, " %c%zu=%s", prefix, d->count,
+                  is_group ? fs_group_name((gid_t)id) : fs_user_name((uid_t)id));
+    d->ids[d->count] = id;
+    return d->count++;
+}
 
-const char* get_file_type(mode_t mode) {
-    if (S_ISDIR(mode)) return "directory";
-    if (S_ISREG(mode)) return "file";
-    if (S_ISLNK(mode)) return "symlink";
-    if (S_ISCHR(mode)) return "char_device";
-    if (S_ISBLK(mode)) return "block_device";
-    if (S_ISFIFO(mode)) return "fifo";
-    if (S_ISSOCK(mode)) return "socket";
-    return "unknown";
+// Appends s as the body of a JSON string; control bytes other than \n become '?'
+void append_json_text(const char *s, size_t len) {
+    fs_buf_reserve(&response, len + len / 8 + 16);
+    for (size_t i = 0; i < len; i++) {
+        char c = s[i];
+        if (c == '"' || c == '\\') {
+            fs_buf_putc(&response, '\\');
+            fs_buf_putc(&response, c);
+        } else if (c == '\n') {
+            fs_buf_append(&response, "\\n", 2);
+        } else {
+            fs_buf_putc(&response, (unsigned char)c < 0x20 ? '?' : c);
+        }
+    }
 }
 
-void send_initialization() {
-    printf("{\"jsonrpc\":\"2.0\",\"method\":\"notifications/initialized\"}\n");
-    fflush(stdout);
+/**
+ * @brief The listing as a compact table for an LLM prompt, cut to fit token_budget
+ *
+ * One header row, then "mode|size|modified|owner|group|name" per entry with
+ * ls-style modes, human sizes, local minute timestamps, and owners and
+ * groups replaced by short codes listed once above the table. Rows are
+ * added in the requested order (name by default) until the estimated cost
+ * of the next one would overrun the budget.
+ */
+void handle_render_for_llm(int id, const char* directory, const list_options *opts, long long budget) {
+    fs_dir *dir = fs_dir_open_in(directory, FS_LIST_TIMED, &request_arena);
+    if (!dir) {
+        phase_mark(PHASE_OPENDIR);
+        send_error(id, "directory_error", "Cannot open directory");
+        return;
+    }
+    phase_mark(PHASE_OPENDIR);
+    if (set_name_filters(dir, opts) != 0) {
+        fs_dir_close(dir);
+        send_error(id, "invalid_params", "Invalid or too complex pattern or regex");
+        return;
+    }
+    phase_mark(PHASE_PARSE);
+
+    const fs_entry *entry;
+    fs_table_clear(&listing_table);
+    while ((entry = fs_dir_next(dir))) fs_table_add(&listing_table, entry);
+    const fs_dir_times *times = fs_dir_timing(dir);
+    timer_add(PHASE_ENUMERATE, times->enumerate_ns);
+    timer_add(PHASE_STAT, times->stat_ns);
+    request_timer.mark = fs_now_ns();
+
+    uint32_t *rows = fs_arena_alloc(&request_arena, (listing_table.count + 1) * sizeof(uint32_t));
+    size_t n = fs_table_filter(&listing_table, &opts->filter, rows);
+    size_t end = n;
+    if (opts->limit >= 0 && (unsigned long long)opts->limit < n &&
+        (unsigned long long)opts->offset < n - (unsigned long long)opts->limit) {
+        end = opts->offset + opts->limit;
+    }
+    int sort = opts->sort == FS_SORT_NONE ? FS_SORT_NAME : opts->sort;
+    end = fs_table_top(&listing_table, rows, n, sort, opts->descending, end);
+    phase_mark(PHASE_SELECT);
+
+    static const char *sort_names[] = { "", "name", "size", "modified" };
+    char title[PATH_MAX + 128];
+    int title_len = snprintf(title, sizeof(title), "%s: %zu entries, by %s%s\n", directory, n,
+                             sort_names[sort], opts->descending ? " desc" : "");
+    if (title_len >= (int)sizeof(title)) title_len = sizeof(title) - 1;
+    static const char header[] = "mode|size|modified|owner|group|name\n";
+    // Reserve room for the "(N more not shown)" footer and the two dictionary labels
+    long long used = (long long)(llm_tokens(title, title_len) + llm_tokens(header, sizeof(header) - 1)) + 16;
+
+    render_owners.count = render_groups.count = 0;
+    render_owners.text.len = render_groups.text.len = 0;
+    render_rows.len = 0;
+    size_t shown = 0;
+    for (size_t i = opts->offset; i < end; i++) {
+        uint32_t r = rows[i];
+        size_t owners_len = render_owners.text.len, groups_len = render_groups.text.len;
+        size_t owners = render_owners.count, groups = render_groups.count;
+        size_t row_start = render_rows.len;
+        uint64_t t0 = fs_now_ns();
+        size_t owner = render_code(&render_owners, listing_table.uid[r], 'u', 0);
+        size_t group = render_code(&render_groups, listing_table.gid[r], 'g', 1);
+        uint64_t t1 = fs_now_ns();
+
+        mode_t mode = listing_table.mode[r];
+        char perms[11], size[16], when[32];
+        fs_format_permissions(mode, perms);
+        perms[0] = S_ISLNK(mode) ? 'l' : S_ISCHR(mode) ? 'c' : S_ISBLK(mode) ? 'b' :
+                   S_ISFIFO(mode) ? 'p' : S_ISSOCK(mode) ? 's' : perms[0];
+        format_size_short((uint64_t)listing_table.size[r], size);
+        time_t mtime = (time_t)listing_table.mtime[r];
+        struct tm tm;
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime_r(&mtime, &tm));
+        fs_buf_printf(&render_rows, "%s|%s|%s|u%zu|g%zu|", perms, size, when, owner, group);
+        for (const char *p = fs_table_name(&listing_table, r); *p; p++) {
+            fs_buf_putc(&render_rows, *p == '\n' ? '?' : *p);    // keep one row per line
+        }
+        fs_buf_putc(&render_rows, '\n');
+
+        long long cost = (long long)(llm_tokens(render_rows.data + row_start, render_rows.len - row_start) +
+                                     llm_tokens(render_owners.text.data + owners_len, render_owners.text.len - owners_len) +
+                                     llm_tokens(render_groups.text.data + groups_len, render_groups.text.len - groups_len));
+        timer_add(PHASE_NAMES, t1 - t0);
+        timer_add(PHASE_SERIALIZE, fs_now_ns() - t1);
+        if (used + cost > budget) {
+            render_rows.len = row_start;
+            render_owners.text.len = owners_len;
+            render_groups.text.len = groups_len;
+            render_owners.count = owners;
+            render_groups.count = groups;
+            break;
+        }
+        used += cost;
+        shown++;
+    }
+    request_timer.mark = fs_now_ns();
+
+    size_t listed = end > (size_t)opts->offset ? end - opts->offset : 0;
+    fs_buf_printf(&response, "{\"jsonrpc\":\"2.0\",\"id\":%d,\"result\":{\"text\":\"", id);
+    append_json_text(title, title_len);
+    if (render_owners.count) {
+        append_json_text("owners:", 7);
+        append_json_text(render_owners.text.data, render_owners.text.len);
+        append_json_text("\ngroups:", 8);
+        append_json_text(render_groups.text.data, render_groups.text.len);
+        append_json_text("\n", 1);
+    }
+    append_json_text(header, sizeof(header) - 1);
+    append_json_text(render_rows.data, render_rows.len);
+    if (shown < listed) fs_buf_printf(&response, "(%zu more not shown)\\n", listed - shown);
+    fs_buf_printf(&response, "\",\"entries\":%zu,\"shown\":%zu,\"tokens\":%lld,\"token_budget\":%lld}}\n",
+                  n, shown, used, budget);
+    phase_mark(PHASE_SERIALIZE);
+    send_response(id);
+    fs_dir_close(dir);
 }
 
-void send_tools_list(int id) {
-    printf("{\"jsonrpc\":\"2.0\",\"id\":%d,\"result\":["
-           "{\"name\":\"list_files\","
-           "\"description\":\"List all files in a directory\","
-           "\"inputSchema\":{\"type\":\"object\",\"properties\":{\"directory\":{\"type\":\"string\",\"description\":\"Directory path\"}},\"required\":[\"directory\"]}}"
-           "]}\n", id);
-    fflush(stdout);
+/**
+ * @brief One entry held by the sampler: enough to render it without a second stat
+ */
+typedef struct {
+    struct stat st;
+    char name[NAME_MAX + 1];
+} sample_item;
+
+/**
+ * @brief Entries of one (type, extension, size bucket) with a reservoir of cap of them
+ */
+typedef struct {
+    uint8_t type;           // SAMPLE_FILE, ...
+    uint8_t bucket;         // sample_bucket()
+    char ext[SAMPLE_EXT_LEN + 1];
+    uint64_t seen;
+    size_t take;            // share of the final sample
+    sample_item *items;
+} sample_stratum;
+
+typedef struct {
+    char ext[SAMPLE_EXT_LEN + 1];
+    uint64_t count;
+    uint64_t bytes;
+} sample_ext;
+
+enum { SAMPLE_FILE, SAMPLE_DIR, SAMPLE_LINK, SAMPLE_OTHER };
+const char *sample_type_names[] = { "file", "directory", "symlink", "other" };
+const char *sample_bucket_names[] = {
+    "empty", "<32B", "<1K", "<32K", "<1M", "<32M", "<1G", ">=1G",
+};
+#define SAMPLE_BUCKETS (sizeof(sample_bucket_names) / sizeof(sample_bucket_names[0]))
+
+/**
+ * @brief State of one sample_files pass; everything lives in the request arena
+ */
+typedef struct {
+    uint64_t rng;
+    size_t cap;                                 // reservoir size per stratum
+    sample_stratum strata[SAMPLE_STRATA + 1];   // the last one takes whatever does not fit
+    size_t nstrata;
+    uint8_t strata_index[2 * SAMPLE_STRATA];    // open addressing, 0 = empty, else index + 1
+    sample_ext exts[SAMPLE_EXT_SLOTS];
+    uint64_t ext_other, ext_other_bytes;
+    uint64_t entries, bytes;
+    uint64_t types[4];
+    uint64_t buckets[SAMPLE_BUCKETS];
+    uint64_t setuid, setgid, world_writable;
+    sample_item largest[SAMPLE_OUTLIERS], newest[SAMPLE_OUTLIERS], oldest[SAMPLE_OUTLIERS];
+    sample_item odd[SAMPLE_OUTLIERS];
+    size_t nlargest, nnewest, noldest, nodd;
+} sampler;
+
+uint64_t sample_random(sampler *s) {
+    // xorshift64*
+    s->rng ^= s->rng >> 12;
+    s->rng ^= s->rng << 25;
+    s->rng ^= s->rng >> 27;
+    return s->rng * 0x2545F4914F6CDD1DULL;
 }
 
-void send_error(int id, const char* code, const char* message) {
-    printf("{\"jsonrpc\":\"2.0\",\"id\":%d,\"error\":{\"code\":\"%s\",\"message\":\"%s\"}}\n", 
-           id, code, message);
-    fflush(stdout);
+// 0 for empty files, then one bucket per factor of 32
+uint8_t sample_bucket(off_t size) {
+    if (size <= 0) return 0;
+    int bits = 63 - __builtin_clzll((unsigned long long)size);
+    int b = 1 + bits / 5;
+    return (uint8_t)(b < (int)SAMPLE_BUCKETS ? b : (int)SAMPLE_BUCKETS - 1);
 }
 
-void print_file_json_compact(const char *directory, const char *filename, struct stat *st, int first) {
-    struct passwd *pwd = getpwuid(st->st_uid);
-    struct group *grp = getgrgid(st->st_gid);
-    const char *file_type = get_file_type(st->st_mode);
-    
-    char fullpath[2048];
-    if (strcmp(directory, ".") == 0) {
-        snprintf(fullpath, sizeof(fullpath), "%s", filename);
+// Lower-cased extension of a regular file's name, "" if it has none or it is too long
+void sample_extension(const char *name, char ext[SAMPLE_EXT_LEN + 1]) {
+    const char *dot = strrchr(name, '.');
+    ext[0] = '\0';
+    if (!dot || dot == name || strlen(dot + 1) > SAMPLE_EXT_LEN) return;
+    size_t i = 0;
+    for (const char *p = dot + 1; *p; p++) ext[i++] = (*p >= 'A' && *p <= 'Z') ? *p + 32 : *p;
+    ext[i] = '\0';
+}
+
+uint64_t sample_hash(const char *ext, unsigned extra) {
+    uint64_t h = 1469598103934665603ULL ^ extra;    // FNV-1a
+    for (const char *p = ext; *p; p++) h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    return h;
+}
+
+sample_stratum* sample_stratum_of(sampler *s, uint8_t type, uint8_t bucket, const char *ext) {
+    size_t mask = 2 * SAMPLE_STRATA - 1;
+    for (size_t i = sample_hash(ext, type << 8 | bucket) & mask; ; i = (i + 1) & mask) {
+        if (!s->strata_index[i]) {
+            if (s->nstrata == SAMPLE_STRATA) break;
+            sample_stratum *st = &s->strata[s->nstrata];
+            st->type = type;
+            st->bucket = bucket;
+            strcpy(st->ext, ext);
+            st->items = fs_arena_alloc(&request_arena, s->cap * sizeof(sample_item));
+            s->strata_index[i] = (uint8_t)++s->nstrata;
+            return st;
+        }
+        sample_stratum *st = &s->strata[s->strata_index[i] - 1];
+        if (st->type == type && st->bucket == bucket && strcmp(st->ext, ext) == 0) return st;
+    }
+    sample_stratum *overflow = &s->strata[SAMPLE_STRATA];
+    if (!overflow->items) {
+        overflow->type = SAMPLE_OTHER;
+        overflow->items = fs_arena_alloc(&request_arena, s->cap * sizeof(sample_item));
+    }
+    return overflow;
+}
+
+void sample_count_ext(sampler *s, const char *ext, off_t size) {
+    for (size_t i = sample_hash(ext, 0) & (SAMPLE_EXT_SLOTS - 1), probes = 0; probes < SAMPLE_EXT_SLOTS;
+         i = (i + 1) & (SAMPLE_EXT_SLOTS - 1), probes++) {
+        sample_ext *e = &s->exts[i];
+        if (!e->count) strcpy(e->ext, ext);
+        if (strcmp(e->ext, ext) == 0) {
+            e->count++;
+            e->bytes += (uint64_t)size;
+            return;
+        }
+    }
+    s->ext_other++;
+    s->ext_other_bytes += (uint64_t)size;
+}
+
+// Keeps the SAMPLE_OUTLIERS items that rank highest by before(), best first
+void sample_keep(sample_item *top, size_t *n, const fs_entry *entry,
+                 int (*before)(const struct stat *, const struct stat *)) {
+    size_t i = *n;
+    if (i == SAMPLE_OUTLIERS) {
+        if (!before(&entry->st, &top[i - 1].st)) return;
+        i--;
     } else {
-        snprintf(fullpath, sizeof(fullpath), "%s/%s", directory, filename);
+        (*n)++;
     }
-    
-    if (!first) printf(",");
-    
-    printf("{\"name\":\"%s\",\"path\":\"%s\",\"size\":%lld,\"owner\":\"%s\",\"group\":\"%s\","
-           "\"uid\":%d,\"gid\":%d,\"permissions\":\"%03o\",\"permissions_readable\":\"",
-           filename, fullpath, (long long)st->st_size, 
-           pwd ? pwd->pw_name : "unknown", grp ? grp->gr_name : "unknown",
-           st->st_uid, st->st_gid, st->st_mode & 0777);
-    
-    // Print permissions
-    printf("%c", S_ISDIR(st->st_mode) ? 'd' : '-');
-    printf("%c", (st->st_mode & S_IRUSR) ? 'r' : '-');
-    printf("%c", (st->st_mode & S_IWUSR) ? 'w' : '-');
-    printf("%c", (st->st_mode & S_IXUSR) ? 'x' : '-');
-    printf("%c", (st->st_mode & S_IRGRP) ? 'r' : '-');
-    printf("%c", (st->st_mode & S_IWGRP) ? 'w' : '-');
-    printf("%c", (st->st_mode & S_IXGRP) ? 'x' : '-');
-    printf("%c", (st->st_mode & S_IROTH) ? 'r' : '-');
-    printf("%c", (st->st_mode & S_IWOTH) ? 'w' : '-');
-    printf("%c", (st->st_mode & S_IXOTH) ? 'x' : '-');
-    
-    printf("\",\"type\":\"%s\",\"modified\":%ld,\"accessed\":%ld,\"changed\":%ld,"
-           "\"inode\":%llu,\"device\":\"%ld\",\"hard_links\":%hu,\"block_size\":%d,\"blocks\":%lld}",
-           file_type, st->st_mtime, st->st_atime, st->st_ctime,
-           (unsigned long long)st->st_ino, (long)st->st_dev, st->st_nlink,
-           st->st_blksize, (long long)st->st_blocks);
+    while (i > 0 && before(&entry->st, &top[i - 1].st)) {
+        top[i] = top[i - 1];
+        i--;
+    }
+    top[i].st = entry->st;
+    snprintf(top[i].name, sizeof(top[i].name), "%s", entry->name);
 }
 
-void handle_list_files(int id, const char* directory) {
-    DIR *dir = opendir(directory);
+int sample_larger(const struct stat *a, const struct stat *b) { return a->st_size > b->st_size; }
+int sample_newer(const struct stat *a, const struct stat *b) { return a->st_mtime > b->st_mtime; }
+int sample_older(const struct stat *a, const struct stat *b) { return a->st_mtime < b->st_mtime; }
+
+void sample_add(sampler *s, const fs_entry *entry) {
+    const struct stat *st = &entry->st;
+    uint8_t type = S_ISREG(st->st_mode) ? SAMPLE_FILE : S_ISDIR(st->st_mode) ? SAMPLE_DIR :
+                   S_ISLNK(st->st_mode) ? SAMPLE_LINK : SAMPLE_OTHER;
+    uint8_t bucket = sample_bucket(st->st_size);
+    char ext[SAMPLE_EXT_LEN + 1] = "";
+    s->entries++;
+    s->types[type]++;
+    if (type == SAMPLE_FILE) {
+        s->bytes += (uint64_t)st->st_size;
+        s->buckets[bucket]++;
+        sample_extension(entry->name, ext);
+        sample_count_ext(s, ext, st->st_size);
+    } else {
+        bucket = 0;    // directory sizes say nothing useful
+    }
+
+    sample_stratum *stratum = sample_stratum_of(s, type, bucket, ext);
+    uint64_t slot = stratum->seen++;
+    if (slot >= s->cap) slot = sample_random(s) % stratum->seen;    // Algorithm R
+    if (slot < s->cap) {
+        stratum->items[slot].st = *st;
+        snprintf(stratum->items[slot].name, sizeof(stratum->items[slot].name), "%s", entry->name);
+    }
+
+    if (type == SAMPLE_FILE) sample_keep(s->largest, &s->nlargest, entry, sample_larger);
+    if (type != SAMPLE_LINK) {
+        sample_keep(s->newest, &s->nnewest, entry, sample_newer);
+        sample_keep(s->oldest, &s->noldest, entry, sample_older);
+    }
+    int odd = 0;
+    if (st->st_mode & S_ISUID) s->setuid++, odd = 1;
+    if (st->st_mode & S_ISGID && !S_ISDIR(st->st_mode)) s->setgid++, odd = 1;
+    if ((st->st_mode & S_IWOTH) && type != SAMPLE_LINK && !(st->st_mode & S_ISVTX)) s->world_writable++, odd = 1;
+    if (odd && s->nodd < SAMPLE_OUTLIERS) {
+        s->odd[s->nodd].st = *st;
+        snprintf(s->odd[s->nodd++].name, sizeof(s->odd[0].name), "%s", entry->name);
+    }
+}
+
+/**
+ * @brief Splits n sample slots over the strata in proportion to their size
+ *
+ * Every stratum gets at least one slot while slots last (biggest strata
+ * first), so rare kinds of entry are represented; no stratum gets more than
+ * it holds, and what it cannot take goes to the next largest.
+ */
+void sample_allocate(sampler *s, size_t n) {
+    sample_stratum *order[SAMPLE_STRATA + 1];
+    size_t count = 0;
+    for (size_t i = 0; i <= SAMPLE_STRATA; i++) {
+        if (s->strata[i].seen) order[count++] = &s->strata[i];
+    }
+    for (size_t i = 1; i < count; i++) {    // by size, descending; count is small
+        sample_stratum *x = order[i];
+        size_t j = i;
+        for (; j > 0 && order[j - 1]->seen < x->seen; j--) order[j] = order[j - 1];
+        order[j] = x;
+    }
+    size_t left = n;
+    for (size_t i = 0; i < count && left; i++) {
+        order[i]->take = 1;
+        left--;
+    }
+    uint64_t total = s->entries;
+    size_t base = left;
+    for (size_t i = 0; i < count && left; i++) {
+        size_t room = (size_t)(order[i]->seen < s->cap ? order[i]->seen : s->cap) - order[i]->take;
+        size_t want = (size_t)((double)base * order[i]->seen / total + 0.5);
+        size_t add = want < room ? want : room;
+        if (add > left) add = left;
+        order[i]->take += add;
+        left -= add;
+    }
+    for (size_t i = 0; i < count && left; i++) {
+        size_t room = (size_t)(order[i]->seen < s->cap ? order[i]->seen : s->cap) - order[i]->take;
+        size_t add = room < left ? room : left;
+        order[i]->take += add;
+        left -= add;
+    }
+}
+
+void sample_entry_json(const char *directory, const sample_item *item, const char *reason, int first) {
+    char permissions[11];
+    fs_format_permissions(item->st.st_mode, permissions);
+    fs_buf_printf(&response, "%s{\"name\":", first ? "" : ",");
+    fs_buf_json_string(&response, item->name);
+    fs_buf_printf(&response, ",\"path\":");
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s%s%s", strcmp(directory, ".") ? directory : "",
+             strcmp(directory, ".") ? "/" : "", item->name);
+    fs_buf_json_string(&response, path);
+    fs_buf_printf(&response, ",\"type\":\"%s\",\"size\":%lld,\"modified\":%ld,\"owner\":\"%s\","
+                  "\"group\":\"%s\",\"permissions\":\"%03o\",\"permissions_readable\":\"%s\"",
+                  fs_file_type(item->st.st_mode), (long long)item->st.st_size, (long)item->st.st_mtime,
+                  fs_user_name(item->st.st_uid), fs_group_name(item->st.st_gid),
+                  (unsigned int)(item->st.st_mode & 0777), permissions);
+    if (reason) {
+        fs_buf_printf(&response, ",\"stratum\":");
+        fs_buf_json_string(&response, reason);
+    }
+    fs_buf_putc(&response, '}');
+}
+
+void sample_list(const char *directory, const char *key, const sample_item *items, size_t n, int first) {
+    fs_buf_printf(&response, "%s\"%s\":[", first ? "" : ",", key);
+    for (size_t i = 0; i < n; i++) sample_entry_json(directory, &items[i], NULL, i == 0);
+    fs_buf_putc(&response, ']');
+}
+
+int sample_ext_by_count(const void *a, const void *b) {
+    const sample_ext *x = a, *y = b;
+    if (x->count != y->count) return x->count < y->count ? 1 : -1;
+    return strcmp(x->ext, y->ext);
+}
+
+/**
+ * @brief A bounded, representative subset of a directory plus exact counts, in one pass
+ *
+ * Entries are stratified by type, extension and size bucket (factors of 32)
+ * and each stratum keeps a reservoir (Algorithm R), so the sample reflects
+ * the whole directory rather than the start of readdir order. The largest,
+ * newest and oldest entries and ones with setuid, setgid or world-writable
+ * modes are listed separately, and every count in the summary is exact.
+ */
+void handle_sample_files(int id, const char* directory, long long sample_size, uint64_t seed) {
+    // Links are described by the link itself, never by what it points at
+    fs_dir *dir = fs_dir_open_in(directory, FS_LIST_TIMED | FS_LIST_NOFOLLOW, &request_arena);
     if (!dir) {
+        phase_mark(PHASE_OPENDIR);
         send_error(id, "directory_error", "Cannot open directory");
         return;
     }
-    
-    printf("{\"jsonrpc\":\"2.0\",\"id\":%d,\"result\":[", id);
-    
-    struct dirent *entry;
-    struct stat st;
+    phase_mark(PHASE_OPENDIR);
+
+    sampler *s = fs_arena_alloc(&request_arena, sizeof(sampler));
+    memset(s, 0, sizeof(*s));
+    size_t n = sample_size < 0 ? 0 : sample_size > SAMPLE_MAX ? SAMPLE_MAX : (size_t)sample_size;
+    s->cap = n / 2 > 4 ? n / 2 : 4;
+    s->rng = seed ? seed : 0x9E3779B97F4A7C15ULL;
+    const fs_entry *entry;
+    while ((entry = fs_dir_next(dir))) sample_add(s, entry);
+    const fs_dir_times *times = fs_dir_timing(dir);
+    timer_add(PHASE_ENUMERATE, times->enumerate_ns);
+    timer_add(PHASE_STAT, times->stat_ns);
+    request_timer.mark = fs_now_ns();
+    sample_allocate(s, n);
+    phase_mark(PHASE_SELECT);
+
+    fs_buf_printf(&response, "{\"jsonrpc\":\"2.0\",\"id\":%d,\"result\":{\"entries\":%llu,\"bytes\":%llu,\"types\":{",
+                  id, (unsigned long long)s->entries, (unsigned long long)s->bytes);
+    for (int t = 0; t < 4; t++) {
+        fs_buf_printf(&response, "%s\"%s\":%llu", t ? "," : "", sample_type_names[t], (unsigned long long)s->types[t]);
+    }
+    fs_buf_printf(&response, "},\"file_sizes\":{");
+    for (size_t b = 0; b < SAMPLE_BUCKETS; b++) {
+        fs_buf_printf(&response, "%s\"%s\":%llu", b ? "," : "", sample_bucket_names[b], (unsigned long long)s->buckets[b]);
+    }
+    fs_buf_printf(&response, "},\"extensions\":[");
+    qsort(s->exts, SAMPLE_EXT_SLOTS, sizeof(sample_ext), sample_ext_by_count);
+    uint64_t rest = s->ext_other, rest_bytes = s->ext_other_bytes;
+    for (size_t i = 0; i < SAMPLE_EXT_SLOTS && s->exts[i].count; i++) {
+        if (i >= SAMPLE_TOP_EXTENSIONS) {
+            rest += s->exts[i].count;
+            rest_bytes += s->exts[i].bytes;
+            continue;
+        }
+        fs_buf_printf(&response, "%s{\"ext\":", i ? "," : "");
+        fs_buf_json_string(&response, s->exts[i].ext);
+        fs_buf_printf(&response, ",\"count\":%llu,\"bytes\":%llu}",
+                      (unsigned long long)s->exts[i].count, (unsigned long long)s->exts[i].bytes);
+    }
+    fs_buf_printf(&response, "],\"other_extensions\":{\"count\":%llu,\"bytes\":%llu},"
+                  "\"odd_permissions\":{\"setuid\":%llu,\"setgid\":%llu,\"world_writable\":%llu},\"outliers\":{",
+                  (unsigned long long)rest, (unsigned long long)rest_bytes, (unsigned long long)s->setuid,
+                  (unsigned long long)s->setgid, (unsigned long long)s->world_writable);
+    sample_list(directory, "largest", s->largest, s->nlargest, 1);
+    sample_list(directory, "newest", s->newest, s->nnewest, 0);
+    sample_list(directory, "oldest", s->oldest, s->noldest, 0);
+    sample_list(directory, "odd_permissions", s->odd, s->nodd, 0);
+    fs_buf_printf(&response, "},\"sample\":[");
     int first = 1;
-    
-    while ((entry = readdir(dir))) {
-        if (entry->d_name[0] == '.') continue;
-        
-        char fullpath[2048];
-        snprintf(fullpath, sizeof(fullpath), "%s/%s", directory, entry->d_name);
-        
-        if (stat(fullpath, &st) == 0) {
-            print_file_json_compact(directory, entry->d_name, &st, first);
+    for (size_t i = 0; i <= SAMPLE_STRATA; i++) {
+        sample_stratum *st = &s->strata[i];
+        char reason[64];
+        snprintf(reason, sizeof(reason), "%s%s%s%s%s", i == SAMPLE_STRATA ? "other" : sample_type_names[st->type],
+                 st->ext[0] ? " ." : "", st->ext, st->type == SAMPLE_FILE && i < SAMPLE_STRATA ? " " : "",
+                 st->type == SAMPLE_FILE && i < SAMPLE_STRATA ? sample_bucket_names[st->bucket] : "");
+        size_t held = st->seen < s->cap ? (size_t)st->seen : s->cap;
+        for (size_t k = 0; k < st->take; k++) {
+            // Partial Fisher-Yates: a small stratum's reservoir is still in readdir order
+            size_t j = k + (size_t)(sample_random(s) % (held - k));
+            sample_item swap = st->items[k];
+            st->items[k] = st->items[j];
+            st->items[j] = swap;
+            sample_entry_json(directory, &st->items[k], reason, first);
             first = 0;
         }
     }
-    
-    printf("]}\n");
-    fflush(stdout);
-    closedir(dir);
+    fs_buf_printf(&response, "],\"strata\":%zu}}\n", s->nstrata + (s->strata[SAMPLE_STRATA].seen ? 1 : 0));
+    phase_mark(PHASE_SERIALIZE);
+    send_response(id);
+    fs_dir_close(dir);
 }
 
 char* extract_string_value(const char* json, const char* key) {
@@ -127,12 +2878,110 @@ char* extract_string_value(const char* json, const char* key) {
     char *end = strchr(start, '"');
     if (!end) return NULL;
     
-    int len = end - start;
-    char *result = malloc(len + 1);
-    strncpy(result, start, len);
-    result[len] = '\0';
-    
-    return result;
+    return fs_arena_strndup(&request_arena, start, end - start);
+}
+
+long long extract_number(const char* json, const char* key, long long fallback) {
+    char search_pattern[256];
+    snprintf(search_pattern, sizeof(search_pattern), "\"%s\":", key);
+
+    char *start = strstr(json, search_pattern);
+    if (!start) return fallback;
+
+    return atoll(start + strlen(search_pattern));
+}
+
+// Raw JSON of params._meta.progressToken (a string or a number), or NULL
+char* extract_progress_token(const char* json) {
+    char *start = strstr(json, "\"progressToken\":");
+    if (!start) return NULL;
+    start += 16;
+    char *end = start;
+    if (*end == '"') {
+        for (end++; *end && *end != '"'; end++) {
+            if (*end == '\\' && end[1]) end++;
+        }
+        if (*end != '"') return NULL;
+        end++;
+    } else {
+        end += strspn(end, "-0123456789");
+    }
+    return end > start ? fs_arena_strndup(&request_arena, start, end - start) : NULL;
+}
+
+static int hex4(const char *p) {
+    int v = 0;
+    for (int i = 0; i < 4; i++) {
+        int c = p[i];
+        if (c >= '0' && c <= '9') v = v * 16 + c - '0';
+        else if (c >= 'a' && c <= 'f') v = v * 16 + c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') v = v * 16 + c - 'A' + 10;
+        else return -1;
+    }
+    return v;
+}
+
+// Decodes the string value of key (escapes included) into out: its length,
+// -1 if key is absent, -2 if the string is malformed, holds a NUL or does not fit
+int extract_string_into(const char* json, const char* key, char *out, size_t cap) {
+    char search_pattern[256];
+    snprintf(search_pattern, sizeof(search_pattern), "\"%s\":\"", key);
+    const char *p = strstr(json, search_pattern);
+    if (!p) return -1;
+    p += strlen(search_pattern);
+
+    size_t len = 0;
+    while (*p != '"') {
+        char utf8[4];
+        size_t n = 1;
+        if (*p == '\0') return -2;
+        if (*p != '\\') {
+            utf8[0] = *p++;
+        } else {
+            p++;
+            const char *simple = strchr("\"\\/bfnrt", *p);
+            if (*p && simple) {
+                utf8[0] = "\"\\/\b\f\n\r\t"[simple - "\"\\/bfnrt"];
+                p++;
+            } else if (*p == 'u') {
+                long cp = hex4(p + 1);
+                if (cp < 0) return -2;
+                p += 5;
+                if (cp >= 0xD800 && cp <= 0xDBFF && p[0] == '\\' && p[1] == 'u') {
+                    long low = hex4(p + 2);
+                    if (low < 0xDC00 || low > 0xDFFF) return -2;
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    p += 6;
+                }
+                if (cp <= 0 || (cp >= 0xD800 && cp <= 0xDFFF)) return -2;
+                if (cp < 0x80) {
+                    utf8[0] = (char)cp;
+                } else if (cp < 0x800) {
+                    utf8[0] = (char)(0xC0 | cp >> 6);
+                    utf8[1] = (char)(0x80 | (cp & 0x3F));
+                    n = 2;
+                } else if (cp < 0x10000) {
+                    utf8[0] = (char)(0xE0 | cp >> 12);
+                    utf8[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+                    utf8[2] = (char)(0x80 | (cp & 0x3F));
+                    n = 3;
+                } else {
+                    utf8[0] = (char)(0xF0 | cp >> 18);
+                    utf8[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+                    utf8[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+                    utf8[3] = (char)(0x80 | (cp & 0x3F));
+                    n = 4;
+                }
+            } else {
+                return -2;
+            }
+        }
+        if (len + n >= cap) return -2;
+        memcpy(out + len, utf8, n);
+        len += n;
+    }
+    out[len] = '\0';
+    return (int)len;
 }
 
 int extract_id(const char* json) {
@@ -143,32 +2992,618 @@ int extract_id(const char* json) {
     return atoi(id_start);
 }
 
-int main() {
-    send_initialization();
+// Codec picked from the client's "compression":[...] offer in initialize
+int requested_codec(const char *line) {
+    const char *offer = strstr(line, "\"compression\":[");
+    if (!offer) return CODEC_NONE;
+    const char *end = strchr(offer, ']');
+    const char *lz4 = strstr(offer, "\"lz4\"");
+    return lz4 && end && lz4 < end ? CODEC_LZ4 : CODEC_NONE;
+}
+
+// Reads the optional list_files arguments; -1 if one is invalid
+int parse_list_options(const char *line, list_options *opts) {
+    static const mode_t types[] = { S_IFREG, S_IFDIR, S_IFLNK, S_IFCHR, S_IFBLK, S_IFIFO, S_IFSOCK };
+    const fs_filter all = FS_FILTER_ALL;
+    memset(opts, 0, sizeof(*opts));
+    opts->filter = all;
+
+    char *sort = extract_string_value(line, "sort");
+    char *order = extract_string_value(line, "order");
+    char *type = extract_string_value(line, "type");
+    if (sort) {
+        if (strcmp(sort, "name") == 0) opts->sort = FS_SORT_NAME;
+        else if (strcmp(sort, "size") == 0) opts->sort = FS_SORT_SIZE;
+        else if (strcmp(sort, "modified") == 0) opts->sort = FS_SORT_MODIFIED;
+        else return -1;
+    }
+    if (order) {
+        if (strcmp(order, "desc") == 0) opts->descending = 1;
+        else if (strcmp(order, "asc") != 0) return -1;
+    }
+    if (type) {
+        for (size_t i = 0; i < sizeof(types) / sizeof(types[0]) && !opts->filter.type; i++) {
+            if (strcmp(type, fs_file_type(types[i])) == 0) opts->filter.type = types[i];
+        }
+        if (!opts->filter.type) return -1;
+    }
+    opts->offset = extract_number(line, "offset", 0);
+    opts->limit = extract_number(line, "limit", -1);
+    opts->filter.min_size = extract_number(line, "min_size", INT64_MIN);
+    opts->filter.max_size = extract_number(line, "max_size", INT64_MAX);
+    opts->filter.modified_after = extract_number(line, "modified_after", INT64_MIN);
+    opts->filter.modified_before = extract_number(line, "modified_before", INT64_MAX);
+    if (opts->offset < 0) return -1;
+    opts->content_type = strstr(line, "\"content_type\":true") != NULL;
+    opts->ignore_case = strstr(line, "\"ignore_case\":true") != NULL;
+    opts->dictionary = strstr(line, "\"dictionary\":true") != NULL;
+    opts->track = strstr(line, "\"track\":true") != NULL;
+    if (extract_string_into(line, "since", opts->since, sizeof(opts->since)) == -2) return -1;
+    if (extract_string_into(line, "pattern", opts->pattern, sizeof(opts->pattern)) == -2) return -1;
+    if (extract_string_into(line, "regex", opts->regex, sizeof(opts->regex)) == -2) return -1;
+
+    opts->buffered = sort || order || type || opts->offset > 0 || opts->limit >= 0 ||
+                     memcmp(&opts->filter, &all, sizeof(all)) != 0;
+    return 0;
+}
+
+void handle_request(char *line) {
+    if (line[strspn(line, " \t")] == '[') {
+        handle_batch(line);
+        return;
+    }
+    timer_start();
+    int id = extract_id(line);
+    PROBE_REQUEST_START(id, line);
     
-    char buffer[4096];
-    while (fgets(buffer, sizeof(buffer), stdin)) {
-        buffer[strcspn(buffer, "\n")] = 0;
-        
-        int id = extract_id(buffer);
-        
-        if (strstr(buffer, "\"method\":\"tools/list\"")) {
-            send_tools_list(id);
-        }
-        else if (strstr(buffer, "\"name\":\"list_files\"")) {
-            char *directory = extract_string_value(buffer, "directory");
-            if (directory) {
-                handle_list_files(id, directory);
-                free(directory);
-            } else {
-                send_error(id, "invalid_params", "Missing directory parameter");
+    if (strstr(line, "\"method\":\"shm/release\"")) {
+        request_timer.method = METHOD_SHM_RELEASE;
+        long long offset = extract_number(line, "offset", -1);
+        phase_mark(PHASE_PARSE);
+        shm_release(offset);
+    }
+    else if (strstr(line, "\"method\":\"tools/list\"")) {
+        request_timer.method = METHOD_TOOLS_LIST;
+        phase_mark(PHASE_PARSE);
+        send_tools_list(id);
+    }
+    else if (strstr(line, "\"name\":\"list_files\"")) {
+        request_timer.method = METHOD_LIST_FILES;
+        char *directory = extract_string_value(line, "directory");
+        list_options opts;
+        int valid = parse_list_options(line, &opts);
+        stream_begin(id, line);
+        phase_mark(PHASE_PARSE);
+        if (!directory) {
+            send_error(id, "invalid_params", "Missing directory parameter");
+        } else if (valid != 0) {
+            send_error(id, "invalid_params", "Invalid sort, order, type, offset, pattern or regex");
+        } else {
+            handle_list_files(id, directory, &opts);
+        }
+    }
+    else if (strstr(line, "\"name\":\"get_metrics\"")) {
+        request_timer.method = METHOD_GET_METRICS;
+        phase_mark(PHASE_PARSE);
+        handle_get_metrics(id);
+    }
+    else if (strstr(line, "\"name\":\"hash_files\"")) {
+        request_timer.method = METHOD_HASH_FILES;
+        char *directory = extract_string_value(line, "directory");
+        phase_mark(PHASE_PARSE);
+        if (!directory) {
+            send_error(id, "invalid_params", "Missing directory parameter");
+        } else {
+            handle_hash_files(id, directory, line);
+        }
+    }
+    else if (strstr(line, "\"name\":\"find_duplicates\"")) {
+        request_timer.method = METHOD_FIND_DUPLICATES;
+        char *directory = extract_string_value(line, "directory");
+        long long min_size = extract_number(line, "min_size", 1);
+        long long limit = extract_number(line, "limit", -1);
+        int hidden = strstr(line, "\"include_hidden\":false") == NULL;
+        phase_mark(PHASE_PARSE);
+        if (!directory) {
+            send_error(id, "invalid_params", "Missing directory parameter");
+        } else {
+            handle_find_duplicates(id, directory, min_size, limit, hidden);
+        }
+    }
+    else if (strstr(line, "\"name\":\"diff_snapshots\"")) {
+        request_timer.method = METHOD_DIFF_SNAPSHOTS;
+        char *old_file = extract_string_value(line, "old");
+        char *new_file = extract_string_value(line, "new");
+        long long limit = extract_number(line, "limit", DIFF_DEFAULT_LIMIT);
+        phase_mark(PHASE_PARSE);
+        if (!old_file || !new_file) {
+            send_error(id, "invalid_params", "Missing old or new parameter");
+        } else {
+            handle_diff_snapshots(id, old_file, new_file, limit);
+        }
+    }
+    else if (strstr(line, "\"name\":\"render_for_llm\"")) {
+        request_timer.method = METHOD_RENDER_FOR_LLM;
+        char *directory = extract_string_value(line, "directory");
+        list_options opts;
+        int valid = parse_list_options(line, &opts);
+        long long budget = extract_number(line, "token_budget", RENDER_DEFAULT_BUDGET);
+        phase_mark(PHASE_PARSE);
+        if (!directory) {
+            send_error(id, "invalid_params", "Missing directory parameter");
+        } else if (valid != 0) {
+            send_error(id, "invalid_params", "Invalid sort, order, type, offset, pattern or regex");
+        } else {
+            handle_render_for_llm(id, directory, &opts, budget);
+        }
+    }
+    else if (strstr(line, "\"name\":\"sample_files\"")) {
+        request_timer.method = METHOD_SAMPLE_FILES;
+        char *directory = extract_string_value(line, "directory");
+        long long sample_size = extract_number(line, "sample_size", SAMPLE_DEFAULT);
+        uint64_t seed = (uint64_t)extract_number(line, "seed", (long long)fs_now_ns());
+        phase_mark(PHASE_PARSE);
+        if (!directory) {
+            send_error(id, "invalid_params", "Missing directory parameter");
+        } else {
+            handle_sample_files(id, directory, sample_size, seed);
+        }
+    }
+    else if (strstr(line, "\"method\":\"initialize\"")) {
+        request_timer.method = METHOD_INITIALIZE;
+        phase_mark(PHASE_PARSE);
+        int codec = requested_codec(line);
+        fs_buf_printf(&response, "{\"jsonrpc\":\"2.0\",\"id\":%d,\"result\":{\"protocolVersion\":\"2024-11-05\",\"capabilities\":{\"tools\":{\"listChanged\":true}%s},\"serverInfo\":{\"name\":\"FileSavantAI\",\"version\":\"1.0.0\"}}}\n",
+                      id, codec == CODEC_LZ4 ? ",\"experimental\":{\"compression\":\"lz4\"}" : "");
+        send_response(id);
+        // Responses after this one use it; a repeated initialize can turn it off again
+        if (current_conn) current_conn->codec = codec;
+        else stdio_codec = codec;
+    }
+    PROBE_REQUEST_DONE(id, method_names[request_timer.method]);
+    timer_finish();
+    fs_arena_reset(&request_arena);
+}
+
+/**
+ * @brief One element of a JSON-RPC batch
+ */
+typedef struct {
+    char *line;         // the element, NUL-terminated in place; NULL: not an object
+    fs_buf *out;        // response buffer of the thread that ran it
+    size_t start;
+    size_t len;         // 0: a notification, nothing to answer
+} batch_item;
+
+/**
+ * @brief The batch being answered; keeps its capacity between batches
+ *
+ * Elements run concurrently on batch_pool, each rendering into the
+ * thread-local response of whichever thread picked it up. Those buffers
+ * are reused from batch to batch, and the single reply is stitched
+ * together from them in request order.
+ */
+struct {
+    batch_item *items;
+    size_t count;
+    size_t cap;
+    fs_buf joined;      // assembled reply; swapped into response to send it
+} batch;
+
+void send_null_id_error(const char *code, const char *message) {
+    fs_buf_printf(&response, "{\"jsonrpc\":\"2.0\",\"id\":null,\"error\":{\"code\":\"%s\",\"message\":\"%s\"}}\n",
+                  code, message);
+    send_response(-1);
+}
+
+// End of the JSON value starting at p: just past a closing bracket, or at the
+// ',' or ']' after a scalar; NULL if the value is empty or never closes
+char* batch_value_end(char *p) {
+    char *start = p;
+    int depth = 0, in_string = 0;
+    for (; *p; p++) {
+        if (in_string) {
+            if (*p == '\\' && p[1]) p++;
+            else if (*p == '"') in_string = 0;
+        } else if (*p == '"') {
+            in_string = 1;
+        } else if (*p == '{' || *p == '[') {
+            depth++;
+        } else if (*p == '}' || *p == ']') {
+            if (depth == 0) break;    // the batch's own ']'
+            if (--depth == 0) return p + 1;
+        } else if (*p == ',' && depth == 0) {
+            break;
+        }
+    }
+    return depth == 0 && !in_string && p > start ? p : NULL;
+}
+
+void batch_run(void *ctx, size_t i) {
+    (void)ctx;
+    batch_item *item = &batch.items[i];
+    in_batch = 1;
+    item->out = &response;
+    item->start = response.len;
+    if (item->line) handle_request(item->line);
+    else send_null_id_error("invalid_request", "Batch element is not an object");
+    item->len = response.len - item->start;
+    in_batch = 0;
+}
+
+/**
+ * @brief Answers a JSON-RPC batch array with one array of responses
+ *
+ * Elements are split in place, run concurrently, and answered in request
+ * order; notifications contribute nothing, and a batch of only
+ * notifications gets no reply at all.
+ */
+void handle_batch(char *line) {
+    timer_start();
+    request_timer.method = METHOD_BATCH;
+    batch.count = 0;
+
+    char *p = line + strspn(line, " \t") + 1;
+    p += strspn(p, " \t\r");
+    int empty = *p == ']';
+    int valid = !empty;
+    while (valid) {
+        char *end = batch_value_end(p);
+        if (!end) {
+            valid = 0;
+            break;
+        }
+        if (batch.count == batch.cap) {
+            size_t cap = batch.cap ? 2 * batch.cap : 64;
+            batch_item *grown = realloc(batch.items, cap * sizeof(batch_item));
+            if (!grown) {
+                valid = 0;
+                break;
+            }
+            batch.items = grown;
+            batch.cap = cap;
+        }
+        batch.items[batch.count++] = (batch_item){ *p == '{' ? p : NULL, NULL, 0, 0 };
+
+        char *next = end + strspn(end, " \t\r");
+        char separator = *next;
+        *end = '\0';
+        if (separator == ']') break;
+        if (separator != ',') valid = 0;
+        p = next + 1;
+        p += strspn(p, " \t\r");
+    }
+    phase_mark(PHASE_PARSE);
+    if (!valid) {
+        send_null_id_error(empty ? "invalid_request" : "parse_error", empty ? "Empty batch" : "Malformed batch");
+        timer_finish();
+        return;
+    }
+
+    // Elements time themselves; the batch clock picks up again once they are done
+    phase_clock clock = request_timer;
+    pthread_once(&batch_pool_once, start_batch_pool);
+    fs_pool_run(batch_pool, batch.count, batch_run, NULL);
+    request_timer = clock;
+    request_timer.mark = fs_now_ns();
+
+    fs_buf *joined = &batch.joined;
+    joined->len = 0;
+    fs_buf_putc(joined, '[');
+    for (size_t i = 0; i < batch.count; i++) {
+        batch_item *item = &batch.items[i];
+        if (item->len == 0) continue;
+        size_t len = item->len;
+        if (item->out->data[item->start + len - 1] == '\n') len--;
+        if (joined->len > 1) fs_buf_putc(joined, ',');
+        fs_buf_append(joined, item->out->data + item->start, len);
+    }
+    for (size_t i = 0; i < batch.count; i++) {
+        if (batch.items[i].out) batch.items[i].out->len = 0;
+    }
+    if (joined->len > 1) {
+        fs_buf_append(joined, "]\n", 2);
+        fs_buf swap = response;
+        response = *joined;
+        *joined = swap;
+        send_response(-1);
+    }
+    timer_finish();
+}
+
+#ifdef __linux__
+int epoll_fd = -1;
+int spare_fd = -1;    // given up to accept, and hang up on, a client when descriptors run out
+
+void conn_update_events(connection *c) {
+    struct epoll_event ev = {0};
+    ev.events = (c->paused || c->eof ? 0 : EPOLLIN) | (c->out_sent < c->out.len ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+void conn_close(connection *c) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->in);
+    free(c->out.data);
+    free(c);
+}
+
+// Writes as much queued output as the socket takes; -1 if the peer is gone
+int conn_write(connection *c) {
+    while (c->out_sent < c->out.len) {
+        ssize_t n = write(c->fd, c->out.data + c->out_sent, c->out.len - c->out_sent);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        c->out_sent += n;
+    }
+    if (c->out_sent == c->out.len) {
+        c->out.len = 0;
+        c->out_sent = 0;
+    }
+    return 0;
+}
+
+void conn_flush(connection *c) {
+    conn_write(c);    // errors surface as EPOLLERR/EPOLLHUP on the next wait
+    if (c->out.len - c->out_sent > CONN_HIGH_WATER) c->paused = 1;
+}
+
+// Waits for a slow reader mid-request, so a streamed listing never queues more than
+// CONN_HIGH_WATER. Every other client waits with it, so a reader that takes nothing
+// for CONN_STALL_MS is dropped: its queue is discarded and it closes after the request.
+void conn_drain(connection *c) {
+    for (;;) {
+        int failed = conn_write(c) != 0;
+        if (!failed && c->out.len - c->out_sent <= CONN_HIGH_WATER) break;
+        struct pollfd pfd = { c->fd, POLLOUT, 0 };
+        int ready = failed ? 0 : poll(&pfd, 1, CONN_STALL_MS);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0) {
+            c->dropped = 1;
+            c->out.len = c->out_sent = 0;
+            return;
+        }
+    }
+    // The queue rarely empties while chunks keep coming; reclaim the sent half
+    if (c->out_sent > c->out.len / 2) {
+        memmove(c->out.data, c->out.data + c->out_sent, c->out.len - c->out_sent);
+        c->out.len -= c->out_sent;
+        c->out_sent = 0;
+    }
+}
+
+// Runs every complete line buffered so far, unless the client is paused
+void conn_process(connection *c) {
+    size_t start = 0;
+    while (!c->paused && !c->dropped) {
+        char *nl = memchr(c->in + start, '\n', c->in_len - start);
+        if (!nl) break;
+        *nl = '\0';
+        current_conn = c;
+        handle_request(c->in + start);
+        current_conn = NULL;
+        start = nl - c->in + 1;
+    }
+    memmove(c->in, c->in + start, c->in_len - start);
+    c->in_len -= start;
+}
+
+// Returns -1 when the connection should be closed; end of input only sets eof,
+// since a client that shut down its write side still waits for the answers
+int conn_read(connection *c) {
+    for (;;) {
+        if (c->in_len == MAX_REQUEST_LINE) return -1;    // oversized request
+        ssize_t n = read(c->fd, c->in + c->in_len, MAX_REQUEST_LINE - c->in_len);
+        if (n == 0) {
+            c->eof = 1;
+            if (c->in_len > 0 && c->in[c->in_len - 1] != '\n') {
+                c->in[c->in_len++] = '\n';    // a last line without a newline, as fgets() reads it
+                conn_process(c);
+            }
+            return 0;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        c->in_len += n;
+        conn_process(c);
+        if (c->paused || c->dropped) return 0;
+    }
+}
+
+void accept_clients(int listen_fd) {
+    for (;;) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if ((errno == EMFILE || errno == ENFILE) && spare_fd >= 0) {
+                // The client stays queued and epoll keeps reporting it: turn it away instead.
+                // The fd is allocated before the queue is checked, so the queue may be empty
+                close(spare_fd);
+                fd = accept(listen_fd, NULL, NULL);
+                if (fd >= 0) close(fd);
+                spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                if (fd < 0) return;
+                continue;
+            }
+            return;
+        }
+
+        connection *c = calloc(1, sizeof(connection));
+        char *in = malloc(MAX_REQUEST_LINE);
+        if (!c || !in) {
+            free(c);
+            free(in);
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->in = in;
+
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            close(fd);
+            free(in);
+            free(c);
+            continue;
+        }
+
+        current_conn = c;
+        send_initialization();
+        current_conn = NULL;
+        conn_update_events(c);
+    }
+}
+
+int serve_socket(const char *path) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    unlink(path);    // stale socket from a previous run
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listen_fd, SOMAXCONN) != 0) {
+        perror(path);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;    // NULL marks the listening socket
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+    struct epoll_event events[MAX_EVENTS];
+    for (;;) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            return 1;
+        }
+        for (int i = 0; i < n; i++) {
+            connection *c = events[i].data.ptr;
+            if (!c) {
+                accept_clients(listen_fd);
+                continue;
+            }
+
+            int closing = (events[i].events & EPOLLERR) != 0;
+            if (!closing && (events[i].events & EPOLLOUT)) {
+                closing = conn_write(c) != 0;
+                if (c->paused && c->out.len - c->out_sent < CONN_LOW_WATER) {
+                    c->paused = 0;
+                    conn_process(c);    // requests that arrived while paused
+                }
+            }
+            if (!closing && !c->paused && !c->eof && (events[i].events & EPOLLIN)) {
+                closing = conn_read(c) != 0;
+            }
+            if (!closing && (events[i].events & EPOLLHUP)) {
+                // Hung up both ways: flush what we can; the write fails if nobody reads it
+                c->eof = 1;
+                closing = conn_write(c) != 0 || c->out_sent < c->out.len;
             }
+            // Requests still buffered behind a pause run before an ended connection closes
+            if (!closing && c->eof && !c->paused && c->out_sent == c->out.len) closing = 1;
+            if (c->dropped) closing = 1;
+
+            if (closing) conn_close(c);
+            else conn_update_events(c);
+        }
+    }
+}
+#else
+void conn_flush(connection *c) {
+    (void)c;
+}
+
+void conn_drain(connection *c) {
+    (void)c;
+}
+
+int serve_socket(const char *path) {
+    fprintf(stderr, "--listen %s: socket daemon mode requires Linux (epoll)\n", path);
+    return 1;
+}
+#endif
+
+int main(int argc, char *argv[]) {
+    int shm_socket = -1;
+    size_t shm_size = SHM_DEFAULT_SIZE;
+    const char *listen_path = NULL;
+    unsigned metrics_interval = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--shm-socket=", 13) == 0) {
+            shm_socket = atoi(argv[i] + 13);
+        } else if (strncmp(argv[i], "--shm-size=", 11) == 0) {
+            shm_size = strtoull(argv[i] + 11, NULL, 10);
+        } else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+            listen_path = argv[++i];
+        } else if (strncmp(argv[i], "--metrics-interval=", 19) == 0) {
+            metrics_interval = (unsigned)atoi(argv[i] + 19);
+        } else if (strncmp(argv[i], "--cache-mb=", 11) == 0) {
+            result_cache.budget = strtoull(argv[i] + 11, NULL, 10) * 1024 * 1024;
+        } else if (strcmp(argv[i], "--zero-copy") == 0) {
+            zero_copy = 1;
+        } else if (strncmp(argv[i], "--delta-mb=", 11) == 0) {
+            delta_store.budget = strtoull(argv[i] + 11, NULL, 10) * 1024 * 1024;
+        } else if (strncmp(argv[i], "--io-threads=", 13) == 0) {
+            io_threads = atoi(argv[i] + 13);
+        } else if (strncmp(argv[i], "--batch-threads=", 16) == 0) {
+            batch_threads = atoi(argv[i] + 16);
+        } else if (strncmp(argv[i], "--sniff-budget-ms=", 18) == 0) {
+            sniff_budget_ns = strtoull(argv[i] + 18, NULL, 10) * 1000000ull;
+        } else {
+            fprintf(stderr, "Usage: %s [--shm-socket=FD] [--shm-size=BYTES] [--listen SOCKET_PATH] "
+                            "[--metrics-interval=SECONDS] [--cache-mb=N] [--delta-mb=N] [--io-threads=N] "
+                            "[--batch-threads=N] [--sniff-budget-ms=N] [--zero-copy]\n", argv[0]);
+            return 2;
         }
-        else if (strstr(buffer, "\"method\":\"initialize\"")) {
-            printf("{\"jsonrpc\":\"2.0\",\"id\":%d,\"result\":{\"protocolVersion\":\"2024-11-05\",\"capabilities\":{\"tools\":{\"listChanged\":true}},\"serverInfo\":{\"name\":\"FileSavantAI\",\"version\":\"1.0.0\"}}}\n", id);
-            fflush(stdout);
+    }
+
+    metrics_start_ns = fs_now_ns();
+    pthread_t dump_thread;
+    if (metrics_interval > 0 &&
+        pthread_create(&dump_thread, NULL, metrics_dump_thread, &metrics_interval) == 0) {
+        pthread_detach(dump_thread);
+    }
+
+    if (listen_path) {
+        return serve_socket(listen_path);
+    }
+
+    if (shm_socket >= 0) {
+        if (shm_init(shm_socket, shm_size) != 0) {
+            perror("shared-memory transport");
+            return 1;
         }
+        close(shm_socket);
+    }
+
+    send_initialization();
+    
+    char buffer[MAX_REQUEST_LINE];
+    while (fgets(buffer, sizeof(buffer), stdin)) {
+        buffer[strcspn(buffer, "\n")] = 0;
+        handle_request(buffer);
     }
     
     return 0;
-}
\ No newline at end of file
+}
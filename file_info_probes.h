@@ -0,0 +1,40 @@
+#ifndef FILE_INFO_PROBES_H
+#define FILE_INFO_PROBES_H
+
+// USDT probes for file_info_mcp_server (provider "filesavant")
+//
+// With systemtap's <sys/sdt.h> each probe is a single nop plus an ELF note
+// that bpftrace/perf can attach to at run time; without the header, or with
+// -DFILESAVANT_NO_PROBES, every probe compiles to nothing.
+//
+//   request__start(int id, const char *request_line)
+//   request__done(int id, const char *method)
+//   dir__open(const char *directory, int ok)
+//   entry__stat(const char *directory, const char *name, long long size)
+//   entry__done(const char *directory, size_t response_bytes)
+//   flush(int id, size_t bytes, int transport)    0 stdio, 1 shm, 2 socket
+
+#if !defined(FILESAVANT_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define FILESAVANT_PROBES 1
+#endif
+#endif
+
+#ifdef FILESAVANT_PROBES
+#define PROBE_REQUEST_START(id, method)         DTRACE_PROBE2(filesavant, request__start, id, method)
+#define PROBE_REQUEST_DONE(id, method)          DTRACE_PROBE2(filesavant, request__done, id, method)
+#define PROBE_DIR_OPEN(directory, ok)           DTRACE_PROBE2(filesavant, dir__open, directory, ok)
+#define PROBE_ENTRY_STAT(directory, name, size) DTRACE_PROBE3(filesavant, entry__stat, directory, name, size)
+#define PROBE_ENTRY_DONE(directory, bytes)      DTRACE_PROBE2(filesavant, entry__done, directory, bytes)
+#define PROBE_FLUSH(id, bytes, transport)       DTRACE_PROBE3(filesavant, flush, id, bytes, transport)
+#else
+#define PROBE_REQUEST_START(id, method)         do { } while (0)
+#define PROBE_REQUEST_DONE(id, method)          do { } while (0)
+#define PROBE_DIR_OPEN(directory, ok)           do { } while (0)
+#define PROBE_ENTRY_STAT(directory, name, size) do { } while (0)
+#define PROBE_ENTRY_DONE(directory, bytes)      do { } while (0)
+#define PROBE_FLUSH(id, bytes, transport)       do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,302 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "libfilesavant.h"
+
+// _filesavant - in-process directory listing for ai_integration.py
+
+/**
+ * @brief Fixed-width record exported through the buffer protocol (format "14q")
+ *
+ * name_offset/name_length index into EntryArray.names (UTF-8 bytes).
+ */
+typedef struct {
+    int64_t size;
+    int64_t uid;
+    int64_t gid;
+    int64_t mode;
+    int64_t modified;
+    int64_t accessed;
+    int64_t changed;
+    int64_t inode;
+    int64_t device;
+    int64_t hard_links;
+    int64_t block_size;
+    int64_t blocks;
+    int64_t name_offset;
+    int64_t name_length;
+} fs_record;
+
+#define RECORD_FORMAT "14q"
+
+static const char *record_fields[] = {
+    "size", "uid", "gid", "mode", "modified", "accessed", "changed", "inode",
+    "device", "hard_links", "block_size", "blocks", "name_offset", "name_length",
+};
+
+// Same keys, in the same order, as the JSON objects from list_files
+static const char *entry_fields[] = {
+    "name", "path", "size", "owner", "group", "uid", "gid", "permissions",
+    "permissions_readable", "type", "modified", "accessed", "changed", "inode",
+    "device", "hard_links", "block_size", "blocks",
+};
+
+typedef struct {
+    fs_record *records;
+    size_t count;
+    size_t cap;
+    fs_buf names;
+} listing;
+
+static void listing_free(listing *l) {
+    PyMem_RawFree(l->records);
+    fs_buf_free(&l->names);
+}
+
+// Reads the whole directory without touching Python objects (GIL released)
+static int collect(const char *directory, int flags, listing *out) {
+    fs_dir *dir = fs_dir_open(directory, flags);
+    if (!dir) return -1;
+
+    const fs_entry *entry;
+    while ((entry = fs_dir_next(dir))) {
+        if (out->count == out->cap) {
+            size_t cap = out->cap ? out->cap * 2 : 256;
+            fs_record *records = PyMem_RawRealloc(out->records, cap * sizeof(fs_record));
+            if (!records) {
+                fs_dir_close(dir);
+                errno = ENOMEM;
+                return -1;
+            }
+            out->records = records;
+            out->cap = cap;
+        }
+
+        const struct stat *st = &entry->st;
+        fs_record *r = &out->records[out->count++];
+        size_t name_length = strlen(entry->name);
+        r->size = st->st_size;
+        r->uid = st->st_uid;
+        r->gid = st->st_gid;
+        r->mode = st->st_mode;
+        r->modified = st->st_mtime;
+        r->accessed = st->st_atime;
+        r->changed = st->st_ctime;
+        r->inode = (int64_t)st->st_ino;
+        r->device = (int64_t)st->st_dev;
+        r->hard_links = (int64_t)st->st_nlink;
+        r->block_size = st->st_blksize;
+        r->blocks = st->st_blocks;
+        r->name_offset = (int64_t)out->names.len;
+        r->name_length = (int64_t)name_length;
+        fs_buf_append(&out->names, entry->name, name_length);
+    }
+    fs_dir_close(dir);
+    return 0;
+}
+
+static int collect_or_raise(const char *directory, int hidden, listing *out) {
+    int rc;
+    memset(out, 0, sizeof(*out));
+    Py_BEGIN_ALLOW_THREADS
+    rc = collect(directory, hidden ? FS_LIST_HIDDEN : 0, out);
+    Py_END_ALLOW_THREADS
+    if (rc != 0) {
+        listing_free(out);
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, directory);
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject* entry_tuple(const char *directory, const fs_record *r, const char *names) {
+    char permissions[11];
+    char octal[8];
+    char device[32];
+    fs_format_permissions((mode_t)r->mode, permissions);
+    snprintf(octal, sizeof(octal), "%03o", (unsigned int)(r->mode & 0777));
+    snprintf(device, sizeof(device), "%lld", (long long)r->device);
+
+    PyObject *name = PyUnicode_DecodeFSDefaultAndSize(names + r->name_offset, r->name_length);
+    if (!name) return NULL;
+    PyObject *path = strcmp(directory, ".") == 0 ?
+        (Py_INCREF(name), name) : PyUnicode_FromFormat("%s/%U", directory, name);
+    if (!path) {
+        Py_DECREF(name);
+        return NULL;
+    }
+
+    return Py_BuildValue("(NNLssLLsssLLLKsLLL)",
+                         name, path, (long long)r->size,
+                         fs_user_name((uid_t)r->uid), fs_group_name((gid_t)r->gid),
+                         (long long)r->uid, (long long)r->gid, octal, permissions,
+                         fs_file_type((mode_t)r->mode),
+                         (long long)r->modified, (long long)r->accessed, (long long)r->changed,
+                         (unsigned long long)r->inode, device, (long long)r->hard_links,
+                         (long long)r->block_size, (long long)r->blocks);
+}
+
+static PyObject* py_list_dir(PyObject *self, PyObject *args, PyObject *kwargs) {
+    (void)self;
+    static char *keywords[] = {"directory", "hidden", NULL};
+    const char *directory = ".";
+    int hidden = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|sp", keywords, &directory, &hidden)) return NULL;
+
+    listing l;
+    if (collect_or_raise(directory, hidden, &l) != 0) return NULL;
+
+    PyObject *result = PyList_New((Py_ssize_t)l.count);
+    for (size_t i = 0; result && i < l.count; i++) {
+        PyObject *item = entry_tuple(directory, &l.records[i], l.names.data);
+        if (!item) {
+            Py_CLEAR(result);
+            break;
+        }
+        PyList_SET_ITEM(result, (Py_ssize_t)i, item);
+    }
+    listing_free(&l);
+    return result;
+}
+
+/**
+ * @brief EntryArray: records as a buffer-protocol struct array plus a names blob
+ */
+typedef struct {
+    PyObject_HEAD
+    listing l;
+    PyObject *names;
+    Py_ssize_t shape[1];
+    Py_ssize_t strides[1];
+} EntryArray;
+
+static void EntryArray_dealloc(EntryArray *self) {
+    Py_XDECREF(self->names);
+    listing_free(&self->l);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int EntryArray_getbuffer(EntryArray *self, Py_buffer *view, int flags) {
+    if (flags & PyBUF_WRITABLE) {
+        PyErr_SetString(PyExc_BufferError, "EntryArray is read-only");
+        return -1;
+    }
+    view->obj = (PyObject *)self;
+    Py_INCREF(self);
+    view->buf = self->l.records;
+    view->len = (Py_ssize_t)(self->l.count * sizeof(fs_record));
+    view->readonly = 1;
+    view->itemsize = sizeof(fs_record);
+    view->format = (flags & PyBUF_FORMAT) ? RECORD_FORMAT : NULL;
+    view->ndim = 1;
+    view->shape = (flags & PyBUF_ND) ? self->shape : NULL;
+    view->strides = (flags & PyBUF_STRIDES) ? self->strides : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    return 0;
+}
+
+static Py_ssize_t EntryArray_length(EntryArray *self) {
+    return (Py_ssize_t)self->l.count;
+}
+
+static PyBufferProcs EntryArray_as_buffer = {
+    .bf_getbuffer = (getbufferproc)EntryArray_getbuffer,
+};
+
+static PySequenceMethods EntryArray_as_sequence = {
+    .sq_length = (lenfunc)EntryArray_length,
+};
+
+static PyObject* EntryArray_get_names(EntryArray *self, void *closure) {
+    (void)closure;
+    Py_INCREF(self->names);
+    return self->names;
+}
+
+static PyGetSetDef EntryArray_getset[] = {
+    {"names", (getter)EntryArray_get_names, NULL, "Concatenated entry names (bytes)", NULL},
+    {NULL},
+};
+
+static PyTypeObject EntryArrayType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_filesavant.EntryArray",
+    .tp_basicsize = sizeof(EntryArray),
+    .tp_dealloc = (destructor)EntryArray_dealloc,
+    .tp_as_sequence = &EntryArray_as_sequence,
+    .tp_as_buffer = &EntryArray_as_buffer,
+    .tp_getset = EntryArray_getset,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Directory listing as packed " RECORD_FORMAT " records (see RECORD_FIELDS)",
+};
+
+static PyObject* py_list_dir_array(PyObject *self, PyObject *args, PyObject *kwargs) {
+    (void)self;
+    static char *keywords[] = {"directory", "hidden", NULL};
+    const char *directory = ".";
+    int hidden = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|sp", keywords, &directory, &hidden)) return NULL;
+
+    EntryArray *array = PyObject_New(EntryArray, &EntryArrayType);
+    if (!array) return NULL;
+    array->names = NULL;
+    if (collect_or_raise(directory, hidden, &array->l) != 0) {
+        memset(&array->l, 0, sizeof(array->l));
+        Py_DECREF(array);
+        return NULL;
+    }
+    array->names = PyBytes_FromStringAndSize(array->l.names.data, (Py_ssize_t)array->l.names.len);
+    fs_buf_free(&array->l.names);
+    array->shape[0] = (Py_ssize_t)array->l.count;
+    array->strides[0] = sizeof(fs_record);
+    if (!array->names) {
+        Py_DECREF(array);
+        return NULL;
+    }
+    return (PyObject *)array;
+}
+
+static PyObject* string_tuple(const char **items, size_t count) {
+    PyObject *tuple = PyTuple_New((Py_ssize_t)count);
+    for (size_t i = 0; tuple && i < count; i++) {
+        PyTuple_SET_ITEM(tuple, (Py_ssize_t)i, PyUnicode_FromString(items[i]));
+    }
+    return tuple;
+}
+
+static PyMethodDef filesavant_methods[] = {
+    {"list_dir", (PyCFunction)(void (*)(void))py_list_dir, METH_VARARGS | METH_KEYWORDS,
+     "list_dir(directory='.', hidden=False) -> list of tuples ordered as FIELDS"},
+    {"list_dir_array", (PyCFunction)(void (*)(void))py_list_dir_array, METH_VARARGS | METH_KEYWORDS,
+     "list_dir_array(directory='.', hidden=False) -> EntryArray of RECORD_FIELDS records"},
+    {NULL, NULL, 0, NULL},
+};
+
+static struct PyModuleDef filesavant_module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "_filesavant",
+    .m_doc = "In-process directory listing backed by libfilesavant",
+    .m_size = -1,
+    .m_methods = filesavant_methods,
+};
+
+PyMODINIT_FUNC PyInit__filesavant(void) {
+    if (PyType_Ready(&EntryArrayType) < 0) return NULL;
+
+    PyObject *module = PyModule_Create(&filesavant_module);
+    if (!module) return NULL;
+
+    Py_INCREF(&EntryArrayType);
+    if (PyModule_AddObject(module, "EntryArray", (PyObject *)&EntryArrayType) < 0 ||
+        PyModule_AddObject(module, "FIELDS", string_tuple(entry_fields, sizeof(entry_fields) / sizeof(entry_fields[0]))) < 0 ||
+        PyModule_AddObject(module, "RECORD_FIELDS", string_tuple(record_fields, sizeof(record_fields) / sizeof(record_fields[0]))) < 0 ||
+        PyModule_AddStringConstant(module, "RECORD_FORMAT", RECORD_FORMAT) < 0) {
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
+}
@@ -0,0 +1,284 @@
+#include "fs_blake3.h"
+
+#include <string.h>
+
+#define BLOCK_LEN 64
+#define CHUNK_START 1
+#define CHUNK_END 2
+#define PARENT 4
+#define ROOT 8
+#define LANES 8
+
+static const uint32_t IV[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+// Message word order for rounds 1..7 (the permutation applied cumulatively)
+static const uint8_t SCHEDULE[7][16] = {
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+    { 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+    { 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+    { 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+    { 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+    { 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+};
+
+static inline uint32_t load32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+#define G(v, a, b, c, d, x, y) do { \
+    v[a] = v[a] + v[b] + (x); v[d] = ROTR(v[d] ^ v[a], 16); \
+    v[c] = v[c] + v[d];       v[b] = ROTR(v[b] ^ v[c], 12); \
+    v[a] = v[a] + v[b] + (y); v[d] = ROTR(v[d] ^ v[a], 8);  \
+    v[c] = v[c] + v[d];       v[b] = ROTR(v[b] ^ v[c], 7);  \
+} while (0)
+
+#define ROUNDS(v, m) do { \
+    for (int r = 0; r < 7; r++) { \
+        const uint8_t *s = SCHEDULE[r]; \
+        G(v, 0, 4, 8, 12, m[s[0]], m[s[1]]); \
+        G(v, 1, 5, 9, 13, m[s[2]], m[s[3]]); \
+        G(v, 2, 6, 10, 14, m[s[4]], m[s[5]]); \
+        G(v, 3, 7, 11, 15, m[s[6]], m[s[7]]); \
+        G(v, 0, 5, 10, 15, m[s[8]], m[s[9]]); \
+        G(v, 1, 6, 11, 12, m[s[10]], m[s[11]]); \
+        G(v, 2, 7, 8, 13, m[s[12]], m[s[13]]); \
+        G(v, 3, 4, 9, 14, m[s[14]], m[s[15]]); \
+    } \
+} while (0)
+
+#define ROTR(x, n) rotr(x, n)
+
+// Full 16-word compression output; the chaining value is out[0..7]
+static void compress(const uint32_t cv[8], const uint8_t block[BLOCK_LEN], uint64_t counter,
+                     uint32_t block_len, uint32_t flags, uint32_t out[16]) {
+    uint32_t m[16];
+    for (int i = 0; i < 16; i++) m[i] = load32(block + 4 * i);
+    uint32_t v[16] = {
+        cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+        IV[0], IV[1], IV[2], IV[3],
+        (uint32_t)counter, (uint32_t)(counter >> 32), block_len, flags,
+    };
+    ROUNDS(v, m);
+    for (int i = 0; i < 8; i++) {
+        out[i] = v[i] ^ v[i + 8];
+        out[i + 8] = v[i + 8] ^ cv[i];
+    }
+}
+
+#undef ROTR
+
+typedef uint32_t u32xL __attribute__((vector_size(4 * LANES)));
+typedef uint8_t u8xL __attribute__((vector_size(4 * LANES)));
+
+// Rotations by whole bytes are one byte shuffle; 12 and 7 stay shift/or
+#define ROT_BYTES(x, ...) ((u32xL)__builtin_shuffle((u8xL)(x), (u8xL){ __VA_ARGS__ }))
+#define ROTR(x, n) \
+    ((n) == 16 ? ROT_BYTES(x, 2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13, \
+                             18, 19, 16, 17, 22, 23, 20, 21, 26, 27, 24, 25, 30, 31, 28, 29) : \
+     (n) == 8 ? ROT_BYTES(x, 1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12, \
+                            17, 18, 19, 16, 21, 22, 23, 20, 25, 26, 27, 24, 29, 30, 31, 28) : \
+     (((x) >> (n)) | ((x) << (32 - (n)))))
+
+#if defined(__x86_64__) && defined(__linux__) && !defined(__clang__)
+#define SIMD_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define SIMD_CLONES
+#endif
+
+#define SHUF(a, b, ...) __builtin_shuffle(a, b, (u32xL){ __VA_ARGS__ })
+
+// Eight rows (one per lane) of eight words become eight columns (one per word)
+static inline void transpose(u32xL r[8], u32xL c[8]) {
+    u32xL a[8], b[8];
+    for (int i = 0; i < 8; i += 2) {
+        a[i] = SHUF(r[i], r[i + 1], 0, 8, 1, 9, 4, 12, 5, 13);
+        a[i + 1] = SHUF(r[i], r[i + 1], 2, 10, 3, 11, 6, 14, 7, 15);
+    }
+    for (int i = 0; i < 8; i += 4) {
+        b[i] = SHUF(a[i], a[i + 2], 0, 1, 8, 9, 4, 5, 12, 13);
+        b[i + 1] = SHUF(a[i], a[i + 2], 2, 3, 10, 11, 6, 7, 14, 15);
+        b[i + 2] = SHUF(a[i + 1], a[i + 3], 0, 1, 8, 9, 4, 5, 12, 13);
+        b[i + 3] = SHUF(a[i + 1], a[i + 3], 2, 3, 10, 11, 6, 7, 14, 15);
+    }
+    for (int i = 0; i < 4; i++) {
+        c[i] = SHUF(b[i], b[i + 4], 0, 1, 2, 3, 8, 9, 10, 11);
+        c[i + 4] = SHUF(b[i], b[i + 4], 4, 5, 6, 7, 12, 13, 14, 15);
+    }
+}
+
+/**
+ * @brief Chaining values of LANES consecutive whole chunks, one chunk per lane
+ */
+SIMD_CLONES
+static void hash_chunks(const uint8_t *input, uint64_t counter, uint32_t cvs[LANES][8]) {
+    u32xL h[8], counter_lo, counter_hi;
+    for (int i = 0; i < 8; i++) {
+        for (int lane = 0; lane < LANES; lane++) h[i][lane] = IV[i];
+    }
+    for (int lane = 0; lane < LANES; lane++) {
+        counter_lo[lane] = (uint32_t)(counter + lane);
+        counter_hi[lane] = (uint32_t)((counter + lane) >> 32);
+    }
+
+    for (int b = 0; b < FS_BLAKE3_CHUNK_LEN / BLOCK_LEN; b++) {
+        u32xL m[16];
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        for (int half = 0; half < 2; half++) {
+            u32xL rows[8];
+            for (int lane = 0; lane < LANES; lane++) {
+                memcpy(&rows[lane], input + lane * FS_BLAKE3_CHUNK_LEN + b * BLOCK_LEN + 32 * half, 32);
+            }
+            transpose(rows, m + 8 * half);
+        }
+#else
+        for (int w = 0; w < 16; w++) {
+            for (int lane = 0; lane < LANES; lane++) {
+                m[w][lane] = load32(input + lane * FS_BLAKE3_CHUNK_LEN + b * BLOCK_LEN + 4 * w);
+            }
+        }
+#endif
+        uint32_t flags = (b == 0 ? CHUNK_START : 0) | (b == FS_BLAKE3_CHUNK_LEN / BLOCK_LEN - 1 ? CHUNK_END : 0);
+        u32xL v[16];
+        for (int i = 0; i < 8; i++) v[i] = h[i];
+        for (int i = 0; i < 4; i++) v[8 + i] = (u32xL){0} + IV[i];
+        v[12] = counter_lo;
+        v[13] = counter_hi;
+        v[14] = (u32xL){0} + BLOCK_LEN;
+        v[15] = (u32xL){0} + flags;
+        ROUNDS(v, m);
+        for (int i = 0; i < 8; i++) h[i] = v[i] ^ v[i + 8];
+    }
+
+    for (int lane = 0; lane < LANES; lane++) {
+        for (int i = 0; i < 8; i++) cvs[lane][i] = h[i][lane];
+    }
+}
+
+#undef ROTR
+
+static void parent_cv(const uint32_t left[8], const uint32_t right[8], uint32_t flags, uint32_t out[8]) {
+    uint8_t block[BLOCK_LEN];
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 4; j++) {
+            block[4 * i + j] = (uint8_t)(left[i] >> (8 * j));
+            block[32 + 4 * i + j] = (uint8_t)(right[i] >> (8 * j));
+        }
+    }
+    uint32_t full[16];
+    compress(IV, block, 0, BLOCK_LEN, PARENT | flags, full);
+    memcpy(out, full, 8 * sizeof(uint32_t));
+}
+
+// Completed subtrees merge as soon as their sibling exists; total_chunks counts new_cv's chunk
+static void add_chunk_cv(fs_blake3 *h, uint32_t new_cv[8], uint64_t total_chunks) {
+    while ((total_chunks & 1) == 0) {
+        h->cv_stack_len--;
+        parent_cv(h->cv_stack[h->cv_stack_len], new_cv, 0, new_cv);
+        total_chunks >>= 1;
+    }
+    memcpy(h->cv_stack[h->cv_stack_len++], new_cv, 8 * sizeof(uint32_t));
+}
+
+static void chunk_reset(fs_blake3 *h, uint64_t counter) {
+    memcpy(h->cv, IV, sizeof(h->cv));
+    h->chunk_counter = counter;
+    h->block_len = 0;
+    h->blocks_compressed = 0;
+}
+
+static size_t chunk_len(const fs_blake3 *h) {
+    return (size_t)h->blocks_compressed * BLOCK_LEN + h->block_len;
+}
+
+static uint32_t chunk_start_flag(const fs_blake3 *h) {
+    return h->blocks_compressed == 0 ? CHUNK_START : 0;
+}
+
+void fs_blake3_init(fs_blake3 *h) {
+    chunk_reset(h, 0);
+    h->cv_stack_len = 0;
+}
+
+void fs_blake3_update(fs_blake3 *h, const void *data, size_t len) {
+    const uint8_t *in = data;
+    while (len > 0) {
+        if (chunk_len(h) == FS_BLAKE3_CHUNK_LEN) {
+            // A full chunk is only finished once more input proves it is not the root
+            uint32_t out[16];
+            compress(h->cv, h->block, h->chunk_counter, h->block_len,
+                     chunk_start_flag(h) | CHUNK_END, out);
+            add_chunk_cv(h, out, h->chunk_counter + 1);
+            chunk_reset(h, h->chunk_counter + 1);
+        }
+        if (chunk_len(h) == 0) {
+            // Whole chunks with input still behind them: LANES at a time
+            while (len > LANES * FS_BLAKE3_CHUNK_LEN) {
+                uint32_t cvs[LANES][8];
+                hash_chunks(in, h->chunk_counter, cvs);
+                for (int lane = 0; lane < LANES; lane++) {
+                    add_chunk_cv(h, cvs[lane], h->chunk_counter + lane + 1);
+                }
+                chunk_reset(h, h->chunk_counter + LANES);
+                in += LANES * FS_BLAKE3_CHUNK_LEN;
+                len -= LANES * FS_BLAKE3_CHUNK_LEN;
+            }
+        }
+
+        size_t room = FS_BLAKE3_CHUNK_LEN - chunk_len(h);
+        size_t take = len < room ? len : room;
+        len -= take;
+        while (take > 0) {
+            if (h->block_len == BLOCK_LEN) {
+                uint32_t out[16];
+                compress(h->cv, h->block, h->chunk_counter, BLOCK_LEN, chunk_start_flag(h), out);
+                memcpy(h->cv, out, sizeof(h->cv));
+                h->blocks_compressed++;
+                h->block_len = 0;
+            }
+            size_t n = BLOCK_LEN - h->block_len;
+            if (n > take) n = take;
+            memcpy(h->block + h->block_len, in, n);
+            h->block_len += (uint8_t)n;
+            in += n;
+            take -= n;
+        }
+    }
+}
+
+void fs_blake3_final(const fs_blake3 *h, uint8_t out[FS_BLAKE3_OUT_LEN]) {
+    // The last chunk's output node, folded up the stack; the final node gets ROOT
+    uint32_t cv[8], full[16];
+    uint8_t block[BLOCK_LEN] = {0};
+    memcpy(block, h->block, h->block_len);
+    uint32_t block_len = h->block_len;
+    uint64_t counter = h->chunk_counter;
+    uint32_t flags = chunk_start_flag(h) | CHUNK_END;
+    memcpy(cv, h->cv, sizeof(cv));
+
+    for (int i = h->cv_stack_len; i > 0; i--) {
+        compress(cv, block, counter, block_len, flags, full);
+        for (int w = 0; w < 8; w++) {
+            for (int j = 0; j < 4; j++) {
+                block[4 * w + j] = (uint8_t)(h->cv_stack[i - 1][w] >> (8 * j));
+                block[32 + 4 * w + j] = (uint8_t)(full[w] >> (8 * j));
+            }
+        }
+        memcpy(cv, IV, sizeof(cv));
+        block_len = BLOCK_LEN;
+        counter = 0;
+        flags = PARENT;
+    }
+
+    compress(cv, block, counter, block_len, flags | ROOT, full);
+    for (int w = 0; w < 8; w++) {
+        for (int j = 0; j < 4; j++) out[4 * w + j] = (uint8_t)(full[w] >> (8 * j));
+    }
+}
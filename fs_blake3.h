@@ -0,0 +1,28 @@
+#ifndef FS_BLAKE3_H
+#define FS_BLAKE3_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// BLAKE3 (unkeyed, 32-byte output) for libfilesavant's content hashing.
+// Runs of whole 1 KB chunks are compressed eight at a time with GCC vector
+// extensions; everything else goes through the portable compression.
+
+#define FS_BLAKE3_OUT_LEN 32
+#define FS_BLAKE3_CHUNK_LEN 1024
+
+typedef struct {
+    uint32_t cv[8];               // chaining value of the current chunk
+    uint64_t chunk_counter;
+    uint8_t block[64];
+    uint8_t block_len;
+    uint8_t blocks_compressed;
+    uint8_t cv_stack_len;
+    uint32_t cv_stack[54][8];     // one per level of a 2^64-chunk tree
+} fs_blake3;
+
+void fs_blake3_init(fs_blake3 *h);
+void fs_blake3_update(fs_blake3 *h, const void *data, size_t len);
+void fs_blake3_final(const fs_blake3 *h, uint8_t out[FS_BLAKE3_OUT_LEN]);
+
+#endif
@@ -0,0 +1,102 @@
+#include "fs_lz4.h"
+
+#include <string.h>
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5       // a block always ends with at least this many literals
+#define MATCH_START_LIMIT 12  // ...and its last match starts at least this far from the end
+#define HASH_BITS 12
+#define MAX_OFFSET 65535
+#define STORED 0x80000000u    // block size flag: the data follows uncompressed
+
+// Magic 0x184D2204; FLG 0x60 (version 01, independent blocks); BD 0x40
+// (64 KB blocks); header checksum 0x82, the second byte of XXH32(FLG BD)
+static const uint8_t HEADER[FS_LZ4_HEADER_LEN] = { 0x04, 0x22, 0x4D, 0x18, 0x60, 0x40, 0x82 };
+
+static inline uint32_t load32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void store32le(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static inline uint32_t hash4(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Lengths of 15 and more continue in bytes of 255 and a final remainder
+static uint8_t* put_length(uint8_t *op, size_t len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Literals, then (unless match_len is 0) a match of match_len bytes offset back
+static uint8_t* put_sequence(uint8_t *op, const uint8_t *literals, size_t literal_len,
+                             size_t offset, size_t match_len) {
+    uint8_t *token = op++;
+    *token = (uint8_t)((literal_len < 15 ? literal_len : 15) << 4);
+    if (literal_len >= 15) op = put_length(op, literal_len - 15);
+    memcpy(op, literals, literal_len);
+    op += literal_len;
+    if (!match_len) return op;
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    size_t extra = match_len - MIN_MATCH;
+    *token |= (uint8_t)(extra < 15 ? extra : 15);
+    if (extra >= 15) op = put_length(op, extra - 15);
+    return op;
+}
+
+static size_t compress_block(const uint8_t *src, size_t n, uint8_t *dst) {
+    uint16_t table[1 << HASH_BITS];
+    memset(table, 0, sizeof(table));
+    const uint8_t *ip = src, *anchor = src, *end = src + n;
+    uint8_t *op = dst;
+    if (n > MATCH_START_LIMIT) {
+        const uint8_t *match_start_limit = end - MATCH_START_LIMIT;
+        const uint8_t *match_end_limit = end - LAST_LITERALS;
+        while (ip <= match_start_limit) {
+            uint32_t sequence = load32(ip);
+            uint32_t h = hash4(sequence);
+            const uint8_t *ref = src + table[h];
+            table[h] = (uint16_t)(ip - src);
+            if (ref >= ip || ip - ref > MAX_OFFSET || load32(ref) != sequence) {
+                ip += 1 + ((ip - anchor) >> 6);    // skip faster through incompressible runs
+                continue;
+            }
+            size_t len = MIN_MATCH;
+            while (ip + len < match_end_limit && ip[len] == ref[len]) len++;
+            op = put_sequence(op, anchor, ip - anchor, ip - ref, len);
+            ip = anchor = ip + len;
+        }
+    }
+    return put_sequence(op, anchor, end - anchor, 0, 0) - dst;
+}
+
+size_t fs_lz4_frame_header(uint8_t out[FS_LZ4_HEADER_LEN]) {
+    memcpy(out, HEADER, sizeof(HEADER));
+    return sizeof(HEADER);
+}
+
+size_t fs_lz4_frame_block(const void *src, size_t n, uint8_t *out) {
+    size_t len = compress_block(src, n, out + 4);
+    if (len >= n) {
+        memcpy(out + 4, src, n);
+        store32le(out, (uint32_t)n | STORED);
+        return 4 + n;
+    }
+    store32le(out, (uint32_t)len);
+    return 4 + len;
+}
+
+size_t fs_lz4_frame_end(uint8_t out[FS_LZ4_END_LEN]) {
+    memset(out, 0, FS_LZ4_END_LEN);
+    return FS_LZ4_END_LEN;
+}
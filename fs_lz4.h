@@ -0,0 +1,38 @@
+#ifndef FS_LZ4_H
+#define FS_LZ4_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// LZ4 frames (https://github.com/lz4/lz4/blob/dev/doc/lz4_Frame_format.md)
+// for the server's compressed responses. Blocks are independent and at most
+// 64 KB, so they can be compressed separately and concatenated; any LZ4
+// decoder (python-lz4's lz4.frame, the lz4 CLI) reads the result.
+
+#define FS_LZ4_BLOCK_MAX (64 * 1024)
+#define FS_LZ4_HEADER_LEN 7
+#define FS_LZ4_END_LEN 4
+
+// Room fs_lz4_frame_block() needs for a block of n bytes
+#define FS_LZ4_BLOCK_BOUND(n) (4 + (n) + (n) / 255 + 16)
+
+/**
+ * @brief Writes the frame header: 64 KB independent blocks, no checksums
+ */
+size_t fs_lz4_frame_header(uint8_t out[FS_LZ4_HEADER_LEN]);
+
+/**
+ * @brief Writes one block of n <= FS_LZ4_BLOCK_MAX bytes, with its size word
+ *
+ * Greedy LZ4 matching on a 4096-entry hash table; input that would not
+ * shrink is stored as is.
+ * @return Bytes written, at most FS_LZ4_BLOCK_BOUND(n)
+ */
+size_t fs_lz4_frame_block(const void *src, size_t n, uint8_t *out);
+
+/**
+ * @brief Writes the end mark that closes the frame
+ */
+size_t fs_lz4_frame_end(uint8_t out[FS_LZ4_END_LEN]);
+
+#endif
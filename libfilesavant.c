@@ -0,0 +1,2173 @@
+#define _GNU_SOURCE    // statx
+#include "libfilesavant.h"
+#include "fs_blake3.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <grp.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#define FS_PATH_MAX 2048
+#define FS_ARENA_BLOCK (64 * 1024)
+#define FS_DENTS_SIZE (32 * 1024)
+
+void fs_buf_reserve(fs_buf *b, size_t extra) {
+    if (b->len + extra <= b->cap) return;
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->len + extra) cap *= 2;
+    char *data = realloc(b->data, cap);
+    if (!data) {
+        perror("realloc");
+        exit(1);
+    }
+    b->data = data;
+    b->cap = cap;
+}
+
+void fs_buf_append(fs_buf *b, const void *data, size_t len) {
+    fs_buf_reserve(b, len);
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+void fs_buf_printf(fs_buf *b, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(b->data + b->len, b->cap - b->len, fmt, args);
+    va_end(args);
+
+    if (n >= 0 && (size_t)n >= b->cap - b->len) {
+        fs_buf_reserve(b, n + 1);
+        va_start(args, fmt);
+        vsnprintf(b->data + b->len, b->cap - b->len, fmt, args);
+        va_end(args);
+    }
+    if (n > 0) b->len += n;
+}
+
+void fs_buf_putc(fs_buf *b, char c) {
+    fs_buf_reserve(b, 1);
+    b->data[b->len++] = c;
+}
+
+void fs_buf_free(fs_buf *b) {
+    free(b->data);
+    b->data = NULL;
+    b->len = b->cap = 0;
+}
+
+// Copies src into dst as a JSON string body (no quotes), truncating to fit
+static const char* json_escape(char *dst, size_t cap, const char *src) {
+    size_t n = 0;
+    for (; *src && n + 7 < cap; src++) {
+        unsigned char c = (unsigned char)*src;
+        if (c == '"' || c == '\\') {
+            dst[n++] = '\\';
+            dst[n++] = c;
+        } else if (c < 0x20) {
+            n += snprintf(dst + n, cap - n, "\\u%04x", c);
+        } else {
+            dst[n++] = c;
+        }
+    }
+    dst[n] = '\0';
+    return dst;
+}
+
+void fs_buf_json_string(fs_buf *b, const char *s) {
+    char escaped[FS_PATH_MAX * 2];
+    fs_buf_printf(b, "\"%s\"", json_escape(escaped, sizeof(escaped), s));
+}
+
+struct fs_arena_block {
+    fs_arena_block *next;
+    size_t size;
+    char data[] __attribute__((aligned(16)));
+};
+
+void* fs_arena_alloc(fs_arena *a, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    fs_arena_block *b = a->blocks;
+    if (!b || a->used + size > b->size) {
+        size_t block = FS_ARENA_BLOCK;
+        while (block < size) block *= 2;
+        b = malloc(sizeof(fs_arena_block) + block);
+        if (!b) {
+            perror("malloc");
+            exit(1);
+        }
+        b->next = a->blocks;
+        b->size = block;
+        a->blocks = b;
+        a->used = 0;
+        a->total += block;
+    }
+    void *p = b->data + a->used;
+    a->used += size;
+    return p;
+}
+
+char* fs_arena_strndup(fs_arena *a, const char *s, size_t len) {
+    char *copy = fs_arena_alloc(a, len + 1);
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+void fs_arena_reset(fs_arena *a) {
+    if (a->blocks && a->blocks->next) {
+        // Outgrown: one block sized for the whole chain from now on
+        size_t total = a->total;
+        fs_arena_free(a);
+        fs_arena_alloc(a, total);
+    }
+    a->used = 0;
+}
+
+void fs_arena_free(fs_arena *a) {
+    while (a->blocks) {
+        fs_arena_block *next = a->blocks->next;
+        free(a->blocks);
+        a->blocks = next;
+    }
+    a->used = a->total = 0;
+}
+
+struct fs_dir {
+    DIR *dir;                   // NULL when reading with getdents64
+    int fd;
+    char *dents;                // getdents64 buffer (arena iterators on Linux)
+    size_t dents_len;
+    size_t dents_pos;
+    fs_arena *arena;            // non-NULL: this struct lives in the arena
+    int flags;
+    const char *directory;
+    size_t prefix_len;          // bytes of "directory/" kept in path
+    fs_entry entry;
+    fs_dir_times times;
+    const fs_glob *glob;        // names these reject are skipped before the stat
+    fs_regex *regex;
+    char path[];                // "directory/" plus room for any one name
+};
+
+#ifdef __linux__
+struct fs_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+uint64_t fs_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+fs_dir* fs_dir_open_in(const char *directory, int flags, fs_arena *arena) {
+    uint64_t start = (flags & FS_LIST_TIMED) ? fs_now_ns() : 0;
+    size_t prefix_len = strcmp(directory, ".") != 0 ? strlen(directory) + 1 : 0;
+    size_t size = sizeof(fs_dir) + prefix_len + NAME_MAX + 1;
+    fs_dir *dir = arena ? fs_arena_alloc(arena, size) : malloc(size);
+    if (!dir) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(dir, 0, sizeof(*dir));
+
+#ifdef __linux__
+    if (arena) {
+        // Arena memory is reclaimed by the next reset, so failure needs no cleanup
+        dir->fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir->fd < 0) return NULL;
+        dir->dents = fs_arena_alloc(arena, FS_DENTS_SIZE);
+    }
+#endif
+    if (!dir->dents) {
+        dir->dir = opendir(directory);
+        if (!dir->dir) {
+            int saved = errno;
+            if (!arena) free(dir);
+            errno = saved;
+            return NULL;
+        }
+        dir->fd = dirfd(dir->dir);
+    }
+
+    dir->arena = arena;
+    dir->flags = flags;
+    dir->directory = directory;
+    dir->prefix_len = prefix_len;
+    if (prefix_len) {
+        memcpy(dir->path, directory, prefix_len - 1);
+        dir->path[prefix_len - 1] = '/';
+    }
+    dir->path[prefix_len] = '\0';
+    dir->entry.path = dir->path;
+    if (flags & FS_LIST_TIMED) dir->times.opendir_ns = fs_now_ns() - start;
+    return dir;
+}
+
+fs_dir* fs_dir_open(const char *directory, int flags) {
+    return fs_dir_open_in(directory, flags, NULL);
+}
+
+// Next raw name, "." and ".." included; NULL at the end of the directory
+static const char* read_name(fs_dir *dir) {
+#ifdef __linux__
+    if (!dir->dir) {
+        if (dir->dents_pos >= dir->dents_len) {
+            long n = syscall(SYS_getdents64, dir->fd, dir->dents, FS_DENTS_SIZE);
+            if (n <= 0) return NULL;
+            dir->dents_len = (size_t)n;
+            dir->dents_pos = 0;
+        }
+        struct fs_dirent64 *d = (struct fs_dirent64 *)(dir->dents + dir->dents_pos);
+        dir->dents_pos += d->d_reclen;
+        return d->d_name;
+    }
+#endif
+    struct dirent *d = readdir(dir->dir);
+    return d ? d->d_name : NULL;
+}
+
+const fs_entry* fs_dir_next(fs_dir *dir) {
+    int timed = dir->flags & FS_LIST_TIMED;
+    uint64_t mark = timed ? fs_now_ns() : 0;
+    const char *name;
+    while ((name = read_name(dir))) {
+        if (name[0] == '.' && !(dir->flags & FS_LIST_HIDDEN)) continue;
+        if (name[0] == '.' && (name[1] == '\0' ||
+            (name[1] == '.' && name[2] == '\0'))) continue;
+        if (dir->glob && !fs_glob_match(dir->glob, name)) continue;
+        if (dir->regex && !fs_regex_match(dir->regex, name)) continue;
+
+        uint64_t stat_start = 0;
+        if (timed) {
+            stat_start = fs_now_ns();
+            dir->times.enumerate_ns += stat_start - mark;
+        }
+
+        // stat relative to the open directory: no repeated path walk
+        int rc = fstatat(dir->fd, name, &dir->entry.st, dir->flags & FS_LIST_NOFOLLOW ? AT_SYMLINK_NOFOLLOW : 0);
+        if (timed) {
+            mark = fs_now_ns();
+            dir->times.stat_ns += mark - stat_start;
+        }
+        if (rc != 0) continue;
+
+        snprintf(dir->path + dir->prefix_len, NAME_MAX + 1, "%s", name);
+        dir->entry.name = name;
+        return &dir->entry;
+    }
+    if (timed) dir->times.enumerate_ns += fs_now_ns() - mark;
+    return NULL;
+}
+
+const fs_dir_times* fs_dir_timing(const fs_dir *dir) {
+    return &dir->times;
+}
+
+const fs_entry* fs_dir_lookup(fs_dir *dir, const char *name) {
+    uint64_t start = (dir->flags & FS_LIST_TIMED) ? fs_now_ns() : 0;
+    int rc = fstatat(dir->fd, name, &dir->entry.st, dir->flags & FS_LIST_NOFOLLOW ? AT_SYMLINK_NOFOLLOW : 0);
+    if (dir->flags & FS_LIST_TIMED) dir->times.stat_ns += fs_now_ns() - start;
+    if (rc != 0) return NULL;
+
+    snprintf(dir->path + dir->prefix_len, NAME_MAX + 1, "%s", name);
+    dir->entry.name = name;
+    return &dir->entry;
+}
+
+void fs_dir_close(fs_dir *dir) {
+    if (!dir) return;
+    if (dir->dir) closedir(dir->dir);
+    else close(dir->fd);
+    if (!dir->arena) free(dir);
+}
+
+/*
+ * Name automata: glob patterns and regular expressions are both built into a
+ * Thompson NFA over bytes. A set of NFA states is one DFA state; globs are
+ * determinized up front, regexes lazily as names need them. Either way a name
+ * costs one table lookup per byte once its states exist, with no backtracking.
+ *
+ * "?", "." and bracket expressions match one UTF-8 character.
+ */
+
+#define NFA_MAX_STATES 65536
+#define NFA_AT_START 0x1    // assertions: eps[0] only holds at this end of the name
+#define NFA_AT_END   0x2
+
+typedef uint64_t byte_set[4];
+
+typedef struct {
+    int set;                  // byte transition: index into sets, -1 for none
+    int next;
+    int eps[2];               // epsilon edges, -1 for none
+    int assert;               // NFA_AT_*: eps[0] is an anchor, not a free edge
+} nfa_state;
+
+typedef struct {
+    nfa_state *states;
+    byte_set *sets;
+    size_t count, cap;
+    size_t nsets, sets_cap;
+    int nocase;
+    int error;                // errno value once the pattern is invalid or too large
+    fs_arena *arena;
+} nfa;
+
+typedef struct {
+    int start;
+    int end;                  // no edges yet: the next piece hangs off it
+} nfa_frag;
+
+static int bit_has(const uint64_t *bits, size_t i) {
+    return (bits[i >> 6] >> (i & 63)) & 1;
+}
+
+static void bit_set(uint64_t *bits, size_t i) {
+    bits[i >> 6] |= 1ull << (i & 63);
+}
+
+static void bit_range(uint64_t *bits, unsigned lo, unsigned hi) {
+    for (unsigned c = lo; c <= hi; c++) bit_set(bits, c);
+}
+
+// ASCII letters only; the complement of a folded set is folded too
+static void nfa_fold(uint64_t *bits) {
+    for (unsigned c = 'A'; c <= 'Z'; c++) {
+        if (bit_has(bits, c) || bit_has(bits, c + 32)) {
+            bit_set(bits, c);
+            bit_set(bits, c + 32);
+        }
+    }
+}
+
+static void nfa_init(nfa *n, int flags, fs_arena *arena) {
+    memset(n, 0, sizeof(*n));
+    n->nocase = flags & FS_GLOB_NOCASE;
+    n->arena = arena;
+}
+
+// Indices stay valid as the arrays grow; pointers into them do not
+static int nfa_state_new(nfa *n) {
+    if (n->count == n->cap) {
+        size_t cap = n->cap ? 2 * n->cap : 64;
+        nfa_state *grown = fs_arena_alloc(n->arena, cap * sizeof(nfa_state));
+        if (n->count) memcpy(grown, n->states, n->count * sizeof(nfa_state));
+        n->states = grown;
+        n->cap = cap;
+    }
+    if (n->count >= NFA_MAX_STATES) n->error = E2BIG;
+    nfa_state *s = &n->states[n->count];
+    s->set = s->next = s->eps[0] = s->eps[1] = -1;
+    s->assert = 0;
+    return (int)n->count++;
+}
+
+static nfa_frag nfa_frag_new(nfa *n) {
+    nfa_frag f;
+    f.start = nfa_state_new(n);
+    f.end = nfa_state_new(n);
+    return f;
+}
+
+static void nfa_edge(nfa *n, int from, const byte_set bits, int to) {
+    if (n->nsets == n->sets_cap) {
+        size_t cap = n->sets_cap ? 2 * n->sets_cap : 32;
+        byte_set *grown = fs_arena_alloc(n->arena, cap * sizeof(byte_set));
+        if (n->nsets) memcpy(grown, n->sets, n->nsets * sizeof(byte_set));
+        n->sets = grown;
+        n->sets_cap = cap;
+    }
+    memcpy(n->sets[n->nsets], bits, sizeof(byte_set));
+    if (n->nocase) nfa_fold(n->sets[n->nsets]);
+    n->states[from].set = (int)n->nsets++;
+    n->states[from].next = to;
+}
+
+// Adds start as one more way out of *split, chaining a new split state when it is full
+static void nfa_alternate(nfa *n, int *split, int start) {
+    if (n->states[*split].eps[0] < 0) {
+        n->states[*split].eps[0] = start;
+    } else if (n->states[*split].eps[1] < 0) {
+        n->states[*split].eps[1] = start;
+    } else {
+        int more = nfa_state_new(n);
+        n->states[more].eps[0] = n->states[*split].eps[1];
+        n->states[more].eps[1] = start;
+        n->states[*split].eps[1] = more;
+        *split = more;
+    }
+}
+
+static nfa_frag nfa_concat(nfa *n, nfa_frag a, nfa_frag b) {
+    n->states[a.end].eps[0] = b.start;
+    a.end = b.end;
+    return a;
+}
+
+static nfa_frag nfa_literal(nfa *n, unsigned char c) {
+    byte_set bits = {0};
+    bit_set(bits, c);
+    nfa_frag f = nfa_frag_new(n);
+    nfa_edge(n, f.start, bits, f.end);
+    return f;
+}
+
+// The bytes from p up to end, in order
+static nfa_frag nfa_bytes(nfa *n, const unsigned char *p, const unsigned char *end) {
+    nfa_frag f;
+    f.start = f.end = nfa_state_new(n);
+    for (; p < end; p++) f = nfa_concat(n, f, nfa_literal(n, *p));
+    return f;
+}
+
+// One character whose first byte is in bits: ASCII, or a lead byte and exactly the
+// continuation bytes it announces. Stray bytes of invalid UTF-8 are never a character,
+// so a match cannot begin inside one; only "*" and the unanchored regex search pass them.
+static nfa_frag nfa_char(nfa *n, const byte_set bits) {
+    static const struct { unsigned lo, hi; int tail; } shapes[] = {
+        { 0x00, 0x7F, 0 }, { 0xC0, 0xDF, 1 }, { 0xE0, 0xEF, 2 }, { 0xF0, 0xF7, 3 },
+    };
+    byte_set continuation = {0};
+    bit_range(continuation, 0x80, 0xBF);
+
+    nfa_frag f = nfa_frag_new(n);
+    int split = f.start;
+    for (size_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++) {
+        byte_set first = {0};
+        for (unsigned c = shapes[i].lo; c <= shapes[i].hi; c++) {
+            if (bit_has(bits, c)) bit_set(first, c);
+        }
+        if (!(first[0] | first[1] | first[2] | first[3])) continue;
+
+        int start = nfa_state_new(n), at = nfa_state_new(n);
+        nfa_edge(n, start, first, at);
+        for (int t = 0; t < shapes[i].tail; t++) {
+            int following = nfa_state_new(n);
+            nfa_edge(n, at, continuation, following);
+            at = following;
+        }
+        n->states[at].eps[0] = f.end;
+        nfa_alternate(n, &split, start);
+    }
+    return f;
+}
+
+// Bytes past the UTF-8 lead byte at p that belong to its character
+static const unsigned char* utf8_end(const unsigned char *p, const unsigned char *stop) {
+    if (*p++ < 0xC0) return p;
+    while (p < stop && (*p & 0xC0) == 0x80) p++;
+    return p;
+}
+
+// Length of the character a lead byte announces; 1 for any other byte
+static size_t utf8_len(unsigned char lead) {
+    if (lead >= 0xF8) return 1;
+    if (lead >= 0xF0) return 4;
+    if (lead >= 0xE0) return 3;
+    return lead >= 0xC0 ? 2 : 1;
+}
+
+// Multi-byte characters that agree with skip[0..count) up to byte depth but are
+// none of them: each byte value taken at depth becomes one more way out of *split
+static void nfa_char_except(nfa *n, int *split, const unsigned char **skip, size_t count, size_t depth, int to) {
+    byte_set taken = {0};
+    for (size_t i = 0; i < count; i++) {
+        unsigned char b = skip[i][depth];
+        if (bit_has(taken, b)) continue;
+        bit_set(taken, b);
+        if (depth + 1 == utf8_len(skip[i][0])) continue;    // the whole character is excluded
+
+        const unsigned char **same = fs_arena_alloc(n->arena, count * sizeof(*same));
+        size_t k = 0;
+        for (size_t j = i; j < count; j++) {
+            if (skip[j][depth] == b) same[k++] = skip[j];
+        }
+        byte_set one = {0};
+        bit_set(one, b);
+        int start = nfa_state_new(n), at = nfa_state_new(n);
+        nfa_edge(n, start, one, at);
+        nfa_char_except(n, &at, same, k, depth + 1, to);
+        nfa_alternate(n, split, start);
+    }
+    if (depth == 0) return;
+
+    // Any other continuation byte here leaves nothing to exclude
+    byte_set rest = {0}, continuation = {0};
+    bit_range(continuation, 0x80, 0xBF);
+    for (int w = 0; w < 4; w++) rest[w] = continuation[w] & ~taken[w];
+    if (!(rest[0] | rest[1] | rest[2] | rest[3])) return;
+    int start = nfa_state_new(n), at = nfa_state_new(n);
+    nfa_edge(n, start, rest, at);
+    for (size_t t = depth + 1; t < utf8_len(skip[0][0]); t++) {
+        int following = nfa_state_new(n);
+        nfa_edge(n, at, continuation, following);
+        at = following;
+    }
+    n->states[at].eps[0] = to;
+    nfa_alternate(n, split, start);
+}
+
+// Regex \d \w \s and their complements; 0 for any other escape
+static int nfa_shorthand(char e, uint64_t *bits) {
+    byte_set add = {0};
+    switch (e | 0x20) {
+    case 'd': bit_range(add, '0', '9'); break;
+    case 'w': bit_range(add, '0', '9'); bit_range(add, 'A', 'Z'); bit_range(add, 'a', 'z'); bit_set(add, '_'); break;
+    case 's': bit_range(add, '\t', '\r'); bit_set(add, ' '); break;
+    default: return 0;
+    }
+    for (int w = 0; w < 4; w++) bits[w] |= (e & 0x20) ? add[w] : ~add[w];
+    return 1;
+}
+
+// Regex control-character escapes; anything else stands for itself
+static unsigned char nfa_escaped(char e) {
+    switch (e) {
+    case 'n': return '\n';
+    case 't': return '\t';
+    case 'r': return '\r';
+    case 'f': return '\f';
+    case 'v': return '\v';
+    default: return (unsigned char)e;
+    }
+}
+
+// The ']' closing the bracket expression at p, or NULL if it is not one.
+// Globs negate with '!' or '^', regexes with '^' only.
+static const char* nfa_class_end(const char *p, int regex) {
+    p++;
+    if (*p == '^' || (*p == '!' && !regex)) p++;
+    if (*p == ']') p++;
+    for (; *p && *p != ']'; p++) {
+        if (*p == '\\' && p[1]) p++;
+    }
+    return *p ? p : NULL;
+}
+
+// Bracket expression from the '[' at p to the ']' at close. Single bytes and
+// ranges form one byte set; multi-byte characters become literal alternatives,
+// or in a negated expression are excluded through nfa_char_except().
+static nfa_frag nfa_class(nfa *n, const char *p, const char *close, int regex) {
+    const unsigned char *c = (const unsigned char *)p + 1;
+    const unsigned char *stop = (const unsigned char *)close;
+    int negate = *c == '^' || (*c == '!' && !regex);
+    if (negate) c++;
+
+    nfa_frag f = nfa_frag_new(n);
+    int split = f.start;
+    byte_set bits = {0};
+    const unsigned char **skip = negate ? fs_arena_alloc(n->arena, (stop - c + 1) * sizeof(*skip)) : NULL;
+    size_t nskip = 0;
+    while (c < stop) {
+        if (regex && *c == '\\' && c + 1 < stop && nfa_shorthand((char)c[1], bits)) {
+            c += 2;
+            continue;
+        }
+        int escaped = *c == '\\' && c + 1 < stop;
+        if (escaped) c++;
+        if (*c >= 0xC0) {
+            const unsigned char *seq = c;
+            c = utf8_end(c, stop);
+            if (negate) {
+                if ((size_t)(c - seq) == utf8_len(*seq)) skip[nskip++] = seq;
+                continue;
+            }
+
+            nfa_frag chars = nfa_bytes(n, seq, c);
+            n->states[chars.end].eps[0] = f.end;
+            nfa_alternate(n, &split, chars.start);
+            continue;
+        }
+        // \n, \t and the like only when escaped: [a-f] ends at 'f', not at '\f'
+        unsigned lo = regex && escaped ? nfa_escaped((char)*c) : *c, hi = lo;
+        c++;
+        if (c + 1 < stop && *c == '-') {
+            c++;
+            escaped = *c == '\\' && c + 1 < stop;
+            if (escaped) c++;
+            hi = regex && escaped ? nfa_escaped((char)*c) : *c;
+            c++;
+        }
+        if (lo > hi) n->error = EINVAL;    // [z-a] would match nothing; say so instead
+        else bit_range(bits, lo, hi < 0xBF ? hi : 0xBF);
+    }
+    if (negate) {
+        if (n->nocase) nfa_fold(bits);
+        for (int w = 0; w < 4; w++) bits[w] = ~bits[w];
+        bit_range(bits, 0xC0, 0xFF);
+        for (size_t i = 0; i < nskip; i++) bits[3] &= ~(1ull << (skip[i][0] & 63));
+        if (nskip) nfa_char_except(n, &split, skip, nskip, 0, f.end);
+    }
+    if (bits[0] | bits[1] | bits[2] | bits[3]) {
+        nfa_frag one = nfa_char(n, bits);
+        n->states[one.end].eps[0] = f.end;
+        nfa_alternate(n, &split, one.start);
+    }
+    return f;
+}
+
+// Adds to set every state reachable over epsilon edges, anchors only where at allows
+static void nfa_closure(const nfa *n, uint64_t *set, size_t words, int *stack, int at) {
+    size_t top = 0;
+    for (size_t w = 0; w < words; w++) {
+        for (uint64_t bits = set[w]; bits; bits &= bits - 1) stack[top++] = (int)(w * 64 + __builtin_ctzll(bits));
+    }
+    while (top > 0) {
+        const nfa_state *s = &n->states[stack[--top]];
+        for (int e = 0; e < 2; e++) {
+            int t = s->eps[e];
+            if (t < 0 || (s->assert && !(s->assert & at))) continue;
+            if (!bit_has(set, (size_t)t)) {
+                bit_set(set, (size_t)t);
+                stack[top++] = t;
+            }
+        }
+    }
+}
+
+// States reachable from set on byte, closed over the edges that hold mid-name
+static void nfa_step(const nfa *n, const uint64_t *set, unsigned char byte, uint64_t *out, size_t words, int *stack) {
+    memset(out, 0, words * sizeof(uint64_t));
+    for (size_t w = 0; w < words; w++) {
+        for (uint64_t bits = set[w]; bits; bits &= bits - 1) {
+            const nfa_state *s = &n->states[w * 64 + __builtin_ctzll(bits)];
+            if (s->set >= 0 && bit_has(n->sets[s->set], byte)) bit_set(out, (size_t)s->next);
+        }
+    }
+    nfa_closure(n, out, words, stack, 0);
+}
+
+// Splits bytes into classes that no transition tells apart; returns the class count
+static size_t nfa_byte_classes(const nfa *n, uint8_t *classes, unsigned char *sample) {
+    size_t nclasses = 1;
+    memset(classes, 0, 256);
+    for (size_t s = 0; s < n->nsets; s++) {
+        int remap[512];
+        memset(remap, -1, sizeof(remap));
+        nclasses = 0;
+        for (unsigned c = 0; c < 256; c++) {
+            int key = classes[c] * 2 + bit_has(n->sets[s], c);
+            if (remap[key] < 0) remap[key] = (int)nclasses++;
+            classes[c] = (uint8_t)remap[key];
+        }
+    }
+    for (int c = 255; c >= 0; c--) sample[classes[c]] = (unsigned char)c;
+    return nclasses;
+}
+
+// DFA states as NFA state sets, deduplicated through an open-addressing table
+typedef struct {
+    uint64_t **sets;          // slots keep their memory across nfa_subsets_clear()
+    size_t count;
+    size_t max;
+    size_t words;
+    int *buckets;
+    size_t nbuckets;          // power of two, at least twice max
+} nfa_subsets;
+
+static void nfa_subsets_clear(nfa_subsets *d) {
+    memset(d->buckets, -1, d->nbuckets * sizeof(int));
+    d->count = 0;
+}
+
+static void nfa_subsets_init(nfa_subsets *d, size_t words, size_t max, fs_arena *arena) {
+    d->words = words;
+    d->max = max;
+    d->sets = fs_arena_alloc(arena, max * sizeof(uint64_t *));
+    memset(d->sets, 0, max * sizeof(uint64_t *));
+    for (d->nbuckets = 16; d->nbuckets < 2 * max; d->nbuckets *= 2) {}
+    d->buckets = fs_arena_alloc(arena, d->nbuckets * sizeof(int));
+    nfa_subsets_clear(d);
+}
+
+// Index of the DFA state for set, adding it if new; -1 when all max are taken
+static int nfa_intern(nfa_subsets *d, const uint64_t *set, fs_arena *arena) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t w = 0; w < d->words; w++) h = (h ^ set[w]) * 1099511628211ULL;
+    size_t b = (h ^ (h >> 29)) & (d->nbuckets - 1);
+    while (d->buckets[b] >= 0) {
+        if (memcmp(d->sets[d->buckets[b]], set, d->words * sizeof(uint64_t)) == 0) return d->buckets[b];
+        b = (b + 1) & (d->nbuckets - 1);
+    }
+    if (d->count == d->max) return -1;
+    if (!d->sets[d->count]) d->sets[d->count] = fs_arena_alloc(arena, d->words * sizeof(uint64_t));
+    memcpy(d->sets[d->count], set, d->words * sizeof(uint64_t));
+    d->buckets[b] = (int)d->count;
+    return (int)d->count++;
+}
+
+/*
+ * Glob patterns: determinized at compile time into a table with one row per
+ * state and one column per byte class.
+ */
+
+#define GLOB_MAX_DFA_STATES 4096
+#define GLOB_DEAD 0     // the empty state set: nothing can match any more
+#define GLOB_START 1
+
+struct fs_glob {
+    uint8_t classes[256];     // byte -> column
+    size_t nclasses;
+    uint16_t *next;           // [state * nclasses + class]
+    uint8_t *accept;
+    fs_arena *owned;          // fs_glob_compile(): the arena holding all of this
+};
+
+// Whether the '{' at p has a matching '}'
+static int glob_brace_closes(const char *p) {
+    int depth = 0;
+    for (; *p; p++) {
+        if (*p == '\\' && p[1]) p++;
+        else if (*p == '{') depth++;
+        else if (*p == '}' && --depth == 0) return 1;
+    }
+    return 0;
+}
+
+static nfa_frag glob_sequence(nfa *n, const char **p, int depth);
+
+// {a,b,...} with *p just past the '{'; leaves *p past the matching '}'
+static nfa_frag glob_alternatives(nfa *n, const char **p, int depth) {
+    nfa_frag f = nfa_frag_new(n);
+    int split = f.start;
+    for (;;) {
+        nfa_frag alt = glob_sequence(n, p, depth);
+        n->states[alt.end].eps[0] = f.end;
+        nfa_alternate(n, &split, alt.start);
+        if (**p != ',') break;
+        (*p)++;
+    }
+    if (**p == '}') (*p)++;
+    return f;
+}
+
+// Pieces up to the end of the pattern, or to a ',' or '}' of the enclosing braces
+static nfa_frag glob_sequence(nfa *n, const char **p, int depth) {
+    byte_set all = { ~0ull, ~0ull, ~0ull, ~0ull };
+    nfa_frag f;
+    f.start = f.end = nfa_state_new(n);
+    while (**p) {
+        const char *c = *p, *close;
+        if (depth > 0 && (*c == ',' || *c == '}')) break;
+
+        nfa_frag piece;
+        if (*c == '*') {
+            while (**p == '*') (*p)++;
+            piece = nfa_frag_new(n);
+            nfa_edge(n, piece.start, all, piece.start);
+            n->states[piece.start].eps[0] = piece.end;
+        } else if (*c == '?') {
+            (*p)++;
+            piece = nfa_char(n, all);
+        } else if (*c == '[' && (close = nfa_class_end(c, 0))) {
+            piece = nfa_class(n, c, close, 0);
+            *p = close + 1;
+        } else if (*c == '{' && glob_brace_closes(c)) {
+            (*p)++;
+            piece = glob_alternatives(n, p, depth + 1);
+        } else {
+            if (*c == '\\' && c[1]) c++;
+            piece = nfa_literal(n, (unsigned char)*c);
+            *p = c + 1;
+        }
+        f = nfa_concat(n, f, piece);
+    }
+    return f;
+}
+
+fs_glob* fs_glob_compile_in(const char *pattern, int flags, fs_arena *arena) {
+    nfa n;
+    nfa_init(&n, flags, arena);
+    const char *p = pattern;
+    nfa_frag whole = glob_sequence(&n, &p, 0);
+    if (n.error) {
+        errno = n.error;
+        return NULL;
+    }
+
+    fs_glob *g = fs_arena_alloc(arena, sizeof(fs_glob));
+    memset(g, 0, sizeof(*g));
+    unsigned char sample[256];    // one byte of each class
+    g->nclasses = nfa_byte_classes(&n, g->classes, sample);
+
+    // Subset construction, breadth first from the start state
+    nfa_subsets d;
+    nfa_subsets_init(&d, (n.count + 63) / 64, GLOB_MAX_DFA_STATES, arena);
+    int *stack = fs_arena_alloc(arena, n.count * sizeof(int));
+    uint64_t *work = fs_arena_alloc(arena, d.words * sizeof(uint64_t));
+
+    memset(work, 0, d.words * sizeof(uint64_t));
+    nfa_intern(&d, work, arena);                     // GLOB_DEAD
+    bit_set(work, (size_t)whole.start);
+    nfa_closure(&n, work, d.words, stack, NFA_AT_START);
+    nfa_intern(&d, work, arena);                     // GLOB_START
+
+    size_t rows = 64;
+    uint16_t *next = fs_arena_alloc(arena, rows * g->nclasses * sizeof(uint16_t));
+    for (size_t state = 0; state < d.count; state++) {
+        if (state == rows) {
+            uint16_t *grown = fs_arena_alloc(arena, 2 * rows * g->nclasses * sizeof(uint16_t));
+            memcpy(grown, next, rows * g->nclasses * sizeof(uint16_t));
+            next = grown;
+            rows *= 2;
+        }
+        for (size_t k = 0; k < g->nclasses; k++) {
+            nfa_step(&n, d.sets[state], sample[k], work, d.words, stack);
+            int target = nfa_intern(&d, work, arena);
+            if (target < 0) {
+                errno = E2BIG;
+                return NULL;
+            }
+            next[state * g->nclasses + k] = (uint16_t)target;
+        }
+    }
+
+    g->next = next;
+    g->accept = fs_arena_alloc(arena, d.count);
+    for (size_t state = 0; state < d.count; state++) {
+        g->accept[state] = (uint8_t)bit_has(d.sets[state], (size_t)whole.end);
+    }
+    return g;
+}
+
+fs_glob* fs_glob_compile(const char *pattern, int flags) {
+    fs_arena *arena = calloc(1, sizeof(fs_arena));
+    if (!arena) return NULL;
+    fs_glob *g = fs_glob_compile_in(pattern, flags, arena);
+    if (!g) {
+        int saved = errno;
+        fs_arena_free(arena);
+        free(arena);
+        errno = saved;
+        return NULL;
+    }
+    g->owned = arena;
+    return g;
+}
+
+int fs_glob_match(const fs_glob *glob, const char *name) {
+    unsigned state = GLOB_START;
+    for (const unsigned char *c = (const unsigned char *)name; *c; c++) {
+        state = glob->next[state * glob->nclasses + glob->classes[*c]];
+        if (state == GLOB_DEAD) return 0;
+    }
+    return glob->accept[state];
+}
+
+void fs_glob_free(fs_glob *glob) {
+    if (!glob || !glob->owned) return;
+    fs_arena *arena = glob->owned;
+    fs_arena_free(arena);
+    free(arena);
+}
+
+void fs_dir_set_glob(fs_dir *dir, const fs_glob *glob) {
+    dir->glob = glob;
+}
+
+/*
+ * Regular expressions: the DFA is built lazily, one transition the first
+ * time a name needs it, in a cache of about REGEX_CACHE_BYTES. A full cache
+ * is flushed and refilled, so each byte costs at most one NFA step and time
+ * stays linear in the name whatever the pattern. A literal prefix is first
+ * searched for with strstr(), so most names never reach the automaton.
+ */
+
+#define REGEX_CACHE_BYTES (256 * 1024)
+#define REGEX_MAX_REPEAT 1000
+#define REGEX_PREFIX_MAX 64
+#define REGEX_DEAD 0
+#define REGEX_UNKNOWN 0xFFFF          // transition not computed yet
+#define REGEX_MATCH 0x1               // a match has been seen: the name matches
+#define REGEX_MATCH_AT_END 0x2        // ... if the name ends here ($)
+
+struct fs_regex {
+    nfa nfa;
+    int start;                // NFA start state; preceded by a loop on every byte unless anchored
+    int match;
+    int anchored;             // starts with ^: only the start of the name can begin a match
+    uint8_t classes[256];
+    size_t nclasses;
+    unsigned char sample[256];
+    char prefix[REGEX_PREFIX_MAX];    // every match begins with these bytes
+    size_t prefix_len;
+    int literal;              // the prefix is the whole pattern: strstr() decides alone
+    nfa_subsets cache;
+    uint16_t *next;           // [state * nclasses + class], REGEX_UNKNOWN until needed
+    uint8_t *flags;           // REGEX_MATCH*
+    int start_state;          // -1 until computed after a flush
+    uint64_t *work, *scratch, *pending;
+    int *stack;
+    fs_arena *arena;
+    fs_arena *owned;          // fs_regex_compile(): the arena holding all of this
+};
+
+static nfa_frag regex_alternation(nfa *n, const char **p, int depth);
+
+static nfa_frag regex_atom(nfa *n, const char **p, int depth) {
+    byte_set bits = {0};
+    const char *c = *p, *close;
+    nfa_frag f;
+    switch (*c) {
+    case '(':
+        *p = c + 1;
+        if ((*p)[0] == '?' && (*p)[1] == ':') *p += 2;
+        else if (**p == '?') n->error = EINVAL;    // lookaround and flags are not supported
+        f = regex_alternation(n, p, depth + 1);
+        if (**p == ')') (*p)++;
+        else n->error = EINVAL;
+        return f;
+    case '[':
+        close = nfa_class_end(c, 1);
+        if (!close) {
+            n->error = EINVAL;
+            *p = c + 1;
+            return nfa_frag_new(n);
+        }
+        *p = close + 1;
+        return nfa_class(n, c, close, 1);
+    case '.':
+        *p = c + 1;
+        for (int w = 0; w < 4; w++) bits[w] = ~0ull;
+        return nfa_char(n, bits);
+    case '^':
+    case '$':
+        *p = c + 1;
+        f = nfa_frag_new(n);
+        n->states[f.start].assert = *c == '^' ? NFA_AT_START : NFA_AT_END;
+        n->states[f.start].eps[0] = f.end;
+        return f;
+    case '*':
+    case '+':
+    case '?':
+        n->error = EINVAL;    // nothing to repeat
+        *p = c + 1;
+        return nfa_frag_new(n);
+    case '\\':
+        if (!c[1] || ((c[1] | 0x20) >= 'a' && (c[1] | 0x20) <= 'z' && !strchr("dDwWsSnrtfv", c[1])) ||
+            (c[1] >= '0' && c[1] <= '9')) {
+            n->error = EINVAL;    // \b, backreferences and the like are not supported
+            *p = c + (c[1] ? 2 : 1);
+            return nfa_frag_new(n);
+        }
+        *p = c + 2;
+        if (nfa_shorthand(c[1], bits)) return nfa_char(n, bits);
+        return nfa_literal(n, nfa_escaped(c[1]));
+    default:
+        *p = (const char *)utf8_end((const unsigned char *)c, (const unsigned char *)c + strlen(c));
+        return nfa_bytes(n, (const unsigned char *)c, (const unsigned char *)*p);
+    }
+}
+
+// Reads a quantifier at *p into min and max (-1: unbounded); 0 if there is none
+static int regex_quantifier(const char **p, long *min, long *max) {
+    const char *c = *p;
+    if (*c == '*') {
+        *min = 0, *max = -1, c++;
+    } else if (*c == '+') {
+        *min = 1, *max = -1, c++;
+    } else if (*c == '?') {
+        *min = 0, *max = 1, c++;
+    } else if (*c == '{' && c[1] >= '0' && c[1] <= '9') {
+        char *end;
+        *min = *max = strtol(c + 1, &end, 10);
+        if (*end == ',' && end[1] == '}') {
+            *max = -1;
+            end++;
+        } else if (*end == ',' && end[1] >= '0' && end[1] <= '9') {
+            *max = strtol(end + 1, &end, 10);
+        }
+        if (*end != '}') return 0;    // not a quantifier: '{' is a literal
+        c = end + 1;
+    } else {
+        return 0;
+    }
+    if (*c == '?') c++;    // lazy repeats match the same names
+    *p = c;
+    return 1;
+}
+
+// An atom and its quantifier; repeats parse the atom's text again for each copy
+static nfa_frag regex_piece(nfa *n, const char **p, int depth) {
+    const char *atom = *p;
+    nfa_frag f = regex_atom(n, p, depth);
+    long min, max, again;
+    if (n->error || !regex_quantifier(p, &min, &max)) return f;
+    if (regex_quantifier(p, &again, &again) || min > REGEX_MAX_REPEAT || max > REGEX_MAX_REPEAT ||
+        (max >= 0 && min > max)) {
+        n->error = EINVAL;
+        return f;
+    }
+
+    // min copies in a row; x+ then loops back over the last one, x{m,n} adds optional copies
+    nfa_frag seq;
+    seq.start = seq.end = nfa_state_new(n);
+    long copies = max >= 0 ? max : (min > 0 ? min : 1);
+    for (long i = 0; i < copies && !n->error; i++) {
+        nfa_frag copy = f;
+        if (i > 0) {
+            const char *q = atom;
+            copy = regex_atom(n, &q, depth);
+        }
+        int loop = max < 0 && i == copies - 1;
+        if (i < min && !loop) {
+            seq = nfa_concat(n, seq, copy);
+            continue;
+        }
+        nfa_frag wrap = nfa_frag_new(n);
+        n->states[wrap.start].eps[0] = copy.start;
+        n->states[wrap.start].eps[1] = wrap.end;
+        n->states[copy.end].eps[0] = loop ? wrap.start : wrap.end;
+        if (i < min) wrap.start = copy.start;    // x+: the first pass is not optional
+        seq = nfa_concat(n, seq, wrap);
+    }
+    return seq;
+}
+
+static nfa_frag regex_concatenation(nfa *n, const char **p, int depth) {
+    nfa_frag f;
+    f.start = f.end = nfa_state_new(n);
+    while (**p && **p != '|' && !(**p == ')' && depth > 0) && !n->error) {
+        if (**p == ')') {
+            n->error = EINVAL;    // unbalanced
+            break;
+        }
+        f = nfa_concat(n, f, regex_piece(n, p, depth));
+    }
+    return f;
+}
+
+static nfa_frag regex_alternation(nfa *n, const char **p, int depth) {
+    nfa_frag f = nfa_frag_new(n);
+    int split = f.start;
+    for (;;) {
+        nfa_frag alt = regex_concatenation(n, p, depth);
+        n->states[alt.end].eps[0] = f.end;
+        nfa_alternate(n, &split, alt.start);
+        if (**p != '|' || n->error) break;
+        (*p)++;
+    }
+    return f;
+}
+
+// Whether pattern has a '|' outside any group, where no prefix is shared
+static int regex_top_level_bar(const char *p) {
+    int depth = 0;
+    for (; *p; p++) {
+        const char *close;
+        if (*p == '\\' && p[1]) p++;
+        else if (*p == '[' && (close = nfa_class_end(p, 1))) p = close;
+        else if (*p == '(') depth++;
+        else if (*p == ')') depth--;
+        else if (*p == '|' && depth == 0) return 1;
+    }
+    return 0;
+}
+
+// Literal bytes at the start of p that every match begins with; *whole when they are all of p
+static size_t regex_prefix(const char *p, char *out, size_t cap, int *whole) {
+    size_t len = 0;
+    *whole = 0;
+    for (;;) {
+        const char *c = p, *end;
+        if (!*c) {
+            *whole = 1;
+            return len;
+        }
+        if (*c == '\\' && c[1] && !((c[1] | 0x20) >= 'a' && (c[1] | 0x20) <= 'z') && !(c[1] >= '0' && c[1] <= '9')) {
+            c++;
+            end = c + 1;
+        } else if (strchr(".[]()|*+?{}^$\\", *c)) {
+            return len;
+        } else {
+            end = (const char *)utf8_end((const unsigned char *)c, (const unsigned char *)c + strlen(c));
+        }
+        if (*end == '*' || *end == '?' || *end == '{') return len;    // may occur zero times
+        if (len + (size_t)(end - c) >= cap) return len;
+        memcpy(out + len, c, end - c);
+        len += end - c;
+        if (*end == '+') return len;
+        p = end;
+    }
+}
+
+// The DFA state for re->work, with its row and flags set up; -1 when the cache is full
+static int regex_state(fs_regex *re) {
+    size_t before = re->cache.count;
+    int state = nfa_intern(&re->cache, re->work, re->arena);
+    if (state < 0 || (size_t)state < before) return state;
+
+    memset(re->next + (size_t)state * re->nclasses, 0xFF, re->nclasses * sizeof(uint16_t));
+    memcpy(re->scratch, re->work, re->cache.words * sizeof(uint64_t));
+    nfa_closure(&re->nfa, re->scratch, re->cache.words, re->stack, NFA_AT_END);
+    re->flags[state] = (uint8_t)((bit_has(re->work, (size_t)re->match) ? REGEX_MATCH : 0) |
+                                 (bit_has(re->scratch, (size_t)re->match) ? REGEX_MATCH_AT_END : 0));
+    return state;
+}
+
+static void regex_flush(fs_regex *re) {
+    nfa_subsets_clear(&re->cache);
+    memset(re->work, 0, re->cache.words * sizeof(uint64_t));
+    regex_state(re);                  // REGEX_DEAD
+    re->start_state = -1;
+}
+
+static int regex_start(fs_regex *re) {
+    if (re->start_state < 0) {
+        memset(re->work, 0, re->cache.words * sizeof(uint64_t));
+        bit_set(re->work, (size_t)re->start);
+        nfa_closure(&re->nfa, re->work, re->cache.words, re->stack, NFA_AT_START);
+        re->start_state = regex_state(re);
+    }
+    return re->start_state;
+}
+
+// Computes and caches one transition; when the cache is full it starts over from the target
+static int regex_transition(fs_regex *re, int state, unsigned char byte) {
+    nfa_step(&re->nfa, re->cache.sets[state], byte, re->work, re->cache.words, re->stack);
+    int target = regex_state(re);
+    if (target < 0) {
+        memcpy(re->pending, re->work, re->cache.words * sizeof(uint64_t));
+        regex_flush(re);
+        memcpy(re->work, re->pending, re->cache.words * sizeof(uint64_t));
+        return regex_state(re);
+    }
+    re->next[(size_t)state * re->nclasses + re->classes[byte]] = (uint16_t)target;
+    return target;
+}
+
+fs_regex* fs_regex_compile_in(const char *pattern, int flags, fs_arena *arena) {
+    fs_regex *re = fs_arena_alloc(arena, sizeof(fs_regex));
+    memset(re, 0, sizeof(*re));
+    re->arena = arena;
+    nfa *n = &re->nfa;
+    nfa_init(n, flags, arena);
+
+    const char *p = pattern;
+    re->anchored = pattern[0] == '^' && !regex_top_level_bar(pattern);
+    if (!re->anchored) {
+        // Unanchored search: a loop that lets a match begin at any byte
+        byte_set all = { ~0ull, ~0ull, ~0ull, ~0ull };
+        re->start = nfa_state_new(n);
+        nfa_edge(n, re->start, all, re->start);
+    }
+    nfa_frag whole = regex_alternation(n, &p, 0);
+    if (*p && !n->error) n->error = EINVAL;
+    if (n->error) {
+        errno = n->error;
+        return NULL;
+    }
+    if (re->anchored) re->start = whole.start;
+    else n->states[re->start].eps[0] = whole.start;
+    re->match = whole.end;
+
+    if (!regex_top_level_bar(pattern)) {
+        re->prefix_len = regex_prefix(pattern + re->anchored, re->prefix, sizeof(re->prefix), &re->literal);
+        re->prefix[re->prefix_len] = '\0';
+        re->literal = re->literal && re->prefix_len > 0;
+    }
+
+    re->nclasses = nfa_byte_classes(n, re->classes, re->sample);
+    size_t words = (n->count + 63) / 64;
+    size_t per_state = re->nclasses * sizeof(uint16_t) + words * sizeof(uint64_t) + 2 * sizeof(int) + 1;
+    size_t max = REGEX_CACHE_BYTES / per_state;
+    if (max < 8) max = 8;
+    if (max > REGEX_UNKNOWN) max = REGEX_UNKNOWN;
+    nfa_subsets_init(&re->cache, words, max, arena);
+    re->next = fs_arena_alloc(arena, max * re->nclasses * sizeof(uint16_t));
+    re->flags = fs_arena_alloc(arena, max);
+    re->work = fs_arena_alloc(arena, words * sizeof(uint64_t));
+    re->scratch = fs_arena_alloc(arena, words * sizeof(uint64_t));
+    re->pending = fs_arena_alloc(arena, words * sizeof(uint64_t));
+    re->stack = fs_arena_alloc(arena, n->count * sizeof(int));
+    regex_flush(re);
+    return re;
+}
+
+fs_regex* fs_regex_compile(const char *pattern, int flags) {
+    fs_arena *arena = calloc(1, sizeof(fs_arena));
+    if (!arena) return NULL;
+    fs_regex *re = fs_regex_compile_in(pattern, flags, arena);
+    if (!re) {
+        int saved = errno;
+        fs_arena_free(arena);
+        free(arena);
+        errno = saved;
+        return NULL;
+    }
+    re->owned = arena;
+    return re;
+}
+
+int fs_regex_match(fs_regex *re, const char *name) {
+    const unsigned char *c = (const unsigned char *)name;
+    if (re->prefix_len) {
+        if (re->anchored) {
+            int differs = re->nfa.nocase ? strncasecmp(name, re->prefix, re->prefix_len)
+                                         : memcmp(name, re->prefix, re->prefix_len);
+            if (differs) return 0;
+        } else {
+            // No match can begin before the first occurrence of the prefix
+            const char *hit = re->nfa.nocase ? strcasestr(name, re->prefix) : strstr(name, re->prefix);
+            if (!hit) return 0;
+            c = (const unsigned char *)hit;
+        }
+        if (re->literal) return 1;
+    }
+
+    int state = regex_start(re);
+    for (; *c; c++) {
+        if (re->flags[state] & REGEX_MATCH) return 1;
+        int next = re->next[(size_t)state * re->nclasses + re->classes[*c]];
+        state = next != REGEX_UNKNOWN ? next : regex_transition(re, state, *c);
+        if (state == REGEX_DEAD) return 0;
+    }
+    return (re->flags[state] & (REGEX_MATCH | REGEX_MATCH_AT_END)) != 0;
+}
+
+void fs_regex_free(fs_regex *re) {
+    if (!re || !re->owned) return;
+    fs_arena *arena = re->owned;
+    fs_arena_free(arena);
+    free(arena);
+}
+
+void fs_dir_set_regex(fs_dir *dir, fs_regex *re) {
+    dir->regex = re;
+}
+
+static void* table_column(void *column, size_t cap, size_t width) {
+    void *grown = realloc(column, cap * width);
+    if (!grown) {
+        perror("realloc");
+        exit(1);
+    }
+    return grown;
+}
+
+void fs_table_add(fs_table *t, const fs_entry *entry) {
+    if (t->count == t->cap) {
+        t->cap = t->cap ? t->cap * 2 : 1024;
+        t->size = table_column(t->size, t->cap, sizeof(*t->size));
+        t->mtime = table_column(t->mtime, t->cap, sizeof(*t->mtime));
+        t->inode = table_column(t->inode, t->cap, sizeof(*t->inode));
+        t->mode = table_column(t->mode, t->cap, sizeof(*t->mode));
+        t->uid = table_column(t->uid, t->cap, sizeof(*t->uid));
+        t->gid = table_column(t->gid, t->cap, sizeof(*t->gid));
+        t->name = table_column(t->name, t->cap, sizeof(*t->name));
+    }
+    const struct stat *st = &entry->st;
+    size_t row = t->count++;
+    t->size[row] = st->st_size;
+    t->mtime[row] = st->st_mtime;
+    t->inode[row] = st->st_ino;
+    t->mode[row] = st->st_mode;
+    t->uid[row] = st->st_uid;
+    t->gid[row] = st->st_gid;
+    t->name[row] = t->names.len;
+    fs_buf_append(&t->names, entry->name, strlen(entry->name) + 1);
+}
+
+void fs_table_clear(fs_table *t) {
+    t->count = 0;
+    t->names.len = 0;
+}
+
+void fs_table_free(fs_table *t) {
+    free(t->size);
+    free(t->mtime);
+    free(t->inode);
+    free(t->mode);
+    free(t->uid);
+    free(t->gid);
+    free(t->name);
+    fs_buf_free(&t->names);
+    memset(t, 0, sizeof(*t));
+}
+
+#define FS_SCAN_CHUNK 4096
+
+// x86-64 Linux gets an AVX2 clone of the scan kernel, picked at load time
+#if defined(__x86_64__) && defined(__linux__) && !defined(__clang__)
+#define FS_SIMD_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define FS_SIMD_CLONES
+#endif
+
+typedef int64_t fs_i64x4 __attribute__((vector_size(32)));
+typedef uint32_t fs_u32x4 __attribute__((vector_size(16)));
+typedef int32_t fs_i32x4 __attribute__((vector_size(16)));
+
+// keep[i] = 1 if row i of the chunk passes the filter, four rows per step
+FS_SIMD_CLONES
+static void filter_chunk(const int64_t *size, const int64_t *mtime, const uint32_t *mode, size_t n,
+                         const fs_filter *filter, uint8_t *keep) {
+    const int64_t min_size = filter->min_size, max_size = filter->max_size;
+    const int64_t after = filter->modified_after, before = filter->modified_before;
+    const uint32_t type = filter->type;
+    const int32_t any_type = filter->type == 0 ? -1 : 0;
+    const fs_i64x4 vmin = { min_size, min_size, min_size, min_size };
+    const fs_i64x4 vmax = { max_size, max_size, max_size, max_size };
+    const fs_i64x4 vafter = { after, after, after, after };
+    const fs_i64x4 vbefore = { before, before, before, before };
+    const fs_u32x4 vformat = { S_IFMT, S_IFMT, S_IFMT, S_IFMT };
+    const fs_u32x4 vtype = { type, type, type, type };
+    const fs_i32x4 vany = { any_type, any_type, any_type, any_type };
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        fs_i64x4 sz, mt;
+        fs_u32x4 md;
+        memcpy(&sz, size + i, sizeof(sz));
+        memcpy(&mt, mtime + i, sizeof(mt));
+        memcpy(&md, mode + i, sizeof(md));
+        fs_i32x4 type_ok = ((md & vformat) == vtype) | vany;
+        fs_i64x4 ok = (sz >= vmin) & (sz <= vmax) & (mt >= vafter) & (mt <= vbefore) &
+                      __builtin_convertvector(type_ok, fs_i64x4);
+        for (int j = 0; j < 4; j++) keep[i + j] = (uint8_t)(ok[j] & 1);
+    }
+    for (; i < n; i++) {
+        keep[i] = (size[i] >= min_size) & (size[i] <= max_size) &
+                  (mtime[i] >= after) & (mtime[i] <= before) &
+                  ((any_type != 0) | ((mode[i] & S_IFMT) == type));
+    }
+}
+
+size_t fs_table_filter(const fs_table *t, const fs_filter *filter, uint32_t *rows) {
+    uint8_t keep[FS_SCAN_CHUNK];
+    size_t matched = 0;
+    for (size_t base = 0; base < t->count; base += FS_SCAN_CHUNK) {
+        size_t n = t->count - base < FS_SCAN_CHUNK ? t->count - base : FS_SCAN_CHUNK;
+        filter_chunk(t->size + base, t->mtime + base, t->mode + base, n, filter, keep);
+        // Branch-free compaction of the matching row numbers
+        for (size_t i = 0; i < n; i++) {
+            rows[matched] = (uint32_t)(base + i);
+            matched += keep[i];
+        }
+    }
+    return matched;
+}
+
+// Whether row a is ordered before row b
+static int row_before(const fs_table *t, int key, int descending, uint32_t a, uint32_t b) {
+    int cmp = 0;
+    if (key == FS_SORT_NAME) {
+        cmp = strcmp(fs_table_name(t, a), fs_table_name(t, b));
+    } else {
+        const int64_t *column = key == FS_SORT_SIZE ? t->size : t->mtime;
+        cmp = (column[a] > column[b]) - (column[a] < column[b]);
+    }
+    if (descending) cmp = -cmp;
+    return cmp != 0 ? cmp < 0 : a < b;
+}
+
+// Max-heap by sort order: the root is the row that ranks last
+static void heap_sift_down(const fs_table *t, int key, int descending, uint32_t *heap, size_t n, size_t i) {
+    for (;;) {
+        size_t largest = i, left = 2 * i + 1, right = left + 1;
+        if (left < n && row_before(t, key, descending, heap[largest], heap[left])) largest = left;
+        if (right < n && row_before(t, key, descending, heap[largest], heap[right])) largest = right;
+        if (largest == i) return;
+        uint32_t tmp = heap[i];
+        heap[i] = heap[largest];
+        heap[largest] = tmp;
+        i = largest;
+    }
+}
+
+size_t fs_table_top(const fs_table *t, uint32_t *rows, size_t n, int key, int descending, size_t k) {
+    if (k > n) k = n;
+    if (key == FS_SORT_NONE || k == 0) return k;
+
+    for (size_t i = k / 2; i-- > 0;) heap_sift_down(t, key, descending, rows, k, i);
+    for (size_t i = k; i < n; i++) {
+        if (row_before(t, key, descending, rows[i], rows[0])) {
+            rows[0] = rows[i];
+            heap_sift_down(t, key, descending, rows, k, 0);
+        }
+    }
+    // Heapsort the survivors into order
+    for (size_t end = k; end > 1; end--) {
+        uint32_t tmp = rows[0];
+        rows[0] = rows[end - 1];
+        rows[end - 1] = tmp;
+        heap_sift_down(t, key, descending, rows, end - 1, 0);
+    }
+    return k;
+}
+
+const char* fs_file_type(mode_t mode) {
+    if (S_ISDIR(mode)) return "directory";
+    if (S_ISREG(mode)) return "file";
+    if (S_ISLNK(mode)) return "symlink";
+    if (S_ISCHR(mode)) return "char_device";
+    if (S_ISBLK(mode)) return "block_device";
+    if (S_ISFIFO(mode)) return "fifo";
+    if (S_ISSOCK(mode)) return "socket";
+    return "unknown";
+}
+
+/**
+ * @brief Interned id -> name table
+ *
+ * getpwuid/getgrgid can hit NSS (files, LDAP, sssd) on each call, while
+ * directory entries usually share a handful of owners. Names are never
+ * evicted, which keeps returned pointers valid without copying.
+ */
+typedef struct {
+    unsigned int *ids;
+    char **names;       // NULL = empty slot
+    size_t nslots;
+    size_t count;
+    pthread_mutex_t lock;
+} fs_name_cache;
+
+static fs_name_cache user_names = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static fs_name_cache group_names = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static size_t name_slot(const fs_name_cache *cache, unsigned int id) {
+    size_t mask = cache->nslots - 1;
+    size_t i = (id * 2654435761u) & mask;
+    while (cache->names[i] && cache->ids[i] != id) i = (i + 1) & mask;
+    return i;
+}
+
+static void name_cache_grow(fs_name_cache *cache) {
+    fs_name_cache old = *cache;
+    cache->nslots = old.nslots ? old.nslots * 2 : 64;
+    cache->ids = calloc(cache->nslots, sizeof(unsigned int));
+    cache->names = calloc(cache->nslots, sizeof(char *));
+    for (size_t i = 0; i < old.nslots; i++) {
+        if (!old.names[i]) continue;
+        size_t slot = name_slot(cache, old.ids[i]);
+        cache->ids[slot] = old.ids[i];
+        cache->names[slot] = old.names[i];
+    }
+    free(old.ids);
+    free(old.names);
+}
+
+static const char* name_lookup(fs_name_cache *cache, unsigned int id, int is_group) {
+    pthread_mutex_lock(&cache->lock);
+    if (2 * (cache->count + 1) > cache->nslots) name_cache_grow(cache);
+
+    size_t slot = name_slot(cache, id);
+    if (!cache->names[slot]) {
+        char buffer[4096];
+        const char *name = NULL;
+        if (is_group) {
+            struct group grp, *result = NULL;
+            if (getgrgid_r(id, &grp, buffer, sizeof(buffer), &result) == 0 && result) name = grp.gr_name;
+        } else {
+            struct passwd pwd, *result = NULL;
+            if (getpwuid_r(id, &pwd, buffer, sizeof(buffer), &result) == 0 && result) name = pwd.pw_name;
+        }
+        cache->ids[slot] = id;
+        cache->names[slot] = strdup(name ? name : "unknown");
+        cache->count++;
+    }
+    const char *name = cache->names[slot];
+    pthread_mutex_unlock(&cache->lock);
+    return name;
+}
+
+const char* fs_user_name(uid_t uid) {
+    return name_lookup(&user_names, uid, 0);
+}
+
+const char* fs_group_name(gid_t gid) {
+    return name_lookup(&group_names, gid, 1);
+}
+
+void fs_format_permissions(mode_t mode, char *out) {
+    out[0] = S_ISDIR(mode) ? 'd' : '-';
+    out[1] = (mode & S_IRUSR) ? 'r' : '-';
+    out[2] = (mode & S_IWUSR) ? 'w' : '-';
+    out[3] = (mode & S_IXUSR) ? 'x' : '-';
+    out[4] = (mode & S_IRGRP) ? 'r' : '-';
+    out[5] = (mode & S_IWGRP) ? 'w' : '-';
+    out[6] = (mode & S_IXGRP) ? 'x' : '-';
+    out[7] = (mode & S_IROTH) ? 'r' : '-';
+    out[8] = (mode & S_IWOTH) ? 'w' : '-';
+    out[9] = (mode & S_IXOTH) ? 'x' : '-';
+    out[10] = '\0';
+}
+
+void fs_entry_to_json(fs_buf *out, const fs_entry *entry, int pretty) {
+    fs_entry_to_json_as(out, entry, pretty,
+                        fs_user_name(entry->st.st_uid), fs_group_name(entry->st.st_gid));
+}
+
+void fs_entry_to_json_as(fs_buf *out, const fs_entry *entry, int pretty,
+                         const char *owner, const char *group) {
+    const struct stat *st = &entry->st;
+    char permissions[11];
+    char name[FS_PATH_MAX * 2];
+    char path[FS_PATH_MAX * 2];
+    fs_format_permissions(st->st_mode, permissions);
+    json_escape(name, sizeof(name), entry->name);
+    json_escape(path, sizeof(path), entry->path);
+
+    const char *format = pretty ?
+        "{\n"
+        "  \"name\": \"%s\",\n"
+        "  \"path\": \"%s\",\n"
+        "  \"size\": %lld,\n"
+        "  \"owner\": \"%s\",\n"
+        "  \"group\": \"%s\",\n"
+        "  \"uid\": %d,\n"
+        "  \"gid\": %d,\n"
+        "  \"permissions\": \"%03o\",\n"
+        "  \"permissions_readable\": \"%s\",\n"
+        "  \"type\": \"%s\",\n"
+        "  \"modified\": %ld,\n"
+        "  \"accessed\": %ld,\n"
+        "  \"changed\": %ld,\n"
+        "  \"inode\": %llu,\n"
+        "  \"device\": \"%ld\",\n"
+        "  \"hard_links\": %lu,\n"
+        "  \"block_size\": %ld,\n"
+        "  \"blocks\": %lld\n"
+        "}"
+        :
+        "{\"name\":\"%s\",\"path\":\"%s\",\"size\":%lld,\"owner\":\"%s\",\"group\":\"%s\","
+        "\"uid\":%d,\"gid\":%d,\"permissions\":\"%03o\",\"permissions_readable\":\"%s\","
+        "\"type\":\"%s\",\"modified\":%ld,\"accessed\":%ld,\"changed\":%ld,"
+        "\"inode\":%llu,\"device\":\"%ld\",\"hard_links\":%lu,\"block_size\":%ld,\"blocks\":%lld}";
+    if (!owner) {
+        // Dictionary-encoded: the reader maps uid and gid to names itself
+        format =
+            "{\"name\":\"%s\",\"path\":\"%s\",\"size\":%lld,%.0s%.0s"
+            "\"uid\":%d,\"gid\":%d,\"permissions\":\"%03o\",\"permissions_readable\":\"%s\","
+            "\"type\":\"%s\",\"modified\":%ld,\"accessed\":%ld,\"changed\":%ld,"
+            "\"inode\":%llu,\"device\":\"%ld\",\"hard_links\":%lu,\"block_size\":%ld,\"blocks\":%lld}";
+        owner = group = "";
+    }
+
+    fs_buf_printf(out, format,
+                  name, path, (long long)st->st_size,
+                  owner, group,
+                  (int)st->st_uid, (int)st->st_gid, (unsigned int)(st->st_mode & 0777), permissions,
+                  fs_file_type(st->st_mode), (long)st->st_mtime, (long)st->st_atime, (long)st->st_ctime,
+                  (unsigned long long)st->st_ino, (long)st->st_dev, (unsigned long)st->st_nlink,
+                  (long)st->st_blksize, (long long)st->st_blocks);
+}
+
+struct fs_pool {
+    pthread_t *threads;
+    int nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    pthread_mutex_t run_lock;    // one fs_pool_run at a time
+    uint64_t generation;         // bumped for every job, and once more to stop
+    int stopping;
+    int busy;                    // workers still inside the current job
+    void (*fn)(void *ctx, size_t i);
+    void *ctx;
+    size_t n;
+    size_t next;                 // next index to hand out, taken atomically
+};
+
+static void pool_drain(fs_pool *pool) {
+    size_t i;
+    while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->n) {
+        pool->fn(pool->ctx, i);
+    }
+}
+
+static void* pool_worker(void *arg) {
+    fs_pool *pool = arg;
+    uint64_t seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->generation == seen) pthread_cond_wait(&pool->work, &pool->lock);
+        seen = pool->generation;
+        if (pool->stopping) break;
+        pthread_mutex_unlock(&pool->lock);
+        pool_drain(pool);
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0) pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+fs_pool* fs_pool_create(int threads) {
+    if (threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int)cpus : 1;
+    }
+    fs_pool *pool = calloc(1, sizeof(fs_pool));
+    if (!pool) return NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_mutex_init(&pool->run_lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    // The caller of fs_pool_run() is one of the threads
+    pool->threads = calloc((size_t)threads, sizeof(pthread_t));
+    for (int i = 0; i < threads - 1; i++) {
+        if (pthread_create(&pool->threads[i], NULL, pool_worker, pool) != 0) break;
+        pool->nthreads++;
+    }
+    return pool;
+}
+
+void fs_pool_run(fs_pool *pool, size_t n, void (*fn)(void *ctx, size_t i), void *ctx) {
+    pthread_mutex_lock(&pool->run_lock);
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->ctx = ctx;
+    pool->n = n;
+    pool->next = 0;
+    if (n > 1 && pool->nthreads > 0) {
+        pool->busy = pool->nthreads;
+        pool->generation++;
+        pthread_cond_broadcast(&pool->work);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    pool_drain(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy > 0) pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pool->run_lock);
+}
+
+void fs_pool_destroy(fs_pool *pool) {
+    if (!pool) return;
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->nthreads; i++) pthread_join(pool->threads[i], NULL);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->run_lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    free(pool->threads);
+    free(pool);
+}
+
+#define FS_HASH_READ (1024 * 1024)
+#define FS_HASH_CACHE_SLOTS 16384    // direct-mapped, about 1 MB
+
+#ifdef __APPLE__
+#define FS_MTIME_NS(st) ((int64_t)(st)->st_mtimespec.tv_sec * 1000000000LL + (st)->st_mtimespec.tv_nsec)
+#else
+#define FS_MTIME_NS(st) ((int64_t)(st)->st_mtim.tv_sec * 1000000000LL + (st)->st_mtim.tv_nsec)
+#endif
+
+/**
+ * @brief Digests of recently hashed files, keyed by (dev, ino, size, mtime)
+ *
+ * A rewrite that keeps size and mtime (to the nanosecond) is not noticed;
+ * that is the same trade rsync and git's index make.
+ */
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    int64_t mtime_ns;
+    uint8_t digest[FS_HASH_LEN];
+    int valid;
+} fs_hash_slot;
+
+static fs_hash_slot *hash_cache;
+static pthread_mutex_t hash_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t hash_slot(const struct stat *st) {
+    uint64_t key = (uint64_t)st->st_ino * 0x9E3779B97F4A7C15ULL ^ (uint64_t)st->st_dev;
+    return (size_t)(key >> 32) & (FS_HASH_CACHE_SLOTS - 1);
+}
+
+static int hash_cache_get(const struct stat *st, uint8_t out[FS_HASH_LEN]) {
+    int hit = 0;
+    pthread_mutex_lock(&hash_cache_lock);
+    if (hash_cache) {
+        const fs_hash_slot *s = &hash_cache[hash_slot(st)];
+        if (s->valid && s->dev == st->st_dev && s->ino == st->st_ino &&
+            s->size == st->st_size && s->mtime_ns == FS_MTIME_NS(st)) {
+            memcpy(out, s->digest, FS_HASH_LEN);
+            hit = 1;
+        }
+    }
+    pthread_mutex_unlock(&hash_cache_lock);
+    return hit;
+}
+
+static void hash_cache_put(const struct stat *st, const uint8_t digest[FS_HASH_LEN]) {
+    pthread_mutex_lock(&hash_cache_lock);
+    if (!hash_cache) hash_cache = calloc(FS_HASH_CACHE_SLOTS, sizeof(fs_hash_slot));
+    if (hash_cache) {
+        fs_hash_slot *s = &hash_cache[hash_slot(st)];
+        s->dev = st->st_dev;
+        s->ino = st->st_ino;
+        s->size = st->st_size;
+        s->mtime_ns = FS_MTIME_NS(st);
+        memcpy(s->digest, digest, FS_HASH_LEN);
+        s->valid = 1;
+    }
+    pthread_mutex_unlock(&hash_cache_lock);
+}
+
+int fs_hash_file(int dirfd, const char *path, const struct stat *st, uint8_t out[FS_HASH_LEN]) {
+    if (st && S_ISREG(st->st_mode) && hash_cache_get(st, out)) return 0;
+
+    int fd = openat(dirfd, path, O_RDONLY | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0) return -1;
+    struct stat opened;
+    if (fstat(fd, &opened) != 0) goto fail;
+    if (!S_ISREG(opened.st_mode)) {
+        errno = EINVAL;
+        goto fail;
+    }
+    if (!st && hash_cache_get(&opened, out)) {
+        close(fd);
+        return 0;
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    // Doubles the kernel's readahead window for the sequential pass
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    size_t chunk = opened.st_size < FS_HASH_READ ? (size_t)opened.st_size + 1 : FS_HASH_READ;
+    uint8_t *buffer = malloc(chunk);
+    if (!buffer) goto fail;
+    fs_blake3 hasher;
+    fs_blake3_init(&hasher);
+    for (;;) {
+        ssize_t n = read(fd, buffer, chunk);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            free(buffer);
+            goto fail;
+        }
+        if (n == 0) break;
+        fs_blake3_update(&hasher, buffer, (size_t)n);
+    }
+    free(buffer);
+    fs_blake3_final(&hasher, out);
+
+    // Only cache what provably matches the stat taken before reading
+    struct stat after;
+    if (fstat(fd, &after) == 0 && after.st_size == opened.st_size &&
+        FS_MTIME_NS(&after) == FS_MTIME_NS(&opened)) {
+        hash_cache_put(&opened, out);
+    }
+    close(fd);
+    return 0;
+
+fail:;
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return -1;
+}
+
+int fs_hash_edges(int dirfd, const char *path, const struct stat *st, uint8_t out[FS_HASH_LEN]) {
+    if (st->st_size <= 2 * FS_HASH_EDGE) return fs_hash_file(dirfd, path, st, out);
+
+    int fd = openat(dirfd, path, O_RDONLY | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0) return -1;
+    uint8_t buffer[2 * FS_HASH_EDGE];
+    ssize_t head = pread(fd, buffer, FS_HASH_EDGE, 0);
+    ssize_t tail = pread(fd, buffer + FS_HASH_EDGE, FS_HASH_EDGE, st->st_size - FS_HASH_EDGE);
+    int saved = errno;
+    close(fd);
+    if (head != FS_HASH_EDGE || tail != FS_HASH_EDGE) {
+        // Short reads mean the file shrank since st was taken
+        errno = head < 0 || tail < 0 ? saved : ESTALE;
+        return -1;
+    }
+    fs_blake3 hasher;
+    fs_blake3_init(&hasher);
+    fs_blake3_update(&hasher, buffer, sizeof(buffer));
+    fs_blake3_final(&hasher, out);
+    return 0;
+}
+
+void fs_hash_hex(const uint8_t digest[FS_HASH_LEN], char out[2 * FS_HASH_LEN + 1]) {
+    static const char hex[] = "0123456789abcdef";
+    for (int i = 0; i < FS_HASH_LEN; i++) {
+        out[2 * i] = hex[digest[i] >> 4];
+        out[2 * i + 1] = hex[digest[i] & 0xf];
+    }
+    out[2 * FS_HASH_LEN] = '\0';
+}
+
+typedef struct {
+    int dirfd;
+    fs_hash_job *jobs;
+    int flags;
+} fs_hash_batch;
+
+static void hash_one(void *ctx, size_t i) {
+    fs_hash_batch *batch = ctx;
+    fs_hash_job *job = &batch->jobs[i];
+    int rc = batch->flags & FS_HASH_EDGES ?
+             fs_hash_edges(batch->dirfd, job->path, job->st, job->digest) :
+             fs_hash_file(batch->dirfd, job->path, job->st, job->digest);
+    job->error = rc == 0 ? 0 : errno;
+}
+
+void fs_hash_files(fs_pool *pool, int dirfd, fs_hash_job *jobs, size_t n, int flags) {
+    fs_hash_batch batch = { dirfd, jobs, flags };
+    if (pool) {
+        fs_pool_run(pool, n, hash_one, &batch);
+    } else {
+        for (size_t i = 0; i < n; i++) hash_one(&batch, i);
+    }
+}
+
+typedef struct {
+    uint16_t offset;
+    uint8_t len;
+    const char *magic;
+    const char *type;
+} fs_magic;
+
+// First match wins; offsets must stay below FS_SNIFF_LEN
+static const fs_magic magic_table[] = {
+    { 0, 4, "\x7f" "ELF", "application/x-elf" },
+    { 0, 8, "\x89PNG\r\n\x1a\n", "image/png" },
+    { 0, 3, "\xff\xd8\xff", "image/jpeg" },
+    { 0, 6, "GIF87a", "image/gif" },
+    { 0, 6, "GIF89a", "image/gif" },
+    { 0, 2, "\x1f\x8b", "application/gzip" },
+    { 0, 4, "PK\x03\x04", "application/zip" },
+    { 0, 4, "PK\x05\x06", "application/zip" },
+    { 0, 5, "%PDF-", "application/pdf" },
+    { 0, 3, "BZh", "application/x-bzip2" },
+    { 0, 6, "\xfd" "7zXZ\x00", "application/x-xz" },
+    { 0, 4, "\x28\xb5\x2f\xfd", "application/zstd" },
+    { 0, 6, "7z\xbc\xaf\x27\x1c", "application/x-7z-compressed" },
+    { 257, 5, "ustar", "application/x-tar" },
+    { 0, 16, "SQLite format 3\0", "application/vnd.sqlite3" },
+    { 0, 4, "\0asm", "application/wasm" },
+    { 0, 4, "\xcf\xfa\xed\xfe", "application/x-mach-binary" },
+    { 0, 4, "\xce\xfa\xed\xfe", "application/x-mach-binary" },
+    { 0, 2, "MZ", "application/vnd.microsoft.portable-executable" },
+    { 0, 4, "OggS", "audio/ogg" },
+    { 0, 4, "fLaC", "audio/flac" },
+    { 0, 3, "ID3", "audio/mpeg" },
+    { 8, 4, "WAVE", "audio/wav" },
+    { 8, 4, "WEBP", "image/webp" },
+    { 4, 4, "ftyp", "video/mp4" },
+    { 0, 5, "<?xml", "text/xml" },
+    { 0, 3, "\xef\xbb\xbf", "text/plain; charset=utf-8" },
+    { 0, 2, "\xff\xfe", "text/plain; charset=utf-16le" },
+    { 0, 2, "\xfe\xff", "text/plain; charset=utf-16be" },
+};
+
+// Valid UTF-8 without NULs or stray control bytes; a sequence cut off by the read limit is fine
+static int looks_like_text(const uint8_t *p, size_t len, int truncated, int *ascii) {
+    *ascii = 1;
+    for (size_t i = 0; i < len; ) {
+        uint8_t c = p[i];
+        if (c < 0x80) {
+            if (c < 0x20 && c != '\t' && c != '\n' && c != '\r' && c != '\f' && c != '\b' && c != 0x1b) return 0;
+            if (c == 0x7f) return 0;
+            i++;
+            continue;
+        }
+        *ascii = 0;
+        size_t n = c >= 0xf0 && c <= 0xf4 ? 4 : c >= 0xe0 ? 3 : c >= 0xc2 && c < 0xe0 ? 2 : 0;
+        if (n == 0 || c > 0xf4) return 0;
+        for (size_t k = 1; k < n; k++) {
+            if (i + k == len) return truncated;
+            if ((p[i + k] & 0xc0) != 0x80) return 0;
+        }
+        i += n;
+    }
+    return 1;
+}
+
+const char* fs_sniff_buffer(const void *data, size_t len, int truncated) {
+    const uint8_t *p = data;
+    if (len == 0) return "inode/x-empty";
+    for (size_t i = 0; i < sizeof(magic_table) / sizeof(magic_table[0]); i++) {
+        const fs_magic *m = &magic_table[i];
+        if (m->offset + m->len <= len && memcmp(p + m->offset, m->magic, m->len) == 0) return m->type;
+    }
+    int ascii;
+    if (!looks_like_text(p, len, truncated, &ascii)) return "application/octet-stream";
+
+    size_t i = 0;
+    while (i < len && (p[i] == ' ' || p[i] == '\t' || p[i] == '\n' || p[i] == '\r')) i++;
+    if ((len - i >= 14 && strncasecmp((const char *)p + i, "<!doctype html", 14) == 0) ||
+        (len - i >= 5 && strncasecmp((const char *)p + i, "<html", 5) == 0)) {
+        return "text/html";
+    }
+    return ascii ? "text/plain" : "text/plain; charset=utf-8";
+}
+
+const char* fs_sniff_file(int dirfd, const char *path) {
+    int fd = openat(dirfd, path, O_RDONLY | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0) return NULL;
+#ifdef POSIX_FADV_RANDOM
+    // Without this a 512-byte read pulls in a whole readahead window
+    posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+#endif
+    // Exactly FS_SNIFF_LEN: one more byte would read into the next block
+    uint8_t buffer[FS_SNIFF_LEN];
+    size_t len = 0;
+    struct stat st;
+    int rc = fstat(fd, &st);
+    while (rc == 0 && len < sizeof(buffer)) {
+        ssize_t n = read(fd, buffer + len, sizeof(buffer) - len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) rc = -1;
+        if (n <= 0) break;
+        len += (size_t)n;
+    }
+    if (rc != 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return NULL;
+    }
+    close(fd);
+    return fs_sniff_buffer(buffer, len, st.st_size > FS_SNIFF_LEN);
+}
+
+// Snapshot file: a 32-byte header, the root path, then one record per entry
+// sorted by (inode, path). Integers are host byte order, like file_info's
+// Arrow output.
+//
+//   header  "FSSNAP1\n" | u64 count | i64 taken_ns | u32 root_len | u32 0
+//   record  u64 ino | u64 size | i64 mtime_ns | i64 btime_ns | u32 mode | u16 path_len | path
+#define FS_SNAPSHOT_MAGIC "FSSNAP1\n"
+#define FS_SNAPSHOT_HEADER 32
+#define FS_SNAPSHOT_RECORD 38
+#define FS_SNAPSHOT_IO (1024 * 1024)
+
+typedef struct {
+    uint64_t ino;
+    const char *record;    // offset into the record buffer until the walk is done
+} snapshot_key;
+
+static int snapshot_key_cmp(const void *a, const void *b) {
+    const snapshot_key *x = a, *y = b;
+    if (x->ino != y->ino) return x->ino < y->ino ? -1 : 1;
+    uint16_t xl, yl;
+    memcpy(&xl, x->record + 36, 2);
+    memcpy(&yl, y->record + 36, 2);
+    int c = memcmp(x->record + FS_SNAPSHOT_RECORD, y->record + FS_SNAPSHOT_RECORD, xl < yl ? xl : yl);
+    return c ? c : (xl > yl) - (xl < yl);
+}
+
+// Creation time, which tells a renamed file from a new one that reused its inode; 0 if unknown
+static int64_t snapshot_btime(int dirfd, const char *name) {
+#ifdef STATX_BTIME
+    struct statx stx;
+    if (statx(dirfd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, STATX_BTIME, &stx) == 0 &&
+        (stx.stx_mask & STATX_BTIME)) {
+        return (int64_t)stx.stx_btime.tv_sec * 1000000000LL + stx.stx_btime.tv_nsec;
+    }
+#else
+    (void)dirfd;
+    (void)name;
+#endif
+    return 0;
+}
+
+static void snapshot_add(fs_buf *records, const struct stat *st, int64_t btime_ns, const char *path, size_t len) {
+    uint8_t head[FS_SNAPSHOT_RECORD];
+    uint64_t ino = (uint64_t)st->st_ino, size = (uint64_t)st->st_size;
+    int64_t mtime_ns = FS_MTIME_NS(st);
+    uint32_t mode = (uint32_t)st->st_mode;
+    uint16_t path_len = (uint16_t)len;
+    memcpy(head, &ino, 8);
+    memcpy(head + 8, &size, 8);
+    memcpy(head + 16, &mtime_ns, 8);
+    memcpy(head + 24, &btime_ns, 8);
+    memcpy(head + 32, &mode, 4);
+    memcpy(head + 36, &path_len, 2);
+    fs_buf_append(records, head, sizeof(head));
+    fs_buf_append(records, path, len);
+}
+
+long long fs_snapshot_write(const char *root, FILE *out) {
+    struct stat root_st;
+    if (stat(root, &root_st) != 0) return -1;
+    if (!S_ISDIR(root_st.st_mode)) {
+        errno = ENOTDIR;
+        return -1;
+    }
+
+    // Breadth-first; dirs holds the NUL-terminated path of every directory still to read
+    fs_buf dirs = {0}, records = {0};
+    snapshot_key *keys = NULL;
+    size_t count = 0, cap = 0;
+    size_t skip = strcmp(root, ".") == 0 ? 0 : strlen(root) + 1;    // "root/" in fs_dir paths
+    fs_buf_append(&dirs, root, strlen(root) + 1);
+    for (size_t d = 0; d < dirs.len; d += strlen(dirs.data + d) + 1) {
+        fs_dir *dir = fs_dir_open(dirs.data + d, FS_LIST_HIDDEN | FS_LIST_NOFOLLOW);
+        if (!dir && errno == ENAMETOOLONG) {
+            // Leaving the subtree out would record its files as deleted
+            fs_buf_free(&dirs);
+            fs_buf_free(&records);
+            free(keys);
+            return -1;
+        }
+        if (!dir) continue;
+        const fs_entry *entry;
+        while ((entry = fs_dir_next(dir))) {
+            if (entry->st.st_dev != root_st.st_dev) continue;    // a mount point
+            size_t len = strlen(entry->path);
+            if (len <= skip) continue;
+            if (count == cap) {
+                cap = cap ? cap * 2 : 4096;
+                keys = table_column(keys, cap, sizeof(snapshot_key));
+            }
+            keys[count].ino = (uint64_t)entry->st.st_ino;
+            keys[count++].record = (const char *)(uintptr_t)records.len;
+            snapshot_add(&records, &entry->st, snapshot_btime(dir->fd, entry->name),
+                         entry->path + skip, len - skip);
+            if (S_ISDIR(entry->st.st_mode)) fs_buf_append(&dirs, entry->path, len + 1);
+        }
+        fs_dir_close(dir);
+    }
+    fs_buf_free(&dirs);
+
+    for (size_t i = 0; i < count; i++) keys[i].record = records.data + (uintptr_t)keys[i].record;
+    qsort(keys, count, sizeof(snapshot_key), snapshot_key_cmp);
+
+    char resolved[PATH_MAX];
+    const char *name = realpath(root, resolved) ? resolved : root;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint8_t header[FS_SNAPSHOT_HEADER] = {0};
+    uint64_t total = count;
+    int64_t taken_ns = (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+    uint32_t root_len = (uint32_t)strlen(name);
+    memcpy(header, FS_SNAPSHOT_MAGIC, 8);
+    memcpy(header + 8, &total, 8);
+    memcpy(header + 16, &taken_ns, 8);
+    memcpy(header + 24, &root_len, 4);
+    fwrite(header, 1, sizeof(header), out);
+    fwrite(name, 1, root_len, out);
+    for (size_t i = 0; i < count; i++) {
+        uint16_t path_len;
+        memcpy(&path_len, keys[i].record + 36, 2);
+        fwrite(keys[i].record, 1, FS_SNAPSHOT_RECORD + path_len, out);
+    }
+    free(keys);
+    fs_buf_free(&records);
+    if (fflush(out) != 0 || ferror(out)) return -1;
+    return (long long)count;
+}
+
+struct fs_snapshot {
+    FILE *file;
+    char *root;
+    uint64_t count;
+    uint64_t read;
+    int64_t taken_ns;
+    int error;
+    fs_snapshot_entry entry;
+    char path[UINT16_MAX + 1];    // any path_len a record can hold
+};
+
+fs_snapshot* fs_snapshot_open(const char *file) {
+    FILE *f = fopen(file, "rb");
+    if (!f) return NULL;
+    setvbuf(f, NULL, _IOFBF, FS_SNAPSHOT_IO);
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fileno(f), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    uint8_t header[FS_SNAPSHOT_HEADER];
+    uint32_t root_len = 0;
+    fs_snapshot *snap = calloc(1, sizeof(fs_snapshot));
+    if (fread(header, 1, sizeof(header), f) == sizeof(header) &&
+        memcmp(header, FS_SNAPSHOT_MAGIC, 8) == 0) {
+        memcpy(&snap->count, header + 8, 8);
+        memcpy(&snap->taken_ns, header + 16, 8);
+        memcpy(&root_len, header + 24, 4);
+        snap->root = root_len < PATH_MAX ? malloc(root_len + 1) : NULL;
+    }
+    if (!snap->root || fread(snap->root, 1, root_len, f) != root_len) {
+        fclose(f);
+        free(snap->root);
+        free(snap);
+        errno = EINVAL;
+        return NULL;
+    }
+    snap->root[root_len] = '\0';
+    snap->file = f;
+    snap->entry.path = snap->path;
+    return snap;
+}
+
+const fs_snapshot_entry* fs_snapshot_next(fs_snapshot *snap) {
+    if (snap->error || snap->read == snap->count) return NULL;
+    uint8_t head[FS_SNAPSHOT_RECORD];
+    uint16_t path_len;
+    uint64_t prev = snap->entry.ino;
+    fs_snapshot_entry *e = &snap->entry;
+    int ok = fread(head, 1, sizeof(head), snap->file) == sizeof(head);
+    if (ok) {
+        memcpy(&e->ino, head, 8);
+        memcpy(&e->size, head + 8, 8);
+        memcpy(&e->mtime_ns, head + 16, 8);
+        memcpy(&e->btime_ns, head + 24, 8);
+        memcpy(&e->mode, head + 32, 4);
+        memcpy(&path_len, head + 36, 2);
+        ok = !(snap->read && e->ino < prev) &&
+             fread(snap->path, 1, path_len, snap->file) == path_len;
+    }
+    if (!ok) {
+        snap->error = ferror(snap->file) ? EIO : EINVAL;
+        return NULL;
+    }
+    snap->path[path_len] = '\0';
+    e->path_len = path_len;
+    snap->read++;
+    return e;
+}
+
+int fs_snapshot_error(const fs_snapshot *snap) {
+    return snap->error;
+}
+
+const char* fs_snapshot_root(const fs_snapshot *snap) {
+    return snap->root;
+}
+
+int64_t fs_snapshot_taken(const fs_snapshot *snap) {
+    return snap->taken_ns;
+}
+
+uint64_t fs_snapshot_count(const fs_snapshot *snap) {
+    return snap->count;
+}
+
+void fs_snapshot_close(fs_snapshot *snap) {
+    if (!snap) return;
+    fclose(snap->file);
+    free(snap->root);
+    free(snap);
+}
@@ -0,0 +1,413 @@
+#ifndef LIBFILESAVANT_H
+#define LIBFILESAVANT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// libfilesavant - directory listing core shared by file_info,
+// file_info_mcp_server and the _filesavant Python extension
+
+/**
+ * @brief Growable output buffer that responses and listings are rendered into
+ */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} fs_buf;
+
+void fs_buf_reserve(fs_buf *b, size_t extra);
+void fs_buf_append(fs_buf *b, const void *data, size_t len);
+void fs_buf_printf(fs_buf *b, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void fs_buf_putc(fs_buf *b, char c);
+void fs_buf_free(fs_buf *b);
+void fs_buf_json_string(fs_buf *b, const char *s);    // quoted and escaped
+
+/**
+ * @brief Bump allocator for memory that lives exactly as long as one request
+ *
+ * Allocations are carved from one block and released together by
+ * fs_arena_reset(). A request that outgrows the block chains overflow
+ * blocks; the next reset replaces them with a single block of the combined
+ * size, so a steady workload stops calling malloc altogether.
+ */
+typedef struct fs_arena_block fs_arena_block;
+
+typedef struct {
+    fs_arena_block *blocks;    // current block first
+    size_t used;               // bytes handed out from the current block
+    size_t total;              // capacity of the whole chain
+} fs_arena;
+
+void* fs_arena_alloc(fs_arena *a, size_t size);    // 16-byte aligned, never NULL
+char* fs_arena_strndup(fs_arena *a, const char *s, size_t len);
+void fs_arena_reset(fs_arena *a);
+void fs_arena_free(fs_arena *a);
+
+/**
+ * @brief One directory entry and its stat() metadata
+ *
+ * name and path point into the iterator and stay valid until the next
+ * fs_dir_next() call. path is "name" when listing "." and "dir/name" otherwise.
+ */
+typedef struct {
+    const char *name;
+    const char *path;
+    struct stat st;
+} fs_entry;
+
+typedef struct fs_dir fs_dir;
+
+// fs_dir_open flags
+#define FS_LIST_HIDDEN 0x1    // include dot files (skipped by default)
+#define FS_LIST_TIMED  0x2    // accumulate fs_dir_times (two clock reads per phase)
+#define FS_LIST_NOFOLLOW 0x4  // lstat semantics: symlinks are reported, not followed
+
+/**
+ * @brief Time an FS_LIST_TIMED iterator has spent in the kernel so far
+ */
+typedef struct {
+    uint64_t opendir_ns;
+    uint64_t enumerate_ns;    // readdir, including skipped entries
+    uint64_t stat_ns;
+} fs_dir_times;
+
+/**
+ * @brief Opens a directory for iteration
+ * @return Iterator, or NULL with errno set
+ */
+fs_dir* fs_dir_open(const char *directory, int flags);
+
+/**
+ * @brief fs_dir_open with the iterator and its read buffer carved from arena
+ *
+ * On Linux the directory is read with getdents64 into that buffer, so
+ * listing allocates nothing; fs_dir_close() still closes the descriptor.
+ */
+fs_dir* fs_dir_open_in(const char *directory, int flags, fs_arena *arena);
+
+/**
+ * @brief Advances to the next entry that could be stat()ed
+ * @return Entry owned by the iterator, or NULL at the end of the directory
+ */
+const fs_entry* fs_dir_next(fs_dir *dir);
+
+/**
+ * @brief Re-reads one entry of an open directory by name
+ * @return Entry shaped like fs_dir_next()'s (name is the caller's pointer), or NULL if it is gone
+ */
+const fs_entry* fs_dir_lookup(fs_dir *dir, const char *name);
+
+void fs_dir_close(fs_dir *dir);
+
+/**
+ * @brief Phase times of an iterator opened with FS_LIST_TIMED (zeros otherwise)
+ */
+const fs_dir_times* fs_dir_timing(const fs_dir *dir);
+
+/**
+ * @brief Compiled shell-style pattern for matching file names
+ *
+ * Supports *, ?, [a-z], [!...] or [^...], {a,b,...} (nestable) and \ escapes.
+ * ? and bracket expressions match one UTF-8 character. The pattern is
+ * compiled to a DFA once, so a match reads each byte of the name once.
+ */
+typedef struct fs_glob fs_glob;
+
+#define FS_GLOB_NOCASE 0x1    // ASCII letters match either case
+
+/**
+ * @brief Compiles pattern into memory of its own
+ * @return Glob to release with fs_glob_free(), or NULL with errno set
+ *         (EINVAL for a reversed range such as [z-a], E2BIG when the DFA
+ *         would exceed 4096 states)
+ */
+fs_glob* fs_glob_compile(const char *pattern, int flags);
+
+/**
+ * @brief fs_glob_compile with every table carved from arena; fs_glob_free() is a no-op
+ */
+fs_glob* fs_glob_compile_in(const char *pattern, int flags, fs_arena *arena);
+
+int fs_glob_match(const fs_glob *glob, const char *name);
+void fs_glob_free(fs_glob *glob);
+
+/**
+ * @brief Makes fs_dir_next() skip names glob rejects, before they are stat()ed
+ *
+ * glob must outlive the iterator; NULL lists everything again.
+ */
+void fs_dir_set_glob(fs_dir *dir, const fs_glob *glob);
+
+/**
+ * @brief Compiled regular expression for filtering file names
+ *
+ * Searches like grep -E: a match anywhere in the name counts unless the
+ * pattern is anchored with ^ or $. Supports literals, ., [...] and [^...],
+ * \d \w \s (and \D \W \S), groups ( ) and (?: ), |, and the quantifiers
+ * * + ? {m} {m,} {m,n} (lazy forms match the same names). There are no
+ * backreferences or lookaround, so matching takes time linear in the name:
+ * the DFA is built lazily in a bounded cache that is flushed when full.
+ *
+ * Matching updates that cache, so one fs_regex must not be shared between
+ * threads.
+ */
+typedef struct fs_regex fs_regex;
+
+#define FS_REGEX_NOCASE FS_GLOB_NOCASE
+
+/**
+ * @brief Compiles pattern into memory of its own
+ * @return Regex to release with fs_regex_free(), or NULL with errno set
+ *         (EINVAL for bad syntax, including a reversed range such as
+ *         [z-a], E2BIG for more than 65536 NFA states)
+ */
+fs_regex* fs_regex_compile(const char *pattern, int flags);
+
+/**
+ * @brief fs_regex_compile with the automaton and its cache carved from arena
+ */
+fs_regex* fs_regex_compile_in(const char *pattern, int flags, fs_arena *arena);
+
+int fs_regex_match(fs_regex *re, const char *name);
+void fs_regex_free(fs_regex *re);
+
+/**
+ * @brief Makes fs_dir_next() skip names re does not match, before they are stat()ed
+ */
+void fs_dir_set_regex(fs_dir *dir, fs_regex *re);
+
+/**
+ * @brief CLOCK_MONOTONIC in nanoseconds
+ */
+uint64_t fs_now_ns(void);
+
+/**
+ * @brief Compact struct-of-arrays listing for sorting, filtering and paging
+ *
+ * Each column is a packed array, so a scan only touches the bytes it
+ * compares: 44 bytes per entry plus the NUL-terminated name in the shared
+ * heap, against 144 for a struct stat. Rows that are finally returned get
+ * their full metadata back from fs_dir_lookup().
+ */
+typedef struct {
+    size_t count;
+    size_t cap;
+    int64_t *size;
+    int64_t *mtime;
+    uint64_t *inode;
+    uint32_t *mode;
+    uint32_t *uid;
+    uint32_t *gid;
+    uint64_t *name;       // offset of each name in names, past 4 GiB too
+    fs_buf names;
+} fs_table;
+
+void fs_table_add(fs_table *t, const fs_entry *entry);
+void fs_table_clear(fs_table *t);    // empties the table, keeps its capacity
+void fs_table_free(fs_table *t);
+
+static inline const char* fs_table_name(const fs_table *t, size_t row) {
+    return t->names.data + t->name[row];
+}
+
+/**
+ * @brief Row predicate for fs_table_filter(); bounds are inclusive
+ */
+typedef struct {
+    int64_t min_size;
+    int64_t max_size;
+    int64_t modified_after;
+    int64_t modified_before;
+    uint32_t type;        // S_IFREG, S_IFDIR, ...; 0 matches every type
+} fs_filter;
+
+#define FS_FILTER_ALL { INT64_MIN, INT64_MAX, INT64_MIN, INT64_MAX, 0 }
+
+/**
+ * @brief Writes the indices of matching rows to rows (room for t->count)
+ * @return Number of matching rows
+ */
+size_t fs_table_filter(const fs_table *t, const fs_filter *filter, uint32_t *rows);
+
+enum { FS_SORT_NONE, FS_SORT_NAME, FS_SORT_SIZE, FS_SORT_MODIFIED };
+
+/**
+ * @brief Moves the first k rows by key to the front of rows, in order
+ *
+ * Bounded heap selection, O(n log k); ties keep directory order.
+ * @return min(k, n)
+ */
+size_t fs_table_top(const fs_table *t, uint32_t *rows, size_t n, int key, int descending, size_t k);
+
+/**
+ * @brief Determines file type from mode
+ * @param mode File mode from stat structure
+ * @return String representation of file type
+ */
+const char* fs_file_type(mode_t mode);
+
+/**
+ * @brief Resolves a uid/gid to its name, "unknown" if there is none
+ *
+ * Names are cached for the life of the process and the returned pointers
+ * never change, so callers may keep them. Safe to call from any thread.
+ */
+const char* fs_user_name(uid_t uid);
+const char* fs_group_name(gid_t gid);
+
+/**
+ * @brief Formats mode as ls-style "drwxr-xr-x" into out (11 bytes)
+ */
+void fs_format_permissions(mode_t mode, char *out);
+
+/**
+ * @brief Appends the JSON object for one entry
+ * @param pretty Non-zero for the indented file_info layout, zero for one line
+ */
+void fs_entry_to_json(fs_buf *out, const fs_entry *entry, int pretty);
+
+/**
+ * @brief fs_entry_to_json with owner/group already resolved by the caller
+ *
+ * A NULL owner leaves out both name fields (compact form only), for readers
+ * that map uid and gid to names from a table of their own.
+ */
+void fs_entry_to_json_as(fs_buf *out, const fs_entry *entry, int pretty,
+                         const char *owner, const char *group);
+
+/**
+ * @brief Fixed set of worker threads for parallel-for jobs
+ */
+typedef struct fs_pool fs_pool;
+
+/**
+ * @brief Starts threads - 1 workers; the caller of fs_pool_run() is the last one
+ * @param threads Pool size, or <= 0 for one per online CPU
+ */
+fs_pool* fs_pool_create(int threads);
+
+/**
+ * @brief Calls fn(ctx, i) for every i in [0, n) across the pool, returns when all are done
+ */
+void fs_pool_run(fs_pool *pool, size_t n, void (*fn)(void *ctx, size_t i), void *ctx);
+
+void fs_pool_destroy(fs_pool *pool);
+
+#define FS_HASH_LEN 32    // BLAKE3-256
+
+/**
+ * @brief BLAKE3 of a regular file's contents
+ *
+ * Digests are cached by (dev, ino, size, mtime); when st is given a cache
+ * hit does not even open the file.
+ * @param dirfd Directory a relative path is resolved against, or AT_FDCWD
+ * @param st The caller's stat of path, or NULL
+ * @return 0, or -1 with errno set (EINVAL for anything but a regular file)
+ */
+int fs_hash_file(int dirfd, const char *path, const struct stat *st, uint8_t out[FS_HASH_LEN]);
+
+#define FS_HASH_EDGE 4096
+
+/**
+ * @brief BLAKE3 of the first and last FS_HASH_EDGE bytes, a cheap pre-filter for equal-size files
+ *
+ * Files of at most 2 * FS_HASH_EDGE bytes get their full (cached) digest
+ * instead, so for them the result is conclusive. st is required.
+ */
+int fs_hash_edges(int dirfd, const char *path, const struct stat *st, uint8_t out[FS_HASH_LEN]);
+
+void fs_hash_hex(const uint8_t digest[FS_HASH_LEN], char out[2 * FS_HASH_LEN + 1]);
+
+/**
+ * @brief One file of an fs_hash_files() batch
+ */
+typedef struct {
+    const char *path;
+    const struct stat *st;         // may be NULL
+    uint8_t digest[FS_HASH_LEN];
+    int error;                     // errno, 0 on success
+} fs_hash_job;
+
+// fs_hash_files flags
+#define FS_HASH_EDGES 0x1    // fs_hash_edges() instead of fs_hash_file()
+
+/**
+ * @brief fs_hash_file() over jobs, in parallel on pool (or inline when pool is NULL)
+ */
+void fs_hash_files(fs_pool *pool, int dirfd, fs_hash_job *jobs, size_t n, int flags);
+
+#define FS_SNIFF_LEN 512
+
+/**
+ * @brief MIME type from a file's leading bytes
+ *
+ * A magic-number table covers common binary formats (ELF, PNG, JPEG, gzip,
+ * zip, PDF, ...); anything else is text/plain when it is valid UTF-8 and
+ * application/octet-stream otherwise.
+ * @param truncated Non-zero when the file continues past data, so a cut-off UTF-8 sequence is allowed
+ */
+const char* fs_sniff_buffer(const void *data, size_t len, int truncated);
+
+/**
+ * @brief fs_sniff_buffer() over at most the first FS_SNIFF_LEN bytes of path
+ * @return Static type string, or NULL with errno set if the file cannot be read
+ */
+const char* fs_sniff_file(int dirfd, const char *path);
+
+/**
+ * @brief One file of a snapshot
+ *
+ * path is relative to the snapshot root, NUL-terminated, and owned by the
+ * reader until the next fs_snapshot_next() call.
+ */
+typedef struct {
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_ns;
+    int64_t btime_ns;     // creation time, 0 where the filesystem does not keep one
+    uint32_t mode;
+    const char *path;
+    size_t path_len;
+} fs_snapshot_entry;
+
+/**
+ * @brief Records every entry under root (hidden files included, symlinks not
+ * followed, other filesystems not entered) to out, sorted by (inode, path)
+ *
+ * Records are 38 bytes plus the path; the sort is done in memory, so a
+ * snapshot costs about its own size plus 16 bytes per entry while it is taken.
+ * @return Number of entries written, or -1 with errno set
+ */
+long long fs_snapshot_write(const char *root, FILE *out);
+
+typedef struct fs_snapshot fs_snapshot;
+
+/**
+ * @brief Opens a snapshot file for one sequential pass
+ * @return Reader, or NULL with errno set (EINVAL if it is not a snapshot)
+ */
+fs_snapshot* fs_snapshot_open(const char *file);
+
+/**
+ * @brief Advances to the next record in (inode, path) order
+ * @return Record owned by the reader, or NULL at the end or on error (see fs_snapshot_error())
+ */
+const fs_snapshot_entry* fs_snapshot_next(fs_snapshot *snap);
+
+/**
+ * @brief errno of the failure that ended the pass, 0 after a clean end
+ *
+ * A file that is cut short or out of order fails with EINVAL.
+ */
+int fs_snapshot_error(const fs_snapshot *snap);
+
+const char* fs_snapshot_root(const fs_snapshot *snap);
+int64_t fs_snapshot_taken(const fs_snapshot *snap);       // CLOCK_REALTIME, ns
+uint64_t fs_snapshot_count(const fs_snapshot *snap);
+void fs_snapshot_close(fs_snapshot *snap);
+
+#endif
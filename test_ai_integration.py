@@ -1,7 +1,56 @@
+import gzip
+import json
+import mmap
+import os
+import resource
+import shutil
+import socket
+import struct
+import subprocess
+import tempfile
+import threading
+import time
 import unittest
 from unittest.mock import patch, MagicMock
 
-from ai_integration import find_file, run_file_info_simple_rpc, answer_file_question_with_ai, format_file_size, format_timestamp
+try:
+    import lz4.frame
+except ImportError:
+    lz4 = None
+
+try:
+    import pyarrow.ipc
+except ImportError:
+    pyarrow = None
+
+from ai_integration import FileSavantClient, FileSavantError, find_file, run_file_info_simple_rpc, run_file_info_inprocess, run_file_info_shm_rpc, receive_shm_ring, answer_file_question_with_ai, format_file_size, format_timestamp
+
+class FakeServerProcess:
+    """Stands in for a file_info_mcp_server child: answers each request line over a real pipe"""
+
+    def __init__(self, files):
+        self.files = files
+        self.requests = []
+        read_fd, self._write_fd = os.pipe()
+        self.stdout = os.fdopen(read_fd, 'rb')
+        self.stdin = MagicMock()
+        self.stdin.write.side_effect = self._answer
+
+    def _answer(self, line):
+        request = json.loads(line)
+        self.requests.append(request)
+        if request["method"] == "initialize":
+            result = {"protocolVersion": "2024-11-05"}
+        else:
+            result = self.files
+        response = {"jsonrpc": "2.0", "id": request["id"], "result": result}
+        os.write(self._write_fd, (json.dumps(response) + "\n").encode())
+
+    def crash(self):
+        os.close(self._write_fd)
+
+    def wait(self, timeout=None):
+        return 0
 
 class TestEnhancedFileAnalyzer(unittest.TestCase):
 
@@ -245,6 +294,74 @@ class TestEnhancedFileAnalyzer(unittest.TestCase):
         files = run_file_info_simple_rpc(".", suppress_errors=True)
         self.assertEqual(files, [])
 
+    def test_receive_shm_ring(self):
+        """Test receiving the shared-memory fd and ring size over a Unix socket."""
+        parent, child = socket.socketpair(socket.AF_UNIX, socket.SOCK_STREAM)
+        with parent, child, tempfile.TemporaryFile() as ring_file:
+            child.sendmsg([struct.pack("Q", 65536)],
+                          [(socket.SOL_SOCKET, socket.SCM_RIGHTS, struct.pack("i", ring_file.fileno()))])
+            fd, size = receive_shm_ring(parent)
+            self.assertEqual(size, 65536)
+            self.assertEqual(os.fstat(fd).st_ino, os.fstat(ring_file.fileno()).st_ino)
+            os.close(fd)
+
+    @patch('ai_integration.subprocess.Popen')
+    def test_run_file_info_shm_failure(self, mock_popen):
+        """Test the shared-memory transport on server start failure."""
+        mock_popen.side_effect = Exception("MCP server failed")
+        files = run_file_info_shm_rpc(".", suppress_errors=True)
+        self.assertEqual(files, [])
+
+    @patch('ai_integration.subprocess.Popen')
+    def test_persistent_client_reuses_server(self, mock_popen):
+        """Test that one server process and one handshake serve many queries."""
+        server = FakeServerProcess([{"name": "test.txt"}])
+        mock_popen.return_value = server
+        with FileSavantClient(timeout=5) as client:
+            for _ in range(3):
+                self.assertEqual(client.list_files("/fake/dir")[0]["name"], "test.txt")
+        self.assertEqual(mock_popen.call_count, 1)
+        methods = [request["method"] for request in server.requests]
+        self.assertEqual(methods, ["initialize", "tools/call", "tools/call", "tools/call"])
+        self.assertEqual(len({request["id"] for request in server.requests}), 4)
+
+    @patch('ai_integration.subprocess.Popen')
+    def test_persistent_client_restarts_after_crash(self, mock_popen):
+        """Test that a crashed server is replaced on the next query."""
+        first, second = FakeServerProcess([{"name": "a.txt"}]), FakeServerProcess([{"name": "b.txt"}])
+        mock_popen.side_effect = [first, second]
+        with FileSavantClient(timeout=5) as client:
+            self.assertEqual(client.list_files("/fake/dir")[0]["name"], "a.txt")
+            first.crash()
+            for _ in range(100):
+                if not client._connected:
+                    break
+                time.sleep(0.01)
+            self.assertEqual(client.list_files("/fake/dir")[0]["name"], "b.txt")
+        self.assertEqual(mock_popen.call_count, 2)
+
+    @patch('ai_integration.subprocess.Popen')
+    def test_persistent_client_start_failure(self, mock_popen):
+        """Test that a server that cannot start surfaces as an error."""
+        mock_popen.side_effect = OSError("no such file")
+        with FileSavantClient(timeout=5) as client:
+            with self.assertRaises(OSError):
+                client.list_files(".")
+
+    @patch('ai_integration._filesavant')
+    def test_run_file_info_inprocess(self, mock_ext):
+        """Test that extension tuples become the same dicts the server returns."""
+        mock_ext.FIELDS = ("name", "size", "owner")
+        mock_ext.list_dir.return_value = [("test.txt", 100, "john")]
+        files = run_file_info_inprocess("/fake/dir", suppress_errors=True)
+        mock_ext.list_dir.assert_called_once_with("/fake/dir")
+        self.assertEqual(files, [{"name": "test.txt", "size": 100, "owner": "john"}])
+
+    @patch('ai_integration._filesavant', None)
+    def test_run_file_info_inprocess_not_built(self):
+        """Test the in-process path when the extension is missing."""
+        self.assertEqual(run_file_info_inprocess(".", suppress_errors=True), [])
+
     def test_answer_no_files(self):
         """Test answering questions when no files are found."""
         answer = answer_file_question_with_ai([], "who owns test", "test", suppress_warnings=True)
@@ -265,5 +382,600 @@ class TestEnhancedFileAnalyzer(unittest.TestCase):
         answer = answer_file_question_with_ai(self.expected_parsed_data, "who owns with exact match", "hello_world.txt", suppress_warnings=True)
         self.assertIn("john", answer.lower())
 
+REPO = os.path.dirname(os.path.abspath(__file__))
+
+def tool_call(request_id, name, arguments, **params):
+    return {"jsonrpc": "2.0", "id": request_id, "method": "tools/call",
+            "params": {"name": name, "arguments": arguments, **params}}
+
+def request_line(request):
+    """The server matches on compact JSON, one request per line"""
+    return (json.dumps(request, separators=(",", ":")) + "\n").encode()
+
+class TestServerTools(unittest.TestCase):
+    """Builds the server and file_info and runs them against real temporary trees"""
+
+    @classmethod
+    def setUpClass(cls):
+        if not shutil.which("gcc"):
+            raise unittest.SkipTest("needs gcc to build the server")
+        cls.bin = tempfile.mkdtemp()
+        cls.server = cls._build("file_info_mcp_server", "file_info_mcp_server.c", "libfilesavant.c", "fs_blake3.c", "fs_lz4.c")
+        cls.file_info = cls._build("file_info", "file_info.c", "libfilesavant.c", "fs_blake3.c")
+
+    @classmethod
+    def tearDownClass(cls):
+        shutil.rmtree(cls.bin)
+
+    @classmethod
+    def _build(cls, name, *sources):
+        path = os.path.join(cls.bin, name)
+        subprocess.run(["gcc", "-O2", "-pthread", "-o", path, *[os.path.join(REPO, s) for s in sources]], check=True)
+        return path
+
+    def setUp(self):
+        self.tree = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, self.tree)
+
+    def write(self, name, data=b""):
+        path = os.path.join(self.tree, name)
+        os.makedirs(os.path.dirname(path), exist_ok=True)
+        with open(path, "wb") as f:
+            f.write(data)
+        return path
+
+    def chain(self, top, depth):
+        """A directory depth levels down from top, removed by rm -rf: rmtree recurses once per level"""
+        path = os.path.join(self.tree, top, *["d"] * (depth - 1))
+        subprocess.run(["mkdir", "-p", path], check=True)
+        self.addCleanup(subprocess.run, ["rm", "-rf", os.path.join(self.tree, top)], check=True)
+        return path
+
+    def rpc(self, *requests):
+        """Every message one server writes for these request lines, LZ4 frames decoded"""
+        data = b"".join(request_line(r) for r in requests)
+        out = subprocess.run([self.server], input=data, capture_output=True, timeout=120, check=True).stdout
+        messages, pos = [], 0
+        while pos < len(out):
+            end = out.index(b"\n", pos)
+            message = json.loads(out[pos:end])
+            pos = end + 1
+            if isinstance(message, dict) and "compressed" in message:
+                length = message["compressed"]["length"]
+                frame = out[pos:pos + length]
+                pos += length
+                self.assertEqual(len(frame), length)
+                message = dict(json.loads(lz4.frame.decompress(frame)), compressed=message["compressed"])
+            messages.append(message)
+        return messages
+
+    def call(self, name, **arguments):
+        response = self.rpc(tool_call(1, name, arguments))[-1]
+        self.assertNotIn("error", response)
+        return response["result"]
+
+    def client(self):
+        client = FileSavantClient(server_path=self.server, timeout=60)
+        self.addCleanup(client.close)
+        return client
+
+    def serve(self, *args, **options):
+        """One server kept running across requests, for state that lives between them"""
+        server = subprocess.Popen([self.server, *args], stdin=subprocess.PIPE, stdout=subprocess.PIPE, **options)
+        self.addCleanup(server.wait, 60)
+        self.addCleanup(server.stdout.close)
+        self.addCleanup(server.stdin.close)
+        return server
+
+    def reply(self, reader):
+        """The next message with an id; notifications are skipped"""
+        while True:
+            message = json.loads(reader.readline())
+            if "id" in message:
+                return message
+
+    def ask(self, server, request):
+        """Write one request line and read its reply (None for a notification)"""
+        server.stdin.write(request_line(request))
+        server.stdin.flush()
+        return self.reply(server.stdout) if "id" in request else None
+
+    def daemon(self, **options):
+        """A --listen daemon and its socket path, once it accepts connections"""
+        path = os.path.join(tempfile.mkdtemp(), "daemon.sock")
+        self.addCleanup(shutil.rmtree, os.path.dirname(path))
+        daemon = subprocess.Popen([self.server, "--listen", path], stdin=subprocess.DEVNULL,
+                                  stderr=subprocess.DEVNULL, **options)
+        self.addCleanup(daemon.wait, 10)
+        self.addCleanup(daemon.terminate)
+        for _ in range(500):
+            if os.path.exists(path):
+                break
+            time.sleep(0.01)
+        return daemon, path
+
+    def connect(self, path):
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.addCleanup(sock.close)
+        sock.connect(path)
+        return sock, sock.makefile("rb")
+
+    @unittest.skipUnless(pyarrow, "needs pyarrow")
+    def test_arrow_stream_reads_back_with_delta_dictionaries(self):
+        """Test that file_info --format=arrow is a stream pyarrow reads, with late types sent as delta dictionaries."""
+        for i in range(5):
+            self.write(f"f{i}.txt", b"x" * i)
+        os.mkdir(os.path.join(self.tree, "sub"))
+        listing = json.loads(subprocess.run([self.file_info, self.tree], capture_output=True, check=True).stdout)
+        stream = subprocess.run([self.file_info, "--format=arrow", "--batch-rows=1", self.tree],
+                                capture_output=True, check=True).stdout
+        reader = pyarrow.ipc.open_stream(stream)
+        rows = reader.read_all().to_pylist()
+        # One row per batch, so whichever type comes second arrives as a delta
+        self.assertEqual(reader.stats.num_record_batches, 6)
+        self.assertGreaterEqual(reader.stats.num_dictionary_deltas, 1)
+        self.assertEqual({r["name"]: (r["size"], r["type"], r["owner"], r["inode"]) for r in rows},
+                         {e["name"]: (e["size"], e["type"], e["owner"], e["inode"]) for e in listing})
+
+    def test_shm_ring_round_trip_and_release(self):
+        """Test that results come back through the memfd ring and that a released region is used again."""
+        for i in range(100):
+            self.write(f"ring_{i:03d}.txt", b"r" * i)
+        request = tool_call(1, "list_files", {"directory": self.tree})
+        plain = subprocess.run([self.server], input=request_line(request),
+                               capture_output=True, check=True).stdout.splitlines(keepends=True)[-1]
+        files = json.loads(plain)["result"]
+        self.assertEqual(run_file_info_shm_rpc(self.tree, server_path=self.server), files)
+
+        # Room for one response: the second falls back to the pipe until the first is released
+        parent, child = socket.socketpair(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.addCleanup(parent.close)
+        with child:
+            server = self.serve(f"--shm-socket={child.fileno()}", f"--shm-size={len(plain) * 3 // 2}",
+                                pass_fds=(child.fileno(),))
+        fd, size = receive_shm_ring(parent)
+        self.assertTrue(os.readlink(f"/proc/self/fd/{fd}").startswith("/memfd:"))
+        with mmap.mmap(fd, size, prot=mmap.PROT_READ) as ring:
+            os.close(fd)
+            first = self.ask(server, request)
+            self.assertEqual(first["shm"], {"offset": 0, "length": len(plain)})
+            self.assertEqual(ring[:len(plain)], plain)
+            self.assertEqual(self.ask(server, dict(request, id=2))["result"], files)
+            self.ask(server, {"jsonrpc": "2.0", "method": "shm/release", "params": {"offset": 0}})
+            self.assertEqual(self.ask(server, dict(request, id=3))["shm"]["offset"], 0)
+            self.assertEqual(json.loads(ring[:len(plain)])["id"], 3)
+
+    def test_plain_listing_goes_out_in_pieces(self):
+        """Test that a large listing on plain stdio is written as it is rendered, not held whole first."""
+        for i in range(20000):
+            self.write(f"file_{i:05d}_{'x' * 40}")
+        server = self.serve()
+        server.stdout.readline()    # notifications/initialized
+        def peak_kb():
+            with open(f"/proc/{server.pid}/status") as f:
+                return next(int(line.split()[1]) for line in f if line.startswith("VmHWM:"))
+        before = peak_kb()
+        server.stdin.write(request_line(tool_call(1, "list_files", {"directory": self.tree})))
+        server.stdin.flush()
+        line = server.stdout.readline()
+        self.assertEqual(len(json.loads(line)["result"]), 20000)
+        self.assertLess((peak_kb() - before) * 1024, len(line) // 2)
+
+    def test_daemon_serves_two_clients(self):
+        """Test that a --listen daemon answers two clients, each on its own connection and in its own order."""
+        self.write("shared.txt", b"s")
+        path = self.daemon()[1]
+        (first, first_reader), (second, second_reader) = self.connect(path), self.connect(path)
+        first.sendall(request_line(tool_call(1, "list_files", {"directory": self.tree})))
+        second.sendall(request_line(tool_call(1, "list_files", {"directory": "/nonexistent"})) +
+                       request_line(tool_call(2, "list_files", {"directory": self.tree})))
+        self.assertIn("error", self.reply(second_reader))
+        self.assertEqual(self.reply(second_reader)["result"][0]["name"], "shared.txt")
+        self.assertEqual(self.reply(first_reader)["result"][0]["name"], "shared.txt")
+
+    def test_daemon_answers_a_half_closed_client(self):
+        """Test that a client which shuts down its sending side still gets every answer, the last line unterminated."""
+        for i in range(3000):
+            self.write(f"entry_{i:05d}.dat")    # about 1 MB per answer, more than the socket buffers hold
+        sock, reader = self.connect(self.daemon()[1])
+        request = tool_call(1, "list_files", {"directory": self.tree})
+        sock.sendall(request_line(request) + request_line(dict(request, id=2))[:-1])
+        sock.shutdown(socket.SHUT_WR)
+        self.assertEqual([len(self.reply(reader)["result"]) for _ in range(2)], [3000, 3000])
+        self.assertEqual(reader.read(), b"")
+
+    def test_daemon_turns_away_clients_past_its_descriptor_limit(self):
+        """Test that a daemon out of descriptors hangs up on new clients instead of spinning, then serves again."""
+        self.write("kept.txt", b"k")
+        limit = lambda: resource.setrlimit(resource.RLIMIT_NOFILE, (16, 16))
+        daemon, path = self.daemon(preexec_fn=limit)
+        clients = [self.connect(path) for _ in range(20)]
+        greeted = 0
+        for sock, reader in clients:
+            sock.settimeout(10)
+            greeted += reader.readline() != b""
+        self.assertGreater(greeted, 0)
+        self.assertLess(greeted, len(clients))
+
+        def cpu_ticks():
+            with open(f"/proc/{daemon.pid}/stat") as f:
+                fields = f.read().rsplit(")", 1)[1].split()
+            return int(fields[11]) + int(fields[12])    # utime + stime
+        before = cpu_ticks()
+        time.sleep(1)
+        self.assertLess(cpu_ticks() - before, os.sysconf("SC_CLK_TCK") // 4)
+
+        for sock, reader in clients:
+            reader.close()
+            sock.close()
+        for _ in range(100):    # until the daemon has seen the hangups
+            sock, reader = self.connect(path)
+            if reader.readline():
+                break
+            time.sleep(0.05)
+        sock.sendall(request_line(tool_call(1, "list_files", {"directory": self.tree})))
+        self.assertEqual(self.reply(reader)["result"][0]["name"], "kept.txt")
+
+    def test_client_threads_send_while_responses_arrive(self):
+        """Test concurrent batches through one client whose requests and responses each overflow a pipe."""
+        for i in range(50):
+            self.write(f"file_{i:02d}.txt", b"x" * i)
+        client = self.client()
+        results = {}
+        def run(n):
+            results[n] = client.batch([("list_files", {"directory": self.tree})] * 400)
+        threads = [threading.Thread(target=run, args=(n,), daemon=True) for n in range(4)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join(60)
+            self.assertFalse(thread.is_alive(), "client deadlocked")
+        for listings in results.values():
+            self.assertEqual([len(listing) for listing in listings], [50] * 400)
+
+    def test_get_metrics_counts_real_requests(self):
+        """Test that get_metrics reports the requests this server ran, phase by phase, with ordered quantiles."""
+        self.write("m.txt")
+        request = tool_call(1, "list_files", {"directory": self.tree})
+        methods = self.rpc(request, dict(request, id=2), tool_call(3, "get_metrics", {}))[-1]["result"]["methods"]
+        for phase in ("opendir", "stat", "serialize", "total"):
+            self.assertEqual(methods["list_files"][phase]["count"], 2)
+        total = methods["list_files"]["total"]
+        quantiles = [total[k] for k in ("p50_ns", "p90_ns", "p99_ns", "p999_ns")]
+        self.assertEqual(quantiles, sorted(quantiles))
+        self.assertGreater(quantiles[0], 0)
+        self.assertLessEqual(total["max_ns"], total["sum_ns"])
+        client = self.client()
+        client.list_files(self.tree)
+        self.assertEqual(client.get_metrics()["list_files"]["total"]["count"], 1)
+
+    def test_list_options_sort_filter_and_page(self):
+        """Test sort, order, type, offset and limit, and the size and time filters, on a real listing."""
+        sizes = {"a.log": 500, "b.txt": 100, "c.bin": 3000, "d.txt": 0, "e.dat": 2000}
+        for i, (name, size) in enumerate(sizes.items()):
+            mtime = 1600000000 + 1000 * i
+            os.utime(self.write(name, b"x" * size), (mtime, mtime))
+        os.mkdir(os.path.join(self.tree, "sub"))
+
+        def names(**options):
+            return [e["name"] for e in self.call("list_files", directory=self.tree, **options)]
+
+        self.assertEqual(names(sort="size", order="desc", type="file"), ["c.bin", "e.dat", "a.log", "b.txt", "d.txt"])
+        self.assertEqual(names(sort="size", order="desc", type="file", offset=1, limit=2), ["e.dat", "a.log"])
+        self.assertEqual(names(sort="name", order="desc", offset=4), ["b.txt", "a.log"])
+        self.assertEqual(names(type="directory"), ["sub"])
+        self.assertEqual(names(sort="name", type="file", min_size=100, max_size=2000), ["a.log", "b.txt", "e.dat"])
+        self.assertEqual(names(sort="modified", order="desc", modified_after=1600001000, modified_before=1600003000),
+                         ["d.txt", "c.bin", "b.txt"])
+        self.assertEqual([e["name"] for e in self.client().list_files(self.tree, sort="size", type="file", limit=1)],
+                         ["d.txt"])
+
+    def test_result_cache_hit_and_invalidation(self):
+        """Test that --cache-mb answers a repeat listing from the cache until the directory itself changes."""
+        path = self.write("a.txt", b"a")
+        time.sleep(2.1)    # directories changed in the last 2 s are not cached
+        server = self.serve("--cache-mb=8")
+        request = tool_call(1, "list_files", {"directory": self.tree})
+        first = self.ask(server, request)["result"]
+        with open(path, "ab") as f:
+            f.write(b"bc")    # the directory's times stay the same, so the stale size shows the hit
+        self.assertEqual(self.ask(server, dict(request, id=2))["result"], first)
+        self.write("b.txt")
+        third = self.ask(server, dict(request, id=3))["result"]
+        self.assertEqual(sorted((e["name"], e["size"]) for e in third), [("a.txt", 3), ("b.txt", 0)])
+        cache = self.ask(server, tool_call(4, "get_metrics", {}))["result"]["cache"]
+        self.assertEqual((cache["hits"], cache["invalidations"]), (1, 1))
+
+    def test_hash_files_blake3_vectors_and_cache(self):
+        """Test hash_files against the BLAKE3 test vectors, then that the digest cache follows the mtime."""
+        vectors = {
+            0: "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262",
+            1: "2d3adedff11b61f14c886e35afa036736dcd87a74d27b5c1510225d0f592e213",
+            1024: "42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7",
+            1025: "d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444",
+            8193: "bab6c09cb8ce8cf459261398d2e7aef35700bf488116ceb94a36d0f5f1b7bc3b",      # eight chunks and a bit
+            102400: "bc3e3d41a1146b069abffad3c0d44860cf664390afce4d9661f7902e7943e085",
+            1048577: "2f053cd7472cf0cd2f9adaf45c1180255b91b9a865404a63671a0ee5f792ed33",   # past one 1 MB read
+        }
+        data = bytes(i % 251 for i in range(max(vectors)))    # the vectors' input pattern
+        for n in vectors:
+            self.write(f"v{n}", data[:n])
+        client = self.client()
+        self.assertEqual({e["name"]: e["blake3"] for e in client.hash_files(self.tree)},
+                         {f"v{n}": digest for n, digest in vectors.items()})
+
+        # Same size and mtime: the cached digest comes back without reading the new bytes
+        path = os.path.join(self.tree, "v1025")
+        st = os.stat(path)
+        self.write("v1025", bytes(1025))
+        os.utime(path, ns=(st.st_atime_ns, st.st_mtime_ns))
+        self.assertEqual(client.hash_files(self.tree, ["v1025"])[0]["blake3"], vectors[1025])
+        os.utime(path, ns=(st.st_atime_ns, st.st_mtime_ns + 1000))    # touch
+        self.assertEqual(client.hash_files(self.tree, ["v1025"])[0]["blake3"],
+                         "d2beb49d87e59db174cb3ff1440f1899422968df670d060fd7ce759e8cc160e7")
+
+    def test_find_duplicates_hard_links_and_hidden(self):
+        """Test duplicate groups on a real tree: hard links skipped, hidden files searched, near misses split."""
+        content = bytes(range(256)) * 64    # 16 KB: past the edge hash, so the full hash decides
+        for name in ("a.bin", "copy.bin", ".cache/d.bin"):
+            self.write(name, content)
+        os.link(os.path.join(self.tree, "a.bin"), os.path.join(self.tree, "link.bin"))
+        self.write("tail.bin", content[:-1] + b"x")                          # differs at the end
+        self.write("middle.bin", content[:8000] + b"x" + content[8001:])     # same edges, differs inside
+        result = self.call("find_duplicates", directory=self.tree)
+        self.assertEqual(result["group_count"], 1)
+        files = sorted(os.path.relpath(f, self.tree) for f in result["groups"][0]["files"])
+        self.assertEqual(len(files), 3)
+        self.assertIn(".cache/d.bin", files)
+        self.assertIn("copy.bin", files)
+        self.assertEqual(result["hard_links_skipped"], 1)
+        self.assertEqual(result["wasted_bytes"], 2 * len(content))
+        hidden_off = self.call("find_duplicates", directory=self.tree, include_hidden=False)
+        self.assertEqual(len(hidden_off["groups"][0]["files"]), 2)
+
+    def test_find_duplicates_in_deep_tree(self):
+        """Test find_duplicates on a tree whose paths run past 2 KB."""
+        bottom = self.chain("d", 1020)
+        content = bytes(range(256)) * 20
+        for name in ("a.bin", "b.bin"):
+            self.write(os.path.join(bottom, name), content)
+        self.write("top.bin", content)
+        result = self.call("find_duplicates", directory=self.tree)
+        self.assertEqual(result["group_count"], 1)
+        self.assertEqual(sorted(result["groups"][0]["files"]),
+                         [os.path.join(bottom, "a.bin"), os.path.join(bottom, "b.bin"), os.path.join(self.tree, "top.bin")])
+
+    def test_content_type_sniffs_magic_numbers_and_text(self):
+        """Test content_type on PNG, ELF, gzip, text, empty and binary files; directories get none."""
+        self.write("picture.dat", b"\x89PNG\r\n\x1a\n\0\0\0\rIHDR" + bytes(17))
+        shutil.copy(self.server, os.path.join(self.tree, "program"))
+        self.write("archive", gzip.compress(b"payload"))
+        self.write("notes", "héllo wörld\n".encode())
+        self.write("page", b"<!DOCTYPE html><html></html>\n")
+        self.write("empty")
+        self.write("noise", bytes(range(256)))
+        os.mkdir(os.path.join(self.tree, "sub"))
+        entries = self.call("list_files", directory=self.tree, content_type=True)
+        self.assertEqual({e["name"]: e.get("content_type") for e in entries},
+                         {"picture.dat": "image/png", "program": "application/x-elf", "archive": "application/gzip",
+                          "notes": "text/plain; charset=utf-8", "page": "text/html",
+                          "empty": "inode/x-empty", "noise": "application/octet-stream", "sub": None})
+
+    def test_content_type_at_the_sniff_boundary(self):
+        """Test that a UTF-8 character cut by the 512-byte sniff is text only when the file goes on."""
+        self.write("cut", b"a" * 511 + "é".encode())    # the sniff ends after the lead byte
+        self.write("ends", b"a" * 511 + b"\xc3")         # the file does too
+        self.write("whole", b"a" * 510 + "é".encode())
+        entries = self.call("list_files", directory=self.tree, content_type=True)
+        self.assertEqual({e["name"]: e["content_type"] for e in entries},
+                         {"cut": "text/plain; charset=utf-8", "ends": "application/octet-stream",
+                          "whole": "text/plain; charset=utf-8"})
+
+    def test_diff_snapshots_rename_modify_add_remove(self):
+        """Test file_info --snapshot before and after a rename, an edit, a removal and an addition."""
+        snaps = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, snaps)
+        for name in ("a.txt", "b.txt", "c.txt", "sub/s.txt"):
+            self.write(name, b"x")
+        before, after = os.path.join(snaps, "before.snap"), os.path.join(snaps, "after.snap")
+        subprocess.run([self.file_info, "--snapshot", "--output=" + before, self.tree], check=True, capture_output=True)
+        os.rename(os.path.join(self.tree, "a.txt"), os.path.join(self.tree, "moved.txt"))
+        self.write("b.txt", b"longer")
+        os.unlink(os.path.join(self.tree, "c.txt"))
+        self.write("d.txt", b"new")
+        subprocess.run([self.file_info, "--snapshot", "--output=" + after, self.tree], check=True, capture_output=True)
+        result = self.call("diff_snapshots", old=before, new=after)
+        self.assertEqual((result["added"], result["removed"], result["modified"], result["renamed"]), (1, 1, 1, 1))
+        changes = {c["change"]: c for c in result["changes"]}
+        self.assertEqual((changes["renamed"]["old_path"], changes["renamed"]["path"]), ("a.txt", "moved.txt"))
+        self.assertEqual((changes["modified"]["old_size"], changes["modified"]["size"]), (1, 6))
+        self.assertEqual(changes["removed"]["path"], "c.txt")
+        self.assertEqual(changes["added"]["path"], "d.txt")
+
+    def test_snapshot_of_deep_tree(self):
+        """Test file_info --snapshot on a chain of directories past 2 KB of path, and its failure past PATH_MAX."""
+        snaps = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, snaps)
+        self.write(os.path.join(self.chain("d", 1500), "f"), b"x")
+        snap = os.path.join(snaps, "deep.snap")
+        done = subprocess.run([self.file_info, "--snapshot", "--output=" + snap, self.tree],
+                              check=True, capture_output=True, timeout=60)
+        self.assertEqual(done.stderr, b"1501 entries\n")
+        result = self.call("diff_snapshots", old=snap, new=snap)
+        self.assertEqual((result["added"], result["removed"], result["modified"], result["renamed"]), (0, 0, 0, 0))
+
+        # Leaving out what cannot be opened would make a later diff report it as removed
+        self.chain("e", 2100)
+        failed = subprocess.run([self.file_info, "--snapshot", "--output=" + snap, self.tree],
+                                capture_output=True, timeout=60)
+        self.assertEqual(failed.returncode, 1)
+        self.assertIn(b"File name too long", failed.stderr)
+        self.assertFalse(os.path.exists(snap))
+
+    def test_render_for_llm_fits_budget(self):
+        """Test that render_for_llm cuts a real listing to its token budget and says how much is left out."""
+        for i in range(200):
+            self.write(f"report_{i:03d}.csv", b"x" * i)
+        small = self.call("render_for_llm", directory=self.tree, token_budget=400)
+        self.assertEqual(small["entries"], 200)
+        self.assertLess(small["shown"], 200)
+        self.assertLessEqual(small["tokens"], 400)
+        lines = small["text"].splitlines()
+        self.assertIn("mode|size|modified|owner|group|name", lines)
+        self.assertEqual(lines[-1], f"({200 - small['shown']} more not shown)")
+        self.assertTrue(lines[-2].endswith(f"report_{small['shown'] - 1:03d}.csv"))    # name order
+        whole = self.call("render_for_llm", directory=self.tree, token_budget=100000)
+        self.assertEqual(whole["shown"], 200)
+
+    def test_sample_files_exact_counts_and_outliers(self):
+        """Test sample_files counts, outliers and sample size on a mixed tree, links counted as links."""
+        for i in range(30):
+            self.write(f"m{i}.py", b"p" * 100)
+        for i in range(10):
+            self.write(f"log{i}.log", b"l" * 5000)
+        big = self.write("big.bin", b"b" * 200000)
+        os.symlink(big, os.path.join(self.tree, "big.link"))
+        os.chmod(self.write("tool", b"#!"), 0o4755)
+        os.mkdir(os.path.join(self.tree, "sub"))
+        result = self.call("sample_files", directory=self.tree, sample_size=10, seed=7)
+        self.assertEqual(result["entries"], 44)
+        self.assertEqual(result["types"], {"file": 42, "directory": 1, "symlink": 1, "other": 0})
+        self.assertEqual(result["outliers"]["largest"][0]["name"], "big.bin")
+        self.assertEqual(result["odd_permissions"]["setuid"], 1)
+        self.assertEqual(len(result["sample"]), 10)
+        self.assertEqual(len({e["name"] for e in result["sample"]}), 10)
+        again = self.call("sample_files", directory=self.tree, sample_size=10, seed=7)
+        self.assertEqual([e["name"] for e in again["sample"]], [e["name"] for e in result["sample"]])
+
+    def test_batch_answers_every_element_by_id(self):
+        """Test that a batch array gets one array back with each element answered under its own id."""
+        self.write("one.txt", b"1")
+        responses = self.rpc([tool_call(7, "list_files", {"directory": self.tree}),
+                              tool_call(8, "list_files", {"directory": os.path.join(self.tree, "missing")}),
+                              {"jsonrpc": "2.0", "id": 9, "method": "tools/list"}])[-1]
+        by_id = {r["id"]: r for r in responses}
+        self.assertEqual(sorted(by_id), [7, 8, 9])
+        self.assertEqual([f["name"] for f in by_id[7]["result"]], ["one.txt"])
+        self.assertIn("error", by_id[8])
+        self.assertIn("list_files", [t["name"] for t in by_id[9]["result"]])
+        results = self.client().batch([("list_files", {"directory": self.tree}),
+                                       ("list_files", {"directory": os.path.join(self.tree, "missing")})])
+        self.assertEqual(results[0][0]["name"], "one.txt")
+        self.assertIsInstance(results[1], FileSavantError)
+
+    def test_chunked_listing_reassembles(self):
+        """Test that partial_result chunks followed by the result are exactly the plain listing."""
+        for i in range(2500):
+            self.write(f"entry_{i:05d}.dat")
+        plain = self.call("list_files", directory=self.tree)
+        messages = self.rpc(tool_call(1, "list_files", {"directory": self.tree, "chunk_size": 1000},
+                                      _meta={"progressToken": "t1"}))
+        chunks = [m["params"] for m in messages if m.get("method") == "notifications/partial_result"]
+        self.assertGreaterEqual(len(chunks), 2)
+        self.assertEqual([c["chunk"] for c in chunks], list(range(len(chunks))))
+        self.assertTrue(all(len(c["result"]) <= 1000 for c in chunks))
+        streamed = [e for c in chunks for e in c["result"]] + messages[-1]["result"]
+        self.assertEqual([e["name"] for e in streamed], [e["name"] for e in plain])
+        names = [e["name"] for e in self.client().iter_files(self.tree, chunk_size=1000)]
+        self.assertEqual(names, [e["name"] for e in plain])
+
+    def names(self, **options):
+        return sorted(e["name"] for e in self.call("list_files", directory=self.tree, **options))
+
+    def test_glob_patterns_match_names(self):
+        """Test negated classes, nested alternatives, UTF-8 characters and case folding in pattern, and the state cap."""
+        for name in ("report_2023.csv", "report_2024.csv", "~report_2024.csv", "data.log", "data.LOG",
+                     "data.gz", "data.txt", "é.md", "b.md", "ab.md"):
+            self.write(name)
+        self.assertEqual(self.names(pattern="report_202?.csv"), ["report_2023.csv", "report_2024.csv"])
+        self.assertEqual(self.names(pattern="[!~]*_2024.csv"), ["report_2024.csv"])
+        self.assertEqual(self.names(pattern="[^r~]*_2024.csv"), [])
+        self.assertEqual(self.names(pattern="*.{log,{gz,txt}}"), ["data.gz", "data.log", "data.txt"])
+        self.assertEqual(self.names(pattern="*.log", ignore_case=True), ["data.LOG", "data.log"])
+        self.assertEqual(self.names(pattern="?.md"), ["b.md", "é.md"])    # é is one character in two bytes
+        # Each ? after *a doubles the states the DFA needs, past its cap of 4096
+        for pattern in ("*a" + "?" * 16, "[z-a]*"):
+            response = self.rpc(tool_call(1, "list_files", {"directory": self.tree, "pattern": pattern}))[-1]
+            self.assertEqual(response["error"]["code"], "invalid_params")
+
+    def test_regex_filters_names_in_linear_time(self):
+        """Test anchors, classes, counted repeats, alternation and case folding in regex, and a pathological pattern."""
+        for name in ("img_0001.jpg", "img_0002.jpeg", "img_12.png", "IMG_0003.PNG", "x_img_0004.png",
+                     "2024_01.csv", "2024-01.csv", "a" * 250):
+            self.write(name)
+        self.assertEqual(self.names(regex=r"^img_\d{4}\.(jpe?g|png)$"), ["img_0001.jpg", "img_0002.jpeg"])
+        self.assertEqual(self.names(regex=r"^img_\d{4}\.(jpe?g|png)$", ignore_case=True),
+                         ["IMG_0003.PNG", "img_0001.jpg", "img_0002.jpeg"])
+        self.assertEqual(self.names(regex=r"img_\d{4}\.png"), ["x_img_0004.png"])    # unanchored: a search
+        self.assertEqual(self.names(regex=r"^img_\d{1,2}\."), ["img_12.png"])
+        self.assertEqual(self.names(regex=r"^[\d_]+\.csv$"), ["2024_01.csv"])
+        self.assertEqual(self.names(regex=r"^[^\W_]+-"), ["2024-01.csv"])
+        self.assertEqual(self.names(regex=r"^[a-z]+_\d"), ["img_0001.jpg", "img_0002.jpeg", "img_12.png"])
+        response = self.rpc(tool_call(1, "list_files", {"directory": self.tree, "regex": "[z-a]"}))[-1]
+        self.assertEqual(response["error"]["code"], "invalid_params")
+        # A backtracking matcher tries about 2^250 ways to split the a's before failing
+        start = time.monotonic()
+        self.assertEqual(self.names(regex="(a*)*b"), [])
+        self.assertLess(time.monotonic() - start, 10)
+
+    def test_dictionary_listing_names_owners_once(self):
+        """Test that a dictionary listing drops per-entry names and the client restores the same ones."""
+        for i in range(5):
+            self.write(f"f{i}")
+        raw = self.call("list_files", directory=self.tree, dictionary=True)
+        self.assertTrue(all("owner" not in e and "group" not in e for e in raw["entries"]))
+        self.assertEqual(list(raw["users"]), [str(os.getuid())])
+        self.assertEqual(list(raw["groups"]), [str(os.getgid())])
+        plain = self.call("list_files", directory=self.tree)
+        expanded = self.client().list_files(self.tree, dictionary=True)
+        self.assertEqual([(e["name"], e["owner"], e["group"]) for e in expanded],
+                         [(e["name"], e["owner"], e["group"]) for e in plain])
+
+    def test_list_changes_reports_added_removed_modified(self):
+        """Test that a track token followed by since reports exactly what changed in between."""
+        for name in ("keep.txt", "grow.txt", "gone.txt"):
+            self.write(name, b"x")
+        client = self.client()
+        first = client.list_changes(self.tree)
+        self.assertEqual(sorted(e["name"] for e in first["added"]), ["gone.txt", "grow.txt", "keep.txt"])
+        self.write("grow.txt", b"much longer")
+        os.unlink(os.path.join(self.tree, "gone.txt"))
+        self.write("new.txt", b"n")
+        changes = client.list_changes(self.tree, since=first["token"])
+        self.assertFalse(changes["reset"])
+        self.assertEqual([e["name"] for e in changes["added"]], ["new.txt"])
+        self.assertEqual(changes["removed"], ["gone.txt"])
+        # Entries changed within the last 2 s are also reported as modified, since their times are racy
+        self.assertIn("grow.txt", [e["name"] for e in changes["modified"]])
+        self.assertNotEqual(changes["token"], first["token"])
+
+    def test_zero_copy_output_matches_plain_output(self):
+        """Test that --zero-copy writes the same bytes as plain writes for responses past the vmsplice threshold."""
+        for i in range(4000):
+            self.write(f"zero_copy_entry_{i:05d}.txt")
+        requests = [tool_call(1, "list_files", {"directory": self.tree}),
+                    tool_call(2, "list_files", {"directory": self.tree, "sort": "name", "order": "desc"})]
+        data = b"".join(request_line(r) for r in requests)
+        plain = subprocess.run([self.server], input=data, capture_output=True, check=True).stdout
+        spliced = subprocess.run([self.server, "--zero-copy"], input=data, capture_output=True, check=True).stdout
+        self.assertGreater(len(plain), 2 << 20)    # two responses of over 1 MB each, the second reusing the buffer
+        self.assertEqual(spliced, plain)
+
+    @unittest.skipUnless(lz4, "needs the lz4 module")
+    def test_lz4_compressed_listing_round_trips(self):
+        """Test that a negotiated LZ4 response decodes to the same listing as the plain one."""
+        for i in range(1000):
+            self.write(f"compressible_name_{i:05d}.txt", b"z" * i)
+        offer = {"jsonrpc": "2.0", "id": 0, "method": "initialize",
+                 "params": {"capabilities": {"experimental": {"compression": ["lz4"]}}}}
+        request = tool_call(1, "list_files", {"directory": self.tree})
+        plain = self.rpc(request)[-1]
+        handshake, compressed = self.rpc(offer, request)[-2:]
+        self.assertEqual(handshake["result"]["capabilities"]["experimental"], {"compression": "lz4"})
+        self.assertLess(compressed["compressed"]["length"], compressed["compressed"]["size"] // 4)
+        del compressed["compressed"]
+        self.assertEqual(compressed, plain)
+        self.assertEqual(self.client().list_files(self.tree), plain["result"])
+
 if __name__ == '__main__':
     unittest.main() 
\ No newline at end of file